@@ -46,7 +46,12 @@ endif()
 #  set(COR_LIB "mkl_core")
 #endif()
 set(INT_LIB "mkl_intel_lp64")
-set(SEQ_LIB "mkl_sequential")
+if(THREADED_LAPACK)
+  # The OpenMP threading layer of MKL for gcc
+  set(SEQ_LIB "mkl_gnu_thread")
+else()
+  set(SEQ_LIB "mkl_sequential")
+endif()
 set(THR_LIB "mkl_intel_thread")
 set(COR_LIB "mkl_core")
 
@@ -42,12 +42,63 @@ struct newtooldmatvec {
         int * MPO;
 };
 
+/**
+ * A part of the matvec that is executed by a single thread.
+ *
+ * A task is a range of contractions for a single new block. Expensive new
+ * blocks are split over multiple tasks.
+ */
+struct matvectask {
+        /// The new symmetry block.
+        int sb;
+        /// The pair of the first contraction of the task.
+        int pair;
+        /// The first and past-the-end contraction of the task.
+        int contr[2];
+        /** 1 if the new block is split over multiple tasks.
+         *
+         * These tasks accumulate in a private buffer first. */
+        int split;
+        /// Estimated number of flops of the task.
+        double cost;
+};
+
+/**
+ * The execution plan for the matvec, made during the first matvec.
+ *
+ * Every (new block, old block) pair has its contractinfo and every
+ * contraction of a pair has its operator blocks and total prefactor already
+ * resolved. The following matvecs thus only have to walk these arrays.
+ */
 struct secondrun {
+        /// The maximal size of WORK1 and WORK2 over all pairs.
         int worksize[2];
-        int * shufid;
+        /// The number of tasks.
+        int nrtasks;
+        /// The tasks, sorted from most to least expensive.
+        struct matvectask * tasks;
+        /// The maximal size of a new block that is split over multiple tasks.
+        int splitsize;
+        /// The dimensions of every symmetry block.
         int (*dimsofsb)[3];
-        int * nr_oldsb;
-        struct newtooldmatvec ** ntom;
+        /// The total number of (new block, old block) pairs.
+        int nrpairs;
+        /** For every new block the start of its pairs.
+         *
+         * Length is <tt>nrblocks + 1</tt>. */
+        int * pairbeg;
+        /// For every pair the old block.
+        int * oldsb;
+        /// For every pair the contractinfo (only 2 are used for DMRG).
+        struct contractinfo (*cinfo)[3];
+        /** For every pair the start of its contractions.
+         *
+         * Length is <tt>@ref nrpairs + 1</tt>. */
+        int * contrbeg;
+        /// For every contraction the blocks of the operators (OPS1 to OPS3).
+        EL_TYPE * (*opstel)[3];
+        /// For every contraction the total prefactor.
+        EL_TYPE * pref;
 };
 
 /// A structure for all the data needed for the matvec routine.
@@ -152,6 +203,12 @@ struct Heffdata {
         struct instructionset iset;
 
         struct secondrun sr;
+
+        /// 1 if the matvec is done in single precision (see set_Heff_precision()).
+        int single;
+
+        /// The number of vectors @ref matvecT3NS was applied to.
+        int nr_matvecs;
 };
 
 /**
@@ -176,6 +233,39 @@ void init_Heffdata(struct Heffdata * data, const struct rOperators * Operators,
  */
 void matvecT3NS(const double * vec, double * result, void * vdata);
 
+/**
+ * The matvec routine to perform Ψ' = Heff Ψ for multiple vectors at once.
+ *
+ * The vectors are interleaved blockwise internally, such that all the
+ * contractions are done for the different vectors in one go and the
+ * operator blocks are reused.
+ *
+ * @param vec [in] The @p nvec vectors of Ψ values, stored after each other.
+ * @param result [out] Already allocated memory for the @p nvec resulting Ψ'
+ * vectors, stored after each other.
+ * @param nvec [in] The number of vectors.
+ * @param vdata [in] Pointer to a struct @ref Heffdata.
+ */
+void matvecT3NS_block(const double * vec, double * result, int nvec,
+                      void * vdata);
+
+/**
+ * Sets the precision of the matvec.
+ *
+ * In single precision, the contractions are done in float. The operators
+ * stay stored in double, their blocks are converted to float when they are
+ * needed in a contraction. The vectors passed to the matvec routines stay in
+ * double, thus the eigensolver is unaffected. The residual that can be reached
+ * is limited by the precision of the matvec however.
+ *
+ * The precision can be switched at any moment, also in between the matvecs
+ * of an eigensolver.
+ *
+ * @param data [in,out] The data of the effective Hamiltonian.
+ * @param single [in] 1 for single precision, 0 for double precision.
+ */
+void set_Heff_precision(struct Heffdata * data, int single);
+
 /**
  * Makes the diagonal elements of the effective Hamiltonian.
  *
@@ -190,3 +280,22 @@ EL_TYPE * make_diagonal(const struct Heffdata * data);
  * @param data [in, out] The structure to destroy.
  */
 void destroy_Heffdata(struct Heffdata * data);
+
+/**
+ * Frees the execution plans kept from previous optimization steps.
+ *
+ * The first matvec of an optimization step makes an execution plan
+ * (see @ref secondrun). The part of it that only depends on the block
+ * structure is kept for the sites of the step and reused in a later step on
+ * the same sites with the same block structure. The least recently used
+ * plans are dropped when the kept plans take more than 1 GB. The kept plans
+ * are shared by all threads and only accessed in a critical section, so
+ * Heffdata can be made and used on several threads at once.
+ */
+void destroy_Heffplans(void);
+
+/// Returns the total number of times an execution plan was reused.
+int Heffplans_reused(void);
+
+/// Returns the total number of vectors multiplied in single precision.
+int Heff_single_matvecs(void);
@@ -0,0 +1,111 @@
+/*
+    T3NS: an implementation of the Three-Legged Tree Tensor Network algorithm
+    Copyright (C) 2018-2019 Klaas Gunst <Klaas.Gunst@UGent.be>
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 3.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#pragma once
+#include <stddef.h>
+
+/**
+ * @file arena.h
+ *
+ * The header file for the workspace arenas.
+ *
+ * An arena is a stack of temporary memory. Allocations are taken from one
+ * big buffer and are released all at once by going back to a previous mark:
+ *
+ * > const long long mark = arena_mark(ar);<br>
+ * > double * work = arena_malloc(ar, size, double);<br>
+ * > ...<br>
+ * > arena_release(ar, mark);
+ *
+ * Every OpenMP thread has its own arena (see thread_arena()), thus no locking
+ * is needed. When the buffer is full, the extra allocations are done on the
+ * heap. Once the arena is completely released again, its buffer is grown to
+ * the maximal usage, such that the next steps do not allocate anymore.
+ * trim_arenas() shrinks the buffers again to the recent usage.
+ */
+
+/// Allocates memory for @p s elements of type @p t from arena @p ar.
+#define arena_malloc(ar, s, t) arena_malloc_helper((ar), (s), sizeof(t), #t, \
+                                                   __FILE__, __LINE__, __func__)
+
+/// An allocation that did not fit in the buffer of an arena.
+struct arena_overflow {
+        /// The allocated memory.
+        char * mem;
+        /// The usage of the arena at the moment of this allocation.
+        long long begin;
+};
+
+/// The structure for an arena.
+struct arena {
+        /// The buffer.
+        char * mem;
+        /// The size of the buffer in bytes.
+        long long size;
+        /// The number of bytes in use.
+        long long used;
+        /// The maximal number of bytes in use since the last reset_arenas_peak().
+        long long peak;
+        /// The maximal number of bytes ever in use.
+        long long high;
+
+        /// The number of allocations that did not fit in the buffer.
+        int nover;
+        /// The allocated length of @ref over.
+        int capover;
+        /// The allocations that did not fit in the buffer.
+        struct arena_overflow * over;
+};
+
+/**
+ * @brief Returns the arena of the calling thread.
+ *
+ * The arena is initialized empty for every thread and persists over the
+ * different parallel regions.
+ */
+struct arena * thread_arena(void);
+
+/// Allocates memory from an arena. Use the arena_malloc() macro instead.
+void * arena_malloc_helper(struct arena * ar, long long s, size_t t,
+                           const char * typ, const char * file, int line,
+                           const char * func);
+
+/// Returns the current mark of the arena.
+long long arena_mark(const struct arena * ar);
+
+/// Releases all the memory allocated from the arena after the given mark.
+void arena_release(struct arena * ar, long long mark);
+
+/// Returns the sum of the peak usage of the arenas of all threads in bytes.
+long long arenas_peak(void);
+
+/// Resets the peak usage of the arenas of all threads.
+void reset_arenas_peak(void);
+
+/** Shrinks the buffers of the arenas of all threads.
+ *
+ * A buffer that is much larger than the peak usage since the last 
+ * reset_arenas_peak() is freed, and the buffers only grow again to that peak.
+ * This way the arenas keep no memory for a high-water mark of the past. 
+ * All arenas should be completely released.
+ */
+void trim_arenas(void);
+
+/** Frees the buffers of the arenas of all threads.
+ *
+ * All arenas should be completely released.
+ */
+void destroy_arenas(void);
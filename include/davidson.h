@@ -22,7 +22,105 @@
  *
  * This file contains the Davidson optimization.
  * For algorithm see http://people.inf.ethz.ch/arbenz/ewp/Lnotes/chapter12.pdf algorithm 12.1
+ *
+ * The solver converges the lowest roots of a symmetric matrix. Every
+ * iteration the subspace can be expanded with the preconditioned residuals of
+ * multiple roots (block Davidson). These are orthonormalized with BLAS-3
+ * operations (block Gram-Schmidt followed by a Cholesky QR) and the matrix
+ * vector products are done for the whole block at once.
+ *
+ * All the state of the solver is kept in a @ref davidson_context, thus
+ * different solvers can run concurrently. The workspace of a context is only
+ * reallocated when a bigger problem is passed, so a context can be reused
+ * over successive optimization steps. It is freed by
+ * destroy_davidson_context().
+ */
+
+/// The state and workspace of the Davidson solver.
+struct davidson_context {
+        /// The current size of the subspace.
+        int m;
+        /// The maximal size of the subspace for the current problem.
+        int max_vecs;
+        /// The dimension of the current problem.
+        int size;
+        /// The maximal number of search vectors added in every iteration.
+        int block;
+        /// The number of lowest roots to converge.
+        int nroots;
+        /** The number of Ritz vectors calculated in every iteration.
+         *
+         * This is <tt>max(@ref nroots, @ref block)</tt>. */
+        int nritz;
+        /// The size of the subspace after deflation.
+        int keep;
+
+        /// The subspace.
+        double * V;
+        /// The matrix times the subspace.
+        double * VA;
+        /// The diagonal of the matrix used for the preconditioner.
+        const double * diagonal;
+        /// The Ritz vectors of the lowest @ref nritz roots.
+        double * ritz;
+        /// The residuals and correction vectors of the lowest @ref nritz roots.
+        double * vec_t;
+        /// The norms of the residuals.
+        double * residues;
+        /// Workspace for the deflation.
+        double * work;
+        /// Workspace for the overlaps of the orthonormalization.
+        double * overlap;
+
+        /// The projected problem.
+        double * sub_matrix;
+        /// The eigenvectors of the projected problem.
+        double * eigv;
+        /// The eigenvalues of the projected problem.
+        double * eigvalues;
+
+        /// The problem dimension for which the workspace is allocated.
+        long long cap_size;
+        /// The subspace size for which the workspace is allocated.
+        int cap_vecs;
+        /// The number of Ritz vectors for which the workspace is allocated.
+        int cap_ritz;
+        /// The number of vectors kept on deflation for which @ref work is allocated.
+        int cap_keep;
+
+        /** Switches between a cheap (0) and an accurate (1) matvec, e.g. in
+         * single and double precision. The first argument is the data of the
+         * matvec.
+         *
+         * The initial guess is multiplied with the accurate matvec, the
+         * search continues with the cheap one till the residuals reach
+         * @ref refine_tol. The subspace is then restarted from the lowest
+         * Ritz vectors of which the matvecs are redone with the accurate one.
+         * If the accurate matvec is not reached, only the eigenvalue of the
+         * result is recalculated with it.
+         *
+         * NULL if not used. It is only used for the next call of
+         * davidson_ctx(). */
+        void (*refine)(void *, int);
+        /// The residual at which the accurate matvec is needed again.
+        double refine_tol;
+};
+
+/**
+ * @brief Initializes an empty Davidson context.
+ *
+ * No workspace is allocated, this happens in the first call of davidson_ctx().
+ *
+ * @param [out] ctx The context.
  */
+void init_davidson_context(struct davidson_context * ctx);
+
+/**
+ * @brief Destroys a Davidson context and its workspace.
+ *
+ * @param [in,out] ctx The context to destroy.
+ */
+void destroy_davidson_context(struct davidson_context * ctx);
 
 /**
  * @brief diagonal preconditioner for davidson algorithm.
@@ -41,20 +139,57 @@ void davidson_diagonal_preconditioner(const double * const result,
 /**
  * @brief main function for Davidson algorithm.
  *
+ * A temporary context is used, see davidson_ctx() for reusing the workspace
+ * over different calls.
+ *
  * @param [in,out] result Initial guess as input, converged vector as output.
- * @param [out] energy The converged energy.
+ * If more roots are asked, this is the guess for and the vector of the highest
+ * of them.
+ * @param [out] energy The converged energy of the highest root.
  * @param [in] basis_size The dimension of the problem.
  * @param [in] max_vecs Maximum number of vectors kept before deflation happens.
  * @param [in] keep_deflate Number of vectors kept after deflation.
+ * @param [in] block Maximal number of search vectors added in every iteration
+ * (block Davidson). The extra vectors are the corrections for the next lowest
+ * roots. With 1 and a single root the normal Davidson algorithm is used.
+ * @param [in] nroots The number of lowest roots to converge. The guesses for
+ * the lower roots are unit vectors on the lowest diagonal elements.
  * @param [in] davidson_tol The tolerance.
  * @param [in] max_its Maximum number of iterations.
  * @param [in] diagonal Diagonal elements of the Hamiltonian.
  * @param [in] matvec The pointer to the matrix vector product.
+ * @param [in] blockmatvec The pointer to the matrix vector product for 
+ * multiple vectors stored after each other. Can be NULL, then @p matvec is 
+ * used for every vector separately.
  * @param [in] vdat Pointer to a data structure needed for the matvec function.
- * @return The info. 0 if no error.
+ * @return 0 if converged, 1 if not converged within @p max_its iterations
+ * and -1 on error. On error @p result and @p energy are not changed.
  */
 int davidson(double * result, double * energy, int size, int max_vecs, 
-             int keep_deflate, double davidson_tol, int max_its, 
+             int keep_deflate, int block, int nroots, double davidson_tol, 
+             int max_its, 
              const double * diagonal, 
              void (*matvec)(const double *, double *, void *), 
+             void (*blockmatvec)(const double *, double *, int, void *),
              void * vdat);
+
+/**
+ * @brief Davidson algorithm with a reusable context.
+ *
+ * Same as davidson(), but the workspace of @p ctx is used and kept after
+ * returning. It is only reallocated when the problem does not fit.
+ * If <tt>@p ctx->{@link davidson_context.refine refine}</tt> is set, the
+ * matvec is switched during the solve, see @ref davidson_context.refine.
+ *
+ * @param [in,out] ctx The initialized context.
+ * @return See davidson().
+ *
+ * For the other parameters see davidson().
+ */
+int davidson_ctx(struct davidson_context * ctx, double * result, 
+                 double * energy, int size, int max_vecs, int keep_deflate, 
+                 int block, int nroots, double davidson_tol, int max_its, 
+                 const double * diagonal, 
+                 void (*matvec)(const double *, double *, void *), 
+                 void (*blockmatvec)(const double *, double *, int, void *),
+                 void * vdat);
@@ -66,6 +66,22 @@ int compare_tags(const int * tags[3], const int nr_tags[3], const int base_tag,
 int fuse_value(const int * tags[3], const int nr_tags[3], const int base_tag,
                double * const val);
 
+/**
+ * @brief Makes the list of orbital quadruples with a significant interaction.
+ *
+ * Only the quadruples allowed by the point group symmetry are visited in the
+ * packed interaction terms. A quadruple is kept if the largest of its terms
+ * (ab|cd), (ac|bd) and (ad|bc) is non-zero and at least @p threshold.
+ *
+ * @param [in] threshold The threshold on the interaction terms.
+ * @param [out] quads The sorted quadruples a <= b <= c <= d, every orbital
+ * plus one in 16 bits with a in the most significant bits. Free with 
+ * safe_free().
+ * @return The number of quadruples.
+ */
+long long QC_interacting_quadruples(double threshold, 
+                                    unsigned long long ** quads);
+
 void QC_write_hamiltonian_to_disk(const hid_t id);
 
 void QC_read_hamiltonian_from_disk(const hid_t id);
@@ -73,3 +89,18 @@ void QC_read_hamiltonian_from_disk(const hid_t id);
 int QC_consistent_state(int * ts);
 
 void QC_reinit_hamiltonian(void);
+
+/**
+ * @brief Converts a FCIDUMP to the binary integral format.
+ *
+ * The integrals are stored in a hdf5 file, packed by permutational and point
+ * group symmetry. The hdf5 file can be used everywhere a FCIDUMP is expected
+ * and is read much faster.
+ *
+ * @param [in] fcidump The FCIDUMP to convert.
+ * @param [in] h5file The hdf5 file to write.
+ */
+void QC_convert_fcidump(char fcidump[], char h5file[]);
+
+/// Returns 1 if @p fil is a FCIDUMP converted by QC_convert_fcidump().
+int QC_is_converted_fcidump(const char fil[]);
@@ -15,6 +15,7 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 #pragma once
+#include <hdf5.h>
 
 /**
  * \file instructions.h
@@ -84,3 +85,52 @@ void start_fill_instruction(struct instructionset * instructions, int step);
 void fill_instruction(int id1, int id2, int id3, double pref);
 
 void clear_instructions(void);
+
+/**
+ * @brief Makes all the instruction sets needed for the updates of the
+ * renormalized operators and the merges in an optimization.
+ *
+ * The sets are made concurrently, every set by one thread. Sets that already
+ * exist are not made again. Without this, the sets are made on their first
+ * fetch.
+ *
+ * The MPO combos of the merges need the symsecs of the operators and are only
+ * made on the first fetch_merge().
+ */
+void prepare_instructions(void);
+
+/**
+ * @brief Sets the threshold for the screening of the integrals.
+ *
+ * Instructions of which the prefactor is a combination of integrals smaller
+ * in absolute value than @p threshold are not made. The default is 0.
+ * The instruction sets already made are not changed.
+ */
+void set_integral_screening(double threshold);
+
+/// Returns the threshold for the screening of the integrals.
+double get_integral_screening(void);
+
+/// Returns a number that changes every time an instruction set is added.
+int instructions_version(void);
+
+/**
+ * @brief Writes the instruction sets made so far to disk.
+ *
+ * The indices are delta-encoded as variable length integers and every unique
+ * prefactor is stored once.
+ *
+ * @param [in] id The group to write the instructions in.
+ */
+void write_instructions_to_disk(const hid_t id);
+
+/**
+ * @brief Reads the instruction sets written by write_instructions_to_disk().
+ *
+ * The sets are only read if they were made for the same network, orbital
+ * order, hamiltonian and integral screening. The current sets are replaced.
+ *
+ * @param [in] id The group the instructions were written in.
+ * @return The number of sets read.
+ */
+int read_instructions_from_disk(const hid_t id);
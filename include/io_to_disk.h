@@ -21,15 +21,38 @@
 #include "rOperators.h"
 
 #define H5_DEFAULT_LOCATION "./"
+/// Datasets of at least this size in bytes are aligned on this size in a file.
+#define H5_MAP_ALIGNMENT 4096
 
-enum hdf5type { THDF5_INT, THDF5_DOUBLE, THDF5_EL_TYPE, THDF5_QN_TYPE };
-
-void write_to_disk(const char * hdf5_loc, const struct siteTensor * const T3NS, 
-                   const struct rOperators * const ops);
+enum hdf5type { THDF5_INT, THDF5_DOUBLE, THDF5_EL_TYPE, THDF5_QN_TYPE,
+               THDF5_BYTE };
 
+/**
+ * @brief Reads a calculation from disk.
+ *
+ * The elements of the site tensors and renormalized operators are not read
+ * but mapped from the file where possible, such that only the pages that are
+ * used are loaded. The mapping is private: changes in memory are not written
+ * to the file and the file can be removed or replaced by a new file.
+ * Use release_mapped_memory() before freeing a @ref sparseblocks.tel array.
+ *
+ * @param [in] filename The file to read.
+ * @param [out] T3NS The site tensors.
+ * @param [out] ops The renormalized operators.
+ * @return 0 on success, 1 if the file does not exist.
+ */
 int read_from_disk(const char filename[], struct siteTensor ** const T3NS, 
                    struct rOperators ** const ops);
 
+/**
+ * @brief Releases memory mapped from disk by read_from_disk().
+ *
+ * @param [in] ptr The memory to release.
+ * @return 1 if @p ptr pointed in mapped memory and is released, 0 if not and
+ * it should be freed as usual.
+ */
+int release_mapped_memory(const void * ptr);
+
 void write_dataset(hid_t id, const char datname[], const void * dat, 
                    hsize_t size, enum hdf5type kind);
 
@@ -39,3 +62,126 @@ void write_attribute(hid_t group_id, const char atrname[], const void * atr,
                      hsize_t size, enum hdf5type kind);
 
 void read_attribute(hid_t id, const char atrname[], void * atr);
+
+/**
+ * @brief Sets if the instruction sets are saved with the calculation.
+ *
+ * The saved instruction sets are read again by read_from_disk(), such that a
+ * continued calculation does not need to make them.
+ *
+ * @param [in] save 1 to save the instruction sets, 0 not to.
+ */
+void set_save_instructions(int save);
+
+/**
+ * @brief Sets the scratch directory for the out-of-core storage of the 
+ * renormalized operators.
+ *
+ * @param [in] scratch The scratch directory. NULL disables the out-of-core
+ * storage.
+ */
+void set_scratch_location(const char * scratch);
+
+/**
+ * @brief Starts the out-of-core storage for the given renormalized operators.
+ *
+ * Afterwards operators can be spilled to the scratch directory. While active,
+ * checkpoint_to_disk() links the scratch files of the spilled operators.
+ *
+ * @param [in,out] rops The renormalized operators for every bond.
+ * @return 1 if a scratch location is set, else 0 and nothing is done.
+ */
+int init_rOps_spilling(struct rOperators * rops);
+
+/**
+ * @brief Loads the given operators back in memory if they are spilled.
+ *
+ * Waits for the running spill and prefetch job first.
+ */
+void fetch_rOps(const int * bonds, int n);
+
+/**
+ * @brief Starts a background job that spills the operators that are not
+ * needed and prefetches the ones needed next.
+ *
+ * All operators not in @p keep and @p fetch are written to scratch and freed.
+ * The operators in @p fetch are read back in memory. Until the next call of
+ * wait_rOps_job(), fetch_rOps() or spill_and_prefetch_rOps() the caller
+ * should only access the operators in @p keep.
+ */
+void spill_and_prefetch_rOps(const int * keep, int nkeep, 
+                             const int * fetch, int nfetch);
+
+/// Waits till the running spill and prefetch job is finished.
+void wait_rOps_job(void);
+
+/**
+ * @brief Marks the given operators as renewed in memory.
+ *
+ * Their old version on scratch becomes invalid. Operators that are still
+ * spilled are left untouched. The next checkpoint_to_disk() writes them anew.
+ */
+void mark_rOps_modified(const int * bonds, int n);
+
+/**
+ * @brief Returns how many times operators were spilled to scratch and loaded
+ * back since the last init_rOps_spilling().
+ *
+ * The counts stay available after destroy_rOps_spilling().
+ *
+ * @param [out] spills The number of spilled operators.
+ * @param [out] loads The number of operators loaded back from scratch.
+ */
+void rOps_spilling_counts(int * spills, int * loads);
+
+/**
+ * @brief Stops the out-of-core storage.
+ *
+ * All spilled operators are loaded back in memory and the scratch files are
+ * removed.
+ */
+void destroy_rOps_spilling(void);
+
+/**
+ * @brief Writes an incremental checkpoint of the calculation to 
+ * <tt>hdf5_loc/T3NScalc.h5</tt> in the background.
+ *
+ * The site tensors, renormalized operators and the hamiltonian are written in
+ * separate files to which <tt>T3NScalc.h5</tt> links, so the result can be
+ * read by read_from_disk(). Only the objects marked as modified by
+ * mark_T3NS_modified() and mark_rOps_modified() since the previous checkpoint
+ * of the same calculation are written again.
+ *
+ * The modified objects are written from memory by a background thread, after
+ * which the old <tt>T3NScalc.h5</tt> is atomically replaced and its files that
+ * are not needed anymore are removed. Till then, the site tensors and
+ * operators should only be modified after wait_T3NS_checkpointed() or
+ * wait_rOps_checkpointed().
+ *
+ * @param [in] hdf5_loc The directory to write to. NULL writes nothing.
+ * @param [in] T3NS The site tensors.
+ * @param [in] ops The renormalized operators.
+ */
+void checkpoint_to_disk(const char * hdf5_loc, 
+                        const struct siteTensor * const T3NS, 
+                        const struct rOperators * const ops);
+
+/// Marks the site tensors of the given sites as modified for the checkpoints.
+void mark_T3NS_modified(const int * sites, int n);
+
+/// Waits till the running checkpoint is completely written.
+void wait_checkpoint_job(void);
+
+/// Waits till the running checkpoint has written the given site tensors.
+void wait_T3NS_checkpointed(const int * sites, int n);
+
+/// Waits till the running checkpoint has written the given operators.
+void wait_rOps_checkpointed(const int * bonds, int n);
+
+/**
+ * @brief Waits for the running checkpoint and stops tracking the modified
+ * objects.
+ *
+ * The next checkpoint writes all objects again.
+ */
+void finish_checkpoints(void);
@@ -132,6 +132,20 @@ int site_is_left_of_bond(int site, int bond);
  */
 void get_bonds_of_site(int site, int * bonds);
 
+/**
+ * @brief Uses a private copy of @ref network.sitetoorb in the calling thread.
+ *
+ * get_bonds_of_site() and the permutation of site tensors use this copy
+ * instead, see also set_private_symsecs().
+ *
+ * @param [in] sitetoorb The private copy, NULL to use @ref network.sitetoorb
+ * again. It stays owned by the caller.
+ */
+void set_private_sitetoorb(int * sitetoorb);
+
+/// Returns the sitetoorb array used by the calling thread.
+int * get_sitetoorb(void);
+
 int get_braT3NSbond(int bond);
 
 int get_ketT3NSbond(int bond);
@@ -42,6 +42,26 @@ struct regime {
         double energy_conv;
         /// Level of noise to add after every optimization step.
         double noise;
+        /** Number of vectors added in every iteration of the davidson 
+         * (block Davidson). 0 or 1 is the normal Davidson. */
+        int davidson_block;
+        /** If 1, the matvecs are done in single precision till the residual
+         * reaches the accuracy of single precision (see set_Heff_precision()).
+         * The remaining iterations are done in double precision. */
+        int single_prec;
+        /** If larger than 0, the Davidson tolerance of every step is set to
+         * this factor times the square root of the discarded weight or 
+         * energy change of the previous step, whichever is largest. 
+         * It is bounded by @ref davidson_rtl and DAVIDSON_ADAPT_MAX_RTL. */
+        double davidson_adapt;
+        /** If 1, the noise is only used for selecting the renormalized bases
+         * in a multi-site decomposition. The converged tensor projected on 
+         * these bases is propagated as guess for the next step. */
+        int clean_guess;
+        /** The number of lowest roots converged by the (block) Davidson.
+         * The highest of them is the state that is optimized, 1 is the 
+         * ground state. */
+        int davidson_roots;
 };
 
 /// Struct with the optimization scheme stored in it.
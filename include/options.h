@@ -18,6 +18,7 @@
 
 # define DAVIDSON_MAX_VECS 30
 # define DAVIDSON_KEEP_DEFLATE 2
+# define DAVIDSON_ADAPT_MAX_RTL 1e-3
 
 # define DEFAULT_SITESIZE 2
 # define DEFAULT_MINSTATES 2
@@ -26,3 +27,8 @@
 # define DEFAULT_SWEEPS 4
 # define DEFAULT_E_CONV 1e-6
 # define DEFAULT_NOISE 0
+# define DEFAULT_DAVIDSON_BLOCK 1
+# define DEFAULT_SINGLE_PREC 0
+# define DEFAULT_DAVIDSON_ADAPT 0.
+# define DEFAULT_CLEAN_GUESS 0
+# define DEFAULT_DAVIDSON_ROOTS 1
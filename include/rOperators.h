@@ -129,6 +129,15 @@ struct rOperators null_rOperators(void);
 /// Destroys a rOperators and sets it to a null initialized rOperators.
 void destroy_rOperators(struct rOperators* rops);
 
+/**
+ * @brief Makes a deep copy of a rOperators.
+ *
+ * @param [out] copy The resulting copy.
+ * @param [in] orig The rOperators to copy.
+ */
+void deep_copy_rOperators(struct rOperators * copy, 
+                          const struct rOperators * orig);
+
 /// Initializes a vacuum rOperators at the given bond
 struct rOperators vacuum_rOperators(int bond, int is_left);
 
@@ -454,12 +454,15 @@ struct SelectRes {
  * @param [out] U The remainder of the multisite tensor.
  * @param [out] S The singular values.
  * @param [out] V The siteTensor that was split off.
+ * @param [in,out] B NULL or a tensor with the same blocks as @p A. It is 
+ * replaced by its (normalized) projection on @p V, with the same blocks as 
+ * @p U.
  * @return res Structure with data of the resulting truncation.
  */
 struct SelectRes split_of_site(struct siteTensor * A, int site, 
                                const struct SvalSelect * sel, 
                                struct siteTensor * U, struct Sval * S, 
-                               struct siteTensor * V);
+                               struct siteTensor * V, struct siteTensor * B);
 
 /// Information on the performed decomposition.
 struct decompose_info {
@@ -527,11 +530,38 @@ void print_decompose_info(const struct decompose_info * info,
  * The resulting one-site siteTensors of the decomposition are stored in this
  * array.
  * @param [in] sel Selection criterion for the truncation for HOSVD.
+ * @param [in,out] B NULL or a tensor with the same blocks as @p A. 
+ * If given, the bases are selected from @p A, but the projection of @p B on
+ * them is stored as the new orthogonality center. It is destroyed.
  * @return Information on the performed decomposition.
  */
 struct decompose_info HOSVD(struct siteTensor * A, int nCenter, 
                             struct siteTensor * T3NS, 
-                            const struct SvalSelect * sel);
+                            const struct SvalSelect * sel, 
+                            struct siteTensor * B);
+
+/**
+ * @brief Randomized SVD of rank @p k of a dense matrix.
+ *
+ * The range of @p A is sampled with @p k random vectors and refined by power
+ * iterations (Halko, Martinsson and Tropp, algorithm 4.4 and 5.1). The HOSVD
+ * uses it for symmetry sectors much larger than the bond dimension.
+ *
+ * @param [in] M The number of rows of @p A.
+ * @param [in] N The number of columns of @p A.
+ * @param [in] A The column-major matrix. It is not changed.
+ * @param [in] k The rank, at most min(@p M, @p N).
+ * @param [out] sing The @p k largest singular values.
+ * @param [out] U The @p M x @p k left singular vectors.
+ * @param [out] VT The @p k x @p N right singular vectors.
+ * @param [out] tail The weight of the singular values that are not
+ * computed, i.e. \f$\|A\|_F^2 - Σ_i s_i^2\f$.
+ * @param [in] seed The seed for the random vectors.
+ * @return 0 on success, the LAPACK error otherwise.
+ */
+int randomized_svd(int M, int N, const EL_TYPE * A, int k, double * sing,
+                   EL_TYPE * U, EL_TYPE * VT, double * tail, 
+                   unsigned int seed);
 
 /**
  * @brief Executes one QR decomposition for orthocenter and contracts the 
@@ -568,8 +598,10 @@ struct decompose_info qr_step(struct siteTensor * A, int nCenter,
  * The resulting one-site siteTensors of the decomposition are stored in this
  * array.
  * @param [in] sel Selection criterion for the truncation for HOSVD.
+ * @param [in,out] B See HOSVD(), ignored for a QR decomposition.
  * @return Information on the performed decomposition.
  */
 struct decompose_info decompose_siteTensor(struct siteTensor * A, int nCenter,
                                            struct siteTensor * T3NS, 
-                                           const struct SvalSelect * sel);
+                                           const struct SvalSelect * sel,
+                                           struct siteTensor * B);
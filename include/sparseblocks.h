@@ -33,6 +33,8 @@
 #define EL_TYPE double
 /// Type of the elements of the tensors for HDF5
 #define EL_TYPE_H5 H5T_IEEE_F64LE
+/// The HDF5 type in memory of the elements of the tensors
+#define EL_TYPE_H5_NATIVE H5T_NATIVE_DOUBLE
 
 /**
  * The structure for the sparse blocks of the tensors. 
@@ -229,6 +231,95 @@ struct contractinfo {
 void do_contract(const struct contractinfo * cinfo, EL_TYPE ** tel, 
                  double alpha, double beta);
 
+/**
+ * @brief Performs a (batched) sgemm for the inputted tensors.
+ *
+ * The single precision version of do_contract().
+ *
+ * @param [in] cinfo Structure with the contract info.
+ * @param [in] tel Pointer to the different tensors.
+ * @param [in] alpha α Parameter for sgemm.
+ * @param [in] beta β Parameter for sgemm.
+ */
+void do_contract_single(const struct contractinfo * cinfo, float ** tel, 
+                        float alpha, float beta);
+
+struct arena;
+
+/**
+ * Workspace used by do_contract_batch() for the packing of the batch.
+ *
+ * The memory is grown when needed and can be reused over different calls.
+ */
+struct contractbuffer {
+        /// The allocated memory.
+        EL_TYPE * mem;
+        /// Number of elements allocated in @ref mem.
+        long long size;
+        /** The arena from which the memory is taken.
+         *
+         * If NULL, the memory is allocated on the heap. */
+        struct arena * ar;
+};
+
+/**
+ * @brief Initializes an empty contractbuffer.
+ *
+ * @param [out] buf The contractbuffer.
+ * @param [in] ar The arena to take the memory from (see arena.h). The memory
+ * is released together with the arena. If NULL, the heap is used.
+ */
+void init_contractbuffer(struct contractbuffer * buf, struct arena * ar);
+
+/**
+ * @brief Destroys a contractbuffer.
+ *
+ * @param [in,out] buf The contractbuffer to destroy.
+ */
+void destroy_contractbuffer(struct contractbuffer * buf);
+
+/**
+ * @brief Performs a batch of @p n contractions with the same shape.
+ *
+ * This does the same as
+ *
+ * > for (k = 0; k < n; ++k) do_contract(cinfo, tel[k], alpha[k], beta);
+ *
+ * but for small contractions the batch is packed together in a few bigger
+ * dgemms, such that the overhead of the many small dgemm calls disappears.
+ *
+ * * If all contractions accumulate in the same `C`, the `A`'s and `B`'s are
+ *   stacked along the contracted dimension and one dgemm is done.
+ * * If all contractions share the same `A` (or `B`), the other matrices are
+ *   stacked along `N` (or `M`) and the result is scattered over the
+ *   different `C`'s afterwards.
+ * * Else, the contractions are executed as a grouped dgemm (MKL) or one
+ *   after another.
+ *
+ * Different `C`'s in the batch should either be the same or not overlap.
+ * If they are the same, β should be 1.
+ *
+ * @param [in] cinfo The shared contractinfo of the contractions.
+ * @param [in] tel For every contraction, the pointers to the different tensors
+ * as in do_contract().
+ * @param [in] alpha For every contraction the α parameter.
+ * @param [in] beta The β parameter.
+ * @param [in] n The number of contractions in the batch.
+ * @param [in,out] buf Workspace for the packing.
+ */
+void do_contract_batch(const struct contractinfo * cinfo, EL_TYPE ** const * tel,
+                       const double * alpha, double beta, int n,
+                       struct contractbuffer * buf);
+
+/**
+ * @brief The single precision version of do_contract_batch().
+ *
+ * The workspace @p buf can be shared with do_contract_batch().
+ */
+void do_contract_batch_single(const struct contractinfo * cinfo, 
+                              float ** const * tel, const float * alpha, 
+                              float beta, int n, struct contractbuffer * buf);
+
 /**
  * @brief General permutation and addition of a block.
  *
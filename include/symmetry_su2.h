@@ -66,6 +66,14 @@ void SU2_get_irrstring(char * buffer, int irr);
  */
 int SU2_which_irrep(char * buffer, int * irr);
 
+/**
+ * @brief Frees the tables with the memoized Wigner symbols of all threads.
+ *
+ * The Wigner symbols needed for the prefactors are calculated once per thread
+ * and stored in a hash table keyed by their \f$2j\f$ values.
+ */
+void destroy_wigner_caches(void);
+
 double SU2_prefactor_mirror_coupling(const int * symv);
 
 double SU2_prefactor_pAppend(int (*sv)[3], int is_left);
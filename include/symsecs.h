@@ -76,6 +76,30 @@ void get_symsecs(struct symsecs *res, int bond);
  */
 void get_symsecs_arr(int n, struct symsecs * res, const int * bonds);
 
+/**
+ * \brief Returns a pointer to the symmsecs of a virtual bond, such that they
+ * can be changed.
+ *
+ * \param [in] bond The virtual bond.
+ * \return The symmsecs in the bookkeeper, or the private ones of the thread
+ * if set by set_private_symsecs().
+ */
+struct symsecs * get_symsecs_ptr(int bond);
+
+/**
+ * \brief Uses private symmsecs for some virtual bonds in the calling thread.
+ *
+ * get_symsecs(), get_symsecs_arr() and get_symsecs_ptr() return these instead
+ * of the ones in the bookkeeper. Different threads can thus change the
+ * symmsecs of the same bonds independently. The private symmsecs are not
+ * passed to the threads of a nested parallel region.
+ *
+ * \param [in] n The number of bonds, 0 to use the bookkeeper again.
+ * \param [in] bonds The bonds.
+ * \param [in] ss The symmsecs of the bonds, they stay owned by the caller.
+ */
+void set_private_symsecs(int n, const int * bonds, struct symsecs * ss);
+
 void destroy_symsecs(struct symsecs *sectors);
 
 /**
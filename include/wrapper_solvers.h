@@ -21,12 +21,14 @@
  * \brief The wrapper for the different solvers.
  *
  * This wraps the different solvers together. At this moment you have the
- * option out of Davidson only. 
+ * option out of Davidson (with a block mode for multiple roots) and PRIMME.
  *
  * These sparse solvers can be used for finding the lowest algebraic
  * eigenvalues.
  */
 
+struct davidson_context;
+
 /**
  * \brief the wrapper for the sparse eigensolvers for finding the lowest
  * algebraic eigenvalues.
@@ -38,6 +40,15 @@
  * \param [in] matvec The pointer to the function defining the matrix vector
  * product. This function should take as arguments the incoming vector, the
  * outputted vector and a pointer to data needed.
+ * \param [in] blockmatvec The pointer to the function defining the matrix 
+ * vector product for multiple vectors at once. Its arguments are the incoming
+ * vectors, the outputted vectors (both stored after each other), the number of
+ * vectors and a pointer to data needed. Can be NULL.
+ * \param [in] block The number of vectors for which the matrix vector product
+ * is done at once by the solver (block Davidson or the block size of PRIMME).
+ * \param [in] nroots The number of lowest roots to converge. The highest of 
+ * them is returned in \p vec and \p energy. Larger than 1 always uses the 
+ * Davidson.
  * \param [in] data The pointer to a data structure needed for the matrix
  * vector product.
  * \param [in] diagonal An array of diagonal elements of the matrix. When using
@@ -47,14 +58,22 @@
  * \f$||Ax - \lambda M x|| < tol \f$ for the found vector \f$x\f$ and energy
  * \f$ \lambda \f$.
  * \param [in] max_its The maximum number of iterations.
- * \param [in] solver String that specifies solver to be used. "D" for Davidson.
+ * \param [in] solver String that specifies solver to be used. "D" for Davidson
+ * and "PRIMME" for PRIMME.
  * \param [in] davidson_keep The number of vectors to be kept after deflation
  * in the Davidson algorithm.
  * \param [in] davidson_max_vec Number of maximum vectors to be taken into
  * account before deflation is needed in the Davidson algorithm.
+ * \param [in,out] ctx The context with the workspace for the Davidson
+ * algorithm, reused over different calls. Can be NULL, then a temporary
+ * workspace is used. If <tt>ctx->refine</tt> is set, the Davidson algorithm
+ * is used.
  */
 int sparse_eigensolve(double * result, double * energy, int size, int max_vecs, 
-                      int keep_deflate, double tol, int max_its, 
+                      int keep_deflate, int block, int nroots, double tol, 
+                      int max_its, 
                       const double * diagonal, 
                       void (*matvec)(const double *, double *, void *), 
-                      void * vdat, const char solver[]);
+                      void (*blockmatvec)(const double *, double *, int, void *),
+                      void * vdat, struct davidson_context * ctx, 
+                      const char solver[]);
@@ -18,6 +18,7 @@
 #include <stdio.h>
 #include <omp.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "Heff.h"
 #include "symmetries.h"
@@ -29,6 +30,7 @@
 #include "hamiltonian.h"
 #include "instructions.h"
 #include "sort.h"
+#include "arena.h"
 
 #define NEW 0
 #define OLD 1
@@ -115,94 +117,118 @@ static void find_indexes(QN_TYPE qn, const int * maxdims, int * indexes)
         assert(qn < maxdims[2]);
 }
 
-static void makeqnumbersarr_count_or_store(int **** qnumbersarray, 
-                                           const struct rOperators * Operator, 
-                                           int internaldim, int count)
-{
-        const int couplnr = rOperators_give_nr_of_couplings(Operator);
+/* An open addressing hash table from quantum numbers to indices. */
+struct qnhash {
+        int mask;
+        QN_TYPE * keys;
+        int * vals;
+};
 
-        if (count) {
-                *qnumbersarray = safe_malloc(internaldim ,int **);
-                for (int i = 0; i < internaldim; ++i) {
-                        (*qnumbersarray)[i] = safe_malloc(internaldim ,int *);
-                        for (int j = 0; j < internaldim; ++j)
-                                (*qnumbersarray)[i][j] = safe_calloc(1, int);
-                }
-        } else {
-                for (int i = 0; i < internaldim; ++i) {
-                        for (int j = 0; j < internaldim; ++j) {
-                                (*qnumbersarray)[i][j] = 
-                                        realloc((*qnumbersarray)[i][j], 
-                                                ((*qnumbersarray)[i][j][0] + 1) 
-                                                * sizeof(int));
-                                (*qnumbersarray)[i][j][0] = 0;
-                        }
-                }
-        }
+static void init_qnhash(struct qnhash * h, int n)
+{
+        int size = 16;
+        while (size < 2 * n) { size *= 2; }
+        h->mask = size - 1;
+        h->keys = safe_malloc(size, *h->keys);
+        h->vals = safe_malloc(size, *h->vals);
+        for (int i = 0; i < size; ++i) { h->vals[i] = -1; }
+}
 
-        QN_TYPE prevqn = -1;
-        int currhss = 0;
-        for (int i = 0; i < Operator->begin_blocks_of_hss[Operator->nrhss]; ++i) {
-                const QN_TYPE currqn = Operator->qnumbers[couplnr * i + couplnr - 1];
+static void destroy_qnhash(struct qnhash * h)
+{
+        safe_free(h->keys);
+        safe_free(h->vals);
+}
 
-                while (i >= Operator->begin_blocks_of_hss[currhss + 1]) {
-                        ++currhss;
-                }
-                if (prevqn == currqn) { continue; }
+static int qnhash_slot(const struct qnhash * h, QN_TYPE key)
+{
+        unsigned long long x = (unsigned long long) key * 0x9E3779B97F4A7C15ULL;
+        x ^= x >> 32;
+        int slot = x & h->mask;
+        while (h->vals[slot] != -1 && h->keys[slot] != key) {
+                slot = (slot + 1) & h->mask;
+        }
+        return slot;
+}
 
-                const int braindex = currqn % internaldim;
-                const QN_TYPE temp = currqn / internaldim;
-                const int ketindex = temp % internaldim;
+static void qnhash_insert(struct qnhash * h, QN_TYPE key, int val)
+{
+        const int slot = qnhash_slot(h, key);
+        h->keys[slot] = key;
+        h->vals[slot] = val;
+}
 
-                assert(temp / internaldim == currhss);
-                ++(*qnumbersarray)[braindex][ketindex][0];
-                if (!count) {
-                        (*qnumbersarray)[braindex][ketindex]
-                                [(*qnumbersarray)[braindex][ketindex][0]] 
-                                = currhss;
-                }
-                prevqn = currqn;
-        }
+/* Returns the index stored for key, -1 if not found. */
+static int qnhash_find(const struct qnhash * h, QN_TYPE key)
+{
+        return h->vals[qnhash_slot(h, key)];
 }
 
+/* For every (bra, ket) index of the internal bond, the symmetry sectors of
+ * the operators coupling them: qnumbersarray[bra][ket][0] is the number of
+ * sectors, followed by the sectors themselves.
+ *
+ * Everything is stored in one buffer, which is freed by destroyqnumbersarr. */
 static void makeqnumbersarr_from_operator(int **** qnumbersarray, 
                                           const struct rOperators * Operator, 
                                           int internaldim)
 {
-        makeqnumbersarr_count_or_store(qnumbersarray, Operator, internaldim, 1);
-        makeqnumbersarr_count_or_store(qnumbersarray, Operator, internaldim, 0);
-}
+        const int couplnr = rOperators_give_nr_of_couplings(Operator);
+        const int N = Operator->begin_blocks_of_hss[Operator->nrhss];
+        const int dimsq = internaldim * internaldim;
+        const QN_TYPE * qn = &Operator->qnumbers[couplnr - 1];
 
-static void destroyqnumbersarr(int **** qnumbersarray, int internaldim)
-{
+        int * count = safe_calloc(dimsq, *count);
+        for (int i = 0; i < N; ++i) {
+                if (i != 0 && qn[couplnr * i] == qn[couplnr * (i - 1)]) {
+                        continue;
+                }
+                ++count[qn[couplnr * i] % dimsq];
+        }
+
+        int total = dimsq;
+        for (int i = 0; i < dimsq; ++i) { total += count[i]; }
+        int * buffer = safe_malloc(total, *buffer);
+
+        *qnumbersarray = safe_malloc(internaldim, int **);
+        (*qnumbersarray)[0] = safe_malloc(dimsq, int *);
+        int * curr = buffer;
         for (int i = 0; i < internaldim; ++i) {
+                (*qnumbersarray)[i] = (*qnumbersarray)[0] + i * internaldim;
                 for (int j = 0; j < internaldim; ++j) {
-                        safe_free((*qnumbersarray)[i][j]);
+                        (*qnumbersarray)[i][j] = curr;
+                        curr[0] = 0;
+                        curr += count[i + j * internaldim] + 1;
                 }
-                safe_free((*qnumbersarray)[i]);
         }
-        safe_free(*qnumbersarray);
-}
+        safe_free(count);
 
-static int find_next_index(int * id, int dim, int ** qnumberarray)
-{
-        for (++*id; *id < dim; ++*id) {
-                if (qnumberarray[*id] != NULL && qnumberarray[*id][0] != 0) {
-                        return 1;
+        int currhss = 0;
+        for (int i = 0; i < N; ++i) {
+                while (i >= Operator->begin_blocks_of_hss[currhss + 1]) {
+                        ++currhss;
+                }
+                if (i != 0 && qn[couplnr * i] == qn[couplnr * (i - 1)]) {
+                        continue;
                 }
+
+                const int braindex = qn[couplnr * i] % internaldim;
+                const QN_TYPE temp = qn[couplnr * i] / internaldim;
+                const int ketindex = temp % internaldim;
+                assert(temp / internaldim == currhss);
+
+                int * arr = (*qnumbersarray)[braindex][ketindex];
+                arr[++arr[0]] = currhss;
         }
-        *id = -1;
-        return 0;
 }
 
-static int find_in_helperarray(QN_TYPE value, const QN_TYPE * arr,
-                               int * loc, int n)
+static void destroyqnumbersarr(int **** qnumbersarray, int internaldim)
 {
-        for (++*loc; *loc < n; ++*loc) {
-                if (arr[*loc] == value) { return 1; }
+        if (internaldim != 0) {
+                safe_free((*qnumbersarray)[0][0]);
+                safe_free((*qnumbersarray)[0]);
         }
-        *loc = -1;
-        return 0;
+        safe_free(*qnumbersarray);
 }
 
 static void count_or_make_MPOcombos(int * nrMPOs, int ** MPO, int n, 
@@ -239,56 +265,49 @@ static void count_or_make_MPOcombos(int * nrMPOs, int ** MPO, int n,
         }
 }
 
-static int find_next_old(int n, int * indices_old, const int * internaldims, 
-                         int ** qnumberarray[n], const QN_TYPE * helperarr, 
-                         const int * lastid, int * loc, int helperels, 
-                         int * nrMPO, int ** MPO, int hssdim)
+/* The qnBs grouped by the indices of their first two bonds.
+ *
+ * Group i has key[i] = id[0] + id[1] * dim0 and contains the qnBs
+ * qnB[beg[i]] up to qnB[beg[i + 1]]. The groups are sorted by key and the
+ * qnBs in a group are sorted as well. */
+struct qnBgroups {
+        int nr;
+        QN_TYPE * key;
+        int * beg;
+        int * qnB;
+};
+
+static void make_qnBgroups(struct qnBgroups * gr, const QN_TYPE * qnB_arr,
+                           int nr_qnB, QN_TYPE bigdim)
 {
-        assert(n == 3);
-        QN_TYPE findid = indices_old[0] + indices_old[1] * internaldims[0];
-        int * MPOarr[n];
-
-        /* a next last index can be found with the current first two indices? */
-        while (!find_in_helperarray(findid, helperarr, loc, helperels)) {
-                /* no suitable last index is (anymore) found. Increment the first and second index */
-                while (1) {
-                        if (!find_next_index(&indices_old[0], internaldims[0], qnumberarray[0])) { 
-                                /* no suitable increment of first index is found
-                                 * search for an increment of the second index
-                                 * indices_old[0] is set on an invalid value, so search can restart */
-                                if (!find_next_index(&indices_old[1], internaldims[1], qnumberarray[1]))
-                                        return 0; /* if no increments found for the second index, exit this function with a 0 */
-                                else
-                                        continue; /* if a suitable increment is found for second index, do a new search for 
-                                                   * a suitable indices_old[0] */
-                        } else { /* a suitable incrment of the first index is found */
-                                break;
-                        }
+        QN_TYPE * keys = safe_malloc(nr_qnB, *keys);
+        for (int i = 0; i < nr_qnB; ++i) { keys[i] = qnB_arr[i] % bigdim; }
+        gr->qnB = quickSort(keys, nr_qnB, SORT_QN_TYPE);
+
+        gr->nr = 0;
+        gr->key = safe_malloc(nr_qnB, *gr->key);
+        gr->beg = safe_malloc(nr_qnB + 1, *gr->beg);
+        for (int i = 0; i < nr_qnB; ++i) {
+                if (i == 0 || keys[gr->qnB[i]] != gr->key[gr->nr - 1]) {
+                        gr->key[gr->nr] = keys[gr->qnB[i]];
+                        gr->beg[gr->nr++] = i;
                 }
-                findid = indices_old[0] + indices_old[1] * internaldims[0];
         }
+        gr->beg[gr->nr] = nr_qnB;
+        safe_free(keys);
 
-        /* So a valid new third index is found */
-        indices_old[2] = lastid[*loc];
-        MPOarr[0] = qnumberarray[0][indices_old[0]];
-        MPOarr[1] = qnumberarray[1][indices_old[1]];
-        MPOarr[2] = qnumberarray[2][indices_old[2]];
-        *nrMPO = 0;
-        count_or_make_MPOcombos(nrMPO, NULL, n, MPOarr, hssdim);
-        count_or_make_MPOcombos(nrMPO, MPO, n, MPOarr, hssdim);
-        return 1;
+        for (int i = 0; i < gr->nr; ++i) {
+                inplace_quickSort(&gr->qnB[gr->beg[i]],
+                                  gr->beg[i + 1] - gr->beg[i], SORT_INT,
+                                  sizeof *gr->qnB);
+        }
 }
 
-static QN_TYPE * make_helperarray(const int nr, const QN_TYPE * const array, 
-                                  const QN_TYPE mod, int ** const lastid)
+static void destroy_qnBgroups(struct qnBgroups * gr)
 {
-        QN_TYPE * const result = safe_malloc(nr, QN_TYPE);
-        *lastid = safe_malloc(nr, int);
-        for (int i = 0; i < nr; ++i) {
-                (*lastid)[i] = array[i] / mod;
-                result[i] = array[i] % mod;
-        }
-        return result;
+        safe_free(gr->key);
+        safe_free(gr->beg);
+        safe_free(gr->qnB);
 }
 
 static void make_qnB_arrT3NS(struct Heffdata * const data, 
@@ -297,20 +316,17 @@ static void make_qnB_arrT3NS(struct Heffdata * const data,
 {
         const int hssdim = data->MPOsymsec.nrSecs;
         const QN_TYPE bigdim = internaldims[0] * internaldims[1];
-        int * lastind;
-        QN_TYPE * helperarray = make_helperarray(data->nr_qnB, data->qnB_arr,
-                                                 bigdim, &lastind);
+        struct qnBgroups gr;
+        make_qnBgroups(&gr, data->qnB_arr, data->nr_qnB, bigdim);
 
         data->nr_qnBtoqnB  = safe_calloc(data->nr_qnB, int);
         data->qnBtoqnB_arr = safe_malloc(data->nr_qnB, QN_TYPE*);
         data->nrMPOcombos  = safe_malloc(data->nr_qnB, int*);
         data->MPOs         = safe_malloc(data->nr_qnB, int**);
 
-#pragma omp parallel for schedule(dynamic) default(none) shared(lastind, helperarray)
+#pragma omp parallel for schedule(dynamic) default(none) shared(gr)
         for (int i = 0; i < data->nr_qnB; ++i) {
                 int indices[3];
-                int indicesold[3] = {-1, -1, -1};
-                int loc = -1;
                 int * cnt = &data->nr_qnBtoqnB[i];
                 find_indexes(data->qnB_arr[i], internaldims, indices);
                 int ** qnumbersar[3] =  {
@@ -319,47 +335,47 @@ static void make_qnB_arrT3NS(struct Heffdata * const data,
                         qnumberarray[2][indices[2]]
                 };
 
-                /* initialize indices_old */
-                find_next_index(&indicesold[0], internaldims[0], qnumbersar[0]);
-                find_next_index(&indicesold[1], internaldims[1], qnumbersar[1]);
-
-                if (qnumbersar[0] == NULL || 
-                    qnumbersar[1] == NULL || 
-                    qnumbersar[2] == NULL) {
-                        data->qnBtoqnB_arr[i] = NULL;
-                        data->nrMPOcombos[i]  = NULL;
-                        data->MPOs[i]         = NULL;
-                        continue;
-                }
-
                 data->qnBtoqnB_arr[i] = safe_malloc(data->nr_qnB, QN_TYPE);
                 data->nrMPOcombos[i]  = safe_malloc(data->nr_qnB, int);
                 data->MPOs[i]         = safe_malloc(data->nr_qnB, int*);
 
                 *cnt = 0;
-                while (find_next_old(3, indicesold, internaldims, qnumbersar, 
-                                     helperarray, lastind, &loc, data->nr_qnB, 
-                                     &data->nrMPOcombos[i][*cnt], 
-                                     &data->MPOs[i][*cnt], hssdim)) {
-
-                        if (data->nrMPOcombos[i][*cnt] != 0) {
-                                data->qnBtoqnB_arr[i][*cnt] = 
-                                        indicesold[0] + 
-                                        indicesold[1] * internaldims[0] + 
-                                        indicesold[2] * bigdim;
-                                ++(*cnt);
-                                assert(*cnt <= data->nr_qnB);
+                for (int g = 0; g < gr.nr; ++g) {
+                        int * MPOarr[3] = {
+                                qnumbersar[0][gr.key[g] % internaldims[0]],
+                                qnumbersar[1][gr.key[g] / internaldims[0]]
+                        };
+                        if (MPOarr[0][0] == 0 || MPOarr[1][0] == 0) {
+                                continue;
+                        }
+
+                        for (int j = gr.beg[g]; j < gr.beg[g + 1]; ++j) {
+                                const QN_TYPE oldqn = data->qnB_arr[gr.qnB[j]];
+                                MPOarr[2] = qnumbersar[2][oldqn / bigdim];
+
+                                int * nrMPO = &data->nrMPOcombos[i][*cnt];
+                                *nrMPO = 0;
+                                count_or_make_MPOcombos(nrMPO, NULL, 3, MPOarr,
+                                                        hssdim);
+                                count_or_make_MPOcombos(nrMPO, 
+                                                        &data->MPOs[i][*cnt],
+                                                        3, MPOarr, hssdim);
+                                if (*nrMPO != 0) {
+                                        data->qnBtoqnB_arr[i][*cnt] = oldqn;
+                                        ++(*cnt);
+                                        assert(*cnt <= data->nr_qnB);
+                                }
                         }
                 }
                 data->qnBtoqnB_arr[i] = realloc(data->qnBtoqnB_arr[i], *cnt * sizeof(QN_TYPE));
                 data->nrMPOcombos[i]  = realloc(data->nrMPOcombos[i],  *cnt * sizeof(int));
                 data->MPOs[i]         = realloc(data->MPOs[i],         *cnt * sizeof(int*));
         }
-        safe_free(lastind);
-        safe_free(helperarray);
+        destroy_qnBgroups(&gr);
 }
 
-static void make_qnB_arrDMRG(struct Heffdata * const data)
+static void make_qnB_arrDMRG(struct Heffdata * const data,
+                             const struct qnhash * qnBhash)
 {
         data->nr_qnBtoqnB  = safe_calloc(data->nr_qnB, *data->nr_qnBtoqnB);
         data->qnBtoqnB_arr = safe_malloc(data->nr_qnB, *data->qnBtoqnB_arr);
@@ -370,40 +386,65 @@ static void make_qnB_arrDMRG(struct Heffdata * const data)
         const struct rOperators op = data->Operators[opid];
         assert(op.P_operator);
         const int N  = op.begin_blocks_of_hss[op.nrhss];
+        const QN_TYPE * const qna = op.qnumbers;
+
+        /* Bucket the blocks of the operator by the qnB of their bra,
+         * keeping the order of the blocks. */
+        int * qnBid = safe_malloc(N, *qnBid);
+        int * beg = safe_calloc(data->nr_qnB + 1, *beg);
+#pragma omp parallel for schedule(static) default(none) shared(qnBid, qnBhash)
+        for (int j = 0; j < N; ++j) {
+                qnBid[j] = qnhash_find(qnBhash, qna[3 * j]);
+        }
+        for (int j = 0; j < N; ++j) {
+                if (qnBid[j] != -1) { ++beg[qnBid[j] + 1]; }
+        }
+        for (int i = 0; i < data->nr_qnB; ++i) { beg[i + 1] += beg[i]; }
 
-#pragma omp parallel for schedule(dynamic) default(none) shared(stderr)
-        for (int i = 0; i < data->nr_qnB; ++i) {
-                const QN_TYPE * qna = op.qnumbers;
-                data->qnBtoqnB_arr[i] = safe_malloc(data->nr_qnB, QN_TYPE);
-                data->nrMPOcombos[i]  = safe_calloc(data->nr_qnB, int);
-                data->MPOs[i]         = safe_malloc(data->nr_qnB, int*);
+        int * blocks = safe_malloc(beg[data->nr_qnB], *blocks);
+        int * hssofblock = safe_malloc(beg[data->nr_qnB], *hssofblock);
+        int * curr = safe_malloc(data->nr_qnB, *curr);
+        for (int i = 0; i < data->nr_qnB; ++i) { curr[i] = beg[i]; }
+        int currhss = 0;
+        for (int j = 0; j < N; ++j) {
+                while (op.begin_blocks_of_hss[currhss + 1] <= j) {
+                        ++currhss;
+                }
+                if (qnBid[j] == -1) { continue; }
+                blocks[curr[qnBid[j]]] = j;
+                hssofblock[curr[qnBid[j]]++] = currhss;
+        }
+        safe_free(curr);
+        safe_free(qnBid);
 
-                const QN_TYPE qn = data->qnB_arr[i];
-                int currhss = 0;
-                for (int j = 0; j < N; ++j) {
-                        while (op.begin_blocks_of_hss[currhss + 1] <= j) {
-                                ++currhss;
+#pragma omp parallel for schedule(dynamic) default(none) shared(stderr, beg, blocks, hssofblock)
+        for (int i = 0; i < data->nr_qnB; ++i) {
+                const int nrblocks = beg[i + 1] - beg[i];
+                data->qnBtoqnB_arr[i] = safe_malloc(nrblocks, QN_TYPE);
+                data->nrMPOcombos[i]  = safe_calloc(nrblocks, int);
+                data->MPOs[i]         = safe_malloc(nrblocks, int*);
+
+                for (int b = beg[i]; b < beg[i + 1]; ++b) {
+                        const int j = blocks[b];
+                        const int currhss = hssofblock[b];
+                        int k;
+                        for (k = 0; k < data->nr_qnBtoqnB[i]; ++k) {
+                                if (qna[3 * j + 1] ==
+                                    data->qnBtoqnB_arr[i][k]) { break; }
                         }
-                        if (qna[3 * j] == qn) {
-                                int k;
-                                for (k = 0; k < data->nr_qnBtoqnB[i]; ++k) {
-                                        if (qna[3 * j + 1] ==
-                                            data->qnBtoqnB_arr[i][k]) { break; }
-                                }
-                                if (k == data->nr_qnBtoqnB[i]) {
-                                        data->qnBtoqnB_arr[i][k] = qna[3 * j + 1];
-                                        ++data->nr_qnBtoqnB[i];
+                        if (k == data->nr_qnBtoqnB[i]) {
+                                data->qnBtoqnB_arr[i][k] = qna[3 * j + 1];
+                                ++data->nr_qnBtoqnB[i];
 
-                                        data->MPOs[i][k] = safe_calloc(op.nrhss, int);
-                                }
-                                const int chss1 = opid == 1 ?
-                                        hermitian_symsec(currhss) : currhss;
-                                const int chss2 = opid != 1 ?
-                                        hermitian_symsec(currhss) : currhss;
-                                data->MPOs[i][k][data->nrMPOcombos[i][k]] = 
-                                        chss1 + chss2 * data->MPOsymsec.nrSecs;
-                                ++data->nrMPOcombos[i][k];
+                                data->MPOs[i][k] = safe_calloc(op.nrhss, int);
                         }
+                        const int chss1 = opid == 1 ?
+                                hermitian_symsec(currhss) : currhss;
+                        const int chss2 = opid != 1 ?
+                                hermitian_symsec(currhss) : currhss;
+                        data->MPOs[i][k][data->nrMPOcombos[i][k]] = 
+                                chss1 + chss2 * data->MPOsymsec.nrSecs;
+                        ++data->nrMPOcombos[i][k];
                 }
                 for (int j = 0; j < data->nr_qnBtoqnB[i]; ++j) {
                         data->MPOs[i][j] = realloc(data->MPOs[i][j], 
@@ -415,6 +456,7 @@ static void make_qnB_arrDMRG(struct Heffdata * const data)
                                 exit(EXIT_FAILURE);
                         }
                 }
+                if (data->nr_qnBtoqnB[i] == nrblocks) { continue; }
                 data->qnBtoqnB_arr[i] = realloc(data->qnBtoqnB_arr[i], 
                                                 data->nr_qnBtoqnB[i] * 
                                                 sizeof *data->qnBtoqnB_arr[i]);
@@ -439,9 +481,13 @@ static void make_qnB_arrDMRG(struct Heffdata * const data)
                         exit(EXIT_FAILURE);
                 }
         }
+        safe_free(beg);
+        safe_free(blocks);
+        safe_free(hssofblock);
 }
 
-static void make_qnBdatas(struct Heffdata * const data)
+static void make_qnBdatas(struct Heffdata * const data,
+                          const struct qnhash * qnBhash)
 {
         int ***qnumbersarray[3];
         const int internaldims[3] = {
@@ -450,6 +496,28 @@ static void make_qnBdatas(struct Heffdata * const data)
                 data->symarr[data->posB][2].nrSecs
         };
 
+        if (data->isdmrg) {
+                make_qnB_arrDMRG(data, qnBhash);
+        } else {
+#pragma omp parallel for schedule(static) default(none) shared(qnumbersarray)
+                for (int i = 0; i < 3; ++i) {
+                        makeqnumbersarr_from_operator(&qnumbersarray[i],
+                                                      &data->Operators[i],
+                                                      internaldims[i]);
+                }
+
+                make_qnB_arrT3NS(data, internaldims, qnumbersarray);
+
+                destroyqnumbersarr(&qnumbersarray[0], internaldims[0]);
+                destroyqnumbersarr(&qnumbersarray[1], internaldims[1]);
+                destroyqnumbersarr(&qnumbersarray[2], internaldims[2]);
+        }
+}
+
+/* Makes the sorted array of the different qnBs in the site tensor and a hash
+ * table from these qnBs to their index. */
+static void make_qnB_arr(struct Heffdata * const data, struct qnhash * qnBhash)
+{
         data->qnB_arr = safe_malloc(data->siteObject.nrblocks, *data->qnB_arr);
         for (int i = 0; i < data->siteObject.nrblocks; ++i) {
                 data->qnB_arr[i] = 
@@ -468,18 +536,10 @@ static void make_qnBdatas(struct Heffdata * const data)
                 fprintf(stderr, "Reallocation failed in %s.\n", __func__);
                 exit(EXIT_FAILURE);
         }
-        if (data->isdmrg) {
-                make_qnB_arrDMRG(data);
-        } else {
-                makeqnumbersarr_from_operator(&qnumbersarray[0], &data->Operators[0], internaldims[0]);
-                makeqnumbersarr_from_operator(&qnumbersarray[1], &data->Operators[1], internaldims[1]);
-                makeqnumbersarr_from_operator(&qnumbersarray[2], &data->Operators[2], internaldims[2]);
 
-                make_qnB_arrT3NS(data, internaldims, qnumbersarray);
-
-                destroyqnumbersarr(&qnumbersarray[0], internaldims[0]);
-                destroyqnumbersarr(&qnumbersarray[1], internaldims[1]);
-                destroyqnumbersarr(&qnumbersarray[2], internaldims[2]);
+        init_qnhash(qnBhash, data->nr_qnB);
+        for (int i = 0; i < data->nr_qnB; ++i) {
+                qnhash_insert(qnBhash, data->qnB_arr[i], i);
         }
 }
 
@@ -814,7 +874,6 @@ static int find_operator_tel(const int * sb, EL_TYPE ** tel,
 
 static void transform_old_to_new_sb(int *bl, struct indexdata * idd, 
                                     const struct Heffdata * data, 
-                                    const struct contractinfo * cinfo,
                                     struct newtooldmatvec * ntom)
 {
         const int MPO = ntom->MPO[*bl];
@@ -831,28 +890,36 @@ static void transform_old_to_new_sb(int *bl, struct indexdata * idd,
         ntom->sbops[*bl][0] = idd->sb_op[0];
         ntom->sbops[*bl][1] = idd->sb_op[1];
         ntom->sbops[*bl][2] = idd->sb_op[2];
+        ++*bl;
+}
 
-        for (int i = 0; i < nrinst; ++i) {
-                const double totpref = instr[i].pref * ntom->prefactor[*bl];
-                if (!find_operator_tel(ntom->sbops[*bl], &idd->tel[OPS1], 
-                                       data->Operators, instr[i].instr, 
-                                       data->isdmrg)) {
-                        continue;
-                }
+/* Copies the arrays of ntom to exactly sized memory on the heap. */
+static void keep_newtooldmatvec(struct newtooldmatvec * ntom)
+{
+        const int n = ntom->nmbr;
+        if (n == 0) {
+                ntom->sbops = NULL;
+                ntom->prefactor = NULL;
+                ntom->MPO = NULL;
+                return;
+        }
 
-                if (data->isdmrg) {
-                        do_contract(&cinfo[0], idd->tel, 1, 0);
-                        do_contract(&cinfo[1], idd->tel, totpref, 1);
-                } else {
-                        do_contract(&cinfo[0], idd->tel, 1, 0);
-                        do_contract(&cinfo[1], idd->tel, 1, 0);
-                        do_contract(&cinfo[2], idd->tel, totpref, 1);
-                }
+        int (*sbops)[3] = safe_malloc(n, *sbops);
+        EL_TYPE * prefactor = safe_malloc(n, *prefactor);
+        int * MPO = safe_malloc(n, *MPO);
+        for (int i = 0; i < n; ++i) {
+                sbops[i][0] = ntom->sbops[i][0];
+                sbops[i][1] = ntom->sbops[i][1];
+                sbops[i][2] = ntom->sbops[i][2];
+                prefactor[i] = ntom->prefactor[i];
+                MPO[i] = ntom->MPO[i];
         }
-        ++*bl;
+        ntom->sbops = sbops;
+        ntom->prefactor = prefactor;
+        ntom->MPO = MPO;
 }
 
-static void loop_oldqnBs(struct indexdata * idd, struct Heffdata * data,
+static void loop_oldqnBs(struct indexdata * idd, const struct Heffdata * data,
                          int newqnB_id, const double * vec,
                          struct newtooldmatvec * ntom, int * nrold, int * wsize)
 {
@@ -878,187 +945,736 @@ static void loop_oldqnBs(struct indexdata * idd, struct Heffdata * data,
 
                         int cwsize = cinfo[0].M * cinfo[0].N * cinfo[0].L;
                         if (wsize[0] < cwsize) { wsize[0] = cwsize; }
-                        idd->tel[WORK1] = safe_malloc(cwsize, EL_TYPE);
 
                         cwsize = cinfo[1].M * cinfo[1].N * cinfo[1].L * !data->isdmrg;
                         if (wsize[1] < cwsize) { wsize[1] = cwsize; }
-                        idd->tel[WORK2] = safe_malloc(cwsize, EL_TYPE);
 
-                        ntom->sbops = malloc(nrMPOcombos * sizeof *ntom->sbops);
-                        ntom->prefactor = malloc(nrMPOcombos * sizeof *ntom->prefactor);
-                        ntom->MPO = malloc(nrMPOcombos * sizeof *ntom->MPO);
+                        /* Collect in the arena, only keep what is needed */
+                        struct arena * ar = thread_arena();
+                        const long long mark = arena_mark(ar);
+                        ntom->sbops = arena_malloc(ar, nrMPOcombos, *ntom->sbops);
+                        ntom->prefactor = arena_malloc(ar, nrMPOcombos, *ntom->prefactor);
+                        ntom->MPO = arena_malloc(ar, nrMPOcombos, *ntom->MPO);
                         for (int i = 0; i < nrMPOcombos; ++i) {
                                 ntom->MPO[ntom->nmbr] = MPOs[i];
                                 transform_old_to_new_sb(&ntom->nmbr, idd, data, 
-                                                        cinfo, ntom);
+                                                        ntom);
                         }
+                        keep_newtooldmatvec(ntom);
+                        arena_release(ar, mark);
 
-                        ntom->sbops = realloc(ntom->sbops, ntom->nmbr * sizeof *ntom->sbops);
-                        ntom->prefactor = realloc(ntom->prefactor, ntom->nmbr * sizeof *ntom->prefactor);
-                        ntom->MPO = realloc(ntom->MPO, ntom->nmbr * sizeof *ntom->MPO);
+                        *nrold += ntom->nmbr != 0;
+                        ntom += ntom->nmbr != 0;
+                }
+        }
+}
 
-                        if (ntom->nmbr != 0 && 
-                            (ntom->MPO == NULL || ntom->prefactor == NULL || ntom->sbops == NULL)) {
-                                fprintf(stderr, "Error %s:%d: failed realloc.\n",
-                                        __FILE__, __LINE__);
-                                exit(EXIT_FAILURE);
-                        }
+/* New blocks costing more than 1 / (HEFF_SPLIT * nthreads) of the matvec are
+ * split over multiple tasks. */
+#define HEFF_SPLIT 4
 
-                        safe_free(idd->tel[WORK1]);
-                        safe_free(idd->tel[WORK2]);
+/* Counts (if opstel is NULL) or stores the contractions of a (new, old) pair.
+ *
+ * Contractions with an empty operator block are left out. */
+static int resolve_contractions(const struct Heffdata * data,
+                                const struct newtooldmatvec * ntom,
+                                EL_TYPE * (*opstel)[3], EL_TYPE * pref)
+{
+        int cnt = 0;
+        for (int bl = 0; bl < ntom->nmbr; ++bl) {
+                const int MPO = ntom->MPO[bl];
+                const struct instruction * instr = 
+                        &data->iset.instr[data->iset.MPOc_beg[MPO]];
+                const int nrinst = data->iset.MPOc_beg[MPO + 1] - 
+                        data->iset.MPOc_beg[MPO];
+
+                for (int i = 0; i < nrinst; ++i) {
+                        EL_TYPE * tel[3] = {NULL, NULL, NULL};
+                        if (!find_operator_tel(ntom->sbops[bl], tel,
+                                               data->Operators, instr[i].instr, 
+                                               data->isdmrg)) {
+                                continue;
+                        }
 
-                        *nrold += ntom->nmbr != 0;
-                        ntom += ntom->nmbr != 0;
+                        if (opstel != NULL) {
+                                opstel[cnt][0] = tel[0];
+                                opstel[cnt][1] = tel[1];
+                                opstel[cnt][2] = tel[2];
+                                pref[cnt] = instr[i].pref * ntom->prefactor[bl];
+                        }
+                        ++cnt;
                 }
         }
+        return cnt;
 }
 
-static void execute_heffcontr(int bl, const struct Heffdata * data, 
-                              const struct newtooldmatvec * hc, 
-                              const struct contractinfo * cinfo,
-                              EL_TYPE ** tels)
+/* Flattens the newtooldmatvec structures of the first run in the plan. */
+static void compile_secondrun(struct Heffdata * const data,
+                              struct newtooldmatvec ** ntom, 
+                              const int * nr_oldsb)
 {
-        const int MPO = hc->MPO[bl];
-        struct instruction * instr = &data->iset.instr[data->iset.MPOc_beg[MPO]];
-        const int nrinst = data->iset.MPOc_beg[MPO + 1] - data->iset.MPOc_beg[MPO];
-        if (nrinst == 0) { return; }
+        struct secondrun * const sr = &data->sr;
+        const int n = data->siteObject.nrblocks;
+        int map[3];
+        make_map(map, data);
 
-        for (int i = 0; i < nrinst; ++i) {
-                const double totpref = instr[i].pref * hc->prefactor[bl];
-                if (!find_operator_tel(hc->sbops[bl], &tels[OPS1],
-                                       data->Operators, instr[i].instr, 
-                                       data->isdmrg)) {
-                        continue;
+        sr->pairbeg = safe_malloc(n + 1, *sr->pairbeg);
+        sr->pairbeg[0] = 0;
+        for (int i = 0; i < n; ++i) { 
+                sr->pairbeg[i + 1] = sr->pairbeg[i] + nr_oldsb[i]; 
+        }
+        sr->nrpairs = sr->pairbeg[n];
+
+        sr->oldsb = safe_malloc(sr->nrpairs, *sr->oldsb);
+        sr->cinfo = safe_malloc(sr->nrpairs, *sr->cinfo);
+        sr->contrbeg = safe_malloc(sr->nrpairs + 1, *sr->contrbeg);
+
+#pragma omp parallel for schedule(dynamic) default(none) shared(ntom, map, nr_oldsb)
+        for (int i = 0; i < n; ++i) {
+                int dims[2][3] = {
+                        {sr->dimsofsb[i][0], sr->dimsofsb[i][1], sr->dimsofsb[i][2]}
+                };
+
+                for (int j = 0; j < nr_oldsb[i]; ++j) {
+                        const struct newtooldmatvec * cntom = &ntom[i][j];
+                        const int p = sr->pairbeg[i] + j;
+                        dims[OLD][0] = sr->dimsofsb[cntom->oldsb][0];
+                        dims[OLD][1] = sr->dimsofsb[cntom->oldsb][1];
+                        dims[OLD][2] = sr->dimsofsb[cntom->oldsb][2];
+
+                        sr->oldsb[p] = cntom->oldsb;
+                        if (data->isdmrg) {
+                                prepare_cinfo_DMRG(dims, sr->cinfo[p],
+                                                   cntom->bestorder);
+                        } else {
+                                prepare_cinfo_T3NS(dims, map, sr->cinfo[p],
+                                                   cntom->bestorder);
+                        }
+                        sr->contrbeg[p + 1] = 
+                                resolve_contractions(data, cntom, NULL, NULL);
                 }
+        }
 
-                if (data->isdmrg) {
-                        do_contract(&cinfo[0], tels, 1, 0);
-                        do_contract(&cinfo[1], tels, totpref, 1);
-                } else {
-                        do_contract(&cinfo[0], tels, 1, 0);
-                        do_contract(&cinfo[1], tels, 1, 0);
-                        do_contract(&cinfo[2], tels, totpref, 1);
+        sr->contrbeg[0] = 0;
+        for (int p = 0; p < sr->nrpairs; ++p) {
+                sr->contrbeg[p + 1] += sr->contrbeg[p];
+        }
+        sr->opstel = safe_malloc(sr->contrbeg[sr->nrpairs], *sr->opstel);
+        sr->pref = safe_malloc(sr->contrbeg[sr->nrpairs], *sr->pref);
+
+#pragma omp parallel for schedule(dynamic) default(none) shared(ntom, nr_oldsb)
+        for (int i = 0; i < n; ++i) {
+                for (int j = 0; j < nr_oldsb[i]; ++j) {
+                        const int c = sr->contrbeg[sr->pairbeg[i] + j];
+                        resolve_contractions(data, &ntom[i][j], 
+                                             &sr->opstel[c], &sr->pref[c]);
                 }
         }
 }
 
-static void exec_secondrun(const double * const vec, double * const result, 
-                           const struct Heffdata * const data)
+/* Estimated number of flops for a single contraction of a pair. */
+static double pair_cost(const struct contractinfo * cinfo, int isdmrg)
 {
-        int map[3];
-        make_map(map, data);
+        double cost = 0;
+        for (int i = 0; i < (isdmrg ? 2 : 3); ++i) {
+                cost += 2. * cinfo[i].M * cinfo[i].N * cinfo[i].K * cinfo[i].L;
+        }
+        return cost;
+}
 
+/* Divides the plan in tasks and sorts them from most to least expensive.
+ *
+ * Greedy scheduling of these sorted tasks is a longest processing time first
+ * schedule. New blocks that cost more than a fraction of the total are split
+ * in multiple tasks, such that a single block can not stall the other 
+ * threads at the end of the matvec. */
+static void make_matvectasks(struct Heffdata * const data)
+{
+        struct secondrun * const sr = &data->sr;
         const int n = data->siteObject.nrblocks;
-        int first = 0;
-        int second = 0;
-#pragma omp parallel default(none) shared(map) reduction(+:first,second)
-        {
-                EL_TYPE * tels[7];
-                tels[WORK1] = safe_malloc(data->sr.worksize[0], tels);
-                tels[WORK2] = safe_malloc(data->sr.worksize[1], tels);
-                int * bb = data->siteObject.blocks.beginblock;
-
-#pragma omp for schedule(dynamic) nowait 
-                for (int ius = 0; ius < n; ++ius) {
-                        const int i = data->sr.shufid[ius];
-                        int dims[2][3];
-
-                        dims[0][0] = data->sr.dimsofsb[i][0];
-                        dims[0][1] = data->sr.dimsofsb[i][1];
-                        dims[0][2] = data->sr.dimsofsb[i][2];
-
-                        tels[NEW] = result + bb[i];
-
-                        for (int j = 0; j < data->sr.nr_oldsb[i]; ++j) {
-                                const struct newtooldmatvec ntom = data->sr.ntom[i][j];
-                                dims[1][0] = data->sr.dimsofsb[ntom.oldsb][0];
-                                dims[1][1] = data->sr.dimsofsb[ntom.oldsb][1];
-                                dims[1][2] = data->sr.dimsofsb[ntom.oldsb][2];
-                                struct contractinfo cinfo[3];
-
-                                if (data->isdmrg) {
-                                        prepare_cinfo_DMRG(dims, cinfo,
-                                                           ntom.bestorder);
-                                } else {
-                                        prepare_cinfo_T3NS(dims, map, cinfo,
-                                                           ntom.bestorder);
-                                }
+        const int * bb = data->siteObject.blocks.beginblock;
+        const int nthreads = omp_get_max_threads();
+
+        double * ccost = safe_malloc(sr->nrpairs, double);
+        double * bcost = safe_calloc(n, double);
+        double total = 0;
+        for (int i = 0; i < n; ++i) {
+                for (int p = sr->pairbeg[i]; p < sr->pairbeg[i + 1]; ++p) {
+                        ccost[p] = pair_cost(sr->cinfo[p], data->isdmrg);
+                        bcost[i] += ccost[p] * 
+                                (sr->contrbeg[p + 1] - sr->contrbeg[p]);
+                }
+                total += bcost[i];
+        }
+        const double limit = nthreads == 1 ? 
+                total : total / (HEFF_SPLIT * nthreads);
 
-                                tels[OLD] = (double *) vec;
-                                tels[OLD] += bb[ntom.oldsb];
-                                for (int k = 0; k < ntom.nmbr; ++k) {
-                                        execute_heffcontr(k, data, &ntom, cinfo, tels);
+        int size = n;
+        struct matvectask * tasks = safe_malloc(size, *tasks);
+        sr->nrtasks = 0;
+        sr->splitsize = 0;
+        for (int i = 0; i < n; ++i) {
+                const int cbeg = sr->contrbeg[sr->pairbeg[i]];
+                const int cend = sr->contrbeg[sr->pairbeg[i + 1]];
+                if (cbeg == cend) { continue; }
+
+                const int nparts = bcost[i] > limit ? 
+                        (int) (bcost[i] / limit) + 1 : 1;
+                const double target = bcost[i] / nparts;
+                const int first = sr->nrtasks;
+
+                int p = sr->pairbeg[i];
+                int c = cbeg;
+                while (c < cend) {
+                        if (sr->nrtasks == size) {
+                                size *= 2;
+                                tasks = realloc(tasks, size * sizeof *tasks);
+                                if (tasks == NULL) {
+                                        fprintf(stderr, "Error %s:%d: realloc failed.\n",
+                                                __FILE__, __LINE__);
+                                        exit(EXIT_FAILURE);
                                 }
-                                second += ntom.nmbr;
-                                ++first;
                         }
+                        struct matvectask * t = &tasks[sr->nrtasks++];
+                        while (sr->contrbeg[p + 1] <= c) { ++p; }
+                        t->sb = i;
+                        t->pair = p;
+                        t->contr[0] = c;
+                        t->cost = 0;
+                        /* Take contractions till the target cost is reached */
+                        for (; c < cend && t->cost < target; ++c) {
+                                while (sr->contrbeg[p + 1] <= c) { ++p; }
+                                t->cost += ccost[p];
+                        }
+                        t->contr[1] = c;
+                }
+
+                const int split = sr->nrtasks - first > 1;
+                for (int j = first; j < sr->nrtasks; ++j) { tasks[j].split = split; }
+                if (split && sr->splitsize < bb[i + 1] - bb[i]) {
+                        sr->splitsize = bb[i + 1] - bb[i];
+                }
+        }
+        safe_free(ccost);
+        safe_free(bcost);
+
+        double * tcost = safe_malloc(sr->nrtasks, double);
+        for (int j = 0; j < sr->nrtasks; ++j) { tcost[j] = tasks[j].cost; }
+        int * perm = quickSort(tcost, sr->nrtasks, SORT_DOUBLE);
+        sr->tasks = safe_malloc(sr->nrtasks, *sr->tasks);
+        for (int j = 0; j < sr->nrtasks; ++j) {
+                sr->tasks[j] = tasks[perm[sr->nrtasks - 1 - j]];
+        }
+        safe_free(perm);
+        safe_free(tcost);
+        safe_free(tasks);
+}
+
+/* Adapts the contractinfo of a pair for nvec vectors at once.
+ *
+ * The vectors are stored after each other in every block, thus the vector
+ * index acts as an extra last index of the blocks. When the operator is the
+ * first matrix of the dgemm this extends N, else it extends the batch L. */
+static void multivec_cinfo(const struct contractinfo * cinfo, 
+                           struct contractinfo * mcinfo, int nvec, int isdmrg)
+{
+        for (int i = 0; i < (isdmrg ? 2 : 3); ++i) {
+                mcinfo[i] = cinfo[i];
+                if (cinfo[i].tensneeded[0] >= OPS1 && 
+                    cinfo[i].tensneeded[0] <= OPS3) {
+                        mcinfo[i].N *= nvec;
+                } else {
+                        mcinfo[i].L *= nvec;
+                }
+        }
+}
+
+/* The number of elements of the block of operator op (OPS1 to OPS3) in the
+ * contractions of cinfo, 0 if the operator is not used. */
+static int operator_size(const struct contractinfo * cinfo, int op, 
+                         int isdmrg)
+{
+        for (int i = 0; i < (isdmrg ? 2 : 3); ++i) {
+                if (cinfo[i].tensneeded[0] == op) {
+                        return cinfo[i].M * cinfo[i].K;
+                } else if (cinfo[i].tensneeded[1] == op) {
+                        return cinfo[i].K * cinfo[i].N;
+                }
+        }
+        return 0;
+}
+
+/* Maximal number of contractions collected in a heffbatch. */
+#define HEFF_BATCH 32
+/* Minimal number of elements allocated for the work memory of a heffbatch. */
+#define HEFF_BATCH_MEM 1048576
+
+#define HEFF_TYPE EL_TYPE
+#define HEFF_NAME(name) name
+#define HEFF_CONTRACT_BATCH do_contract_batch
+#include "Heff_matvec.h"
+
+#define HEFF_TYPE float
+#define HEFF_NAME(name) name##_single
+#define HEFF_CONTRACT_BATCH do_contract_batch_single
+#define HEFF_SINGLE
+#include "Heff_matvec.h"
+
+void set_Heff_precision(struct Heffdata * data, int single)
+{
+        data->single = single;
+}
+
+/* The first run of previous optimization steps.
+ *
+ * In later sweeps of a regime, the block structure of a multi-site object is
+ * often the same as before. The newtooldmatvec structures of the first run
+ * only depend on this structure, not on the elements of the operators, and
+ * can thus be reused. Only the pointers to the operator blocks have to be
+ * resolved again by compile_secondrun().
+ *
+ * Every plan is identified by the sites and a key holding the block structure
+ * of the siteObject, the symsecs, the operators and the instructions. A hash
+ * of the key is compared first, the full key only if the hashes are equal.
+ *
+ * The plans take at most HEFFPLANS_MAX_BYTES, the least recently used plans
+ * are dropped first.
+ *
+ * The plans are shared by all threads. They are only accessed in the critical
+ * section heffplans, and no pointer to a plan is kept outside of it. */
+#define HEFFPLANS_MAX_BYTES (1LL << 30)
+
+struct heffplan {
+        int nrsites;
+        int sites[STEPSPECS_MSITES];
+        unsigned long long signature;
+        unsigned char * key;
+        long long keysize;
+        int nrblocks;
+        int (*dimsofsb)[3];
+        int worksize[2];
+        int * nr_oldsb;
+        struct newtooldmatvec ** ntom;
+        /* The memory taken by the plan */
+        long long bytes;
+        /* The value of heffplans.clock at the last use */
+        long long last_use;
+};
+
+static struct {
+        int nr;
+        int size;
+        struct heffplan * plans;
+        /* The number of times a plan was reused */
+        int reused;
+        /* The memory taken by all plans */
+        long long bytes;
+        long long clock;
+} heffplans;
+
+struct heffkey {
+        unsigned char * dat;
+        long long size;
+        long long cap;
+};
+
+static void key_append(struct heffkey * key, const void * p, long long n)
+{
+        if (key->size + n > key->cap) {
+                key->cap = 2 * (key->size + n);
+                key->dat = realloc(key->dat, key->cap);
+                if (key->dat == NULL) {
+                        fprintf(stderr, "Error %s:%d: realloc failed.\n",
+                                __FILE__, __LINE__);
+                        exit(EXIT_FAILURE);
+                }
+        }
+        memcpy(key->dat + key->size, p, n);
+        key->size += n;
+}
+
+#define KEY_ARRAY(k, arr, n) key_append((k), (arr), (long long) (n) * sizeof *(arr))
+#define KEY_VALUE(k, val) key_append((k), &(val), sizeof (val))
+
+static void make_heffplan_key(const struct Heffdata * data, 
+                              struct heffkey * key)
+{
+        const struct siteTensor * tens = &data->siteObject;
+        KEY_VALUE(key, data->isdmrg);
+        KEY_VALUE(key, tens->nrblocks);
+        KEY_ARRAY(key, tens->qnumbers, tens->nrblocks * tens->nrsites);
+        KEY_ARRAY(key, tens->blocks.beginblock, tens->nrblocks + 1);
+
+        for (int i = 0; i < tens->nrsites; ++i) {
+                for (int j = 0; j < 3; ++j) {
+                        const struct symsecs * ss = &data->symarr[i][j];
+                        KEY_VALUE(key, ss->nrSecs);
+                        for (int k = 0; k < ss->nrSecs; ++k) {
+                                KEY_ARRAY(key, ss->irreps[k], bookie.nrSyms);
+                        }
+                        KEY_ARRAY(key, ss->dims, ss->nrSecs);
+                }
+        }
+        KEY_VALUE(key, data->MPOsymsec.nrSecs);
+        for (int k = 0; k < data->MPOsymsec.nrSecs; ++k) {
+                KEY_ARRAY(key, data->MPOsymsec.irreps[k], bookie.nrSyms);
+        }
+
+        for (int i = 0; i < (data->isdmrg ? 2 : 3); ++i) {
+                const struct rOperators * ops = &data->Operators[i];
+                KEY_VALUE(key, ops->bond);
+                KEY_VALUE(key, ops->is_left);
+                KEY_VALUE(key, ops->P_operator);
+                KEY_VALUE(key, ops->nrhss);
+                KEY_VALUE(key, ops->nrops);
+                KEY_ARRAY(key, ops->hss_of_ops, ops->nrops);
+                KEY_ARRAY(key, ops->begin_blocks_of_hss, ops->nrhss + 1);
+                KEY_ARRAY(key, ops->qnumbers, 
+                          ops->begin_blocks_of_hss[ops->nrhss] *
+                          rOperators_give_nr_of_couplings(ops));
+        }
+
+        /* The instructions themselves are resolved again */
+        KEY_VALUE(key, data->iset.nrMPOc);
+        KEY_ARRAY(key, data->iset.MPOc, data->iset.nrMPOc);
+        KEY_ARRAY(key, data->iset.MPOc_beg, data->iset.nrMPOc + 1);
+}
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static unsigned long long hash_bytes(const unsigned char * c, long long n)
+{
+        unsigned long long h = FNV_OFFSET;
+        for (long long i = 0; i < n; ++i) { h = (h ^ c[i]) * FNV_PRIME; }
+        return h;
+}
+
+static int same_sites(const struct heffplan * plan, 
+                      const struct siteTensor * tens)
+{
+        if (plan->nrsites != tens->nrsites) { return 0; }
+        for (int i = 0; i < tens->nrsites; ++i) {
+                if (plan->sites[i] != tens->sites[i]) { return 0; }
+        }
+        return 1;
+}
+
+/* Returns the plan for the sites of the siteObject, adds an empty one if
+ * there is none yet. */
+static struct heffplan * find_heffplan(const struct siteTensor * tens)
+{
+        for (int i = 0; i < heffplans.nr; ++i) {
+                if (same_sites(&heffplans.plans[i], tens)) {
+                        return &heffplans.plans[i];
+                }
+        }
+
+        if (heffplans.nr == heffplans.size) {
+                heffplans.size = heffplans.size == 0 ? 16 : 2 * heffplans.size;
+                heffplans.plans = realloc(heffplans.plans, heffplans.size *
+                                          sizeof *heffplans.plans);
+                if (heffplans.plans == NULL) {
+                        fprintf(stderr, "Error %s:%d: realloc failed.\n",
+                                __FILE__, __LINE__);
+                        exit(EXIT_FAILURE);
+                }
+        }
+        struct heffplan * plan = &heffplans.plans[heffplans.nr++];
+        plan->nrsites = tens->nrsites;
+        for (int i = 0; i < tens->nrsites; ++i) { plan->sites[i] = tens->sites[i]; }
+        plan->key = NULL;
+        plan->keysize = 0;
+        plan->nrblocks = 0;
+        plan->dimsofsb = NULL;
+        plan->nr_oldsb = NULL;
+        plan->ntom = NULL;
+        plan->bytes = 0;
+        plan->last_use = 0;
+        return plan;
+}
+
+static void clear_heffplan(struct heffplan * plan)
+{
+        for (int i = 0; i < plan->nrblocks; ++i) {
+                for (int j = 0; j < plan->nr_oldsb[i]; ++j) {
+                        safe_free(plan->ntom[i][j].sbops);
+                        safe_free(plan->ntom[i][j].prefactor);
+                        safe_free(plan->ntom[i][j].MPO);
+                }
+                safe_free(plan->ntom[i]);
+        }
+        safe_free(plan->ntom);
+        safe_free(plan->nr_oldsb);
+        safe_free(plan->dimsofsb);
+        safe_free(plan->key);
+        plan->keysize = 0;
+        plan->nrblocks = 0;
+        heffplans.bytes -= plan->bytes;
+        plan->bytes = 0;
+}
+
+static long long heffplan_bytes(const struct heffplan * plan)
+{
+        long long bytes = plan->keysize + plan->nrblocks * 
+                (sizeof *plan->dimsofsb + sizeof *plan->nr_oldsb + 
+                 sizeof *plan->ntom);
+        for (int i = 0; i < plan->nrblocks; ++i) {
+                for (int j = 0; j < plan->nr_oldsb[i]; ++j) {
+                        const struct newtooldmatvec * ntom = &plan->ntom[i][j];
+                        bytes += sizeof *ntom + ntom->nmbr * 
+                                (sizeof *ntom->sbops + sizeof *ntom->prefactor +
+                                 sizeof *ntom->MPO);
+                }
+        }
+        return bytes;
+}
+
+/* Drops the least recently used plans till all plans fit in
+ * HEFFPLANS_MAX_BYTES. The given plan is kept. */
+static void evict_heffplans(const struct heffplan * keep)
+{
+        while (heffplans.bytes > HEFFPLANS_MAX_BYTES) {
+                struct heffplan * lru = NULL;
+                for (int i = 0; i < heffplans.nr; ++i) {
+                        struct heffplan * plan = &heffplans.plans[i];
+                        if (plan == keep || plan->ntom == NULL) { continue; }
+                        if (lru == NULL || plan->last_use < lru->last_use) {
+                                lru = plan;
+                        }
+                }
+                if (lru == NULL) { return; }
+                clear_heffplan(lru);
+        }
+}
+
+void destroy_Heffplans(void)
+{
+#pragma omp critical (heffplans)
+        {
+                for (int i = 0; i < heffplans.nr; ++i) {
+                        clear_heffplan(&heffplans.plans[i]);
                 }
+                safe_free(heffplans.plans);
+                heffplans.nr = 0;
+                heffplans.size = 0;
+                heffplans.bytes = 0;
+        }
+}
+
+int Heffplans_reused(void)
+{
+        int reused;
+#pragma omp critical (heffplans)
+        reused = heffplans.reused;
+        return reused;
+}
+
+/* Resolves the secondrun from the plan of the sites if it has the same key.
+ * A plan with another key is cleared. Returns 1 if the plan is reused.
+ *
+ * Only call in the critical section heffplans. */
+static int reuse_heffplan(struct Heffdata * data, const struct heffkey * key,
+                          unsigned long long signature)
+{
+        const int n = data->siteObject.nrblocks;
+        struct heffplan * plan = find_heffplan(&data->siteObject);
+        plan->last_use = ++heffplans.clock;
+        if (plan->ntom == NULL || plan->signature != signature || 
+            plan->nrblocks != n || plan->keysize != key->size ||
+            memcmp(plan->key, key->dat, key->size) != 0) {
+                clear_heffplan(plan);
+                return 0;
+        }
 
-                safe_free(tels[WORK1]);
-                safe_free(tels[WORK2]);
+        ++heffplans.reused;
+        for (int i = 0; i < n; ++i) {
+                data->sr.dimsofsb[i][0] = plan->dimsofsb[i][0];
+                data->sr.dimsofsb[i][1] = plan->dimsofsb[i][1];
+                data->sr.dimsofsb[i][2] = plan->dimsofsb[i][2];
+        }
+        data->sr.worksize[0] = plan->worksize[0];
+        data->sr.worksize[1] = plan->worksize[1];
+        compile_secondrun(data, plan->ntom, plan->nr_oldsb);
+        return 1;
+}
+
+/* Keeps the first run for later optimization steps on these sites. The plan
+ * takes ownership of the key, ntom and nr_oldsb.
+ *
+ * Only call in the critical section heffplans. */
+static void store_heffplan(const struct Heffdata * data, struct heffkey * key,
+                           unsigned long long signature, 
+                           struct newtooldmatvec ** ntom, int * nr_oldsb)
+{
+        const int n = data->siteObject.nrblocks;
+        struct heffplan * plan = find_heffplan(&data->siteObject);
+        clear_heffplan(plan);
+        plan->last_use = ++heffplans.clock;
+        plan->signature = signature;
+        plan->key = key->dat;
+        plan->keysize = key->size;
+        plan->nrblocks = n;
+        plan->dimsofsb = safe_malloc(n, *plan->dimsofsb);
+        for (int i = 0; i < n; ++i) {
+                plan->dimsofsb[i][0] = data->sr.dimsofsb[i][0];
+                plan->dimsofsb[i][1] = data->sr.dimsofsb[i][1];
+                plan->dimsofsb[i][2] = data->sr.dimsofsb[i][2];
         }
+        plan->worksize[0] = data->sr.worksize[0];
+        plan->worksize[1] = data->sr.worksize[1];
+        plan->nr_oldsb = nr_oldsb;
+        plan->ntom = ntom;
+        plan->bytes = heffplan_bytes(plan);
+        heffplans.bytes += plan->bytes;
+        evict_heffplans(plan);
 }
 
-static void exec_firstrun(const double * const vec, double * const result, 
-                          struct Heffdata * const data)
+static void make_secondrun(const double * const vec, double * const result, 
+                           struct Heffdata * const data)
 {
         const int n = data->siteObject.nrblocks;
         data->sr.dimsofsb = safe_malloc(n, *data->sr.dimsofsb);
-        data->sr.nr_oldsb = safe_malloc(n, *data->sr.nr_oldsb);
-        data->sr.ntom = safe_malloc(n, *data->sr.ntom);
+
+        struct heffkey key = { 0 };
+        make_heffplan_key(data, &key);
+        const unsigned long long signature = hash_bytes(key.dat, key.size);
+        int reused;
+#pragma omp critical (heffplans)
+        reused = reuse_heffplan(data, &key, signature);
+        if (reused) {
+                safe_free(key.dat);
+                make_matvectasks(data);
+                return;
+        }
+
+        int * nr_oldsb = safe_malloc(n, *nr_oldsb);
+        struct newtooldmatvec ** ntom = safe_malloc(n, *ntom);
 
         int wsize[2] = {0, 0};
-#pragma omp parallel for schedule(dynamic) default(none) shared(stderr) reduction(max:wsize)
+#pragma omp parallel for schedule(dynamic) default(none) shared(ntom, nr_oldsb) reduction(max:wsize)
         for (int newqnB_id = 0; newqnB_id < data->nr_qnB; ++newqnB_id) {
                 struct indexdata idd;
                 make_map(idd.map, data);
 
                 int * newsb = NULL;
                 while (search_block_with_qn(&newsb, newqnB_id, data)) {
-                        data->sr.ntom[*newsb] = safe_malloc(data->siteObject.nrblocks, 
-                                                            *data->sr.ntom[*newsb]);
+                        struct arena * ar = thread_arena();
+                        const long long mark = arena_mark(ar);
+                        struct newtooldmatvec * curr = 
+                                arena_malloc(ar, data->siteObject.nrblocks, 
+                                             *curr);
 
                         fill_indexes(*newsb, &idd, data, NEW, result);
                         data->sr.dimsofsb[*newsb][0] = idd.dim[NEW][0];
                         data->sr.dimsofsb[*newsb][1] = idd.dim[NEW][1];
                         data->sr.dimsofsb[*newsb][2] = idd.dim[NEW][2];
 
-                        data->sr.nr_oldsb[*newsb] = 0;
-                        loop_oldqnBs(&idd, data, newqnB_id, vec, 
-                                     data->sr.ntom[*newsb], 
-                                     &data->sr.nr_oldsb[*newsb], wsize); 
+                        nr_oldsb[*newsb] = 0;
+                        loop_oldqnBs(&idd, data, newqnB_id, vec, curr, 
+                                     &nr_oldsb[*newsb], wsize); 
 
-                        data->sr.ntom[*newsb] = realloc(data->sr.ntom[*newsb], 
-                                                        data->sr.nr_oldsb[*newsb] * 
-                                                        sizeof *data->sr.ntom[*newsb]);
-                        if (data->sr.ntom[*newsb] == NULL) {
-                                fprintf(stderr, "Error %s:%d: failed reallocating.\n",
-                                        __FILE__, __LINE__);
-                                exit(EXIT_FAILURE);
-                        }
+                        const int nr = nr_oldsb[*newsb];
+                        ntom[*newsb] = nr == 0 ? NULL : 
+                                safe_malloc(nr, *ntom[*newsb]);
+                        for (int i = 0; i < nr; ++i) { ntom[*newsb][i] = curr[i]; }
+                        arena_release(ar, mark);
                 }
         }
         data->sr.worksize[0] = wsize[0];
         data->sr.worksize[1] = wsize[1];
 
-        data->sr.shufid = safe_malloc(n, *data->sr.shufid);
-        for (int i = 0; i < n ; ++i) { data->sr.shufid[i] = i; }
-        shuffle(data->sr.shufid, n);
+        compile_secondrun(data, ntom, nr_oldsb);
+        make_matvectasks(data);
+
+#pragma omp critical (heffplans)
+        store_heffplan(data, &key, signature, ntom, nr_oldsb);
+}
+
+/* The number of vectors multiplied in single precision. */
+static int single_matvecs = 0;
+
+int Heff_single_matvecs(void)
+{
+        int nr;
+#pragma omp atomic read
+        nr = single_matvecs;
+        return nr;
 }
 
 void matvecT3NS(const double * vec, double * result, void * vdata)
 {
         struct Heffdata * const data = vdata;
+        ++data->nr_matvecs;
 
         for (int i = 0; i < siteTensor_get_size(&data->siteObject); ++i) {
                 result[i] = 0;
         }
 
-        if (data->sr.dimsofsb != NULL) {
-                exec_secondrun(vec, result, data);
+        if (data->sr.dimsofsb == NULL) { make_secondrun(vec, result, data); }
+        if (data->single) {
+#pragma omp atomic
+                ++single_matvecs;
+                exec_secondrun_single(vec, result, 1, data);
+        } else {
+                exec_secondrun(vec, result, 1, data);
+        }
+}
+
+/* Copies nvec vectors to (dir == 1) or from (dir == -1) the blockwise 
+ * interleaved storage used by exec_secondrun. */
+static void interleave_vectors(double * vecs, double * ivecs, int nvec,
+                               const struct sparseblocks * blocks, 
+                               int nrblocks, int dir)
+{
+        const int size = blocks->beginblock[nrblocks];
+        const int * bb = blocks->beginblock;
+
+#pragma omp parallel for schedule(static) default(none) shared(bb, vecs, ivecs, nvec, nrblocks, dir)
+        for (int i = 0; i < nrblocks; ++i) {
+                const int bsize = bb[i + 1] - bb[i];
+                for (int v = 0; v < nvec; ++v) {
+                        double * x = vecs + (long long) v * size + bb[i];
+                        double * y = ivecs + (long long) bb[i] * nvec + 
+                                (long long) v * bsize;
+                        if (dir == 1) {
+                                for (int k = 0; k < bsize; ++k) { y[k] = x[k]; }
+                        } else {
+                                for (int k = 0; k < bsize; ++k) { x[k] = y[k]; }
+                        }
+                }
+        }
+}
+
+void matvecT3NS_block(const double * vec, double * result, int nvec, 
+                      void * vdata)
+{
+        if (nvec == 1) {
+                matvecT3NS(vec, result, vdata);
+                return;
+        }
+
+        struct Heffdata * const data = vdata;
+        data->nr_matvecs += nvec;
+        const struct sparseblocks * blocks = &data->siteObject.blocks;
+        const int nrblocks = data->siteObject.nrblocks;
+        const long long size = (long long) siteTensor_get_size(&data->siteObject) * nvec;
+        double * ivec = safe_malloc(size, double);
+        double * iresult = safe_calloc(size, double);
+
+        interleave_vectors((double *) vec, ivec, nvec, blocks, nrblocks, 1);
+        if (data->sr.dimsofsb == NULL) { make_secondrun(ivec, iresult, data); }
+        if (data->single) {
+#pragma omp atomic
+                single_matvecs += nvec;
+                exec_secondrun_single(ivec, iresult, nvec, data);
         } else {
-                exec_firstrun(vec, result, data);
+                exec_secondrun(ivec, iresult, nvec, data);
         }
+        interleave_vectors(result, iresult, nvec, blocks, nrblocks, -1);
+
+        safe_free(ivec);
+        safe_free(iresult);
 }
 
 static void diag_old_to_new_sb(int MPO, struct indexdata * idd,
@@ -1109,7 +1725,13 @@ static void diag_old_to_new_sb(int MPO, struct indexdata * idd,
 
 static void adaptMPOcombos(struct Heffdata * data)
 {
-#pragma omp parallel for schedule(dynamic) default(none) shared(data)
+        struct qnhash MPOchash;
+        init_qnhash(&MPOchash, data->iset.nrMPOc);
+        for (int i = 0; i < data->iset.nrMPOc; ++i) {
+                qnhash_insert(&MPOchash, data->iset.MPOc[i], i);
+        }
+
+#pragma omp parallel for schedule(dynamic) default(none) shared(data, MPOchash)
         for (int i = 0; i < data->nr_qnB; ++i) {
                 /* If assertion fails it is because i apparently needed what 
                  * was originally here up until:
@@ -1120,10 +1742,8 @@ static void adaptMPOcombos(struct Heffdata * data)
                 for (int j = 0; j < data->nr_qnBtoqnB[i]; ++j) {
                         int cnt = 0;
                         for (int k = 0; k < data->nrMPOcombos[i][j]; ++k) {
-                                int position = linSearch(&data->MPOs[i][j][k], 
-                                                         data->iset.MPOc,
-                                                         data->iset.nrMPOc, 
-                                                         SORT_INT, sizeof(int));
+                                const int position = qnhash_find(
+                                        &MPOchash, data->MPOs[i][j][k]);
                                 if (position != -1) {
                                         data->MPOs[i][j][cnt++] = position;
                                 }
@@ -1133,35 +1753,64 @@ static void adaptMPOcombos(struct Heffdata * data)
                                                    sizeof *data->MPOs[i][j]);
                 }
         }
+        destroy_qnhash(&MPOchash);
 }
 
-static void make_sb_with_qnBid(struct Heffdata * const data)
+static void make_sb_with_qnBid(struct Heffdata * const data,
+                               const struct qnhash * qnBhash)
 {
-        data->sb_with_qnid = safe_malloc(data->nr_qnB, *data->sb_with_qnid);
         const int n = data->siteObject.nrblocks;
         const int ns = data->siteObject.nrsites;
+        int * qnBid = safe_malloc(n, *qnBid);
+        int * cnt = safe_calloc(data->nr_qnB, *cnt);
+
+#pragma omp parallel for schedule(static) default(none) shared(qnBid, qnBhash)
+        for (int j = 0; j < n; ++j) {
+                const QN_TYPE qn = data->siteObject.qnumbers[j * ns + data->posB];
+                qnBid[j] = qnhash_find(qnBhash, qn);
+                assert(qnBid[j] != -1);
+        }
+        for (int j = 0; j < n; ++j) { ++cnt[qnBid[j]]; }
 
-#pragma omp parallel for schedule(static) default(none) shared(stderr)
+        data->sb_with_qnid = safe_malloc(data->nr_qnB, *data->sb_with_qnid);
         for (int i = 0; i < data->nr_qnB; ++i) {
-                int cnt = 0;
-                data->sb_with_qnid[i] = safe_malloc(n, *data->sb_with_qnid[i]);
-                const QN_TYPE qn = data->qnB_arr[i];
-                const QN_TYPE * pqn = &data->siteObject.qnumbers[data->posB];
-
-                for (int j = 0; j < n; ++j, pqn += ns) {
-                        if (*pqn == qn) { data->sb_with_qnid[i][cnt++] = j; }
-                }
-
                 // sentinel
-                data->sb_with_qnid[i][cnt++] = -1;
-                data->sb_with_qnid[i] = realloc(data->sb_with_qnid[i], cnt * 
-                                                sizeof *data->sb_with_qnid[i]);
-                if (data->sb_with_qnid[i] == NULL) {
-                        fprintf(stderr, "Error %s:%d: realloc failed.\n", 
-                                __FILE__, __LINE__);
-                        exit(EXIT_FAILURE);
-                }
+                data->sb_with_qnid[i] = safe_malloc(cnt[i] + 1, 
+                                                    *data->sb_with_qnid[i]);
+                data->sb_with_qnid[i][cnt[i]] = -1;
+                cnt[i] = 0;
         }
+        for (int j = 0; j < n; ++j) {
+                data->sb_with_qnid[qnBid[j]][cnt[qnBid[j]]++] = j;
+        }
+        safe_free(qnBid);
+        safe_free(cnt);
+}
+
+static void init_null_secondrun(struct secondrun * const sr)
+{
+        sr->nrtasks  = 0;
+        sr->tasks    = NULL;
+        sr->dimsofsb = NULL;
+        sr->nrpairs  = 0;
+        sr->pairbeg  = NULL;
+        sr->oldsb    = NULL;
+        sr->cinfo    = NULL;
+        sr->contrbeg = NULL;
+        sr->opstel   = NULL;
+        sr->pref     = NULL;
+}
+
+static void destroy_secondrun(struct secondrun * const sr)
+{
+        safe_free(sr->dimsofsb);
+        safe_free(sr->tasks);
+        safe_free(sr->pairbeg);
+        safe_free(sr->oldsb);
+        safe_free(sr->cinfo);
+        safe_free(sr->contrbeg);
+        safe_free(sr->opstel);
+        safe_free(sr->pref);
 }
 
 void init_Heffdata(struct Heffdata * data, const struct rOperators * Operators, 
@@ -1213,30 +1862,16 @@ void init_Heffdata(struct Heffdata * data, const struct rOperators * Operators,
         };
         data->iset = fetch_merge(Operators[0].bond, data->isdmrg, hss_ops);
 
-        make_qnBdatas(data);
-        make_sb_with_qnBid(data);
+        struct qnhash qnBhash;
+        make_qnB_arr(data, &qnBhash);
+        make_qnBdatas(data, &qnBhash);
+        make_sb_with_qnBid(data, &qnBhash);
+        destroy_qnhash(&qnBhash);
         adaptMPOcombos(data);
 
-        data->sr.dimsofsb = NULL;
-}
-
-static void destroy_secondrun(struct Heffdata * const data)
-{
-        const int n = data->siteObject.nrblocks;
-
-        safe_free(data->sr.dimsofsb);
-        for (int i = 0; i < n; ++i) {
-                for (int j = 0; j < data->sr.nr_oldsb[i]; ++j) {
-                        struct newtooldmatvec * ntom = &data->sr.ntom[i][j];
-                        safe_free(ntom->sbops);
-                        safe_free(ntom->prefactor);
-                        safe_free(ntom->MPO);
-                }
-                safe_free(data->sr.ntom[i]);
-        }
-        safe_free(data->sr.ntom);
-        safe_free(data->sr.nr_oldsb);
-        safe_free(data->sr.shufid);
+        init_null_secondrun(&data->sr);
+        data->single = 0;
+        data->nr_matvecs = 0;
 }
 
 void destroy_Heffdata(struct Heffdata * const data)
@@ -1262,7 +1897,7 @@ void destroy_Heffdata(struct Heffdata * const data)
         safe_free(data->sb_with_qnid);
         safe_free(data->MPOs);
 
-        destroy_secondrun(data);
+        destroy_secondrun(&data->sr);
 }
 
 EL_TYPE * make_diagonal(const struct Heffdata * const data)
@@ -1293,15 +1928,17 @@ EL_TYPE * make_diagonal(const struct Heffdata * const data)
                         fill_indexes(*sb, &idd, data, NEW, result);
                         fill_indexes(*sb, &idd, data, OLD, result);
 
-                        idd.tel[WORK1] = safe_malloc(idd.dim[OLD][0] * 
-                                                     idd.dim[OLD][1], EL_TYPE);
+                        struct arena * ar = thread_arena();
+                        const long long mark = arena_mark(ar);
+                        idd.tel[WORK1] = arena_malloc(ar, idd.dim[OLD][0] * 
+                                                      idd.dim[OLD][1], EL_TYPE);
                         idd.tel[WORK2] = NULL;
 
                         const int * MPO;
                         for (MPO = MPOs; MPO < &MPOs[nrMPOcombos]; ++MPO) {
                                 diag_old_to_new_sb(*MPO, &idd, data);
                         }
-                        safe_free(idd.tel[WORK1]);
+                        arena_release(ar, mark);
                 }
         }
 
@@ -0,0 +1,295 @@
+/*
+    T3NS: an implementation of the Three-Legged Tree Tensor Network algorithm
+    Copyright (C) 2018-2019 Klaas Gunst <Klaas.Gunst@UGent.be>
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 3.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/*
+ * The execution of the plan of the matvec (see exec_secondrun()), written for
+ * a general element type of the contractions.
+ *
+ * This file is included twice by Heff.c, for double and for single precision.
+ * Before inclusion the following macros should be defined:
+ *
+ * * HEFF_TYPE: the element type of the contractions.
+ * * HEFF_NAME(name): the name of a function or structure for this type.
+ * * HEFF_CONTRACT_BATCH: do_contract_batch() for this type.
+ * * HEFF_SINGLE: only for single precision. The vectors are then converted
+ *   to float at the start of the matvec and the operator blocks when they
+ *   are added to a batch.
+ *
+ * These macros are undefined at the end of this file.
+ */
+
+/* A batch of Heff contractions that share the same contractinfo.
+ *
+ * They are executed together by HEFF_CONTRACT_BATCH once the batch is full
+ * or the (old block, new block) pair is finished. */
+struct HEFF_NAME(heffbatch) {
+        /// Number of contractions in the batch.
+        int n;
+        /// Maximal number of contractions for the current contractinfo.
+        int cap;
+        /// Size of WORK1 and WORK2 for the current contractinfo.
+        int size[2];
+        HEFF_TYPE * tels[HEFF_BATCH][7];
+        HEFF_TYPE ** ptels[HEFF_BATCH];
+        HEFF_TYPE pref[HEFF_BATCH];
+        HEFF_TYPE one[HEFF_BATCH];
+        /// Work memory for WORK1 and WORK2 of every contraction in the batch.
+        HEFF_TYPE * work;
+        long long worklen;
+#ifdef HEFF_SINGLE
+        /// Size of the blocks of OPS1 to OPS3 for the current contractinfo.
+        int opsize[3];
+        /// Memory for the converted operator blocks of the batch.
+        float * ops;
+        long long opslen;
+        /// Number of elements of @ref ops in use.
+        long long opsused;
+        /// The last converted blocks of OPS1 to OPS3.
+        const EL_TYPE * lastop[3];
+        struct arena * ar;
+#endif
+        struct contractbuffer buf;
+};
+
+/* The work memory of the batch is taken from the given arena. */
+static void HEFF_NAME(init_heffbatch)(struct HEFF_NAME(heffbatch) * hb,
+                                      const int * worksize, struct arena * ar)
+{
+        hb->n = 0;
+        hb->cap = 0;
+        for (int i = 0; i < HEFF_BATCH; ++i) {
+                hb->ptels[i] = hb->tels[i];
+                hb->one[i] = 1;
+        }
+        hb->worklen = (long long) worksize[0] + worksize[1];
+        if (hb->worklen < HEFF_BATCH_MEM) { hb->worklen = HEFF_BATCH_MEM; }
+        hb->work = arena_malloc(ar, hb->worklen, HEFF_TYPE);
+#ifdef HEFF_SINGLE
+        hb->opslen = HEFF_BATCH_MEM;
+        hb->ops = arena_malloc(ar, hb->opslen, float);
+        hb->opsused = 0;
+        hb->ar = ar;
+#endif
+        init_contractbuffer(&hb->buf, ar);
+}
+
+/* Prepares the batch for contractions with the given contractinfo. */
+static void HEFF_NAME(start_heffbatch)(struct HEFF_NAME(heffbatch) * hb,
+                                       const struct contractinfo * cinfo,
+                                       int isdmrg)
+{
+        assert(hb->n == 0);
+        hb->size[0] = cinfo[0].M * cinfo[0].N * cinfo[0].L;
+        hb->size[1] = isdmrg ? 0 : cinfo[1].M * cinfo[1].N * cinfo[1].L;
+        const long long persize = hb->size[0] + hb->size[1];
+        hb->cap = persize * HEFF_BATCH > hb->worklen ?
+                hb->worklen / persize : HEFF_BATCH;
+#ifdef HEFF_SINGLE
+        long long opsper = 0;
+        for (int j = 0; j < 3; ++j) {
+                hb->opsize[j] = operator_size(cinfo, OPS1 + j, isdmrg);
+                opsper += hb->opsize[j];
+        }
+        if (opsper > hb->opslen) {
+                /* The old memory is only returned on release of the arena,
+                 * so grow at least twofold. */
+                hb->opslen = opsper > 2 * hb->opslen ? opsper : 2 * hb->opslen;
+                hb->ops = arena_malloc(hb->ar, hb->opslen, float);
+        }
+        if (opsper * hb->cap > hb->opslen) { hb->cap = hb->opslen / opsper; }
+#endif
+        assert(hb->cap >= 1);
+}
+
+static void HEFF_NAME(flush_heffbatch)(struct HEFF_NAME(heffbatch) * hb,
+                                       const struct contractinfo * cinfo,
+                                       int isdmrg)
+{
+        const int last = isdmrg ? 1 : 2;
+        for (int i = 0; i < last; ++i) {
+                HEFF_CONTRACT_BATCH(&cinfo[i], hb->ptels, hb->one, 0, hb->n,
+                                    &hb->buf);
+        }
+        HEFF_CONTRACT_BATCH(&cinfo[last], hb->ptels, hb->pref, 1, hb->n,
+                            &hb->buf);
+        hb->n = 0;
+#ifdef HEFF_SINGLE
+        hb->opsused = 0;
+#endif
+}
+
+#ifdef HEFF_SINGLE
+/* Returns block j of the operators of the next contraction in float.
+ *
+ * If the previous contraction of the batch has the same block, its converted
+ * block is returned. This way do_contract_batch_single() still recognizes
+ * blocks shared by the batch. */
+static float * HEFF_NAME(convert_operator)(struct HEFF_NAME(heffbatch) * hb,
+                                           const EL_TYPE * tel, int j)
+{
+        if (tel != NULL && hb->n != 0 && tel == hb->lastop[j]) {
+                return hb->tels[hb->n - 1][OPS1 + j];
+        }
+        hb->lastop[j] = tel;
+        if (tel == NULL) { return NULL; }
+
+        float * stel = hb->ops + hb->opsused;
+        assert(hb->opsused + hb->opsize[j] <= hb->opslen);
+        for (int i = 0; i < hb->opsize[j]; ++i) { stel[i] = tel[i]; }
+        hb->opsused += hb->opsize[j];
+        return stel;
+}
+#endif
+
+/* Adds a contraction with the given operator blocks to the batch. */
+static void HEFF_NAME(add_to_heffbatch)(struct HEFF_NAME(heffbatch) * hb,
+                                        HEFF_TYPE * const * tels,
+                                        EL_TYPE * const * opstel,
+                                        const struct contractinfo * cinfo,
+                                        double pref, int isdmrg)
+{
+        HEFF_TYPE ** btels = hb->tels[hb->n];
+        btels[NEW] = tels[NEW];
+        btels[OLD] = tels[OLD];
+        for (int j = 0; j < 3; ++j) {
+#ifdef HEFF_SINGLE
+                btels[OPS1 + j] = HEFF_NAME(convert_operator)(hb, opstel[j], j);
+#else
+                btels[OPS1 + j] = opstel[j];
+#endif
+        }
+        /* WORK1's of the batch are consecutive, the same for WORK2 */
+        btels[WORK1] = hb->work + (long long) hb->n * hb->size[0];
+        btels[WORK2] = hb->work + (long long) hb->cap * hb->size[0] +
+                (long long) hb->n * hb->size[1];
+        hb->pref[hb->n] = pref;
+
+        if (++hb->n == hb->cap) {
+                HEFF_NAME(flush_heffbatch)(hb, cinfo, isdmrg);
+        }
+}
+
+/* Executes a task for nvec vectors. The result is added to res. */
+static void HEFF_NAME(exec_matvectask)(const struct matvectask * t,
+                                       const struct Heffdata * data,
+                                       const HEFF_TYPE * vec, HEFF_TYPE * res,
+                                       int nvec,
+                                       struct HEFF_NAME(heffbatch) * hb)
+{
+        const struct secondrun * const sr = &data->sr;
+        const int * bb = data->siteObject.blocks.beginblock;
+        HEFF_TYPE * tels[2];
+        struct contractinfo mcinfo[3];
+        tels[NEW] = res;
+
+        int c = t->contr[0];
+        for (int p = t->pair; c < t->contr[1]; ++p) {
+                const int cend = sr->contrbeg[p + 1] < t->contr[1] ?
+                        sr->contrbeg[p + 1] : t->contr[1];
+                if (c == cend) { continue; }
+
+                const struct contractinfo * cinfo = sr->cinfo[p];
+                if (nvec != 1) {
+                        multivec_cinfo(cinfo, mcinfo, nvec, data->isdmrg);
+                        cinfo = mcinfo;
+                }
+                tels[OLD] = (HEFF_TYPE *) vec +
+                        (long long) bb[sr->oldsb[p]] * nvec;
+
+                HEFF_NAME(start_heffbatch)(hb, cinfo, data->isdmrg);
+                for (; c < cend; ++c) {
+                        HEFF_NAME(add_to_heffbatch)(hb, tels, sr->opstel[c],
+                                                    cinfo, sr->pref[c],
+                                                    data->isdmrg);
+                }
+                HEFF_NAME(flush_heffbatch)(hb, cinfo, data->isdmrg);
+        }
+}
+
+/* Executes the plan for nvec vectors. The result is added to result.
+ *
+ * For nvec > 1, the vectors should be interleaved blockwise, i.e. block i of
+ * vector v starts at beginblock[i] * nvec + v * size of block i. */
+static void HEFF_NAME(exec_secondrun)(const double * const vec,
+                                      double * const result, int nvec,
+                                      const struct Heffdata * const data)
+{
+        const struct secondrun * const sr = &data->sr;
+        const int worksize[2] = {
+                sr->worksize[0] * nvec,
+                sr->worksize[1] * nvec
+        };
+#ifdef HEFF_SINGLE
+        const long long size =
+                (long long) siteTensor_get_size(&data->siteObject) * nvec;
+        float * hvec = safe_malloc(size, *hvec);
+        float * hresult = safe_calloc(size, *hresult);
+
+#pragma omp parallel for schedule(static) default(none) shared(hvec)
+        for (long long i = 0; i < size; ++i) { hvec[i] = vec[i]; }
+#else
+        const double * hvec = vec;
+        double * hresult = result;
+#endif
+
+#pragma omp parallel default(none) shared(hvec, hresult, worksize, nvec)
+        {
+                struct arena * ar = thread_arena();
+                const long long mark = arena_mark(ar);
+                struct HEFF_NAME(heffbatch) hb;
+                HEFF_NAME(init_heffbatch)(&hb, worksize, ar);
+                const int * bb = data->siteObject.blocks.beginblock;
+                /* Accumulation buffer for new blocks split over tasks */
+                HEFF_TYPE * acc = sr->splitsize == 0 ? NULL :
+                        arena_malloc(ar, (long long) sr->splitsize * nvec,
+                                     HEFF_TYPE);
+
+#pragma omp for schedule(dynamic) nowait
+                for (int j = 0; j < sr->nrtasks; ++j) {
+                        const struct matvectask * t = &sr->tasks[j];
+                        HEFF_TYPE * res = hresult + (long long) bb[t->sb] * nvec;
+                        if (!t->split) {
+                                HEFF_NAME(exec_matvectask)(t, data, hvec, res,
+                                                           nvec, &hb);
+                                continue;
+                        }
+
+                        const int bsize = (bb[t->sb + 1] - bb[t->sb]) * nvec;
+                        for (int k = 0; k < bsize; ++k) { acc[k] = 0; }
+                        HEFF_NAME(exec_matvectask)(t, data, hvec, acc, nvec,
+                                                   &hb);
+                        for (int k = 0; k < bsize; ++k) {
+#pragma omp atomic
+                                res[k] += acc[k];
+                        }
+                }
+
+                arena_release(ar, mark);
+        }
+
+#ifdef HEFF_SINGLE
+#pragma omp parallel for schedule(static) default(none) shared(hresult)
+        for (long long i = 0; i < size; ++i) { result[i] += hresult[i]; }
+
+        safe_free(hvec);
+        safe_free(hresult);
+#endif
+}
+
+#undef HEFF_TYPE
+#undef HEFF_NAME
+#undef HEFF_CONTRACT_BATCH
+#undef HEFF_SINGLE
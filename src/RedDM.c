@@ -26,6 +26,7 @@
 #include <assert.h>
 #include "symmetries.h"
 #include "bookkeeper.h"
+#include "io_to_disk.h"
 
 #ifdef T3NS_MKL
 #include "mkl.h"
@@ -87,6 +88,9 @@ static struct RDMbackup backup(struct siteTensor * T3NS)
 static void putback_backup(struct siteTensor * T3NS, struct RDMbackup * backupv)
 {
         for (int i = 0; i < netw.sites; ++i) {
+                if (release_mapped_memory(T3NS[i].blocks.tel)) {
+                        T3NS[i].blocks.tel = NULL;
+                }
                 safe_free(T3NS[i].blocks.tel);
                 T3NS[i].blocks.tel = backupv->tels[i];
         }
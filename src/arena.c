@@ -0,0 +1,148 @@
+/*
+    T3NS: an implementation of the Three-Legged Tree Tensor Network algorithm
+    Copyright (C) 2018-2019 Klaas Gunst <Klaas.Gunst@UGent.be>
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 3.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+
+#include "arena.h"
+#include "macros.h"
+
+/* Allocations are rounded up to a cache line, such that different
+ * allocations do not share one. */
+#define ARENA_ALIGN 64
+
+/* trim_arenas() frees a buffer that is larger than this factor times the peak
+ * usage since the last reset_arenas_peak(). */
+#define ARENA_TRIM_FACTOR 2
+
+static struct arena thread_ar;
+#pragma omp threadprivate(thread_ar)
+
+struct arena * thread_arena(void)
+{
+        return &thread_ar;
+}
+
+void * arena_malloc_helper(struct arena * ar, long long s, size_t t,
+                           const char * typ, const char * file, int line,
+                           const char * func)
+{
+        if (s < 0) {
+                /* Let safe_malloc report the error */
+                return safe_malloc_helper(s, t, typ, file, line, func);
+        }
+        const long long bytes = (s * t + ARENA_ALIGN - 1) / ARENA_ALIGN *
+                ARENA_ALIGN;
+
+        char * result;
+        if (ar->used + bytes <= ar->size) {
+                result = ar->mem + ar->used;
+        } else {
+                if (ar->nover == ar->capover) {
+                        ar->capover = ar->capover == 0 ? 8 : 2 * ar->capover;
+                        ar->over = realloc(ar->over,
+                                           ar->capover * sizeof *ar->over);
+                        if (ar->over == NULL) {
+                                fprintf(stderr, "Error %s:%d: failed realloc.\n",
+                                        __FILE__, __LINE__);
+                                exit(EXIT_FAILURE);
+                        }
+                }
+                result = safe_malloc_helper(bytes == 0 ? 1 : bytes, 1, typ,
+                                            file, line, func);
+                ar->over[ar->nover].mem = result;
+                ar->over[ar->nover].begin = ar->used;
+                ++ar->nover;
+        }
+
+        ar->used += bytes;
+        if (ar->peak < ar->used) { ar->peak = ar->used; }
+        if (ar->high < ar->used) { ar->high = ar->used; }
+        return result;
+}
+
+long long arena_mark(const struct arena * ar)
+{
+        return ar->used;
+}
+
+void arena_release(struct arena * ar, long long mark)
+{
+        assert(mark <= ar->used);
+        while (ar->nover > 0 && ar->over[ar->nover - 1].begin >= mark) {
+                --ar->nover;
+                safe_free(ar->over[ar->nover].mem);
+        }
+        ar->used = mark;
+
+        /* Completely released, grow the buffer to the maximal usage */
+        if (ar->used == 0 && ar->size < ar->high) {
+                assert(ar->nover == 0);
+                safe_free(ar->mem);
+                ar->mem = safe_malloc(ar->high, char);
+                ar->size = ar->high;
+        }
+}
+
+long long arenas_peak(void)
+{
+        long long peak = 0;
+#pragma omp parallel default(none) reduction(+:peak)
+        {
+                peak += thread_arena()->peak;
+        }
+        return peak;
+}
+
+void reset_arenas_peak(void)
+{
+#pragma omp parallel default(none)
+        {
+                struct arena * ar = thread_arena();
+                ar->peak = ar->used;
+        }
+}
+
+void trim_arenas(void)
+{
+#pragma omp parallel default(none)
+        {
+                struct arena * ar = thread_arena();
+                assert(ar->used == 0 && ar->nover == 0);
+                /* Regrows to the recent peak at the next complete release */
+                ar->high = ar->peak;
+                if (ar->size > ARENA_TRIM_FACTOR * ar->peak) {
+                        safe_free(ar->mem);
+                        ar->size = 0;
+                }
+        }
+}
+
+void destroy_arenas(void)
+{
+#pragma omp parallel default(none)
+        {
+                struct arena * ar = thread_arena();
+                assert(ar->used == 0 && ar->nover == 0);
+                safe_free(ar->mem);
+                safe_free(ar->over);
+                ar->size = 0;
+                ar->peak = 0;
+                ar->high = 0;
+                ar->capover = 0;
+        }
+}
@@ -32,33 +32,27 @@
 #include "macros.h"
 
 #define DIAG_CUTOFF 1e-12
+/* Search vectors are dropped if orthogonalization reduces their norm by more
+ * than this factor. */
+#define DROP_CUTOFF 1e-8
+/* Cholesky QR is rejected if the block is worse conditioned than this. */
+#define CHOLQR_CUTOFF 1e-6
 
 /* For algorithm see http://people.inf.ethz.ch/arbenz/ewp/Lnotes/chapter12.pdf, algorithm 12.1 */
 
-static struct {
-        /* sizes */
-        int m;
-        int max_vecs;
-        int size;
+/* Growth factor of the workspace that depends on the dimension of the
+ * problem. Successive optimization steps have slowly growing dimensions, this
+ * avoids reallocating at every step. */
+#define GROW_FACTOR 1.25
 
-        /* The full problem */
-        double * V;
-        double * VA;
-        const double * diagonal;
-        double * vec_t;
-
-        /* The projected problem */
-        double * sub_matrix;
-        double * eigv;
-        double * eigvalues;
-} david_dat;
-
-static int max_vecs_to_alloc(int max_vectors, int keep_deflate, int size)
+static int max_vecs_to_alloc(int max_vectors, int keep_deflate, int nritz,
+                             long long size)
 {
         int new_mvecs = max_vectors;
         for (; new_mvecs >= 0; --new_mvecs) {
                 /* last one is to have at least some room left for other things */
-                const long long total = new_mvecs * 3 + keep_deflate + 1 + 1;
+                const long long total = new_mvecs * 3 + keep_deflate + 
+                        2 * nritz + 1;
                 void * pn = malloc(sizeof(double) * total * size);
                 if (pn != NULL) {
                         free(pn);
@@ -66,7 +60,7 @@ static int max_vecs_to_alloc(int max_vectors, int keep_deflate, int size)
                 }
         }
         if (new_mvecs <= 0) {
-                fprintf(stderr, "Error @%s: Davidson will not be able to allocate memory for a basissize of %d.\n"
+                fprintf(stderr, "Error @%s: Davidson will not be able to allocate memory for a basissize of %lld.\n"
                         "Fatal error.\n", __func__, size);
                 exit(EXIT_FAILURE);
         } else if (new_mvecs != max_vectors) {
@@ -77,81 +71,235 @@ static int max_vecs_to_alloc(int max_vectors, int keep_deflate, int size)
         return new_mvecs;
 }
 
-static void init_david_dat(const double * result, const double * diagonal, 
-                           int size, int max_vecs, int keep_deflate)
+static void free_davidson_workspace(struct davidson_context * ctx)
 {
-        /* sizes */
-        david_dat.m = 0;
-        david_dat.size = size;
-        max_vecs = max_vecs_to_alloc(max_vecs, keep_deflate, size);
-        david_dat.max_vecs = max_vecs;
+        safe_free(ctx->V);
+        safe_free(ctx->VA);
+        safe_free(ctx->ritz);
+        safe_free(ctx->vec_t);
+        safe_free(ctx->residues);
+        safe_free(ctx->work);
+        safe_free(ctx->overlap);
+        safe_free(ctx->sub_matrix);
+        safe_free(ctx->eigv);
+        safe_free(ctx->eigvalues);
+        ctx->cap_size = 0;
+        ctx->cap_vecs = 0;
+        ctx->cap_ritz = 0;
+        ctx->cap_keep = 0;
+}
+
+/* Makes the workspace big enough for the problem in ctx, only reallocates
+ * if the current one is too small. */
+static void reserve_davidson_workspace(struct davidson_context * ctx)
+{
+        if (ctx->size <= ctx->cap_size && ctx->max_vecs <= ctx->cap_vecs &&
+            ctx->nritz <= ctx->cap_ritz && ctx->keep <= ctx->cap_keep) {
+                return;
+        }
+
+        long long size = ctx->size > ctx->cap_size ? 
+                (long long) (ctx->size * GROW_FACTOR) : ctx->cap_size;
+        int nritz = ctx->nritz > ctx->cap_ritz ? ctx->nritz : ctx->cap_ritz;
+        int max_vecs = ctx->max_vecs > ctx->cap_vecs ? 
+                ctx->max_vecs : ctx->cap_vecs;
+        int keep = ctx->keep > ctx->cap_keep ? ctx->keep : ctx->cap_keep;
+
+        free_davidson_workspace(ctx);
+        max_vecs = max_vecs_to_alloc(max_vecs, keep, nritz, size);
+        if (max_vecs < ctx->keep + ctx->block) {
+                fprintf(stderr, "Error @%s: Davidson needs at least %d vectors.\n",
+                        __func__, ctx->keep + ctx->block);
+                exit(EXIT_FAILURE);
+        }
+        if (max_vecs < ctx->max_vecs) { ctx->max_vecs = max_vecs; }
 
         /* The full problem */
-        david_dat.V  = safe_malloc((long long) size * max_vecs, double);
-        david_dat.VA = safe_malloc((long long) size * max_vecs, double);
-        david_dat.diagonal = diagonal;
-        /* vec_t and residue vector */
-        david_dat.vec_t = safe_malloc(size, double);
-        for (int i = 0; i < size; ++i) { david_dat.vec_t[i] = result[i]; }
+        ctx->V  = safe_malloc(size * max_vecs, double);
+        ctx->VA = safe_malloc(size * max_vecs, double);
+        /* Ritz vectors, residues and correction vectors */
+        ctx->ritz = safe_malloc(size * nritz, double);
+        ctx->vec_t = safe_malloc(size * nritz, double);
+        ctx->residues = safe_malloc(nritz, double);
+        /* Deflation and orthonormalization */
+        ctx->work = safe_malloc(size * keep, double);
+        ctx->overlap = safe_malloc(max_vecs * nritz, double);
 
         /* Projected problem */
-        david_dat.sub_matrix = safe_malloc(max_vecs * max_vecs, double);
-        david_dat.eigv       = safe_malloc(max_vecs * max_vecs, double);
-        david_dat.eigvalues  = safe_malloc(max_vecs, double);
+        ctx->sub_matrix = safe_malloc(max_vecs * max_vecs, double);
+        ctx->eigv       = safe_malloc(max_vecs * max_vecs, double);
+        ctx->eigvalues  = safe_malloc(max_vecs, double);
+
+        ctx->cap_size = size;
+        ctx->cap_vecs = max_vecs;
+        ctx->cap_ritz = nritz;
+        ctx->cap_keep = keep;
 }
 
-#ifndef NDEBUG
-static void check_ortho(void)
+static void init_davidson_problem(struct davidson_context * ctx, 
+                                  const double * diagonal, int size, 
+                                  int max_vecs, int keep_deflate, int block,
+                                  int nroots)
 {
-        double * Vi = david_dat.V;
-        for (int i = 0; i < david_dat.m; ++i, Vi += david_dat.size) {
-                double a = -cblas_ddot(david_dat.size, Vi, 1, david_dat.vec_t, 1);
-                if (fabs(a) > 1e-9) {
-                        printf("value of a[%d] = %e\n", i, a);
-                        exit(EXIT_FAILURE);
-                }
+        ctx->m = 0;
+        ctx->size = size;
+        ctx->nroots = nroots;
+        ctx->block = block < 1 ? 1 : block;
+        if (ctx->block > size) { ctx->block = size; }
+        ctx->nritz = nroots > ctx->block ? nroots : ctx->block;
+        ctx->keep = keep_deflate > ctx->nritz ? keep_deflate : ctx->nritz;
+        ctx->max_vecs = max_vecs;
+        if (ctx->max_vecs < ctx->keep + ctx->block) {
+                ctx->max_vecs = ctx->keep + ctx->block;
+                printf("Note @%s: Subspace of the Davidson increased to %d vectors.\n",
+                       __func__, ctx->max_vecs);
         }
+        if (ctx->max_vecs > size) { ctx->max_vecs = size; }
+        if (ctx->keep > ctx->max_vecs) { ctx->keep = ctx->max_vecs; }
+        ctx->diagonal = diagonal;
+        reserve_davidson_workspace(ctx);
 }
-#endif
 
-static void new_search_vector(void)
+/* W = W - V * (V^T * W), with V the current subspace. */
+static void orthogonalize_to_subspace(struct davidson_context * ctx, 
+                                      double * W, int k)
 {
-        double * Vi = david_dat.V;
-        for (int i = 0; i < david_dat.m; ++i, Vi += david_dat.size) {
-                double a = -cblas_ddot(david_dat.size, Vi, 1, david_dat.vec_t, 1);
-                cblas_daxpy(david_dat.size, a, Vi, 1, david_dat.vec_t, 1);
+        if (ctx->m == 0) { return; }
+        cblas_dgemm(CblasColMajor, CblasTrans, CblasNoTrans, ctx->m, k,
+                    ctx->size, 1, ctx->V, ctx->size, W, ctx->size, 0,
+                    ctx->overlap, ctx->m);
+        cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, ctx->size, k,
+                    ctx->m, -1, ctx->V, ctx->size, ctx->overlap, ctx->m, 1,
+                    W, ctx->size);
+}
+
+/* Orthonormalizes W through W = W * R^-1 with R^T * R = W^T * W.
+ *
+ * Returns 0 if the block is too badly conditioned. */
+static int cholesky_qr(struct davidson_context * ctx, double * W, int k)
+{
+        double * R = ctx->overlap;
+        cblas_dsyrk(CblasColMajor, CblasUpper, CblasTrans, k, ctx->size, 1,
+                    W, ctx->size, 0, R, k);
+        if (LAPACKE_dpotrf(LAPACK_COL_MAJOR, 'U', k, R, k) != 0) { return 0; }
+
+        double mindiag = fabs(R[0]);
+        double maxdiag = fabs(R[0]);
+        for (int i = 1; i < k; ++i) {
+                const double d = fabs(R[i * k + i]);
+                if (d < mindiag) { mindiag = d; }
+                if (d > maxdiag) { maxdiag = d; }
         }
-        double a = 1 / cblas_dnrm2(david_dat.size, david_dat.vec_t, 1);
-        cblas_dscal(david_dat.size, a, david_dat.vec_t, 1);
+        if (mindiag < CHOLQR_CUTOFF * maxdiag) { return 0; }
+
+        cblas_dtrsm(CblasColMajor, CblasRight, CblasUpper, CblasNoTrans,
+                    CblasNonUnit, ctx->size, k, 1, R, k, W, ctx->size);
+        return 1;
+}
+
+/* Fallback for badly conditioned blocks: modified Gram-Schmidt where (almost)
+ * linear dependent vectors are dropped.
+ *
+ * Returns the number of remaining vectors. */
+static int gram_schmidt_drop(struct davidson_context * ctx, double * W, int k)
+{
+        int kept = 0;
+        for (int j = 0; j < k; ++j) {
+                double * Wj = W + (long long) j * ctx->size;
+                double * Wk = W + (long long) kept * ctx->size;
+                const double norm0 = cblas_dnrm2(ctx->size, Wj, 1);
+
+                /* Twice is enough */
+                for (int pass = 0; pass < 2; ++pass) {
+                        orthogonalize_to_subspace(ctx, Wj, 1);
+                        for (int i = 0; i < kept; ++i) {
+                                double * Wi = W + (long long) i * ctx->size;
+                                const double a = cblas_ddot(ctx->size, Wi, 1,
+                                                            Wj, 1);
+                                cblas_daxpy(ctx->size, -a, Wi, 1, Wj, 1);
+                        }
+                }
+
+                const double norm = cblas_dnrm2(ctx->size, Wj, 1);
+                if (norm < DROP_CUTOFF * norm0 || norm == 0) { continue; }
+
+                cblas_dscal(ctx->size, 1 / norm, Wj, 1);
+                if (Wk != Wj) {
+                        for (int i = 0; i < ctx->size; ++i) { Wk[i] = Wj[i]; }
+                }
+                ++kept;
+        }
+        return kept;
+}
+
 #ifndef NDEBUG
-        check_ortho();
-#endif
-        for(int i = 0; i < david_dat.size; ++i) { Vi[i] = david_dat.vec_t[i]; }
+static void check_ortho(const struct davidson_context * ctx, int k)
+{
+        const double * Vj = ctx->V + (long long) ctx->m * ctx->size;
+        for (int j = 0; j < k; ++j, Vj += ctx->size) {
+                const double * Vi = ctx->V;
+                for (int i = 0; i < ctx->m + j; ++i, Vi += ctx->size) {
+                        double a = cblas_ddot(ctx->size, Vi, 1, Vj, 1);
+                        if (fabs(a) > 1e-9) {
+                                printf("value of a[%d] = %e\n", i, a);
+                                exit(EXIT_FAILURE);
+                        }
+                }
+        }
 }
+#endif
 
-static void expand_submatrix(void)
+/* Orthonormalizes the k new search vectors at V[m], does their matvec and
+ * adds them to the subspace.
+ *
+ * Returns the number of vectors added. */
+static int expand_subspace(struct davidson_context * ctx, int k,
+                           void (*matvec)(const double *, double *, void *), 
+                           void (*blockmatvec)(const double *, double *, 
+                                               int, void *), 
+                           void * vdat)
 {
+        const long long shift = (long long) ctx->m * ctx->size;
+        double * const W = ctx->V + shift;
+        double * const WA = ctx->VA + shift;
+
+        orthogonalize_to_subspace(ctx, W, k);
+        orthogonalize_to_subspace(ctx, W, k);
+        if (!cholesky_qr(ctx, W, k)) { k = gram_schmidt_drop(ctx, W, k); }
+        if (k == 0) { return 0; }
+#ifndef NDEBUG
+        check_ortho(ctx, k);
+#endif
 
-        double * const VAm = david_dat.VA + (long long) david_dat.size * david_dat.m;
-#pragma omp parallel for default(none) shared(david_dat)
-        for (int i = 0; i < david_dat.m + 1; ++i) {
-                const int shift         = david_dat.m * david_dat.max_vecs;
-                const long long  shift2 = (long long) david_dat.size * i;
-                david_dat.sub_matrix[shift + i] = cblas_ddot(david_dat.size, 
-                                                             david_dat.V + shift2, 
-                                                             1, VAm, 1);
+        /* Only here the expensive matvec is needed */
+        if (k == 1 || blockmatvec == NULL) {
+                for (int j = 0; j < k; ++j) {
+                        const long long jshift = (long long) j * ctx->size;
+                        matvec(W + jshift, WA + jshift, vdat);
+                }
+        } else {
+                blockmatvec(W, WA, k, vdat);
         }
-        ++david_dat.m;
+
+        /* sub_matrix[0:m+k, m:m+k] = V[:, 0:m+k]^T * WA */
+        cblas_dgemm(CblasColMajor, CblasTrans, CblasNoTrans, ctx->m + k, k,
+                    ctx->size, 1, ctx->V, ctx->size, WA, ctx->size, 0,
+                    ctx->sub_matrix + ctx->m * ctx->max_vecs, ctx->max_vecs);
+        ctx->m += k;
+        return k;
 }
 
-static int do_eigsolve(void)
+static int do_eigsolve(struct davidson_context * ctx)
 {
-        const int size = david_dat.m * david_dat.max_vecs;
-        for (int i = 0; i < size; ++i) { david_dat.eigv[i] = david_dat.sub_matrix[i]; }
+        for (int j = 0; j < ctx->m; ++j) {
+                for (int i = 0; i <= j; ++i) {
+                        ctx->eigv[j * ctx->max_vecs + i] =
+                                ctx->sub_matrix[j * ctx->max_vecs + i];
+                }
+        }
 
-        int info = LAPACKE_dsyev(LAPACK_COL_MAJOR, 'V', 'U', david_dat.m, 
-                                 david_dat.eigv, david_dat.max_vecs, 
-                                 david_dat.eigvalues);
+        int info = LAPACKE_dsyev(LAPACK_COL_MAJOR, 'V', 'U', ctx->m, 
+                                 ctx->eigv, ctx->max_vecs, ctx->eigvalues);
         if (info == 0) {
                 return 0;
         } else {
@@ -161,61 +309,126 @@ static int do_eigsolve(void)
         } 
 }
 
-static void deflate(int keep_deflate)
+/* Restarts with the lowest keep Ritz vectors as subspace. */
+static void deflate(struct davidson_context * ctx)
 {
-        long long size_x_deflate = (long long) david_dat.size * keep_deflate;
-        double * new_result = safe_malloc(size_x_deflate, double);
-
-        cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, david_dat.size, 
-                    keep_deflate, david_dat.max_vecs, 1, david_dat.V, 
-                    david_dat.size, david_dat.eigv, david_dat.max_vecs, 0, 
-                    new_result , david_dat.size);
-        for (int i = 0; i < size_x_deflate; ++i) { david_dat.V[i] = new_result[i]; }
-
-        cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, david_dat.size, 
-                    keep_deflate, david_dat.max_vecs, 1, david_dat.VA, 
-                    david_dat.size, david_dat.eigv, david_dat.max_vecs, 0, 
-                    new_result , david_dat.size);
-        for (int i = 0; i < size_x_deflate; ++i) { david_dat.VA[i] = new_result[i]; }
-
-        safe_free(new_result);
+        const long long size_x_keep = (long long) ctx->size * ctx->keep;
+        double * const new_result = ctx->work;
+
+        cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, ctx->size, 
+                    ctx->keep, ctx->m, 1, ctx->V, ctx->size, ctx->eigv, 
+                    ctx->max_vecs, 0, new_result, ctx->size);
+        for (long long i = 0; i < size_x_keep; ++i) { ctx->V[i] = new_result[i]; }
+
+        cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, ctx->size, 
+                    ctx->keep, ctx->m, 1, ctx->VA, ctx->size, ctx->eigv, 
+                    ctx->max_vecs, 0, new_result, ctx->size);
+        for (long long i = 0; i < size_x_keep; ++i) { ctx->VA[i] = new_result[i]; }
+
+        for (int j = 0; j < ctx->keep; ++j) {
+                for (int i = 0; i <= j; ++i) {
+                        ctx->sub_matrix[j * ctx->max_vecs + i] =
+                                i == j ? ctx->eigvalues[j] : 0;
+                }
+        }
+        ctx->m = ctx->keep;
+}
 
-        david_dat.m = 0;
-        while (david_dat.m < keep_deflate) { expand_submatrix(); }
+/* Restarts with the lowest keep Ritz vectors as the new search vectors after
+ * switching to the accurate matvec. The matvecs of the old subspace are not
+ * accurate enough and are redone by expand_subspace().
+ *
+ * Returns the number of new search vectors. */
+static int refine_subspace(struct davidson_context * ctx, 
+                           void (*refine)(void *, int), void * vdat)
+{
+        const int keep = ctx->keep < ctx->m ? ctx->keep : ctx->m;
+        const long long size_x_keep = (long long) ctx->size * keep;
+        double * const new_V = ctx->work;
+
+        cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, ctx->size, 
+                    keep, ctx->m, 1, ctx->V, ctx->size, ctx->eigv, 
+                    ctx->max_vecs, 0, new_V, ctx->size);
+        for (long long i = 0; i < size_x_keep; ++i) { ctx->V[i] = new_V[i]; }
+        ctx->m = 0;
+
+        refine(vdat, 1);
+        return keep;
 }
 
-static double calculate_residue(double * result)
+/* Calculates the Ritz vectors and the residues of the lowest nr roots and
+ * stores the norms of the residues. */
+static void calculate_residues(struct davidson_context * ctx, int nr)
 {
-        double norm2 = 0;
-        const double theta = david_dat.eigvalues[0];
-
-#pragma omp parallel for default(none) shared(david_dat,result) reduction(+:norm2)
-        for (int i = 0; i < david_dat.size; ++i) {
-                result[i] = cblas_ddot(david_dat.m, david_dat.V + i, 
-                                       david_dat.size, david_dat.eigv, 1);
-                david_dat.vec_t[i] = cblas_ddot(david_dat.m, david_dat.VA + i, 
-                                                david_dat.size, david_dat.eigv, 1);
-                david_dat.vec_t[i] -= theta * result[i];
-                norm2 += david_dat.vec_t[i] * david_dat.vec_t[i];
+        cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, ctx->size, nr,
+                    ctx->m, 1, ctx->V, ctx->size, ctx->eigv, ctx->max_vecs, 0,
+                    ctx->ritz, ctx->size);
+        cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, ctx->size, nr,
+                    ctx->m, 1, ctx->VA, ctx->size, ctx->eigv, ctx->max_vecs, 0,
+                    ctx->vec_t, ctx->size);
+
+        for (int j = 0; j < nr; ++j) {
+                const long long shift = (long long) j * ctx->size;
+                cblas_daxpy(ctx->size, -ctx->eigvalues[j], ctx->ritz + shift, 
+                            1, ctx->vec_t + shift, 1);
+                ctx->residues[j] = cblas_dnrm2(ctx->size, ctx->vec_t + shift, 1);
         }
-        return sqrt(norm2);
 }
 
-static void clean_david_dat(void)
+/* Preconditions the residues of the lowest unconverged roots and puts them
+ * after the current subspace.
+ *
+ * Returns the number of new search vectors. */
+static int new_search_block(struct davidson_context * ctx, int nr, double tol)
 {
-        safe_free(david_dat.V);
-        safe_free(david_dat.VA);
-        safe_free(david_dat.vec_t);
-        safe_free(david_dat.sub_matrix);
-        safe_free(david_dat.eigv);
-        safe_free(david_dat.eigvalues);
+        const int maxk = ctx->block < ctx->max_vecs - ctx->m ? 
+                ctx->block : ctx->max_vecs - ctx->m;
+        int k = 0;
+        for (int j = 0; j < nr && k < maxk; ++j) {
+                /* Roots beyond nroots only accelerate the convergence */
+                if (j < ctx->nroots && ctx->residues[j] <= tol) { continue; }
+
+                double * const vec_t = ctx->vec_t + (long long) j * ctx->size;
+                davidson_diagonal_preconditioner(ctx->ritz + 
+                                                 (long long) j * ctx->size,
+                                                 ctx->eigvalues[j], ctx->size,
+                                                 ctx->diagonal, vec_t);
+                double * Vk = ctx->V + (long long) (ctx->m + k) * ctx->size;
+                for (int i = 0; i < ctx->size; ++i) { Vk[i] = vec_t[i]; }
+                ++k;
+        }
+        return k;
 }
 
-static void create_new_vec_t(const double * result)
+/* Puts the initial guesses after the current (empty) subspace. The guess
+ * is used for the highest root, the lower roots start from unit vectors on
+ * the lowest diagonal elements.
+ *
+ * Returns the number of initial vectors. */
+static int initial_block(struct davidson_context * ctx, const double * result)
 {
-        davidson_diagonal_preconditioner(result, david_dat.eigvalues[0],
-                                         david_dat.size, david_dat.diagonal,
-                                         david_dat.vec_t);
+        const int k = ctx->nroots;
+        double * const guess = ctx->V + (long long) (k - 1) * ctx->size;
+        for (int i = 0; i < ctx->size; ++i) { guess[i] = result[i]; }
+
+        for (int j = 0; j < k - 1; ++j) {
+                double * const Vj = ctx->V + (long long) j * ctx->size;
+                int best = -1;
+                for (int i = 0; i < ctx->size; ++i) {
+                        /* Skip the elements that are already used */
+                        int used = 0;
+                        for (int l = 0; l < j && !used; ++l) {
+                                used = ctx->V[(long long) l * ctx->size + i] != 0;
+                        }
+                        if (!used && (best == -1 ||
+                                      ctx->diagonal[i] < ctx->diagonal[best])) {
+                                best = i;
+                        }
+                }
+                for (int i = 0; i < ctx->size; ++i) { Vj[i] = 0; }
+                Vj[best] = 1;
+        }
+        return k;
 }
 
 /* ========================================================================== */
@@ -256,18 +469,71 @@ void davidson_diagonal_preconditioner(const double * const result,
         }
 }
 
-int davidson(double * result, double * energy, int size, int max_vecs, 
-             int keep_deflate, double davidson_tol, int max_its, 
-             const double * diagonal, 
-             void (*matvec)(const double*, double*, void*), 
-             void * vdat)
+void init_davidson_context(struct davidson_context * ctx)
 {
+        ctx->m = 0;
+        ctx->max_vecs = 0;
+        ctx->size = 0;
+        ctx->block = 0;
+        ctx->nroots = 0;
+        ctx->nritz = 0;
+        ctx->keep = 0;
+        ctx->V = NULL;
+        ctx->VA = NULL;
+        ctx->diagonal = NULL;
+        ctx->ritz = NULL;
+        ctx->vec_t = NULL;
+        ctx->residues = NULL;
+        ctx->work = NULL;
+        ctx->overlap = NULL;
+        ctx->sub_matrix = NULL;
+        ctx->eigv = NULL;
+        ctx->eigvalues = NULL;
+        ctx->cap_size = 0;
+        ctx->cap_vecs = 0;
+        ctx->cap_ritz = 0;
+        ctx->cap_keep = 0;
+        ctx->refine = NULL;
+        ctx->refine_tol = 0;
+}
+
+void destroy_davidson_context(struct davidson_context * ctx)
+{
+        free_davidson_workspace(ctx);
+        init_davidson_context(ctx);
+}
+
+int davidson_ctx(struct davidson_context * ctx, double * result, 
+                 double * energy, int size, int max_vecs, int keep_deflate, 
+                 int block, int nroots, double davidson_tol, int max_its, 
+                 const double * diagonal, 
+                 void (*matvec)(const double*, double*, void*), 
+                 void (*blockmatvec)(const double *, double *, int, void *),
+                 void * vdat)
+{
+        if (nroots < 1) { nroots = 1; }
+        if (nroots > size) {
+                fprintf(stderr, "Error @%s: %d roots asked for a problem of dimension %d.\n",
+                        __func__, nroots, size);
+                return -1;
+        }
+
         int its = 0;
+        int converged = 0;
         double residue_norm = davidson_tol * 10;
         double d_energy = davidson_tol * 10;
-        *energy = 0;
-
-        init_david_dat(result, diagonal, size, max_vecs, keep_deflate);
+        double curr_energy = 0;
+        const int target = nroots - 1;
+        /* The switch of the matvec is only used for this call */
+        void (*refine)(void *, int) = ctx->refine;
+        ctx->refine = NULL;
+        /* 1 while the cheap matvec is used */
+        int cheap = 0;
+        if (refine != NULL) { refine(vdat, 1); }
+
+        init_davidson_problem(ctx, diagonal, size, max_vecs, keep_deflate, 
+                              block, nroots);
+        int k = initial_block(ctx, result);
 
         struct timeval t_start, t_end;
         gettimeofday(&t_start, NULL);
@@ -281,25 +547,42 @@ int davidson(double * result, double * energy, int size, int max_vecs,
         printf("---------------------------------\n");
 #endif
 
-        while ((residue_norm > davidson_tol) && its < max_its) {
-                new_search_vector();
-                long long shift = (long long) david_dat.m * david_dat.size;
-
-                /* only here expensive matvec needed */
-                matvec(david_dat.V + shift, david_dat.VA + shift, vdat);
-                expand_submatrix();
-                if (do_eigsolve() != 0)
+        while (!converged && its < max_its) {
+                const int added = expand_subspace(ctx, k, matvec, blockmatvec, 
+                                                  vdat);
+                if (added == 0) {
+                        /* No new directions left, the subspace stagnated */
+                        if (its != 0) { break; }
+                        fprintf(stderr, "Error @%s: Invalid initial guess.\n",
+                                __func__);
+                        return -1;
+                }
+                if (do_eigsolve(ctx) != 0)
                         return -1;
 
-                if (david_dat.m == david_dat.max_vecs) {   /* deflation */
-                        deflate(keep_deflate);
-                        if (do_eigsolve() != 0)
+                /* deflation, if max_vecs is capped by size, the subspace 
+                 * just grows till it spans the full space. */
+                if (ctx->m + ctx->block > ctx->max_vecs && 
+                    ctx->max_vecs < ctx->size) {
+                        deflate(ctx);
+                        if (do_eigsolve(ctx) != 0)
                                 return -1;
                 }
-                residue_norm = calculate_residue(result);
 
-                d_energy = *energy - david_dat.eigvalues[0];
-                *energy  = david_dat.eigvalues[0];
+                const int nr = ctx->nritz < ctx->m ? ctx->nritz : ctx->m;
+                calculate_residues(ctx, nr);
+
+                residue_norm = 0;
+                converged = nr >= nroots;
+                for (int j = 0; j < nroots && j < nr; ++j) {
+                        if (ctx->residues[j] > residue_norm) { 
+                                residue_norm = ctx->residues[j]; 
+                        }
+                        converged = converged && ctx->residues[j] <= davidson_tol;
+                }
+                const double theta = ctx->eigvalues[target < nr ? target : nr - 1];
+                d_energy = curr_energy - theta;
+                curr_energy = theta;
                 ++its;
 #ifdef DAVID_INFO
                 gettimeofday(&t_end2, NULL);
@@ -307,11 +590,26 @@ int davidson(double * result, double * energy, int size, int max_vecs,
                         1000000LL + t_end2.tv_usec - t_start2.tv_usec;
                 gettimeofday(&t_start2, NULL);
                 double d_elapsed = t_elapsed * 1e-6;
-                ++cnt_matvecs;
+                cnt_matvecs += added;
                 printf("%-4d  %e    %lf\t(%lf s)\n", its, residue_norm, 
-                       david_dat.eigvalues[0], d_elapsed);
+                       theta, d_elapsed);
 #endif
-                create_new_vec_t(result);
+                /* In later optimization steps the initial guess is often
+                 * accurate enough already, else search with the cheap matvec */
+                if (!converged && refine != NULL && its == 1 && 
+                    its < max_its && residue_norm > ctx->refine_tol) {
+                        refine(vdat, 0);
+                        cheap = 1;
+                }
+                /* The matvecs of the restarted subspace need an iteration */
+                if (!converged && cheap && its < max_its &&
+                    residue_norm <= ctx->refine_tol) {
+                        k = refine_subspace(ctx, refine, vdat);
+                        cheap = 0;
+                } else if (!converged) {
+                        k = new_search_block(ctx, nr, davidson_tol);
+                        if (k == 0) { break; }
+                }
         }
 
         gettimeofday(&t_end, NULL);
@@ -320,9 +618,50 @@ int davidson(double * result, double * energy, int size, int max_vecs,
         double d_elapsed = t_elapsed * 1e-6;
         printf("   * Davidson: (iter: %d), (d_eig: %.1e), (trunc: %.1e), (time: %.3g sec)\n",
                its, d_energy, residue_norm, d_elapsed);
-        if (residue_norm > davidson_tol) {
+        if (ctx->m <= target) {
+                fprintf(stderr, "Error @%s: Only %d of the %d roots are found.\n",
+                        __func__, ctx->m, nroots);
+                return -1;
+        }
+        if (!converged) {
                 printf("     - Davidson stopped before converging.\n");
         }
-        clean_david_dat();
-        return its >= max_its;
+        if (cheap) {
+                /* At least the energy of the result is calculated with the
+                 * accurate matvec. */
+                const double * const ritz = ctx->ritz + (long long) target * size;
+                refine(vdat, 1);
+                matvec(ritz, ctx->vec_t, vdat);
+                ctx->eigvalues[target] = cblas_ddot(size, ritz, 1, 
+                                                    ctx->vec_t, 1);
+        }
+        if (nroots > 1) {
+                printf("     - Roots:");
+                for (int j = 0; j < nroots; ++j) { 
+                        printf(" %.10f", ctx->eigvalues[j]); 
+                }
+                printf("\n");
+        }
+
+        const double * const ritz = ctx->ritz + (long long) target * size;
+        for (int i = 0; i < size; ++i) { result[i] = ritz[i]; }
+        *energy = ctx->eigvalues[target];
+        return !converged;
+}
+
+int davidson(double * result, double * energy, int size, int max_vecs, 
+             int keep_deflate, int block, int nroots, double davidson_tol, 
+             int max_its, const double * diagonal, 
+             void (*matvec)(const double*, double*, void*), 
+             void (*blockmatvec)(const double *, double *, int, void *),
+             void * vdat)
+{
+        struct davidson_context ctx;
+        init_davidson_context(&ctx);
+        const int ret = davidson_ctx(&ctx, result, energy, size, max_vecs, 
+                                     keep_deflate, block, nroots, davidson_tol, 
+                                     max_its, diagonal, matvec, blockmatvec, 
+                                     vdat);
+        destroy_davidson_context(&ctx);
+        return ret;
 }
@@ -38,6 +38,7 @@
 #include "options.h"
 #include "RedDM.h"
 #include "timers.h"
+#include "instructions.h"
 
 static const char *timernames[] = {
         "Reading HDF5", 
@@ -85,7 +86,8 @@ T3NS_DESCRIPTION
 "\n"
 "INTERACTION      = The type of the interaction. i.e.:\n"
 "                   For Quantum Chemistry:\n"
-"                       /path/to/fcidump.\n"
+"                       /path/to/fcidump or a FCIDUMP converted\n"
+"                       with --convert.\n"
 "                   For nearest neighbour hubbard:\n"
 "                       NN_HUBBARD (t = flt, U = flt)\n"
 "\n"
@@ -137,6 +139,37 @@ T3NS_DESCRIPTION
 "                  Level of Noise : 0.5 * NOISE * W_disc(last_sweep)\n"
 "                  Default : %.0e\n"
 "\n"
+"[DAVID_BLOCK]   = int, int, int \n"
+"                  Number of vectors added in every Davidson iteration.\n"
+"                  A value larger than 1 uses a block Davidson where the\n"
+"                  matrix vector products are done for the block at once.\n"
+"                  Default : %d\n"
+"\n"
+"[SINGLE_PREC]   = int, int, int \n"
+"                  If 1, the matrix vector products are done in single\n"
+"                  precision till the residual reaches the accuracy of\n"
+"                  single precision. The rest is done in double precision.\n"
+"                  Default : %d\n"
+"\n"
+"[DAVID_ADAPT]   = flt, flt, flt \n"
+"                  If larger than 0, the Davidson tolerance of every step is\n"
+"                  DAVID_ADAPT * sqrt(max(W_disc, |dE|)) of the previous step,\n"
+"                  bounded by DAVID_RTL and %.0e.\n"
+"                  Default : %g\n"
+"\n"
+"[CLEAN_GUESS]   = int, int, int \n"
+"                  If 1, the noise is only used to select the renormalized\n"
+"                  bases in a multi-site step. The converged tensor without\n"
+"                  noise is propagated as guess to the next step.\n"
+"                  Default : %d\n"
+"\n"
+"[DAVID_ROOTS]   = int, int, int \n"
+"                  The number of lowest roots converged in every step.\n"
+"                  The highest of them is the state that is optimized, i.e.\n"
+"                  2 targets the first excited state. A value larger than 1\n"
+"                  always uses the block Davidson.\n"
+"                  Default : %d\n"
+"\n"
 "##############################################################################\n";
 
 // A description of the arguments we accept.
@@ -149,6 +182,20 @@ static struct argp_option options[] = {
         {"savelocation", -1, "/path/to/directory", OPTION_ARG_OPTIONAL,
         "Save location for files to disk.\nDefault location is \"" H5_DEFAULT_LOCATION "\"."
         "You can disable saving by passing this option without an argument."},
+        {"scratch", -2, "/path/to/directory", 0,
+        "Scratch location for the renormalized operators. If specified, the "
+                "operators not needed in the current and next optimization "
+                "step are kept on disk instead of in memory."},
+        {"save-instructions", -4, 0, 0,
+        "Also save the instruction sets with the calculation, such that they "
+                "do not have to be made again when continuing it."},
+        {"screening", -5, "THRESHOLD", 0,
+        "Neglect the combinations of integrals smaller than THRESHOLD in "
+                "absolute value when making the instructions. Default is 0."},
+        {"convert", -3, "HDF5_FILE", 0,
+        "Convert the FCIDUMP passed as INPUT_FILE to HDF5_FILE and exit. "
+                "HDF5_FILE can be used as interaction instead of the FCIDUMP "
+                "and is read much faster."},
         {0} /* options struct needs to be closed by a { 0 } option */
 };
 
@@ -156,6 +203,10 @@ static struct argp_option options[] = {
 struct arguments {
         char *h5file;
         char *saveloc;
+        char *scratch;
+        char *convert;
+        int save_instructions;
+        double screening;
         char *args[1];                /* inputfile */
 };
 
@@ -176,6 +227,24 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
                 else
                         arguments->saveloc = arg;
                 break;
+        case -2:
+                arguments->scratch = arg;
+                break;
+        case -3:
+                arguments->convert = arg;
+                break;
+        case -4:
+                arguments->save_instructions = 1;
+                break;
+        case -5: {
+                char * end;
+                arguments->screening = strtod(arg, &end);
+                if (*end != '\0' || arguments->screening < 0) {
+                        argp_error(state, "Invalid screening threshold "
+                                   "\"%s\".", arg);
+                }
+                break;
+        }
         case ARGP_KEY_ARG:
                 /* Too many arguments. */
                 if (state->arg_num >= 1)
@@ -284,7 +353,9 @@ static int initialize_program(int argc, char *argv[],
         snprintf(buffer, buffersize, doc, buffer_symm, MAX_SYMMETRIES,
                  DEFAULT_MINSTATES, DEFAULT_SWEEPS, DEFAULT_E_CONV,
                  DEFAULT_SITESIZE, DEFAULT_SOLVER_TOL, DEFAULT_SOLVER_MAX_ITS,
-                 DEFAULT_NOISE);
+                 DEFAULT_NOISE, DEFAULT_DAVIDSON_BLOCK, DEFAULT_SINGLE_PREC,
+                 DAVIDSON_ADAPT_MAX_RTL, DEFAULT_DAVIDSON_ADAPT,
+                 DEFAULT_CLEAN_GUESS, DEFAULT_DAVIDSON_ROOTS);
 
         struct argp argp = {options, parse_opt, args_doc, buffer};
 
@@ -292,11 +363,20 @@ static int initialize_program(int argc, char *argv[],
         struct arguments arguments;
         arguments.saveloc = H5_DEFAULT_LOCATION;
         arguments.h5file  = NULL;
+        arguments.scratch = NULL;
+        arguments.convert = NULL;
+        arguments.save_instructions = 0;
+        arguments.screening = 0;
 
         /* Parse our arguments.
          * Every option seen by parse_opt will be reflected in arguments. */
         argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
+        if (arguments.convert) {
+                QC_convert_fcidump(arguments.args[0], arguments.convert);
+                exit(EXIT_SUCCESS);
+        }
+
         // Location for saving results.
         if (arguments.saveloc == NULL) {
                 *saveloc = NULL;
@@ -311,6 +391,19 @@ static int initialize_program(int argc, char *argv[],
                 }
         }
 
+        // Location for spilling the renormalized operators.
+        if (arguments.scratch != NULL) {
+                recursive_mkdir(arguments.scratch, 0750);
+                if (access(arguments.scratch, F_OK) != 0) {
+                        fprintf(stderr, "Error at %s: Making of directory \"%s\" failed.\n",
+                                __func__, arguments.scratch);
+                        exit(EXIT_FAILURE);
+                }
+                set_scratch_location(arguments.scratch);
+        }
+        set_save_instructions(arguments.save_instructions);
+        set_integral_screening(arguments.screening);
+
         int minocc = DEFAULT_MINSTATES;
         // Read and continue previous calculation.
         if (arguments.h5file) {
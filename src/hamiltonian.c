@@ -426,7 +426,9 @@ static int set_hamiltonian(char hamiltonian[], int * const hassu2, int * hasseni
                 }
                 return 1;
         }
-        if (ext) {
+        if (QC_is_converted_fcidump(hamiltonian)) {
+                ham = QC;
+        } else if (ext) {
                 char *extfcidump = "FCIDUMP";
                 ++ext;
                 while (*ext) {
@@ -21,6 +21,11 @@
 #include <math.h>
 #include <hdf5.h>
 #include <assert.h>
+#include <omp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "hamiltonian_qc.h"
 #include "io.h"
@@ -30,11 +35,20 @@
 #include "opType.h"
 #include "io_to_disk.h"
 
+/* Maximal number of point group irreps, D2h has 8 */
+#define PG_MAX_IRREPS 8
+
+/* Group of a FCIDUMP converted by QC_convert_fcidump */
+#define FCIDUMP_H5_GROUP "./fcidump"
+
 static struct hamdata {
         int norb;           // number of orbitals.
         int *orbirrep;      // the pg_irreps of the orbitals.
         double core_energy; // core_energy of the system.
-        double* Vijkl;      // interaction terms of the system.
+        double* Vijkl;      // packed interaction terms, see V_index().
+        long long Vsize;    // number of packed interaction terms.
+        int * pairid;       // index of an orbital pair in its irrep block.
+        long long Vstart[PG_MAX_IRREPS]; // start of every irrep block.
         int su2;            // has SU(2) turned on or not.
         int has_seniority;  // Seniority restricted calculation.
 } hdat;
@@ -67,6 +81,12 @@ static double B_tilde(const int * const tags[4], const int twoJ);
 static double get_V(const int * const tag1, const int * const tag2,
                     const int * const tag3, const int * const tag4);
 
+/* The largest absolute value of (ab|cd), (ac|bd) and (ad|bc) */
+static double max_V(const int a, const int b, const int c, const int d);
+
+static void add_quadruple(unsigned long long ** quads, long long * nr,
+                          long long * mem, const int q[4]);
+
 static int correct_tags_4p(const int * tags[3], const int nr_tags[3], 
                            const int base_tag, const int *tag_order[4], 
                            int newpos[4]);
@@ -77,13 +97,26 @@ static int equaltags(const int *tag1, const int *tag2,
 /** reads the header of fcidump, ignores nelec, ms2 and isym. **/
 static void read_header(char hamiltonianfile[]);
 
+/* Reads norb and the ORBSYM of a text FCIDUMP */
+static int * read_text_header(char fil[], int needorbsym);
+
 /** reads the integrals from a fcidump file. **/
 static void read_integrals(double **one_p_int, char hamiltonianfile[]);
 
 /** forms the integrals given a vijkl and a one_p_int **/
 static void form_integrals(double* one_p_int);
 
-static void fillin_Vijkl(const int i, const int j, const int k, const int l);
+/* Prepares the indexing of the packed interaction terms */
+static void prepare_V_index(void);
+
+/* Numbers the orbital pairs within every irrep block for the given orbital
+ * irreps and returns the number of packed interaction terms. */
+static long long make_pairid(const int * irreps, int * pairid, 
+                             long long Vstart[PG_MAX_IRREPS]);
+
+/* Returns the index of (ij|kl) in the packed interaction terms, or -1 if it
+ * is zero by point group symmetry. */
+static long long V_index(const int i, const int j, const int k, const int l);
 
 /* Checks the irreps of the orbitals */
 static int check_orbirrep(void);
@@ -144,6 +177,7 @@ void QC_destroy_hamiltonian(void)
         safe_free(MPOsymsecs.dims);
         safe_free(hdat.orbirrep);
         safe_free(hdat.Vijkl);
+        safe_free(hdat.pairid);
 
         opType_destroy_all();
 }
@@ -156,11 +190,6 @@ void QC_make_hamiltonian(char hamiltonianfile[], int su2, int has_seniority)
         hdat.has_seniority = has_seniority;
         printf(">> Reading FCIDUMP %s\n", hamiltonianfile);
         read_header(hamiltonianfile);
-        read_integrals(&one_p_int, hamiltonianfile);
-
-        printf(">> Preparing hamiltonian...\n");
-        form_integrals(one_p_int);
-
 
         if (!check_orbirrep()) {
                 fprintf(stderr,
@@ -169,6 +198,12 @@ void QC_make_hamiltonian(char hamiltonianfile[], int su2, int has_seniority)
                         "        if there is one inputted at least.\n");
                 exit(EXIT_FAILURE);
         }
+        prepare_V_index();
+        read_integrals(&one_p_int, hamiltonianfile);
+
+        printf(">> Preparing hamiltonian...\n");
+        form_integrals(one_p_int);
+
         prepare_MPOsymsecs();
         init_opType_array(su2);
 }
@@ -595,25 +630,76 @@ int fuse_value(const int * tags[3], const int nr_tags[3], const int base_tag,
         return 1;
 }
 
+long long QC_interacting_quadruples(double threshold, 
+                                    unsigned long long ** quads)
+{
+        const int n = hdat.norb;
+        assert(n < 0xFFFF);
+        long long nr = 0;
+        long long mem = n;
+        *quads = safe_malloc(mem, **quads);
+
+        int q[4];
+        for (q[0] = 0; q[0] < n; ++q[0])
+        for (q[1] = q[0]; q[1] < n; ++q[1])
+        for (q[2] = q[1]; q[2] < n; ++q[2]) {
+                const int irr = hdat.orbirrep[q[0]] ^ hdat.orbirrep[q[1]] ^ 
+                        hdat.orbirrep[q[2]];
+                for (q[3] = q[2]; q[3] < n; ++q[3]) {
+                        if (hdat.orbirrep[q[3]] != irr) { continue; }
+                        const double V = max_V(q[0], q[1], q[2], q[3]);
+                        if (V != 0 && V >= threshold) {
+                                add_quadruple(quads, &nr, &mem, q);
+                        }
+                }
+        }
+        return nr;
+}
+
 static double get_V(const int * const tag1, const int * const tag2,
                     const int * const tag3, const int * const tag4)
 {
-        const int psites  = hdat.norb;
-        const int psites2 = psites * psites;
-        const int psites3 = psites * psites2;
-
         if (tag1[0] != 1 || tag2[0] != 1 || tag3[0] != 0 || tag4[0] != 0)
                 return 0;
         if (!hdat.su2 && (tag1[2] != tag4[2] || tag2[2] != tag3[2]))
                 return 0;
 
-        if (get_pg_symmetry() != -1 && 
-            ((hdat.orbirrep[tag1[1]] ^ hdat.orbirrep[tag2[1]]) ^ 
-             (hdat.orbirrep[tag3[1]] ^ hdat.orbirrep[tag4[1]])) != 0)
-                return 0;
+        /* Also zero if not allowed by the point group symmetry */
+        const long long id = V_index(tag1[1], tag4[1], tag2[1], tag3[1]);
+        return id == -1 ? 0 : hdat.Vijkl[id];
+}
+
+static double max_V(const int a, const int b, const int c, const int d)
+{
+        const long long id[3] = {
+                V_index(a, b, c, d), 
+                V_index(a, c, b, d), 
+                V_index(a, d, b, c)
+        };
+        double result = 0;
+        for (int i = 0; i < 3; ++i) {
+                assert(id[i] != -1);
+                if (fabs(hdat.Vijkl[id[i]]) > result)
+                        result = fabs(hdat.Vijkl[id[i]]);
+        }
+        return result;
+}
 
-        return hdat.Vijkl[tag1[1] + psites * tag4[1] + 
-                psites2 * tag2[1] + psites3 * tag3[1]];
+static void add_quadruple(unsigned long long ** quads, long long * nr,
+                          long long * mem, const int q[4])
+{
+        if (*nr == *mem) {
+                *mem *= 2;
+                *quads = realloc(*quads, *mem * sizeof **quads);
+                if (*quads == NULL) {
+                        fprintf(stderr, "%s:%d; Realloc failed.\n",
+                                __FILE__, __LINE__);
+                        exit(EXIT_FAILURE);
+                }
+        }
+        unsigned long long key = 0;
+        for (int i = 0; i < 4; ++i) { key = key << 16 | (q[i] + 1); }
+        (*quads)[(*nr)++] = key;
 }
 
 static double B(const int * const tags[4], const int twoJ)
@@ -641,12 +727,11 @@ void QC_write_hamiltonian_to_disk(const hid_t id)
 {
         const hid_t group_id = H5Gcreate(id, "./hamiltonian_data", H5P_DEFAULT, 
                                          H5P_DEFAULT, H5P_DEFAULT);
-        const int p2 = hdat.norb * hdat.norb;
-        const int p4 = p2 * p2;
 
         write_attribute(group_id, "norb", &hdat.norb, 1, THDF5_INT);
         write_dataset(group_id, "./orbirrep", hdat.orbirrep, hdat.norb, THDF5_INT);
-        write_dataset(group_id, "./Vijkl", hdat.Vijkl, p4, THDF5_EL_TYPE);
+        write_dataset(group_id, "./Vpacked", hdat.Vijkl, hdat.Vsize, 
+                      THDF5_EL_TYPE);
         write_attribute(group_id, "core_energy", &hdat.core_energy, 1, THDF5_DOUBLE);
         write_attribute(group_id, "su2", &hdat.su2, 1, THDF5_INT);
         write_attribute(group_id, "has_seniority", &hdat.has_seniority, 1, THDF5_INT);
@@ -662,10 +747,27 @@ void QC_read_hamiltonian_from_disk(const hid_t id)
         hdat.orbirrep = safe_malloc(hdat.norb, int);
         read_dataset(group_id, "./orbirrep", hdat.orbirrep);
 
-        const int p2 = hdat.norb * hdat.norb;
-        const int p4 = p2 * p2;
-        hdat.Vijkl = safe_malloc(p4, EL_TYPE);
-        read_dataset(group_id, "./Vijkl", hdat.Vijkl);
+        prepare_V_index();
+        hdat.Vijkl = safe_malloc(hdat.Vsize, EL_TYPE);
+        if (H5Lexists(group_id, "./Vpacked", H5P_DEFAULT) > 0) {
+                read_dataset(group_id, "./Vpacked", hdat.Vijkl);
+        } else {
+                /* Older files store all norb^4 interaction terms */
+                const long long n = hdat.norb;
+                EL_TYPE * dense = safe_malloc(n * n * n * n, EL_TYPE);
+                read_dataset(group_id, "./Vijkl", dense);
+                for (int i = 0; i < n; ++i)
+                for (int j = 0; j <= i; ++j)
+                for (int k = 0; k < n; ++k)
+                for (int l = 0; l <= k; ++l) {
+                        const long long vid = V_index(i, j, k, l);
+                        if (vid != -1) {
+                                hdat.Vijkl[vid] = 
+                                        dense[i + n * (j + n * (k + n * l))];
+                        }
+                }
+                safe_free(dense);
+        }
         read_attribute(group_id, "core_energy", &hdat.core_energy);
         read_attribute(group_id, "su2", &hdat.su2);
         read_attribute(group_id, "has_seniority", &hdat.has_seniority);
@@ -675,6 +777,59 @@ void QC_read_hamiltonian_from_disk(const hid_t id)
         init_opType_array(hdat.su2);
 }
 
+int QC_is_converted_fcidump(const char fil[])
+{
+        if (access(fil, F_OK) != 0 || H5Fis_hdf5(fil) <= 0) { return 0; }
+
+        const hid_t file_id = H5Fopen(fil, H5F_ACC_RDONLY, H5P_DEFAULT);
+        if (file_id < 0) { return 0; }
+        const int result = H5Lexists(file_id, FCIDUMP_H5_GROUP, H5P_DEFAULT) > 0;
+        H5Fclose(file_id);
+        return result;
+}
+
+void QC_convert_fcidump(char fcidump[], char h5file[])
+{
+        char buffer[MY_STRING_LEN];
+        double * one_p_int;
+
+        printf(">> Reading FCIDUMP %s\n", fcidump);
+        int * orbsym = read_text_header(fcidump, read_option("ORBSYM", fcidump, 
+                                                             buffer) != -1);
+
+        /* Packed with the irreps of the ORBSYM, these are closed under XOR */
+        hdat.orbirrep = safe_malloc(hdat.norb, int);
+        for (int i = 0; i < hdat.norb; ++i) { hdat.orbirrep[i] = orbsym[i] - 1; }
+        prepare_V_index();
+        read_integrals(&one_p_int, fcidump);
+
+        printf(">> Writing %s\n", h5file);
+        const hid_t file_id = H5Fcreate(h5file, H5F_ACC_TRUNC, H5P_DEFAULT, 
+                                        H5P_DEFAULT);
+        if (file_id < 0) {
+                fprintf(stderr, "ERROR : failed creating %s.\n", h5file);
+                exit(EXIT_FAILURE);
+        }
+        const hid_t group_id = H5Gcreate(file_id, FCIDUMP_H5_GROUP, H5P_DEFAULT, 
+                                         H5P_DEFAULT, H5P_DEFAULT);
+        write_attribute(group_id, "norb", &hdat.norb, 1, THDF5_INT);
+        write_attribute(group_id, "core_energy", &hdat.core_energy, 1, 
+                        THDF5_DOUBLE);
+        write_dataset(group_id, "./orbsym", orbsym, hdat.norb, THDF5_INT);
+        write_dataset(group_id, "./h1", one_p_int, hdat.norb * hdat.norb, 
+                      THDF5_DOUBLE);
+        write_dataset(group_id, "./Vpacked", hdat.Vijkl, hdat.Vsize, 
+                      THDF5_DOUBLE);
+        H5Gclose(group_id);
+        H5Fclose(file_id);
+
+        safe_free(one_p_int);
+        safe_free(orbsym);
+        safe_free(hdat.orbirrep);
+        safe_free(hdat.Vijkl);
+        safe_free(hdat.pairid);
+}
+
 int QC_consistent_state(int * ts)
 {
         int parity;
@@ -780,7 +935,9 @@ static int equaltags(const int *tag1, const int *tag2,
         }
 }
 
-static void read_header(char fil[])
+/* Reads norb and the ORBSYM of a text FCIDUMP. If orbsym is not needed, all
+ * orbitals are set to the first irrep. */
+static int * read_text_header(char fil[], int needorbsym)
 {
         char buffer[MY_STRING_LEN];
         char *pch;
@@ -798,155 +955,503 @@ static void read_header(char fil[])
                 exit(EXIT_FAILURE);
         }
 
-        hdat.orbirrep = safe_calloc(hdat.norb, int);
-        if (get_pg_symmetry() != -1) {/* reading ORBSYM */
-                int ops;
-                if ((ops = read_option("ORBSYM", fil, buffer)) != hdat.norb) {
-                        fprintf(stderr, "ERROR while reading ORBSYM in %s. %d orbitals found.\n"
-                                "Fix the FCIDUMP or turn of point group symmetry!\n", fil, ops);
+        int * orbsym = safe_malloc(hdat.norb, int);
+        for (int i = 0; i < hdat.norb; ++i) { orbsym[i] = 1; }
+        if (!needorbsym) { return orbsym; }
+
+        int ops;
+        if ((ops = read_option("ORBSYM", fil, buffer)) != hdat.norb) {
+                fprintf(stderr, "ERROR while reading ORBSYM in %s. %d orbitals found.\n"
+                        "Fix the FCIDUMP or turn of point group symmetry!\n", fil, ops);
+                exit(EXIT_FAILURE);
+        }
+
+        pch = strtok(buffer, " ,\n");
+        ops = 0;
+        while (pch) {
+                orbsym[ops] = atoi(pch);
+                if (orbsym[ops] <= 0 || orbsym[ops] > PG_MAX_IRREPS) {
+                        fprintf(stderr, "Error while reading ORBSYM in %s.\n", fil);
                         exit(EXIT_FAILURE);
                 }
+                pch = strtok(NULL, " ,\n");
+                ++ops;
+        }
+        return orbsym;
+}
 
-                pch = strtok(buffer, " ,\n");
-                ops = 0;
-                while (pch) {
-                        hdat.orbirrep[ops] = atoi(pch);
-                        if (hdat.orbirrep[ops] == 0) {
-                                fprintf(stderr, "Error while reading ORBSYM in %s.\n", fil);
-                                exit(EXIT_FAILURE);
-                        } else {
-                                hdat.orbirrep[ops] = fcidump_to_psi4(hdat.orbirrep[ops] - 1, 
-                                                                     get_pg_symmetry() - C1);
-                        }
+/* Reads norb and the ORBSYM of a FCIDUMP converted by QC_convert_fcidump */
+static int * read_h5_header(char fil[])
+{
+        const hid_t file_id = H5Fopen(fil, H5F_ACC_RDONLY, H5P_DEFAULT);
+        const hid_t group_id = H5Gopen(file_id, FCIDUMP_H5_GROUP, H5P_DEFAULT);
 
-                        pch = strtok(NULL, " ,\n");
-                        ++ops;
+        read_attribute(group_id, "norb", &hdat.norb);
+        int * orbsym = safe_malloc(hdat.norb, int);
+        read_dataset(group_id, "./orbsym", orbsym);
+
+        H5Gclose(group_id);
+        H5Fclose(file_id);
+        return orbsym;
+}
+
+static void read_header(char fil[])
+{
+        const int pg = get_pg_symmetry();
+        int * orbsym = QC_is_converted_fcidump(fil) ? read_h5_header(fil) :
+                read_text_header(fil, pg != -1);
+
+        hdat.orbirrep = safe_calloc(hdat.norb, int);
+        if (pg != -1) {
+                for (int i = 0; i < hdat.norb; ++i) {
+                        hdat.orbirrep[i] = fcidump_to_psi4(orbsym[i] - 1, 
+                                                           pg - C1);
                 }
         }
+        safe_free(orbsym);
 }
 
-static void read_integrals(double **one_p_int, char fil[])
+static int is_digit(const char c)
 {
-        /* open file for reading integrals */
-        FILE *fp = fopen(fil, "r");
-        char buffer[255];
-        int ln_cnt = 1;
-        int norb2 = hdat.norb * hdat.norb;
-        int norb3 = norb2 * hdat.norb;
-
-        /* integrals */
-        double *matrix_el;
-        *one_p_int = safe_calloc(norb2, double);
-        hdat.core_energy = 0;
-        hdat.Vijkl = safe_calloc(norb3 * hdat.norb, double);
+        return (unsigned) (c - '0') < 10;
+}
 
-        if (fp == NULL) {
-                fprintf(stderr, "ERROR reading fcidump file: %s\n", fil);
-                exit(EXIT_FAILURE);
+static int is_blank(const char c)
+{
+        return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+/* Reads a floating point number as formatted in a FCIDUMP.
+ * Returns the end of the number or NULL if no number could be read.
+ *
+ * Numbers with at most 15 significant digits and a small exponent are
+ * converted exactly with one multiplication or division by an exact power of
+ * ten. Others are passed to strtod. */
+static const char * parse_double(const char * p, const char * end, 
+                                 double * val)
+{
+        static const double pow10[] = {
+                1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21,
+                1e22
+        };
+        const char * begin = p;
+        unsigned long long mant = 0;
+        int digits = 0;
+        int exp10 = 0;
+        int seen = 0;
+
+        const int neg = p < end && *p == '-';
+        if (p < end && (*p == '-' || *p == '+')) { ++p; }
+
+        for (; p < end && is_digit(*p); ++p) {
+                if (digits < 19) {
+                        mant = 10 * mant + (*p - '0');
+                        digits += mant != 0;
+                } else {
+                        ++exp10;
+                }
+                seen = 1;
+        }
+        if (p < end && *p == '.') {
+                for (++p; p < end && is_digit(*p); ++p) {
+                        if (digits < 19) {
+                                mant = 10 * mant + (*p - '0');
+                                digits += mant != 0;
+                                --exp10;
+                        }
+                        seen = 1;
+                }
+        }
+        if (!seen) { return NULL; }
+
+        /* Fortran writes D as exponent */
+        if (p < end && (*p == 'e' || *p == 'E' || *p == 'd' || *p == 'D')) {
+                const char * q = p + 1;
+                const int eneg = q < end && *q == '-';
+                if (q < end && (*q == '-' || *q == '+')) { ++q; }
+                if (q == end || !is_digit(*q)) { return NULL; }
+
+                int e = 0;
+                for (; q < end && is_digit(*q); ++q) {
+                        if (e < 100000) { e = 10 * e + (*q - '0'); }
+                }
+                exp10 += eneg ? -e : e;
+                p = q;
+        }
+
+        if (mant == 0) {
+                *val = neg ? -0. : 0.;
+        } else if (mant < (1ULL << 53) && exp10 >= -22 && exp10 <= 22) {
+                const double v = exp10 < 0 ? mant / pow10[-exp10] : 
+                        mant * pow10[exp10];
+                *val = neg ? -v : v;
+        } else {
+                char buffer[64];
+                const int len = p - begin;
+                if (len >= (int) sizeof buffer) { return NULL; }
+                for (int i = 0; i < len; ++i) {
+                        buffer[i] = begin[i] == 'd' || begin[i] == 'D' ? 
+                                'e' : begin[i];
+                }
+                buffer[len] = '\0';
+                *val = strtod(buffer, NULL);
+        }
+        return p;
+}
+
+static const char * parse_index(const char * p, const char * end, int * val)
+{
+        if (p == end || !is_digit(*p)) { return NULL; }
+        *val = 0;
+        for (; p < end && is_digit(*p); ++p) {
+                if (*val < 1000000) { *val = 10 * *val + (*p - '0'); }
         }
+        return p;
+}
 
-        /* Pass through buffer until begin of the integrals, this is typically
-         * typed by "&END", "/END" or "/" */
-        while (fgets(buffer, sizeof buffer, fp) != NULL) {
-                char *stops[] = {"&END", "/END", "/"};
-                int lstops = sizeof stops / sizeof(char*);
-                int i;
-                for (i = 0; i < lstops; ++i) {
-                        char *s = stops[i];
-                        char *b = buffer;
+/* Parses "value i j k l" from a line. Returns 0 on a formatting error. */
+static int parse_integral_line(const char * p, const char * eol, 
+                               double * value, int idx[4])
+{
+        while (p < eol && is_blank(*p)) { ++p; }
+        if ((p = parse_double(p, eol, value)) == NULL) { return 0; }
+
+        for (int i = 0; i < 4; ++i) {
+                if (p == eol || !is_blank(*p)) { return 0; }
+                while (p < eol && is_blank(*p)) { ++p; }
+                if ((p = parse_index(p, eol, &idx[i])) == NULL) { return 0; }
+        }
+        while (p < eol && is_blank(*p)) { ++p; }
+        return p == eol;
+}
 
-                        while (isspace(*b)) ++b;
+static int line_number(const char * file, const char * line)
+{
+        int cnt = 1;
+        for (const char * p = file; p < line; ++p) { cnt += *p == '\n'; }
+        return cnt;
+}
 
-                        while (*s && *s == *b) {
+/* Returns the begin of the integrals. The header typically ends with a line
+ * "&END", "/END" or "/". */
+static const char * skip_fcidump_header(const char * p, const char * end)
+{
+        const char *stops[] = {"&END", "/END", "/"};
+        const int lstops = sizeof stops / sizeof(char*);
+
+        while (p < end) {
+                const char * eol = memchr(p, '\n', end - p);
+                if (eol == NULL) { eol = end; }
+
+                for (int i = 0; i < lstops; ++i) {
+                        const char * s = stops[i];
+                        const char * b = p;
+                        while (b < eol && isspace(*b)) { ++b; }
+                        while (*s && b < eol && *s == *b) {
                                 ++b;
                                 ++s;
                         }
-
-                        while (isspace(*b)) ++b;
-                        if (!*b)
-                                break;
+                        while (b < eol && isspace(*b)) { ++b; }
+                        if (b == eol) { return eol == end ? end : eol + 1; }
                 }
-
-                if (i != lstops)
-                        break;
+                p = eol == end ? end : eol + 1;
         }
+        return end;
+}
+
+/* Parses the integral lines in [begin, end) and stores them. */
+static void parse_integral_lines(const char * file, const char * begin, 
+                                 const char * end, double * one_p_int)
+{
+        const int n = hdat.norb;
+        const char * line = begin;
+        while (line < end) {
+                const char * eol = memchr(line, '\n', end - line);
+                if (eol == NULL) { eol = end; }
+
+                const char * p = line;
+                while (p < eol && is_blank(*p)) { ++p; }
+                if (p == eol) { /* Empty line */
+                        line = eol + 1;
+                        continue;
+                }
 
-        /* reading the integrals */
-        while (fgets(buffer, sizeof buffer, fp) != NULL) {
-                int i, j, k, l;
                 double value;
-                int cnt = sscanf(buffer, " %lf %d %d %d %d ", &value, 
-                                 &i, &j, &k, &l); /* chemical notation */
-                ++ln_cnt;
-                if (cnt != 5) {
+                int id[4] = {0};
+                if (!parse_integral_line(line, eol, &value, id)) {
+                        fprintf(stderr, "ERROR: Whilst reading the integrals.\n"
+                                "wrong formatting at line %d!\n", 
+                                line_number(file, line));
+                        exit(EXIT_FAILURE);
+                }
+                /* Orbital energies (e i 0 0 0) are not used */
+                if (id[0] != 0 && id[1] == 0 && id[2] == 0 && id[3] == 0) {
+                        line = eol + 1;
+                        continue;
+                }
+                if (id[0] > n || id[1] > n || id[2] > n || id[3] > n ||
+                    (id[2] != 0 && (id[0] == 0 || id[1] == 0 || id[3] == 0)) ||
+                    (id[2] == 0 && (id[3] != 0 || (id[0] == 0) != (id[1] == 0)))) {
                         fprintf(stderr, "ERROR: Whilst reading the integrals.\n"
-                                "wrong formatting at line %d!\n", ln_cnt);
+                                "wrong index at line %d!\n", 
+                                line_number(file, line));
                         exit(EXIT_FAILURE);
                 }
 
-                if (k != 0)
-                        matrix_el = hdat.Vijkl + (l-1) * norb3 + (k-1) * norb2 
-                                + (j-1) * hdat.norb +(i-1);
-                else if (i != 0)
-                        matrix_el = *one_p_int + (j-1) * hdat.norb + (i-1);
-                else
-                        matrix_el = &hdat.core_energy;
-
-                if (!COMPARE_ELEMENT_TO_ZERO(*matrix_el))
-                        fprintf(stderr, "Doubly inputted value at line %d\n", 
-                                ln_cnt);
-                *matrix_el = value;
+                if (id[2] != 0) {
+                        const long long vid = V_index(id[0] - 1, id[1] - 1, 
+                                                      id[2] - 1, id[3] - 1);
+                        /* Zero by point group symmetry */
+                        if (vid != -1) {
+                                /* Claims the element in one compare and swap,
+                                 * on failure prev holds the value stored by
+                                 * another line. */
+                                double prev = 0;
+                                if (!__atomic_compare_exchange(
+                                            &hdat.Vijkl[vid], &prev, &value,
+                                            0, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                                        /* All permutations of (ij|kl) are
+                                         * stored only once, so only complain
+                                         * about different values. */
+                                        if (!COMPARE_ELEMENT_TO_ZERO(prev) &&
+                                            !COMPARE_ELEMENT_TO_ZERO(prev - value))
+                                                fprintf(stderr, "Doubly inputted value at line %d\n", 
+                                                        line_number(file, line));
+#pragma omp atomic write
+                                        hdat.Vijkl[vid] = value;
+                                }
+                        }
+                } else {
+#pragma omp critical (fcidump_one_p_int)
+                        {
+                                /* h_ij and h_ji are the same term, stored
+                                 * with i >= j. */
+                                const int i = id[0] > id[1] ? id[0] : id[1];
+                                const int j = id[0] > id[1] ? id[1] : id[0];
+                                double * matrix_el = id[0] != 0 ? 
+                                        one_p_int + (j - 1) * n + i - 1 :
+                                        &hdat.core_energy;
+                                if (!COMPARE_ELEMENT_TO_ZERO(*matrix_el))
+                                        fprintf(stderr, "Doubly inputted value at line %d\n", 
+                                                line_number(file, line));
+                                *matrix_el = value;
+                        }
+                }
+                line = eol + 1;
         }
-        fclose(fp);
+}
+
+/* Reads the integrals of a text FCIDUMP.
+ *
+ * The file is mapped in memory and split on line boundaries in a chunk for
+ * every thread. */
+static void read_text_integrals(double * one_p_int, char fil[])
+{
+        const int fd = open(fil, O_RDONLY);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) != 0) {
+                fprintf(stderr, "ERROR reading fcidump file: %s\n", fil);
+                exit(EXIT_FAILURE);
+        }
+        if (st.st_size == 0) {
+                close(fd);
+                return;
+        }
+
+        const char * file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, 
+                                 fd, 0);
+        close(fd);
+        if (file == MAP_FAILED) {
+                fprintf(stderr, "ERROR reading fcidump file: %s\n", fil);
+                exit(EXIT_FAILURE);
+        }
+        madvise((void *) file, st.st_size, MADV_SEQUENTIAL);
+
+        const char * end = file + st.st_size;
+        const char * begin = skip_fcidump_header(file, end);
+
+#pragma omp parallel default(none) shared(file, begin, end, one_p_int)
+        {
+                const int nt = omp_get_num_threads();
+                const int t = omp_get_thread_num();
+                const long long len = end - begin;
+
+                /* A chunk starts after the first newline from its offset */
+                const char * cbegin = begin + len * t / nt;
+                const char * cend = begin + len * (t + 1) / nt;
+                if (t != 0) {
+                        while (cbegin < end && cbegin[-1] != '\n') { ++cbegin; }
+                }
+                if (t != nt - 1) {
+                        while (cend < end && cend[-1] != '\n') { ++cend; }
+                }
+                parse_integral_lines(file, cbegin, cend, one_p_int);
+        }
+        munmap((void *) file, st.st_size);
+}
+
+static long long make_pairid(const int * irreps, int * pairid, 
+                             long long Vstart[PG_MAX_IRREPS])
+{
+        const int n = hdat.norb;
+        long long pairs[PG_MAX_IRREPS] = {0};
+
+        for (int i = 0; i < n; ++i) {
+                for (int j = 0; j <= i; ++j) {
+                        const int irr = irreps[i] ^ irreps[j];
+                        assert(irr >= 0 && irr < PG_MAX_IRREPS);
+                        pairid[i * n + j] = pairs[irr];
+                        pairid[j * n + i] = pairs[irr];
+                        ++pairs[irr];
+                }
+        }
+
+        /* For every irrep the lower triangle of the (ij|kl) matrix is kept */
+        long long size = 0;
+        for (int irr = 0; irr < PG_MAX_IRREPS; ++irr) {
+                Vstart[irr] = size;
+                size += pairs[irr] * (pairs[irr] + 1) / 2;
+        }
+        return size;
+}
+
+/* Reads the integrals of a FCIDUMP converted by QC_convert_fcidump.
+ *
+ * The interaction terms are stored packed for the irreps of the ORBSYM in the
+ * file. If this is not the packing of the current calculation, they are
+ * repacked. */
+static void read_h5_integrals(double * one_p_int, char fil[])
+{
+        const int n = hdat.norb;
+        const hid_t file_id = H5Fopen(fil, H5F_ACC_RDONLY, H5P_DEFAULT);
+        const hid_t group_id = H5Gopen(file_id, FCIDUMP_H5_GROUP, H5P_DEFAULT);
+
+        read_attribute(group_id, "core_energy", &hdat.core_energy);
+        read_dataset(group_id, "./h1", one_p_int);
+
+        int * irreps = safe_malloc(n, int);
+        read_dataset(group_id, "./orbsym", irreps);
+        for (int i = 0; i < n; ++i) { --irreps[i]; }
+
+        int * pairid = safe_malloc(n * n, int);
+        long long Vstart[PG_MAX_IRREPS];
+        const long long Vsize = make_pairid(irreps, pairid, Vstart);
+
+        if (Vsize == hdat.Vsize &&
+            memcmp(pairid, hdat.pairid, n * n * sizeof *pairid) == 0 &&
+            memcmp(Vstart, hdat.Vstart, sizeof Vstart) == 0) {
+                read_dataset(group_id, "./Vpacked", hdat.Vijkl);
+        } else {
+                double * V = safe_malloc(Vsize, double);
+                read_dataset(group_id, "./Vpacked", V);
+
+                /* The orbital pairs ordered by irrep and pairid */
+                int pairoff[PG_MAX_IRREPS + 1] = {0};
+                for (int i = 0; i < n; ++i) {
+                        for (int j = 0; j <= i; ++j) {
+                                ++pairoff[(irreps[i] ^ irreps[j]) + 1];
+                        }
+                }
+                for (int irr = 0; irr < PG_MAX_IRREPS; ++irr) {
+                        pairoff[irr + 1] += pairoff[irr];
+                }
+                const int npairs = pairoff[PG_MAX_IRREPS];
+                int (*pairs)[2] = safe_malloc(npairs, int[2]);
+                for (int i = 0; i < n; ++i) {
+                        for (int j = 0; j <= i; ++j) {
+                                const int irr = irreps[i] ^ irreps[j];
+                                const int a = pairoff[irr] + pairid[i * n + j];
+                                pairs[a][0] = i;
+                                pairs[a][1] = j;
+                        }
+                }
+
+#pragma omp parallel for schedule(dynamic) default(none) \
+                shared(V, Vstart, irreps, pairoff, pairs, npairs, hdat)
+                for (int a = 0; a < npairs; ++a) {
+                        const int irr = irreps[pairs[a][0]] ^ 
+                                irreps[pairs[a][1]];
+                        const long long ij = a - pairoff[irr];
+                        const double * Vrow = V + Vstart[irr] + ij * (ij + 1) / 2;
+                        for (int kl = 0; kl <= ij; ++kl) {
+                                const int * p = pairs[pairoff[irr] + kl];
+                                const long long vid = V_index(pairs[a][0], 
+                                                              pairs[a][1], 
+                                                              p[0], p[1]);
+                                if (vid != -1) { hdat.Vijkl[vid] = Vrow[kl]; }
+                        }
+                }
+                safe_free(pairs);
+                safe_free(V);
+        }
+        safe_free(pairid);
+        safe_free(irreps);
+
+        H5Gclose(group_id);
+        H5Fclose(file_id);
+}
+
+static void read_integrals(double **one_p_int, char fil[])
+{
+        *one_p_int = safe_calloc(hdat.norb * hdat.norb, double);
+        hdat.core_energy = 0;
+        hdat.Vijkl = safe_calloc(hdat.Vsize, double);
+
+        if (QC_is_converted_fcidump(fil))
+                read_h5_integrals(*one_p_int, fil);
+        else
+                read_text_integrals(*one_p_int, fil);
 }
 
 static void form_integrals(double* one_p_int)
 {
-        int i, j, k, l;
+        int i, j, k;
         double pref = 1 / (get_particlestarget() * 1. - 1);
-        int norb2 = hdat.norb * hdat.norb;
-        int norb3 = norb2 * hdat.norb;
 
         for (i = 0; i < hdat.norb; ++i)
                 for (j = 0; j <= i; ++j)
                         one_p_int[i*hdat.norb + j] = one_p_int[j*hdat.norb + i];
 
+        /* (ij|kl) += pref * (h_ij delta_kl + delta_ij h_kl) */
         for (i = 0; i < hdat.norb; ++i)
-                for (j = 0; j <= i; ++j)
-                        for (k = 0; k <= i; ++k)
-                                for (l = 0; l <= k; ++l)
-                                        fillin_Vijkl(i, j, k, l);
-
-        for (i = 0; i < hdat.norb; ++i)
-                for (j = 0; j < hdat.norb; ++j) {
+                for (j = 0; j <= i; ++j) {
                         double pref2 = pref * one_p_int[i * hdat.norb + j];
                         for (k = 0; k < hdat.norb; ++k) {
-                                hdat.Vijkl[i + hdat.norb * j + 
-                                        norb2 * k + norb3 * k] += pref2;
-                                hdat.Vijkl[k + hdat.norb * k + 
-                                        norb2 * i + norb3 * j] += pref2;
+                                const long long vid = V_index(i, j, k, k);
+                                if (vid == -1)
+                                        continue;
+                                /* (ij|kk) and (kk|ij) are the same term */
+                                hdat.Vijkl[vid] += i == j && j == k ? 
+                                        2 * pref2 : pref2;
                         }
                 }
         safe_free(one_p_int);
 }
 
-static void fillin_Vijkl(const int i, const int j, const int k, const int l)
+static void prepare_V_index(void)
 {
-        const int norb2 = hdat.norb * hdat.norb;
-        const int norb3 = norb2 * hdat.norb;
-        const int curr_ind = i + hdat.norb * j + norb2 * k + norb3 * l;
-        const double value = hdat.Vijkl[curr_ind];
+        safe_free(hdat.pairid);
+        hdat.pairid = safe_malloc(hdat.norb * hdat.norb, int);
+        hdat.Vsize = make_pairid(hdat.orbirrep, hdat.pairid, hdat.Vstart);
+}
 
-        if (!COMPARE_ELEMENT_TO_ZERO(value))
-        {
-                hdat.Vijkl[k + hdat.norb * l + norb2 * i + norb3 * j] = value;
-                hdat.Vijkl[j + hdat.norb * i + norb2 * l + norb3 * k] = value;
-                hdat.Vijkl[l + hdat.norb * k + norb2 * j + norb3 * i] = value;
-                hdat.Vijkl[j + hdat.norb * i + norb2 * k + norb3 * l] = value;
-                hdat.Vijkl[l + hdat.norb * k + norb2 * i + norb3 * j] = value;
-                hdat.Vijkl[i + hdat.norb * j + norb2 * l + norb3 * k] = value;
-                hdat.Vijkl[k + hdat.norb * l + norb2 * j + norb3 * i] = value;
+static long long V_index(const int i, const int j, const int k, const int l)
+{
+        const int irr = hdat.orbirrep[i] ^ hdat.orbirrep[j];
+        if (irr != (hdat.orbirrep[k] ^ hdat.orbirrep[l]))
+                return -1;
+
+        const int n = hdat.norb;
+        long long ij = hdat.pairid[i * n + j];
+        long long kl = hdat.pairid[k * n + l];
+        if (ij < kl) {
+                const long long temp = ij;
+                ij = kl;
+                kl = temp;
         }
+        return hdat.Vstart[irr] + ij * (ij + 1) / 2 + kl;
 }
 
 static int check_orbirrep(void)
@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <hdf5.h>
 
 #include "instructions.h"
 #include "instructions_qc.h"
@@ -28,6 +29,8 @@
 #include "macros.h"
 #include "network.h"
 #include "bookkeeper.h"
+#include "opType.h"
+#include "io_to_disk.h"
 
 // instruction set for the physical updates
 static struct instructionset (*iset_pUpdate)[2] = NULL;
@@ -35,6 +38,10 @@ static struct instructionset (*iset_pUpdate)[2] = NULL;
 static struct instructionset (*iset_bUpdate)[2] = NULL;
 // instruction set for the merging
 static struct instructionset (*iset_merge)[2] = NULL;
+// changed every time a set is made, cleared or read
+static int iset_version = 0;
+// the threshold for the screening of the integrals
+static double screening = 0;
 
 //#define PRINT_INSTRUCTIONS
 
@@ -103,6 +110,7 @@ void clear_instructions(void)
                 }
                 safe_free(*instr[i]);
         }
+        ++iset_version;
 }
 
 void destroy_instructionset(struct instructionset * const instructions)
@@ -113,35 +121,90 @@ void destroy_instructionset(struct instructionset * const instructions)
         safe_free(instructions->MPOc_beg);
 }
 
+static void init_isets(struct instructionset (**iset)[2])
+{
+        if (*iset != NULL) { return; }
+        *iset = safe_malloc(netw.nr_bonds, **iset);
+        for (int i = 0; i < netw.nr_bonds; ++i) {
+                (*iset)[i][0] = invalid_instr;
+                (*iset)[i][1] = invalid_instr;
+        }
+}
+
+static void make_pUpdate(struct instructionset * instr, int bond, int is_left)
+{
+        switch(ham) {
+        case QC :
+                QC_fetch_pUpdate(instr, bond, is_left);
+                break;
+        case NN_HUBBARD :
+                NN_H_fetch_pUpdate(instr, bond, is_left);
+                break;
+        case DOCI :
+                DOCI_fetch_pUpdate(instr, bond, is_left);
+                break;
+        default:
+                fprintf(stderr, "%s@%s: Unrecognized Hamiltonian.\n", 
+                        __FILE__, __func__);
+                exit(EXIT_FAILURE);
+        }
+        sort_instructions(instr);
+        instr->MPOc = NULL;
+        instr->MPOc_beg = NULL;
+}
+
+static void make_bUpdate(struct instructionset * instr, int bond, int is_left)
+{
+        switch(ham) {
+        case QC :
+                QC_fetch_bUpdate(instr, bond, is_left);
+                break;
+        case NN_HUBBARD :
+                NN_H_fetch_bUpdate(instr, bond, is_left);
+                break;
+        case DOCI :
+                DOCI_fetch_bUpdate(instr, bond, is_left);
+                break;
+        default:
+                fprintf(stderr, "%s@%s: Unrecognized Hamiltonian.\n", 
+                        __FILE__, __func__);
+                exit(EXIT_FAILURE);
+        }
+        sort_instructions(instr);
+        instr->MPOc = NULL;
+        instr->MPOc_beg = NULL;
+}
+
+/* The MPO combos are not made yet, as they need the symsecs of the
+ * operators. fetch_merge() does this on its first call. */
+static void make_merge(struct instructionset * instr, int bond, int isdmrg)
+{
+        switch(ham) {
+        case QC :
+                QC_fetch_merge(instr, bond, isdmrg);
+                break;
+        case NN_HUBBARD :
+                NN_H_fetch_merge(instr, bond);
+                break;
+        case DOCI :
+                DOCI_fetch_merge(instr, bond, isdmrg);
+                break;
+        default:
+                fprintf(stderr, "%s@%s: Unrecognized Hamiltonian.\n", 
+                        __FILE__, __func__);
+                exit(EXIT_FAILURE);
+        }
+        instr->hss_of_new = NULL;
+        instr->MPOc = NULL;
+        instr->MPOc_beg = NULL;
+}
+
 struct instructionset fetch_pUpdate(int bond, int is_left)
 {
-        if (iset_pUpdate == NULL) {
-                iset_pUpdate = safe_malloc(netw.nr_bonds, *iset_pUpdate);
-                for (int i = 0; i < netw.nr_bonds; ++i) {
-                        iset_pUpdate[i][0] = invalid_instr;
-                        iset_pUpdate[i][1] = invalid_instr;
-                }
-        } 
+        init_isets(&iset_pUpdate);
         if (iset_pUpdate[bond][is_left].nr_instr == -1) {
-                struct instructionset * instr = &iset_pUpdate[bond][is_left];
-                switch(ham) {
-                case QC :
-                        QC_fetch_pUpdate(instr, bond, is_left);
-                        break;
-                case NN_HUBBARD :
-                        NN_H_fetch_pUpdate(instr, bond, is_left);
-                        break;
-                case DOCI :
-                        DOCI_fetch_pUpdate(instr, bond, is_left);
-                        break;
-                default:
-                        fprintf(stderr, "%s@%s: Unrecognized Hamiltonian.\n", 
-                                __FILE__, __func__);
-                        exit(EXIT_FAILURE);
-                }
-                sort_instructions(instr);
-                instr->MPOc = NULL;
-                instr->MPOc_beg = NULL;
+                make_pUpdate(&iset_pUpdate[bond][is_left], bond, is_left);
+                ++iset_version;
         }
 #ifdef PRINT_INSTRUCTIONS
         print_instructions(&iset_pUpdate[bond][is_left], bond, is_left, 'd', 0);
@@ -151,33 +214,10 @@ struct instructionset fetch_pUpdate(int bond, int is_left)
 
 struct instructionset fetch_bUpdate(int bond, int is_left)
 {
-        if (iset_bUpdate == NULL) {
-                iset_bUpdate = safe_malloc(netw.nr_bonds, *iset_bUpdate);
-                for (int i = 0; i < netw.nr_bonds; ++i) {
-                        iset_bUpdate[i][0] = invalid_instr;
-                        iset_bUpdate[i][1] = invalid_instr;
-                }
-        }
+        init_isets(&iset_bUpdate);
         if (iset_bUpdate[bond][is_left].nr_instr == -1) {
-                struct instructionset * instr = &iset_bUpdate[bond][is_left];
-                switch(ham) {
-                case QC :
-                        QC_fetch_bUpdate(instr, bond, is_left);
-                        break;
-                case NN_HUBBARD :
-                        NN_H_fetch_bUpdate(instr, bond, is_left);
-                        break;
-                case DOCI :
-                        DOCI_fetch_bUpdate(instr, bond, is_left);
-                        break;
-                default:
-                        fprintf(stderr, "%s@%s: Unrecognized Hamiltonian.\n", 
-                                __FILE__, __func__);
-                        exit(EXIT_FAILURE);
-                }
-                sort_instructions(instr);
-                instr->MPOc = NULL;
-                instr->MPOc_beg = NULL;
+                make_bUpdate(&iset_bUpdate[bond][is_left], bond, is_left);
+                ++iset_version;
         }
 #ifdef PRINT_INSTRUCTIONS
         print_instructions(&iset_bUpdate[bond][is_left], bond, is_left, 't', 0);
@@ -187,32 +227,14 @@ struct instructionset fetch_bUpdate(int bond, int is_left)
 
 struct instructionset fetch_merge(const int bond, int isdmrg, int ** hss_ops)
 {
-        if (iset_merge == NULL) {
-                iset_merge = safe_malloc(netw.nr_bonds, *iset_merge);
-                for (int i = 0; i < netw.nr_bonds; ++i) {
-                        iset_merge[i][0] = invalid_instr;
-                        iset_merge[i][1] = invalid_instr;
-                }
-        } 
-        if (iset_merge[bond][isdmrg].nr_instr == -1) {
-                struct instructionset * instr = &iset_merge[bond][isdmrg];
-                switch(ham) {
-                case QC :
-                        QC_fetch_merge(instr, bond, isdmrg);
-                        break;
-                case NN_HUBBARD :
-                        NN_H_fetch_merge(instr, bond);
-                        break;
-                case DOCI :
-                        DOCI_fetch_merge(instr, bond, isdmrg);
-                        break;
-                default:
-                        fprintf(stderr, "%s@%s: Unrecognized Hamiltonian.\n", 
-                                __FILE__, __func__);
-                        exit(EXIT_FAILURE);
-                }
+        init_isets(&iset_merge);
+        struct instructionset * instr = &iset_merge[bond][isdmrg];
+        if (instr->nr_instr == -1) {
+                make_merge(instr, bond, isdmrg);
+        }
+        if (instr->MPOc_beg == NULL) {
                 sortinstructions_merge(instr, hss_ops);
-                instr->hss_of_new = NULL;
+                ++iset_version;
         }
 
 #ifdef PRINT_INSTRUCTIONS
@@ -221,6 +243,108 @@ struct instructionset fetch_merge(const int bond, int isdmrg, int ** hss_ops)
         return iset_merge[bond][isdmrg];
 }
 
+void prepare_instructions(void)
+{
+        struct instructionset (**isets[3])[2] = {
+                &iset_pUpdate, &iset_bUpdate, &iset_merge
+        };
+        for (int i = 0; i < 3; ++i) { init_isets(isets[i]); }
+
+        /* The sets to make: kind (0, 1 or 2 for isets), bond and direction */
+        int (*todo)[3] = safe_malloc(3 * netw.nr_bonds, *todo);
+        int nr = 0;
+        for (int bond = 0; bond < netw.nr_bonds; ++bond) {
+                for (int is_left = 0; is_left < 2; ++is_left) {
+                        /* The operators of bond made from site */
+                        const int site = netw.bonds[bond][!is_left];
+                        if (site == -1 || netw.bonds[bond][is_left] == -1) {
+                                continue;
+                        }
+                        if (is_psite(site)) {
+                                int bonds[3];
+                                get_bonds_of_site(site, bonds);
+                                const int prevbond = bonds[2 * !is_left];
+                                if (iset_pUpdate[prevbond][is_left].nr_instr == -1) {
+                                        todo[nr][0] = 0;
+                                        todo[nr][1] = prevbond;
+                                        todo[nr++][2] = is_left;
+                                }
+                        } else if (iset_bUpdate[bond][is_left].nr_instr == -1) {
+                                todo[nr][0] = 1;
+                                todo[nr][1] = bond;
+                                todo[nr++][2] = is_left;
+                        }
+                }
+
+                /* Two-site DMRG merges over bond */
+                if (netw.bonds[bond][0] != -1 && netw.bonds[bond][1] != -1 &&
+                    is_psite(netw.bonds[bond][0]) && 
+                    is_psite(netw.bonds[bond][1]) &&
+                    iset_merge[bond][1].nr_instr == -1) {
+                        todo[nr][0] = 2;
+                        todo[nr][1] = bond;
+                        todo[nr++][2] = 1;
+                }
+        }
+        /* T3NS merges, these are fetched for the first bond of the branching
+         * site */
+        for (int site = 0; site < netw.sites; ++site) {
+                if (is_psite(site)) { continue; }
+                int bonds[3];
+                get_bonds_of_site(site, bonds);
+                if (iset_merge[bonds[0]][0].nr_instr == -1) {
+                        todo[nr][0] = 2;
+                        todo[nr][1] = bonds[0];
+                        todo[nr++][2] = 0;
+                }
+        }
+        if (nr == 0) {
+                safe_free(todo);
+                return;
+        }
+
+        /* Initialize the shared opTypes before the parallel region */
+        struct opType unity;
+        get_unity_opType(&unity);
+
+        /* Every set is made by one thread, the parallel regions inside are
+         * executed by one thread then. */
+#pragma omp parallel for schedule(dynamic) default(none) \
+        shared(todo, nr, iset_pUpdate, iset_bUpdate, iset_merge)
+        for (int i = 0; i < nr; ++i) {
+                const int bond = todo[i][1];
+                const int dir = todo[i][2];
+                switch (todo[i][0]) {
+                case 0:
+                        make_pUpdate(&iset_pUpdate[bond][dir], bond, dir);
+                        break;
+                case 1:
+                        make_bUpdate(&iset_bUpdate[bond][dir], bond, dir);
+                        break;
+                case 2:
+                        make_merge(&iset_merge[bond][dir], bond, dir);
+                        break;
+                }
+        }
+        safe_free(todo);
+        ++iset_version;
+}
+
+void set_integral_screening(double threshold)
+{
+        screening = threshold;
+}
+
+double get_integral_screening(void)
+{
+        return screening;
+}
+
+int instructions_version(void)
+{
+        return iset_version;
+}
+
 int get_next_unique_instr(int * curr_instr, const struct instructionset * set)
 {
         /* instructions->instr is of the form:
@@ -394,8 +518,285 @@ void print_instructions(struct instructionset * instructions, int bond,
         printf("#END INSTR\n");
 }
 
+/* ========================================================================== */
+/* =========================== READING AND WRITING ========================== */
+/* ========================================================================== */
+
+/* The instructions are stored compact. Every instruction is encoded as the
+ * differences of its indices with the previous instruction followed by the
+ * index of its prefactor in a table of the unique prefactors. These numbers
+ * are written as zigzag variable length integers in a byte array. */
+
+static unsigned char * put_varint(unsigned char * p, long long v)
+{
+        unsigned long long u = ((unsigned long long) v << 1) ^ 
+                (unsigned long long) (v >> 63);
+        while (u >= 0x80) {
+                *p++ = (unsigned char) (u | 0x80);
+                u >>= 7;
+        }
+        *p++ = (unsigned char) u;
+        return p;
+}
+
+static const unsigned char * get_varint(const unsigned char * p, 
+                                        long long * v)
+{
+        unsigned long long u = 0;
+        int shift = 0;
+        do {
+                u |= (unsigned long long) (*p & 0x7f) << shift;
+                shift += 7;
+        } while (*p++ & 0x80);
+        *v = (long long) (u >> 1) ^ -(long long) (u & 1);
+        return p;
+}
+
+/* Hashes the bit pattern of a prefactor */
+static unsigned long long hash_pref(double pref)
+{
+        unsigned long long bits;
+        memcpy(&bits, &pref, sizeof bits);
+        bits ^= bits >> 33;
+        bits *= 0xff51afd7ed558ccdULL;
+        bits ^= bits >> 33;
+        return bits;
+}
+
+/* Makes the table of unique prefactors and the index of every instruction
+ * in it. Returns the number of unique prefactors. */
+static int unique_prefs(const struct instructionset * set, double * prefs,
+                        int * id)
+{
+        long long size = 16;
+        while (size < 2LL * set->nr_instr) { size *= 2; }
+        int * table = safe_malloc(size, int);
+        for (long long i = 0; i < size; ++i) { table[i] = -1; }
+
+        int nr = 0;
+        for (int i = 0; i < set->nr_instr; ++i) {
+                const double pref = set->instr[i].pref;
+                long long h = hash_pref(pref) & (size - 1);
+                while (table[h] != -1 && 
+                       memcmp(&prefs[table[h]], &pref, sizeof pref) != 0) {
+                        h = (h + 1) & (size - 1);
+                }
+                if (table[h] == -1) {
+                        table[h] = nr;
+                        prefs[nr++] = pref;
+                }
+                id[i] = table[h];
+        }
+        safe_free(table);
+        return nr;
+}
+
+static void write_instructionset(hid_t id, const char name[], 
+                                 const struct instructionset * set)
+{
+        const hid_t group_id = H5Gcreate(id, name, H5P_DEFAULT, H5P_DEFAULT, 
+                                         H5P_DEFAULT);
+        write_attribute(group_id, "nr_instr", &set->nr_instr, 1, THDF5_INT);
+        write_attribute(group_id, "step", &set->step, 1, THDF5_INT);
+
+        double * prefs = safe_malloc(set->nr_instr, double);
+        int * prefid = safe_malloc(set->nr_instr, int);
+        const int nrprefs = unique_prefs(set, prefs, prefid);
+
+        unsigned char * code = safe_malloc(set->nr_instr * 
+                                           (5LL * set->step + 5), 
+                                           unsigned char);
+        unsigned char * p = code;
+        int nr_new = 0;
+        for (int i = 0; i < set->nr_instr; ++i) {
+                for (int j = 0; j < set->step; ++j) {
+                        const int prev = i == 0 ? 0 : set->instr[i - 1].instr[j];
+                        p = put_varint(p, set->instr[i].instr[j] - prev);
+                }
+                p = put_varint(p, prefid[i]);
+                if (nr_new <= set->instr[i].instr[2]) {
+                        nr_new = set->instr[i].instr[2] + 1;
+                }
+        }
+        write_dataset(group_id, "./code", code, p - code, THDF5_BYTE);
+        write_dataset(group_id, "./prefs", prefs, nrprefs, THDF5_DOUBLE);
+        safe_free(code);
+        safe_free(prefs);
+        safe_free(prefid);
+
+        /* Only the symsecs of the made operators are used */
+        if (set->hss_of_new != NULL) {
+                write_dataset(group_id, "./hss_of_new", set->hss_of_new, 
+                              nr_new, THDF5_INT);
+        }
+        /* The MPO combos of a merge, if already made */
+        if (set->MPOc_beg != NULL) {
+                write_attribute(group_id, "nrMPOc", &set->nrMPOc, 1, 
+                                THDF5_INT);
+                write_dataset(group_id, "./MPOc", set->MPOc, set->nrMPOc, 
+                              THDF5_INT);
+                write_dataset(group_id, "./MPOc_beg", set->MPOc_beg, 
+                              set->nrMPOc + 1, THDF5_INT);
+        }
+        H5Gclose(group_id);
+}
+
+static void read_instructionset(hid_t id, const char name[], 
+                                struct instructionset * set)
+{
+        const hid_t group_id = H5Gopen(id, name, H5P_DEFAULT);
+        *set = invalid_instr;
+        read_attribute(group_id, "nr_instr", &set->nr_instr);
+        read_attribute(group_id, "step", &set->step);
+        if (set->nr_instr != 0) {
+                set->instr = safe_malloc(set->nr_instr, *set->instr);
+                const hid_t dataset_id = H5Dopen(group_id, "./code", 
+                                                 H5P_DEFAULT);
+                const hid_t space_id = H5Dget_space(dataset_id);
+                const hsize_t size = H5Sget_simple_extent_npoints(space_id);
+                H5Sclose(space_id);
+                H5Dclose(dataset_id);
+
+                unsigned char * code = safe_malloc(size, unsigned char);
+                double * prefs = safe_malloc(set->nr_instr, double);
+                read_dataset(group_id, "./code", code);
+                read_dataset(group_id, "./prefs", prefs);
+
+                const unsigned char * p = code;
+                for (int i = 0; i < set->nr_instr; ++i) {
+                        long long v;
+                        for (int j = 0; j < set->step; ++j) {
+                                const int prev = i == 0 ? 0 : 
+                                        set->instr[i - 1].instr[j];
+                                p = get_varint(p, &v);
+                                set->instr[i].instr[j] = prev + (int) v;
+                        }
+                        for (int j = set->step; j < 3; ++j) {
+                                set->instr[i].instr[j] = 0;
+                        }
+                        p = get_varint(p, &v);
+                        set->instr[i].pref = prefs[v];
+                }
+                assert(p == code + size);
+                safe_free(code);
+                safe_free(prefs);
+        }
+
+        if (H5Lexists(group_id, "./hss_of_new", H5P_DEFAULT) > 0) {
+                const hid_t dataset_id = H5Dopen(group_id, "./hss_of_new", 
+                                                 H5P_DEFAULT);
+                const hid_t space_id = H5Dget_space(dataset_id);
+                const hsize_t size = H5Sget_simple_extent_npoints(space_id);
+                H5Sclose(space_id);
+                H5Dclose(dataset_id);
+                set->hss_of_new = safe_malloc(size, int);
+                read_dataset(group_id, "./hss_of_new", set->hss_of_new);
+        }
+        if (H5Aexists(group_id, "nrMPOc") > 0) {
+                read_attribute(group_id, "nrMPOc", &set->nrMPOc);
+                set->MPOc = safe_malloc(set->nrMPOc, int);
+                set->MPOc_beg = safe_malloc(set->nrMPOc + 1, int);
+                if (set->nrMPOc != 0) {
+                        read_dataset(group_id, "./MPOc", set->MPOc);
+                }
+                read_dataset(group_id, "./MPOc_beg", set->MPOc_beg);
+        }
+        H5Gclose(group_id);
+}
+
+static const char * iset_names[] = { "pUpdate", "bUpdate", "merge" };
+
+void write_instructions_to_disk(const hid_t id)
+{
+        struct instructionset (*isets[3])[2] = {
+                iset_pUpdate, iset_bUpdate, iset_merge
+        };
+        const hid_t group_id = H5Gcreate(id, "./instructions", H5P_DEFAULT, 
+                                         H5P_DEFAULT, H5P_DEFAULT);
+        write_attribute(group_id, "nr_bonds", &netw.nr_bonds, 1, THDF5_INT);
+        write_attribute(group_id, "ham", &ham, 1, THDF5_INT);
+        write_attribute(group_id, "screening", &screening, 1, THDF5_DOUBLE);
+        write_dataset(group_id, "./sitetoorb", netw.sitetoorb, netw.sites, 
+                      THDF5_INT);
+
+        for (int k = 0; k < 3; ++k) {
+                if (isets[k] == NULL) { continue; }
+                for (int bond = 0; bond < netw.nr_bonds; ++bond) {
+                        for (int dir = 0; dir < 2; ++dir) {
+                                if (isets[k][bond][dir].nr_instr == -1) {
+                                        continue;
+                                }
+                                char name[64];
+                                sprintf(name, "./%s_%d_%d", iset_names[k], 
+                                        bond, dir);
+                                write_instructionset(group_id, name, 
+                                                     &isets[k][bond][dir]);
+                        }
+                }
+        }
+        H5Gclose(group_id);
+}
+
+int read_instructions_from_disk(const hid_t id)
+{
+        if (H5Lexists(id, "./instructions", H5P_DEFAULT) <= 0) { return 0; }
+        const hid_t group_id = H5Gopen(id, "./instructions", H5P_DEFAULT);
+
+        /* The sets are only valid for the same network, orbital order and
+         * screening */
+        int nr_bonds;
+        int h;
+        double screen = 0;
+        read_attribute(group_id, "nr_bonds", &nr_bonds);
+        read_attribute(group_id, "ham", &h);
+        if (H5Aexists(group_id, "screening") > 0) {
+                read_attribute(group_id, "screening", &screen);
+        }
+        int valid = nr_bonds == netw.nr_bonds && h == (int) ham && 
+                screen == screening;
+        if (valid) {
+                int * sitetoorb = safe_malloc(netw.sites, int);
+                read_dataset(group_id, "./sitetoorb", sitetoorb);
+                valid = memcmp(sitetoorb, netw.sitetoorb, 
+                               netw.sites * sizeof *sitetoorb) == 0;
+                safe_free(sitetoorb);
+        }
+        if (!valid) {
+                H5Gclose(group_id);
+                return 0;
+        }
+
+        clear_instructions();
+        struct instructionset (**isets[3])[2] = {
+                &iset_pUpdate, &iset_bUpdate, &iset_merge
+        };
+        int nr = 0;
+        for (int k = 0; k < 3; ++k) {
+                init_isets(isets[k]);
+                for (int bond = 0; bond < netw.nr_bonds; ++bond) {
+                        for (int dir = 0; dir < 2; ++dir) {
+                                char name[64];
+                                sprintf(name, "./%s_%d_%d", iset_names[k], 
+                                        bond, dir);
+                                if (H5Lexists(group_id, name, 
+                                              H5P_DEFAULT) <= 0) {
+                                        continue;
+                                }
+                                read_instructionset(group_id, name, 
+                                                    &(*isets[k])[bond][dir]);
+                                ++nr;
+                        }
+                }
+        }
+        H5Gclose(group_id);
+        ++iset_version;
+        return nr;
+}
+
+/* Instruction sets of different bonds are made concurrently */
 static int insrno;
 static struct instructionset * instr;
+#pragma omp threadprivate(insrno, instr)
 
 void start_fill_instruction(struct instructionset * instructions, int step)
 {
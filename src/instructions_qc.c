@@ -17,6 +17,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include <math.h>
 #include <omp.h>
 
 #include "instructions.h"
@@ -54,28 +55,220 @@ static void add_instruction(struct instructionset * instructions,
         instructions->instr[instructions->nr_instr - 1].pref = val;
 }
 
-struct instruction_data {
-        int size;
-        int (*offset)[3];
-        int (*amount)[3];
-        long long * start_combine;
+/* The (creator, position) pairs of the tags of an operator */
+struct tag_key {
+        unsigned long long key;
+        int id;
 };
 
-static struct instruction_data get_instruction_data(const struct opType * ops, 
-                                                    char c)
+/* A block of operator combinations with a fixed number of operators and
+ * normal/complementary type on every leg. */
+struct combine_block {
+        int offset[3];
+        int amount[3];
+        int nrop[3];
+        int typ[3];
+        /* The leg whose tags are the union of the tags of the other legs, 
+         * -1 if there is no such leg. */
+        int sumleg;
+        /* The prefactors are integrals which are screened. */
+        int screen;
+        /* The number of items to try. */
+        long long size;
+        /* The sorted keys of the operators on sumleg. */
+        struct tag_key * keys;
+        /* For screened blocks, the number of tags and the operators sorted by
+         * their orbitals on every leg. */
+        int nr_tags[3];
+        struct tag_key * orbkeys[3];
+        /* For screened blocks, bit j is set for the orbitals on leg j. */
+        unsigned char * legs;
+        /* For screened blocks, the quadruples of orbitals to try. */
+        const unsigned long long * quads;
+};
+
+static int compare_tag_key(const void * a, const void * b)
+{
+        const struct tag_key * aa = a;
+        const struct tag_key * bb = b;
+        return (aa->key > bb->key) - (aa->key < bb->key);
+}
+
+/* Adds the (creator, position) pairs of the tags of an operator, sorted */
+static int add_tag_pairs(unsigned int pairs[2], int nr, const int * tags,
+                         int nr_tags, int base_t)
+{
+        assert(nr + nr_tags <= 2);
+        for (int i = 0; i < nr_tags; ++i, ++nr) {
+                const unsigned int p = 2 * tags[i * base_t + 1] + 
+                        tags[i * base_t] + 1;
+                int j;
+                for (j = nr; j > 0 && pairs[j - 1] > p; --j) {
+                        pairs[j] = pairs[j - 1];
+                }
+                pairs[j] = p;
+        }
+        return nr;
+}
+
+static unsigned long long pairs_to_key(const unsigned int pairs[2], int nr)
+{
+        switch (nr) {
+        case 0:
+                return 0;
+        case 1:
+                return pairs[0];
+        default:
+                return (unsigned long long) pairs[0] << 32 | pairs[1];
+        }
+}
+
+/* Adds the (creator, position) pairs of operator k of the given block and leg
+ * to pairs. Returns the new number of pairs. */
+static int operator_pairs(const struct opType * ops, 
+                          const struct combine_block * b, int leg, int k,
+                          unsigned int pairs[2], int nr)
+{
+        const int * tags;
+        int nr_tags, base_t;
+        get_opType_tag(&ops[leg], b->nrop[leg], b->typ[leg], k, &tags,
+                       &nr_tags, &base_t);
+        return add_tag_pairs(pairs, nr, tags, nr_tags, base_t);
+}
+
+/* The sorted orbitals of operator k of the given block and leg, every orbital
+ * plus one in 16 bits. */
+static unsigned long long orbital_key(const struct opType * ops, 
+                                      const struct combine_block * b, int leg,
+                                      int k)
+{
+        const int * tags;
+        int nr_tags, base_t;
+        get_opType_tag(&ops[leg], b->nrop[leg], b->typ[leg], k, &tags,
+                       &nr_tags, &base_t);
+        assert(nr_tags <= 4);
+
+        int orb[4];
+        for (int i = 0; i < nr_tags; ++i) {
+                int j;
+                for (j = i; j > 0 && orb[j - 1] > tags[i * base_t + 1]; --j) {
+                        orb[j] = orb[j - 1];
+                }
+                orb[j] = tags[i * base_t + 1];
+        }
+        unsigned long long key = 0;
+        for (int i = 0; i < nr_tags; ++i) { key = key << 16 | (orb[i] + 1); }
+        return key;
+}
+
+/* First element of the sorted keys with the given key */
+static int lower_key(const struct tag_key * keys, int n, 
+                     unsigned long long key)
+{
+        int lo = 0, hi = n;
+        while (lo < hi) {
+                const int mid = (lo + hi) / 2;
+                if (keys[mid].key < key) {
+                        lo = mid + 1;
+                } else {
+                        hi = mid;
+                }
+        }
+        return lo;
+}
+
+/* Sorts the operators of a leg of the block by the given keys */
+static struct tag_key * sorted_keys(const struct opType * ops, 
+                                    const struct combine_block * b, int leg,
+                                    int by_orbital)
+{
+        struct tag_key * keys = safe_malloc(b->amount[leg], *keys);
+        for (int k = 0; k < b->amount[leg]; ++k) {
+                if (by_orbital) {
+                        keys[k].key = orbital_key(ops, b, leg, k);
+                } else {
+                        unsigned int pairs[2];
+                        const int n = operator_pairs(ops, b, leg, k, pairs, 0);
+                        keys[k].key = pairs_to_key(pairs, n);
+                }
+                keys[k].id = k;
+        }
+        qsort(keys, b->amount[leg], sizeof *keys, compare_tag_key);
+        return keys;
+}
+
+/* Prepares the lookup of the operators for every quadruple of orbitals */
+static void prepare_screened_block(const struct opType * ops, 
+                                   struct combine_block * b)
+{
+        b->legs = safe_calloc(netw.psites, *b->legs);
+        int sum_tags = 0;
+        for (int j = 0; j < 3; ++j) {
+                const int * tags;
+                int base_t;
+                get_opType_tag(&ops[j], b->nrop[j], b->typ[j], 0, &tags,
+                               &b->nr_tags[j], &base_t);
+                sum_tags += b->nr_tags[j];
+
+                b->orbkeys[j] = sorted_keys(ops, b, j, 1);
+                for (int k = 0; k < b->amount[j]; ++k) {
+                        get_opType_tag(&ops[j], b->nrop[j], b->typ[j], k, 
+                                       &tags, &b->nr_tags[j], &base_t);
+                        for (int i = 0; i < b->nr_tags[j]; ++i) {
+                                b->legs[tags[i * base_t + 1]] |= 1 << j;
+                        }
+                }
+        }
+        assert(sum_tags == 4);
+}
+
+/* Decides which combinations of normal and complementary operators can give
+ * an instruction, mirroring interactval(). Returns 0 if none can. */
+static int block_kind(struct combine_block * b, char c)
+{
+        const int sumtyp = b->typ[0] + b->typ[1] + b->typ[2];
+        b->sumleg = -1;
+        b->screen = 0;
+        if (c == 't' || c == 'd') {
+                if (sumtyp != 1) { return 0; }
+                b->sumleg = b->typ[1] + 2 * b->typ[2];
+                return 1;
+        }
+
+        const int outpleg = c - '1';
+        if (sumtyp == 0) {
+                b->sumleg = outpleg;
+        } else if (sumtyp == 1 && b->typ[outpleg]) {
+                b->screen = 1;
+        } else if (sumtyp == 2 && b->typ[outpleg]) {
+                b->sumleg = (b->typ[1] && outpleg != 1) + 
+                        2 * (b->typ[2] && outpleg != 2);
+        } else {
+                return 0;
+        }
+        return 1;
+}
+
+/* Makes the blocks of operators that can possibly combine.
+ *
+ * For the blocks where the tags of one leg are the union of the tags of the
+ * other two legs, only the operators with matching tags are looked up for
+ * every pair of operators on the other legs, instead of trying all the
+ * operators of that leg.
+ *
+ * For the blocks with screened integrals, the non-zero integrals are visited
+ * instead, see combine_quadruple(). */
+static int get_combine_blocks(const struct opType * ops, char c,
+                              const unsigned long long * quads, 
+                              long long nr_quads, 
+                              struct combine_block ** blocks)
 {
-        struct instruction_data result;
         const int (*operator_array)[3];
-        result.size = get_combine_array(&operator_array);
-        result.offset = safe_malloc(result.size, *result.offset);
-        result.amount = safe_malloc(result.size, *result.amount);
-        result.start_combine = safe_malloc(result.size + 1, 
-                                           *result.start_combine);
-
-        // Get the maximal number of instructions. Really worst case scenario.
-        result.start_combine[0] = 0;
-        for (int i = 0; i < result.size; ++i) {
-                long long nr = 1;
+        const int size = get_combine_array(&operator_array);
+        *blocks = safe_malloc(size * 8, **blocks);
+        int nr = 0;
+
+        for (int i = 0; i < size; ++i) {
                 int opn[3] = {
                         operator_array[i][0],
                         operator_array[i][1],
@@ -85,41 +278,46 @@ static struct instruction_data get_instruction_data(const struct opType * ops,
                         opn[c - '1'] = 4 - opn[c - '1'];
                 }
 
-                for (int j = 0; j < 3; ++j) {
-                        range_opType(&result.offset[i][j], 
-                                     &result.amount[i][j],
-                                     &ops[j], opn[j]);
-                        nr *= result.amount[i][j];
+                for (int t = 0; t < 8; ++t) {
+                        struct combine_block * b = &(*blocks)[nr];
+                        b->size = 1;
+                        for (int j = 0; j < 3; ++j) {
+                                b->nrop[j] = opn[j];
+                                b->typ[j] = (t >> j) & 1;
+                                b->offset[j] = ops[j].begin_opType[2 * opn[j] + 
+                                        b->typ[j]];
+                                b->amount[j] = amount_opType(&ops[j], opn[j], 
+                                        (char) (b->typ[j] ? 'c' : 'n'));
+                                b->size *= b->amount[j];
+                        }
+                        if (b->size == 0 || !block_kind(b, c)) { continue; }
+
+                        b->keys = NULL;
+                        b->orbkeys[0] = b->orbkeys[1] = b->orbkeys[2] = NULL;
+                        b->legs = NULL;
+                        b->quads = quads;
+                        if (b->sumleg != -1) {
+                                b->size /= b->amount[b->sumleg];
+                                b->keys = sorted_keys(ops, b, b->sumleg, 0);
+                        } else {
+                                assert(b->screen);
+                                b->size = nr_quads;
+                                prepare_screened_block(ops, b);
+                        }
+                        ++nr;
                 }
-                result.start_combine[i + 1] = result.start_combine[i] + nr;
         }
-        return result;
+        return nr;
 }
 
-static void free_instruction_data(struct instruction_data * dat)
+static void destroy_combine_blocks(struct combine_block * blocks, int nr)
 {
-        safe_free(dat->offset);
-        safe_free(dat->amount);
-        safe_free(dat->start_combine);
-}
-
-static void id_to_curr_instr(long long id, int * curr_instr, 
-                             const struct instruction_data * data)
-{
-        int i;
-        for (i = 0; i < data->size; ++i) {
-                if (data->start_combine[i + 1] > id) { break; }
+        for (int i = 0; i < nr; ++i) { 
+                safe_free(blocks[i].keys); 
+                for (int j = 0; j < 3; ++j) { safe_free(blocks[i].orbkeys[j]); }
+                safe_free(blocks[i].legs);
         }
-        assert(i != data->size);
-
-        id -= data->start_combine[i];
-        assert(id >= 0);
-        curr_instr[0] = id % data->amount[i][0] + data->offset[i][0];
-        id /= data->amount[i][0];
-        curr_instr[1] = id % data->amount[i][1] + data->offset[i][1];
-        id /= data->amount[i][1];
-        curr_instr[2] = id + data->offset[i][2];
-        assert(id < data->amount[i][2]);
+        safe_free(blocks);
 }
 
 static void add_instruction_thread(int * curr_instr, double val, 
@@ -144,6 +342,129 @@ static void add_instruction_thread(int * curr_instr, double val,
         ++*t_nr;
 }
 
+/* Tries the operators of which the tags are the given quadruple of orbitals.
+ *
+ * For every distribution of the orbitals over the legs, the operators with
+ * exactly these orbitals are looked up on every leg. */
+static void combine_quadruple(const struct opType * ops, char c, 
+                              const struct combine_block * b, 
+                              unsigned long long quad, const int * order, 
+                              double screening, struct instruction ** t_instr,
+                              int * meml, int * t_nr)
+{
+        static const int nr_bits[16] = {
+                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+        };
+        int q[4];
+        int onlegs[4];
+        for (int i = 3; i >= 0; --i, quad >>= 16) {
+                q[i] = (int) (quad & 0xFFFF) - 1;
+                onlegs[i] = b->legs[q[i]];
+                if (!onlegs[i]) { return; }
+        }
+
+        unsigned long long seen[12][3];
+        int nr_seen = 0;
+        for (int m0 = 0; m0 < 16; ++m0) {
+                if (nr_bits[m0] != b->nr_tags[0]) { continue; }
+                for (int m1 = 0; m1 < 16; ++m1) {
+                        if (nr_bits[m1] != b->nr_tags[1] || (m0 & m1)) { 
+                                continue; 
+                        }
+                        const int mask[3] = {m0, m1, 15 & ~(m0 | m1)};
+
+                        unsigned long long key[3] = {0, 0, 0};
+                        int ok = 1;
+                        for (int i = 0; i < 4 && ok; ++i) {
+                                const int j = (mask[0] >> i & 1) ? 0 :
+                                        (mask[1] >> i & 1) ? 1 : 2;
+                                ok = onlegs[i] >> j & 1;
+                                key[j] = key[j] << 16 | (q[i] + 1);
+                        }
+                        /* Repeated orbitals give the same distribution */
+                        for (int s = 0; s < nr_seen && ok; ++s) {
+                                ok = seen[s][0] != key[0] || 
+                                        seen[s][1] != key[1] || 
+                                        seen[s][2] != key[2];
+                        }
+                        if (!ok) { continue; }
+                        assert(nr_seen < 12);
+                        for (int j = 0; j < 3; ++j) { 
+                                seen[nr_seen][j] = key[j]; 
+                        }
+                        ++nr_seen;
+
+                        int lo[3], hi[3];
+                        for (int j = 0; j < 3 && ok; ++j) {
+                                lo[j] = lower_key(b->orbkeys[j], b->amount[j],
+                                                  key[j]);
+                                hi[j] = lo[j];
+                                while (hi[j] < b->amount[j] && 
+                                       b->orbkeys[j][hi[j]].key == key[j]) {
+                                        ++hi[j];
+                                }
+                                ok = hi[j] != lo[j];
+                        }
+                        if (!ok) { continue; }
+
+                        int curr_instr[3];
+                        double val;
+                        for (int k0 = lo[0]; k0 < hi[0]; ++k0)
+                        for (int k1 = lo[1]; k1 < hi[1]; ++k1)
+                        for (int k2 = lo[2]; k2 < hi[2]; ++k2) {
+                                const int k[3] = {k0, k1, k2};
+                                for (int j = 0; j < 3; ++j) {
+                                        curr_instr[j] = b->offset[j] + 
+                                                b->orbkeys[j][k[j]].id;
+                                }
+                                if (interactval(curr_instr, ops, c, &val) &&
+                                    fabs(val) >= screening) {
+                                        add_instruction_thread(curr_instr, val,
+                                                               order, t_instr,
+                                                               meml, t_nr);
+                                }
+                        }
+                }
+        }
+}
+
+/* Tries the combinations of item i of a block */
+static void combine_block_item(const struct opType * ops, char c, 
+                               const struct combine_block * b, long long i,
+                               const int * order, double screening,
+                               struct instruction ** t_instr, int * meml, 
+                               int * t_nr)
+{
+        int curr_instr[3];
+        double val;
+        if (b->sumleg == -1) {
+                combine_quadruple(ops, c, b, b->quads[i], order, screening,
+                                  t_instr, meml, t_nr);
+                return;
+        }
+
+        const int s = b->sumleg;
+        const int o[2] = {s == 0, 1 + (s != 2)};
+        const int k[2] = {i % b->amount[o[0]], i / b->amount[o[0]]};
+        unsigned int pairs[2];
+        int nr = operator_pairs(ops, b, o[0], k[0], pairs, 0);
+        nr = operator_pairs(ops, b, o[1], k[1], pairs, nr);
+        const unsigned long long key = pairs_to_key(pairs, nr);
+
+        /* First operator with the same key */
+        int lo = lower_key(b->keys, b->amount[s], key);
+
+        curr_instr[o[0]] = k[0] + b->offset[o[0]];
+        curr_instr[o[1]] = k[1] + b->offset[o[1]];
+        for (; lo < b->amount[s] && b->keys[lo].key == key; ++lo) {
+                curr_instr[s] = b->keys[lo].id + b->offset[s];
+                if (interactval(curr_instr, ops, c, &val)) {
+                        add_instruction_thread(curr_instr, val, order,
+                                               t_instr, meml, t_nr);
+                }
+        }
+}
+
 static void append_instructions(struct instructionset * instructions,
                                 struct instruction * instr, int nr)
 {
@@ -172,18 +493,26 @@ static void append_instructions(struct instructionset * instructions,
                 safe_free(instr);
         }
 }
-
 static void combine_all_operators(const struct opType * const ops, const char c,
                                   struct instructionset * const instructions,
                                   const int * const order)
 {
         assert(c == '1' || c == '2' || c == '3' || c == 't' || c == 'd');
-        struct instruction_data data = get_instruction_data(ops, c);
+        const double screening = get_integral_screening();
+        /* Every screened prefactor is a sum of at most two integrals with a
+         * factor of at most sqrt(3) in front. */
+        unsigned long long * quads;
+        const long long nr_quads = QC_interacting_quadruples(screening / 4,
+                                                             &quads);
+        struct combine_block * blocks;
+        const int nr_blocks = get_combine_blocks(ops, c, quads, nr_quads,
+                                                 &blocks);
         instructions->nr_instr = 0;
         instructions->instr = NULL;
-        const long long max_instr = data.start_combine[data.size];
+        long long max_instr = 0;
+        for (int b = 0; b < nr_blocks; ++b) { max_instr += blocks[b].size; }
 
-#pragma omp parallel default(none) shared(data)
+#pragma omp parallel default(none) shared(blocks, max_instr)
         {
                 // First, for every thread, allocate some working memory
                 // for the instructions.
@@ -192,14 +521,12 @@ static void combine_all_operators(const struct opType * const ops, const char c,
                 struct instruction * t_instr = safe_malloc(meml, *t_instr);
                 int t_nr = 0;
 
-#pragma omp for schedule(guided)
-                for (long long i = 0; i < max_instr; ++i) {
-                        int curr_instr[3];
-                        double val;
-                        id_to_curr_instr(i, curr_instr, &data);
-                        if (interactval(curr_instr, ops, c, &val)) {
-                                add_instruction_thread(curr_instr, val, order,
-                                                       &t_instr, &meml, &t_nr);
+                for (int b = 0; b < nr_blocks; ++b) {
+#pragma omp for schedule(guided) nowait
+                        for (long long i = 0; i < blocks[b].size; ++i) {
+                                combine_block_item(ops, c, &blocks[b], i, 
+                                                   order, screening, &t_instr,
+                                                   &meml, &t_nr);
                         }
                 }
 
@@ -207,7 +534,8 @@ static void combine_all_operators(const struct opType * const ops, const char c,
                 append_instructions(instructions, t_instr, t_nr);
         }
 
-        free_instruction_data(&data);
+        destroy_combine_blocks(blocks, nr_blocks);
+        safe_free(quads);
 }
 
 void QC_fetch_pUpdate(struct instructionset * instructions, 
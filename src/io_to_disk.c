@@ -20,6 +20,11 @@
 #include <hdf5.h>
 #include <unistd.h>
 #include <omp.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include "io_to_disk.h"
 #include "sparseblocks.h"
@@ -31,6 +36,7 @@
 #include "macros.h"
 #include <assert.h>
 #include "hamiltonian.h"
+#include "instructions.h"
 
 static void write_symsec_to_disk(const hid_t id, const struct symsecs * const 
                                  ssec, const int nmbr, char kind)
@@ -166,9 +172,129 @@ static void write_sparseblocks_to_disk(const hid_t id,
         H5Gclose(group_id);
 }
 
+/* Files from which the tensors are mapped by read_from_disk().
+ *
+ * The files are mapped privately, thus the tensors can be changed in memory.
+ * A mapping is removed when all the tensors pointing in it are destroyed. */
+static struct {
+        struct tel_mapping {
+                char name[MY_STRING_LEN];
+                char * mem;
+                size_t size;
+                /* Number of arrays pointing in the mapping */
+                int users;
+        } * map;
+        int nr;
+        int cap;
+        pthread_mutex_t lock;
+} telmaps = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static struct tel_mapping * get_tel_mapping(const char name[])
+{
+        for (int i = 0; i < telmaps.nr; ++i) {
+                if (strcmp(telmaps.map[i].name, name) == 0) { 
+                        return &telmaps.map[i]; 
+                }
+        }
+
+        const int fd = open(name, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+                if (fd >= 0) { close(fd); }
+                return NULL;
+        }
+        void * mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, 
+                          MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) { return NULL; }
+
+        if (telmaps.nr == telmaps.cap) {
+                telmaps.cap = telmaps.cap == 0 ? 8 : 2 * telmaps.cap;
+                telmaps.map = realloc(telmaps.map, 
+                                      telmaps.cap * sizeof *telmaps.map);
+                if (telmaps.map == NULL) {
+                        fprintf(stderr, "Error %s:%d: failed realloc.\n",
+                                __FILE__, __LINE__);
+                        exit(EXIT_FAILURE);
+                }
+        }
+        struct tel_mapping * tm = &telmaps.map[telmaps.nr++];
+        strncpy(tm->name, name, MY_STRING_LEN - 1);
+        tm->name[MY_STRING_LEN - 1] = '\0';
+        tm->mem = mem;
+        tm->size = st.st_size;
+        tm->users = 0;
+        return tm;
+}
+
+/* Returns the elements of the dataset as a pointer in the mapped file, or
+ * NULL if the dataset can not be mapped. This is the case for datasets that
+ * are not contiguous, not aligned or not stored in the native type. */
+static EL_TYPE * map_tel_dataset(const hid_t id, const char datname[], 
+                                 const int N)
+{
+        const hid_t dataset_id = H5Dopen(id, datname, H5P_DEFAULT);
+        const hid_t datatype = H5Dget_type(dataset_id);
+        const haddr_t offset = H5Dget_offset(dataset_id);
+        const int native = H5Tequal(datatype, EL_TYPE_H5_NATIVE) > 0;
+        H5Tclose(datatype);
+        H5Dclose(dataset_id);
+        if (!native || offset == HADDR_UNDEF || offset % sizeof(EL_TYPE) != 0) {
+                return NULL;
+        }
+
+        char name[MY_STRING_LEN];
+        if (H5Fget_name(id, name, MY_STRING_LEN) <= 0) { return NULL; }
+
+        pthread_mutex_lock(&telmaps.lock);
+        struct tel_mapping * tm = get_tel_mapping(name);
+        EL_TYPE * result = NULL;
+        if (tm != NULL && offset + N * sizeof(EL_TYPE) <= tm->size) {
+                result = (EL_TYPE *) (tm->mem + offset);
+                ++tm->users;
+        }
+        pthread_mutex_unlock(&telmaps.lock);
+        return result;
+}
+
+static void remove_tel_mapping(int i)
+{
+        munmap(telmaps.map[i].mem, telmaps.map[i].size);
+        telmaps.map[i] = telmaps.map[--telmaps.nr];
+}
+
+/* Unmaps the files of which no tensors are used. */
+static void prune_tel_mappings(void)
+{
+        pthread_mutex_lock(&telmaps.lock);
+        for (int i = telmaps.nr - 1; i >= 0; --i) {
+                if (telmaps.map[i].users == 0) { remove_tel_mapping(i); }
+        }
+        pthread_mutex_unlock(&telmaps.lock);
+}
+
+int release_mapped_memory(const void * ptr)
+{
+        if (ptr == NULL) { return 0; }
+        const char * p = ptr;
+        int found = 0;
+        pthread_mutex_lock(&telmaps.lock);
+        for (int i = 0; i < telmaps.nr; ++i) {
+                struct tel_mapping * tm = &telmaps.map[i];
+                if (p >= tm->mem && p < tm->mem + tm->size) {
+                        found = 1;
+                        if (--tm->users == 0) { remove_tel_mapping(i); }
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&telmaps.lock);
+        return found;
+}
+
 static void read_sparseblocks_from_disk(const hid_t id, 
                                        struct sparseblocks * block, 
-                                       const int nrblocks, const int nmbr)
+                                       const int nrblocks, const int nmbr,
+                                       const int map)
 {
         char buffer[255];
         sprintf(buffer, "./block_%d", nmbr);
@@ -191,10 +317,13 @@ static void read_sparseblocks_from_disk(const hid_t id,
         block->beginblock = safe_malloc(nrblocks + 1, int);
         read_dataset(group_id, "./beginblock", block->beginblock);
 
-        if (block->beginblock[nrblocks] == 0) {
-                block->tel = NULL;
-        } else {
-                block->tel = safe_malloc(block->beginblock[nrblocks], EL_TYPE);
+        const int N = block->beginblock[nrblocks];
+        block->tel = NULL;
+        if (N != 0 && map) {
+                block->tel = map_tel_dataset(group_id, "./tel", N);
+        }
+        if (N != 0 && block->tel == NULL) {
+                block->tel = safe_malloc(N, EL_TYPE);
                 read_dataset(group_id, "./tel", block->tel);
         }
 
@@ -219,7 +348,7 @@ static void write_siteTensor_to_disk(const hid_t id, const struct siteTensor *
 }
 
 static void read_siteTensor_from_disk(const hid_t id, struct siteTensor * 
-                                     const tens, const int nmbr)
+                                     const tens, const int nmbr, const int map)
 {
         char buffer[255];
         sprintf(buffer, "./tensor_%d", nmbr);
@@ -232,21 +361,8 @@ static void read_siteTensor_from_disk(const hid_t id, struct siteTensor *
 
         tens->qnumbers = safe_malloc(tens->nrblocks * tens->nrsites, QN_TYPE);
         read_dataset(group_id, "./qnumbers", tens->qnumbers);
-        read_sparseblocks_from_disk(group_id, &tens->blocks, tens->nrblocks, 0);
-        H5Gclose(group_id);
-}
-
-static void write_T3NS_to_disk(const hid_t file_id, 
-                               const struct siteTensor * const T3NS)
-{
-        const hid_t group_id = H5Gcreate(file_id, "/T3NS", H5P_DEFAULT, 
-                                         H5P_DEFAULT, H5P_DEFAULT);
-
-        write_attribute(group_id, "nrSites", &netw.sites, 1, THDF5_INT);
-
-        for(int i = 0 ; i < netw.sites; ++i) 
-                write_siteTensor_to_disk(group_id, &T3NS[i], i);
-
+        read_sparseblocks_from_disk(group_id, &tens->blocks, tens->nrblocks, 0,
+                                    map);
         H5Gclose(group_id);
 }
 
@@ -262,7 +378,7 @@ static void read_T3NS_from_disk(const hid_t file_id,
         *T3NS = safe_malloc(nrsit, struct siteTensor);
 
         for(int i = 0 ; i < netw.sites; ++i) 
-                read_siteTensor_from_disk(group_id, &(*T3NS)[i], i);
+                read_siteTensor_from_disk(group_id, &(*T3NS)[i], i, 1);
 
         H5Gclose(group_id);
 }
@@ -304,7 +420,7 @@ static void write_rOperator_to_disk(const hid_t id,
 
 static void read_rOperator_from_disk(const hid_t id,
                                     struct rOperators * const rOp, 
-                                    const int nmbr)
+                                    const int nmbr, const int map)
 {
         char buffer[255];
         sprintf(buffer, "./rOperator_%d", nmbr);
@@ -337,23 +453,8 @@ static void read_rOperator_from_disk(const hid_t id,
                 }
                 else
                         read_sparseblocks_from_disk(group_id, &rOp->operators[i], 
-                                                    nr_blocks, i);
-        }
-        H5Gclose(group_id);
-}
-
-static void write_rOps_to_disk(const hid_t id,
-                               const struct rOperators * const rOps)
-{
-        const hid_t group_id = H5Gcreate(id, "/rOps", H5P_DEFAULT, 
-                                         H5P_DEFAULT, H5P_DEFAULT);
-
-        write_attribute(group_id, "nrOps", &netw.nr_bonds, 1, THDF5_INT);
-
-        for (int i = 0 ; i < netw.nr_bonds; ++i) {
-                write_rOperator_to_disk(group_id, &rOps[i], i);
+                                                    nr_blocks, i, map);
         }
-
         H5Gclose(group_id);
 }
 
@@ -368,7 +469,7 @@ static void read_rOps_from_disk(const hid_t id,
 
         *rOps = safe_malloc(nrbonds, struct rOperators);
         for (int i = 0 ; i < netw.nr_bonds; ++i) {
-                read_rOperator_from_disk(group_id, &(*rOps)[i], i);
+                read_rOperator_from_disk(group_id, &(*rOps)[i], i, 1);
         }
 
         H5Gclose(group_id);
@@ -443,26 +544,673 @@ static void make_h5f_name(const char * hdf5_loc, const char hdf5file[],
         hdf5_resulting[size - 1] = '\0';
 }
 
-void write_to_disk(const char * hdf5_loc, const struct siteTensor * const T3NS, 
-                   const struct rOperators * const ops)
+/* Creates a new HDF5 file. The large datasets are aligned on pages, such that
+ * read_from_disk() can map them. An existing file is unlinked first and never
+ * truncated, since it can still be mapped. */
+static hid_t create_h5_file(const char name[])
+{
+        unlink(name);
+        const hid_t fapl = H5Pcreate(H5P_FILE_ACCESS);
+        H5Pset_alignment(fapl, H5_MAP_ALIGNMENT, H5_MAP_ALIGNMENT);
+        const hid_t file_id = H5Fcreate(name, H5F_ACC_TRUNC, H5P_DEFAULT, fapl);
+        H5Pclose(fapl);
+        return file_id;
+}
+
+/* Saves the instruction sets with the calculation */
+static int save_instr = 0;
+
+void set_save_instructions(int save)
+{
+        save_instr = save;
+}
+
+/* Out-of-core storage of the renormalized operators.
+ *
+ * Spilled operators are written in a separate HDF5 file per bond in the
+ * scratch directory, with the same layout as the files of the checkpoints.
+ * All the
+ * HDF5 calls for spilling and prefetching are done by one background
+ * thread, the main thread waits for it before it uses HDF5 itself. */
+
+/* Serializes the HDF5 calls of the background threads and the main thread,
+ * the HDF5 library is not necessarily thread-safe. */
+static pthread_mutex_t h5_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+        /* The scratch directory, empty if spilling is disabled */
+        char dir[MY_STRING_LEN];
+        /* The renormalized operators of the calculation, NULL if inactive */
+        struct rOperators * rops;
+        int nr;
+        /* 1 if the operator of the bond is on scratch and not in memory */
+        int * spilled;
+        /* 1 if the scratch file holds the current operator of the bond */
+        int * clean;
+
+        /* The background job */
+        pthread_t thread;
+        int running;
+        /* The bonds not to spill and the bonds to prefetch by the job */
+        int * keep;
+        int * fetch;
+
+        /* Number of operators spilled and loaded back since the last 
+         * init_rOps_spilling() */
+        int nr_spills;
+        int nr_loads;
+} ooc;
+
+static void make_scratch_name(int bond, char name[MY_STRING_LEN])
+{
+        char file[MY_STRING_LEN];
+        snprintf(file, MY_STRING_LEN, "T3NS_rOp_%ld_%d.h5", (long) getpid(), 
+                 bond);
+        make_h5f_name(ooc.dir, file, MY_STRING_LEN, name);
+}
+
+static int rOperator_is_spilled(int bond)
+{
+        return ooc.rops != NULL && ooc.spilled[bond];
+}
+
+static void read_rOperator_from_scratch(int bond, struct rOperators * rOp)
+{
+        char name[MY_STRING_LEN];
+        make_scratch_name(bond, name);
+        pthread_mutex_lock(&h5_lock);
+        const hid_t file_id = H5Fopen(name, H5F_ACC_RDONLY, H5P_DEFAULT);
+        if (file_id < 0) {
+                fprintf(stderr, "Error @%s: could not open %s.\n", 
+                        __func__, name);
+                exit(EXIT_FAILURE);
+        }
+        read_rOperator_from_disk(file_id, rOp, 0, 0);
+        H5Fclose(file_id);
+        pthread_mutex_unlock(&h5_lock);
+}
+
+static void spill_rOperator(int bond)
+{
+        struct rOperators * rOp = &ooc.rops[bond];
+        /* Empty operators are not written by write_rOperator_to_disk */
+        if (rOp->is_left == -1 || rOp->bond == -1) { return; }
+
+        if (!ooc.clean[bond]) {
+                char name[MY_STRING_LEN];
+                make_scratch_name(bond, name);
+                /* The old file can be linked in a checkpoint, never
+                 * overwrite it in place */
+                unlink(name);
+                pthread_mutex_lock(&h5_lock);
+                const hid_t file_id = H5Fcreate(name, H5F_ACC_TRUNC, 
+                                                H5P_DEFAULT, H5P_DEFAULT);
+                if (file_id < 0) {
+                        fprintf(stderr, "Error @%s: could not create %s.\n", 
+                                __func__, name);
+                        exit(EXIT_FAILURE);
+                }
+                write_rOperator_to_disk(file_id, rOp, 0);
+                H5Fclose(file_id);
+                pthread_mutex_unlock(&h5_lock);
+                ooc.clean[bond] = 1;
+        }
+        destroy_rOperators(rOp);
+        ooc.spilled[bond] = 1;
+        ++ooc.nr_spills;
+}
+
+static void load_rOperator(int bond)
+{
+        read_rOperator_from_scratch(bond, &ooc.rops[bond]);
+        ooc.spilled[bond] = 0;
+        ++ooc.nr_loads;
+}
+
+static void * rOps_job(void * arg)
+{
+        (void) arg;
+        for (int i = 0; i < ooc.nr; ++i) {
+                if (!ooc.keep[i] && !ooc.spilled[i]) { spill_rOperator(i); }
+        }
+        for (int i = 0; i < ooc.nr; ++i) {
+                if (ooc.fetch[i] && ooc.spilled[i]) { load_rOperator(i); }
+        }
+        return NULL;
+}
+
+void set_scratch_location(const char * scratch)
+{
+        if (scratch == NULL) {
+                ooc.dir[0] = '\0';
+        } else {
+                strncpy(ooc.dir, scratch, MY_STRING_LEN - 1);
+                ooc.dir[MY_STRING_LEN - 1] = '\0';
+        }
+}
+
+int init_rOps_spilling(struct rOperators * rops)
+{
+        if (ooc.dir[0] == '\0') { return 0; }
+        assert(ooc.rops == NULL);
+        ooc.rops = rops;
+        ooc.nr = netw.nr_bonds;
+        ooc.spilled = safe_calloc(ooc.nr, int);
+        ooc.clean = safe_calloc(ooc.nr, int);
+        ooc.keep = safe_calloc(ooc.nr, int);
+        ooc.fetch = safe_calloc(ooc.nr, int);
+        ooc.running = 0;
+        ooc.nr_spills = 0;
+        ooc.nr_loads = 0;
+        return 1;
+}
+
+void rOps_spilling_counts(int * spills, int * loads)
+{
+        wait_rOps_job();
+        *spills = ooc.nr_spills;
+        *loads = ooc.nr_loads;
+}
+
+void wait_rOps_job(void)
+{
+        if (!ooc.running) { return; }
+        pthread_join(ooc.thread, NULL);
+        ooc.running = 0;
+}
+
+void fetch_rOps(const int * bonds, int n)
+{
+        if (ooc.rops == NULL) { return; }
+        wait_rOps_job();
+        for (int i = 0; i < n; ++i) {
+                if (ooc.spilled[bonds[i]]) { load_rOperator(bonds[i]); }
+        }
+}
+
+void spill_and_prefetch_rOps(const int * keep, int nkeep, 
+                             const int * fetch, int nfetch)
+{
+        if (ooc.rops == NULL) { return; }
+        wait_rOps_job();
+        for (int i = 0; i < ooc.nr; ++i) {
+                ooc.keep[i] = 0;
+                ooc.fetch[i] = 0;
+        }
+        for (int i = 0; i < nkeep; ++i) { ooc.keep[keep[i]] = 1; }
+        for (int i = 0; i < nfetch; ++i) { 
+                ooc.keep[fetch[i]] = 1;
+                ooc.fetch[fetch[i]] = 1; 
+        }
+        /* The job frees the spilled operators */
+        for (int i = 0; i < ooc.nr; ++i) {
+                if (!ooc.keep[i] && !ooc.spilled[i]) { 
+                        wait_rOps_checkpointed(&i, 1); 
+                }
+        }
+
+        if (pthread_create(&ooc.thread, NULL, rOps_job, NULL) == 0) {
+                ooc.running = 1;
+        } else {
+                /* Do it synchronously instead */
+                rOps_job(NULL);
+        }
+}
+
+void destroy_rOps_spilling(void)
+{
+        if (ooc.rops == NULL) { return; }
+        wait_rOps_job();
+        for (int i = 0; i < ooc.nr; ++i) {
+                if (ooc.spilled[i]) { load_rOperator(i); }
+                char name[MY_STRING_LEN];
+                make_scratch_name(i, name);
+                unlink(name);
+        }
+        safe_free(ooc.spilled);
+        safe_free(ooc.clean);
+        safe_free(ooc.keep);
+        safe_free(ooc.fetch);
+        ooc.rops = NULL;
+}
+
+/* Incremental checkpoints.
+ *
+ * The hamiltonian and every site tensor and renormalized operator are written
+ * in a separate HDF5 file next to T3NScalc.h5. T3NScalc.h5 itself only holds
+ * the network, the bookkeeper and external links to these files, so that
+ * read_from_disk() reads it as any other T3NScalc.h5.
+ *
+ * A checkpoint only writes new files for the objects modified since the
+ * previous checkpoint. The objects are written from memory by a background
+ * thread, which afterwards replaces T3NScalc.h5 atomically by a rename and
+ * removes the files not referenced anymore. The main thread waits till an
+ * object is written before it modifies it, see wait_T3NS_checkpointed() and
+ * wait_rOps_checkpointed(). */
+
+enum ckpt_kind { CKPT_HAM, CKPT_TENS, CKPT_ROP, CKPT_INSTR };
+
+struct ckpt_obj {
+        enum ckpt_kind kind;
+        int nmbr;
+        /* The object to write, NULL for the hamiltonian */
+        const void * obj;
+        char file[MY_STRING_LEN];
+        /* 1 if written, protected by ckpt_lock */
+        int done;
+};
+
+/* Signals the main thread every time the background job wrote an object */
+static pthread_mutex_t ckpt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ckpt_written = PTHREAD_COND_INITIALIZER;
+
+struct ckpt_files {
+        char (*name)[MY_STRING_LEN];
+        int nr;
+        int cap;
+};
+
+static struct {
+        /* The checkpointed calculation, T3NS is NULL if none */
+        char loc[MY_STRING_LEN];
+        const struct siteTensor * T3NS;
+        const struct rOperators * rops;
+        int sites;
+        int bonds;
+
+        /* The version of the file holding the current hamiltonian, site
+         * tensor or operator. -1 if no such file exists */
+        int ham;
+        int * tens;
+        int * rop;
+        int instr;
+        /* The instructions_version() of the written instructions */
+        int instr_version;
+        /* Counter for the versions, never reused during a run */
+        int version;
+        /* The start time of the run, such that the files of different runs 
+         * with the same process id get a different name */
+        long run;
+
+        /* The background job */
+        pthread_t thread;
+        int running;
+        struct ckpt_obj * objs;
+        int nobjs;
+        char name[MY_STRING_LEN];
+        char tmpname[MY_STRING_LEN + 4];
+        struct ckpt_files obsolete;
+} ckpt;
+
+static void add_ckpt_file(struct ckpt_files * files, const char name[])
+{
+        if (files->nr == files->cap) {
+                files->cap = files->cap == 0 ? 16 : 2 * files->cap;
+                files->name = realloc(files->name,
+                                      files->cap * sizeof *files->name);
+                if (files->name == NULL) {
+                        fprintf(stderr, "Error %s:%d: failed realloc.\n",
+                                __FILE__, __LINE__);
+                        exit(EXIT_FAILURE);
+                }
+        }
+        strncpy(files->name[files->nr], name, MY_STRING_LEN - 1);
+        files->name[files->nr][MY_STRING_LEN - 1] = '\0';
+        ++files->nr;
+}
+
+static int has_ckpt_file(const struct ckpt_files * files, const char name[])
+{
+        for (int i = 0; i < files->nr; ++i) {
+                if (strcmp(files->name[i], name) == 0) { return 1; }
+        }
+        return 0;
+}
+
+static void make_ckpt_file(enum ckpt_kind kind, int nmbr, int version,
+                           char file[MY_STRING_LEN])
+{
+        const char * kindname[] = { "ham", "T3NS", "rOp", "instr" };
+        snprintf(file, MY_STRING_LEN, "T3NScalc_%ld_%ld_%s_%d_%d.h5",
+                 (long) getpid(), ckpt.run, kindname[kind], nmbr, version);
+}
+
+static herr_t collect_external_link(hid_t group, const char * name,
+                                    const H5L_info_t * info, void * dat)
+{
+        if (info->type != H5L_TYPE_EXTERNAL) { return 0; }
+        char buffer[2 * MY_STRING_LEN];
+        if (info->u.val_size > sizeof buffer) { return 0; }
+
+        const char * file;
+        const char * obj;
+        unsigned flags;
+        H5Lget_val(group, name, buffer, sizeof buffer, H5P_DEFAULT);
+        H5Lunpack_elink_val(buffer, info->u.val_size, &flags, &file, &obj);
+
+        /* Only the files made by a checkpoint in the same directory */
+        if (strchr(file, '/') == NULL && strncmp(file, "T3NScalc_", 9) == 0) {
+                char fullname[MY_STRING_LEN];
+                make_h5f_name(ckpt.loc, file, MY_STRING_LEN, fullname);
+                add_ckpt_file(dat, fullname);
+        }
+        return 0;
+}
+
+/* Collects the files to which a T3NScalc.h5 links. */
+static void collect_linked_files(const char name[], struct ckpt_files * files)
+{
+        files->nr = 0;
+        if (access(name, F_OK) != 0 || H5Fis_hdf5(name) <= 0) { return; }
+
+        const hid_t file_id = H5Fopen(name, H5F_ACC_RDONLY, H5P_DEFAULT);
+        if (file_id < 0) { return; }
+        const char * groups[] = { "/", "/T3NS", "/rOps" };
+        for (int i = 0; i < 3; ++i) {
+                if (i != 0 && H5Lexists(file_id, groups[i], H5P_DEFAULT) <= 0)
+                        continue;
+                const hid_t group_id = H5Gopen(file_id, groups[i], H5P_DEFAULT);
+                H5Literate(group_id, H5_INDEX_NAME, H5_ITER_NATIVE, NULL,
+                           collect_external_link, files);
+                H5Gclose(group_id);
+        }
+        H5Fclose(file_id);
+}
+
+static void copy_file(const char from[], const char to[])
+{
+        FILE * in = fopen(from, "rb");
+        FILE * out = fopen(to, "wb");
+        if (in == NULL || out == NULL) {
+                fprintf(stderr, "Error @%s: could not copy %s to %s.\n",
+                        __func__, from, to);
+                exit(EXIT_FAILURE);
+        }
+        char buffer[1 << 16];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof buffer, in)) > 0) {
+                if (fwrite(buffer, 1, n, out) != n) {
+                        fprintf(stderr, "Error @%s: could not write %s.\n",
+                                __func__, to);
+                        exit(EXIT_FAILURE);
+                }
+        }
+        fclose(in);
+        fclose(out);
+}
+
+static void reset_checkpoint(const char * hdf5_loc,
+                             const struct siteTensor * T3NS,
+                             const struct rOperators * rops)
+{
+        safe_free(ckpt.tens);
+        safe_free(ckpt.rop);
+        strncpy(ckpt.loc, hdf5_loc, MY_STRING_LEN - 1);
+        ckpt.loc[MY_STRING_LEN - 1] = '\0';
+        ckpt.T3NS = T3NS;
+        ckpt.rops = rops;
+        ckpt.sites = netw.sites;
+        ckpt.bonds = netw.nr_bonds;
+        if (ckpt.run == 0) { ckpt.run = (long) time(NULL); }
+        ckpt.ham = -1;
+        ckpt.instr = -1;
+        ckpt.tens = safe_malloc(ckpt.sites, int);
+        ckpt.rop = safe_malloc(ckpt.bonds, int);
+        for (int i = 0; i < ckpt.sites; ++i) { ckpt.tens[i] = -1; }
+        for (int i = 0; i < ckpt.bonds; ++i) { ckpt.rop[i] = -1; }
+}
+
+static void write_ckpt_object(struct ckpt_obj * obj);
+
+/* Adds an external link to the file of the given object. If the object was
+ * modified, a new file is made or scheduled for the background job. */
+static void link_ckpt_object(hid_t group_id, const char linkname[],
+                             enum ckpt_kind kind, int nmbr, int * version,
+                             const void * obj)
+{
+        const char * objname[] = {
+                "/hamiltonian", "/tensor_0", "/rOperator_0", "/instructions"
+        };
+        char file[MY_STRING_LEN];
+
+        if (*version != -1) {
+                make_ckpt_file(kind, nmbr, *version, file);
+        } else if (kind == CKPT_ROP && rOperator_is_spilled(nmbr)) {
+                /* The scratch file holds the current operator */
+                *version = ckpt.version;
+                make_ckpt_file(kind, nmbr, *version, file);
+                char name[MY_STRING_LEN];
+                char path[MY_STRING_LEN];
+                make_scratch_name(nmbr, name);
+                make_h5f_name(ckpt.loc, file, MY_STRING_LEN, path);
+                if (link(name, path) != 0) { copy_file(name, path); }
+        } else if (kind == CKPT_INSTR) {
+                /* Sets are still added during the sweeps, write them now */
+                *version = ckpt.version;
+                make_ckpt_file(kind, nmbr, *version, file);
+                struct ckpt_obj cobj = { .kind = kind, .obj = NULL };
+                make_h5f_name(ckpt.loc, file, MY_STRING_LEN, cobj.file);
+                write_ckpt_object(&cobj);
+        } else {
+                *version = ckpt.version;
+                make_ckpt_file(kind, nmbr, *version, file);
+                struct ckpt_obj * cobj = &ckpt.objs[ckpt.nobjs++];
+                make_h5f_name(ckpt.loc, file, MY_STRING_LEN, cobj->file);
+                cobj->kind = kind;
+                cobj->nmbr = nmbr;
+                cobj->obj = obj;
+                cobj->done = 0;
+        }
+        H5Lcreate_external(file, objname[kind], group_id, linkname,
+                           H5P_DEFAULT, H5P_DEFAULT);
+}
+
+static void write_ckpt_object(struct ckpt_obj * obj)
+{
+        pthread_mutex_lock(&h5_lock);
+        const hid_t file_id = create_h5_file(obj->file);
+        if (file_id < 0) {
+                fprintf(stderr, "Error @%s: could not create %s.\n",
+                        __func__, obj->file);
+                exit(EXIT_FAILURE);
+        }
+        switch (obj->kind) {
+        case CKPT_HAM:
+                write_hamiltonian_to_disk(file_id);
+                break;
+        case CKPT_TENS:
+                write_siteTensor_to_disk(file_id, obj->obj, 0);
+                break;
+        case CKPT_ROP:
+                write_rOperator_to_disk(file_id, obj->obj, 0);
+                break;
+        case CKPT_INSTR:
+                write_instructions_to_disk(file_id);
+                break;
+        }
+        H5Fclose(file_id);
+        pthread_mutex_unlock(&h5_lock);
+
+        pthread_mutex_lock(&ckpt_lock);
+        obj->done = 1;
+        pthread_cond_broadcast(&ckpt_written);
+        pthread_mutex_unlock(&ckpt_lock);
+}
+
+static void * checkpoint_job(void * arg)
+{
+        (void) arg;
+        for (int i = 0; i < ckpt.nobjs; ++i) {
+                write_ckpt_object(&ckpt.objs[i]);
+        }
+        /* Only now all the linked files exist */
+        if (rename(ckpt.tmpname, ckpt.name) != 0) {
+                fprintf(stderr, "Error @%s: could not rename %s to %s.\n",
+                        __func__, ckpt.tmpname, ckpt.name);
+                exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < ckpt.obsolete.nr; ++i) {
+                unlink(ckpt.obsolete.name[i]);
+        }
+        return NULL;
+}
+
+void wait_checkpoint_job(void)
+{
+        if (!ckpt.running) { return; }
+        pthread_join(ckpt.thread, NULL);
+        ckpt.running = 0;
+}
+
+/* Waits till the running checkpoint has written the given object */
+static void wait_ckpt_object(enum ckpt_kind kind, int nmbr)
+{
+        if (!ckpt.running) { return; }
+        pthread_mutex_lock(&ckpt_lock);
+        for (int i = 0; i < ckpt.nobjs; ++i) {
+                const struct ckpt_obj * obj = &ckpt.objs[i];
+                if (obj->kind != kind || obj->nmbr != nmbr) { continue; }
+                while (!obj->done) {
+                        pthread_cond_wait(&ckpt_written, &ckpt_lock);
+                }
+        }
+        pthread_mutex_unlock(&ckpt_lock);
+}
+
+void wait_T3NS_checkpointed(const int * sites, int n)
+{
+        for (int i = 0; i < n; ++i) { wait_ckpt_object(CKPT_TENS, sites[i]); }
+}
+
+void wait_rOps_checkpointed(const int * bonds, int n)
+{
+        for (int i = 0; i < n; ++i) { wait_ckpt_object(CKPT_ROP, bonds[i]); }
+}
+
+void checkpoint_to_disk(const char * hdf5_loc,
+                        const struct siteTensor * const T3NS,
+                        const struct rOperators * const ops)
 {
         if (hdf5_loc == NULL)
                 return;
+        wait_checkpoint_job();
+        wait_rOps_job();
 
-        hid_t file_id;
-        const char hdf5nam[] = "T3NScalc.h5";
-        char hdf5file[MY_STRING_LEN];
-        make_h5f_name(hdf5_loc, hdf5nam, MY_STRING_LEN, hdf5file);
+        if (ckpt.T3NS != T3NS || ckpt.rops != ops ||
+            strncmp(ckpt.loc, hdf5_loc, MY_STRING_LEN - 1) != 0 ||
+            ckpt.sites != netw.sites || ckpt.bonds != netw.nr_bonds) {
+                reset_checkpoint(hdf5_loc, T3NS, ops);
+        }
+        ++ckpt.version;
+
+        make_h5f_name(ckpt.loc, "T3NScalc.h5", MY_STRING_LEN, ckpt.name);
+        snprintf(ckpt.tmpname, sizeof ckpt.tmpname, "%s.tmp", ckpt.name);
 
-        file_id = H5Fcreate(hdf5file, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+        struct ckpt_files old = { 0 };
+        collect_linked_files(ckpt.name, &old);
 
+        ckpt.objs = realloc(ckpt.objs, (1 + ckpt.sites + ckpt.bonds) *
+                            sizeof *ckpt.objs);
+        ckpt.nobjs = 0;
+
+        unlink(ckpt.tmpname);
+        const hid_t file_id = H5Fcreate(ckpt.tmpname, H5F_ACC_TRUNC,
+                                        H5P_DEFAULT, H5P_DEFAULT);
+        if (ckpt.objs == NULL || file_id < 0) {
+                fprintf(stderr, "Error @%s: could not create %s.\n",
+                        __func__, ckpt.tmpname);
+                exit(EXIT_FAILURE);
+        }
         write_network_to_disk(file_id);
         write_bookkeeper_to_disk(file_id);
-        write_hamiltonian_to_disk(file_id);
-        write_T3NS_to_disk(file_id, T3NS);
-        write_rOps_to_disk(file_id, ops);
+        link_ckpt_object(file_id, "/hamiltonian", CKPT_HAM, 0, &ckpt.ham,
+                         NULL);
+        if (save_instr) {
+                if (ckpt.instr_version != instructions_version()) {
+                        ckpt.instr = -1;
+                }
+                ckpt.instr_version = instructions_version();
+                link_ckpt_object(file_id, "/instructions", CKPT_INSTR, 0,
+                                 &ckpt.instr, NULL);
+        }
 
+        char buffer[255];
+        hid_t group_id = H5Gcreate(file_id, "/T3NS", H5P_DEFAULT,
+                                   H5P_DEFAULT, H5P_DEFAULT);
+        write_attribute(group_id, "nrSites", &netw.sites, 1, THDF5_INT);
+        for (int i = 0; i < netw.sites; ++i) {
+                sprintf(buffer, "tensor_%d", i);
+                link_ckpt_object(group_id, buffer, CKPT_TENS, i,
+                                 &ckpt.tens[i], &T3NS[i]);
+        }
+        H5Gclose(group_id);
+
+        group_id = H5Gcreate(file_id, "/rOps", H5P_DEFAULT,
+                             H5P_DEFAULT, H5P_DEFAULT);
+        write_attribute(group_id, "nrOps", &netw.nr_bonds, 1, THDF5_INT);
+        for (int i = 0; i < netw.nr_bonds; ++i) {
+                /* Empty operators are not written */
+                if (!rOperator_is_spilled(i) &&
+                    (ops[i].is_left == -1 || ops[i].bond == -1)) {
+                        ckpt.rop[i] = -1;
+                        continue;
+                }
+                sprintf(buffer, "rOperator_%d", i);
+                link_ckpt_object(group_id, buffer, CKPT_ROP, i,
+                                 &ckpt.rop[i], &ops[i]);
+        }
+        H5Gclose(group_id);
         H5Fclose(file_id);
+
+        /* The files of the previous checkpoint that are not reused */
+        struct ckpt_files new = { 0 };
+        collect_linked_files(ckpt.tmpname, &new);
+        ckpt.obsolete.nr = 0;
+        for (int i = 0; i < old.nr; ++i) {
+                if (!has_ckpt_file(&new, old.name[i])) {
+                        add_ckpt_file(&ckpt.obsolete, old.name[i]);
+                }
+        }
+        safe_free(old.name);
+        safe_free(new.name);
+
+        if (pthread_create(&ckpt.thread, NULL, checkpoint_job, NULL) == 0) {
+                ckpt.running = 1;
+        } else {
+                /* Do it synchronously instead */
+                checkpoint_job(NULL);
+        }
+}
+
+void mark_T3NS_modified(const int * sites, int n)
+{
+        if (ckpt.T3NS == NULL) { return; }
+        for (int i = 0; i < n; ++i) { ckpt.tens[sites[i]] = -1; }
+}
+
+void mark_rOps_modified(const int * bonds, int n)
+{
+        for (int i = 0; i < n; ++i) {
+                if (ckpt.rops != NULL) { ckpt.rop[bonds[i]] = -1; }
+                /* Spilled operators that were not renewed stay on scratch */
+                if (ooc.rops == NULL || ooc.rops[bonds[i]].bond == -1) {
+                        continue;
+                }
+                ooc.clean[bonds[i]] = 0;
+                ooc.spilled[bonds[i]] = 0;
+        }
+}
+
+void finish_checkpoints(void)
+{
+        wait_checkpoint_job();
+        safe_free(ckpt.tens);
+        safe_free(ckpt.rop);
+        safe_free(ckpt.objs);
+        safe_free(ckpt.obsolete.name);
+        ckpt.obsolete.cap = 0;
+        ckpt.T3NS = NULL;
+        ckpt.rops = NULL;
 }
 
 int read_from_disk(const char filename[], struct siteTensor ** const T3NS, 
@@ -474,6 +1222,8 @@ int read_from_disk(const char filename[], struct siteTensor ** const T3NS,
                 return 1;
         }
 
+        wait_checkpoint_job();
+        wait_rOps_job();
         hid_t file_id = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
 
         read_network_from_disk(file_id);
@@ -481,8 +1231,14 @@ int read_from_disk(const char filename[], struct siteTensor ** const T3NS,
         read_hamiltonian_from_disk(file_id);
         read_T3NS_from_disk(file_id, T3NS);
         read_rOps_from_disk(file_id, ops);
+        const int nr_instr = read_instructions_from_disk(file_id);
+        if (nr_instr != 0) {
+                printf(">> %d instruction sets read from %s.\n", nr_instr,
+                       filename);
+        }
 
         H5Fclose(file_id);
+        prune_tel_mappings();
         return 0;
 }
 
@@ -490,7 +1246,8 @@ void write_attribute(hid_t group_id, const char atrname[], const void * atr,
                      hsize_t size, enum hdf5type kind)
 {
         hid_t datatype_arr[] = {
-                H5T_STD_I32LE, H5T_IEEE_F64LE, EL_TYPE_H5, QN_TYPE_H5
+                H5T_STD_I32LE, H5T_IEEE_F64LE, EL_TYPE_H5, QN_TYPE_H5,
+                H5T_STD_U8LE
         };
 
         if (atr == NULL || size == 0) { return; }
@@ -518,7 +1275,8 @@ void write_dataset(hid_t id, const char datname[], const void * dat, hsize_t siz
                    enum hdf5type kind)
 {
         hid_t datatype_arr[] = {
-                H5T_STD_I32LE, H5T_IEEE_F64LE, EL_TYPE_H5, QN_TYPE_H5
+                H5T_STD_I32LE, H5T_IEEE_F64LE, EL_TYPE_H5, QN_TYPE_H5,
+                H5T_STD_U8LE
         };
 
         if (dat == NULL || size == 0) { return; }
@@ -398,6 +398,20 @@ void print_network(void)
         printf("################################################################################\n\n");
 }
 
+/* A private sitetoorb array of the thread, see set_private_sitetoorb(). */
+static int * private_sitetoorb = NULL;
+#pragma omp threadprivate(private_sitetoorb)
+
+void set_private_sitetoorb(int * sitetoorb)
+{
+        private_sitetoorb = sitetoorb;
+}
+
+int * get_sitetoorb(void)
+{
+        return private_sitetoorb != NULL ? private_sitetoorb : netw.sitetoorb;
+}
+
 int is_psite(int site)
 {
         assert(site < netw.sites && site >= 0);
@@ -440,7 +454,7 @@ void get_bonds_of_site(int site, int * bonds)
         assert(i != netw.nr_bonds);
 
         if (is_psite(site)) {
-                bonds[1] = 2 * netw.nr_bonds + netw.sitetoorb[site];
+                bonds[1] = 2 * netw.nr_bonds + get_sitetoorb()[site];
         } else {
                 for (++i; i < netw.nr_bonds; ++i) {
                         if (netw.bonds[i][1] == site) {
@@ -40,6 +40,8 @@ static int base_tag = 0;
 static int nr_basetags[NR_OPS][NR_TYP];
 static struct opType * opType_arr = NULL;
 static struct opType site_opType  = {.begin_opType = NULL, .tags_opType = NULL};
+/* change_site() overwrites the tags, so every thread has its own copy */
+#pragma omp threadprivate(site_opType)
 static struct opType unity_opType = {.begin_opType = NULL, .tags_opType = NULL};
 
 struct makeinfo {
@@ -349,6 +351,7 @@ void opType_destroy_all(void)
         for (i = 0; i < netw.nr_bonds * 2; ++i)
                 clean_opType(&opType_arr[i]);
         safe_free(opType_arr);
+#pragma omp parallel default(none)
         clean_opType(&site_opType);
 }
 
@@ -28,9 +28,12 @@
 #define STRTOKSEP " ,\t\n"
 
 enum regimeoptions {MIN_D, MAX_D, TRUNCERR, D, SITESIZE, 
-        DAVID_RTL, DAVID_ITS, SWEEPS, E_CONV, NOISE};
+        DAVID_RTL, DAVID_ITS, SWEEPS, E_CONV, NOISE, DAVID_BLOCK, SINGLE_PREC,
+        DAVID_ADAPT, CLEAN_GUESS, DAVID_ROOTS};
 static const char *optionnames[] = {"minD", "maxD", "TRUNC_ERR", "D", 
-        "SITE_SIZE", "DAVID_RTL", "DAVID_ITS", "SWEEPS", "E_CONV", "NOISE"};
+        "SITE_SIZE", "DAVID_RTL", "DAVID_ITS", "SWEEPS", "E_CONV", "NOISE",
+        "DAVID_BLOCK", "SINGLE_PREC", "DAVID_ADAPT",
+        "CLEAN_GUESS", "DAVID_ROOTS"};
 
 /* ========================================================================== */
 /* ========================== STATIC FUNCTIONS ============================== */
@@ -60,6 +63,21 @@ static void fill_regimeoptions_default(struct optScheme * const scheme,
                 case NOISE:
                         reg->noise = DEFAULT_NOISE;
                         break;
+                case DAVID_BLOCK:
+                        reg->davidson_block = DEFAULT_DAVIDSON_BLOCK;
+                        break;
+                case SINGLE_PREC:
+                        reg->single_prec = DEFAULT_SINGLE_PREC;
+                        break;
+                case DAVID_ADAPT:
+                        reg->davidson_adapt = DEFAULT_DAVIDSON_ADAPT;
+                        break;
+                case CLEAN_GUESS:
+                        reg->clean_guess = DEFAULT_CLEAN_GUESS;
+                        break;
+                case DAVID_ROOTS:
+                        reg->davidson_roots = DEFAULT_DAVIDSON_ROOTS;
+                        break;
                 default:
                         fprintf(stderr, "%s@%s: No default defined for option %s\n",
                                 __FILE__, __func__, optionnames[option]);
@@ -88,7 +106,12 @@ static void fill_regimeoptions(char buffer[], struct optScheme * const scheme,
                         &reg->davidson_max_its,
                         &reg->max_sweeps,
                         &reg->energy_conv,
-                        &reg->noise
+                        &reg->noise,
+                        &reg->davidson_block,
+                        &reg->single_prec,
+                        &reg->davidson_adapt,
+                        &reg->clean_guess,
+                        &reg->davidson_roots
                 };
                 errno = 0;
                 switch (option) {
@@ -98,6 +121,10 @@ static void fill_regimeoptions(char buffer[], struct optScheme * const scheme,
                 case SITESIZE:
                 case DAVID_ITS:
                 case SWEEPS:
+                case DAVID_BLOCK:
+                case SINGLE_PREC:
+                case CLEAN_GUESS:
+                case DAVID_ROOTS:
                         pnti = towrite[option];
                         *pnti = strtol(pch, &endptr, 0);
                         if(errno != 0 || *endptr != '\0') {
@@ -110,6 +137,7 @@ static void fill_regimeoptions(char buffer[], struct optScheme * const scheme,
                 case DAVID_RTL:
                 case E_CONV:
                 case NOISE:
+                case DAVID_ADAPT:
                         pntd = towrite[option];
                         *pntd = strtod(pch, &endptr);
                         if(errno != 0 || *endptr != '\0') {
@@ -189,7 +217,7 @@ void read_optScheme(const char inputfile[], struct optScheme * scheme)
 {
         char buffer[255];
         read_bonddim(inputfile, scheme);
-        for (enum regimeoptions opt = SITESIZE; opt <= NOISE; ++opt) {
+        for (enum regimeoptions opt = SITESIZE; opt <= DAVID_ROOTS; ++opt) {
                 const int ro = read_option(optionnames[opt], inputfile, buffer);
                 if (ro == -1) {
                         fill_regimeoptions_default(scheme, opt);
@@ -276,5 +304,30 @@ void print_optScheme(const struct optScheme * const scheme)
                 printf("%11.3f", scheme->regimes[i].noise);
         }
         printf("\n");
+        printf("%10s", optionnames[DAVID_BLOCK]);
+        for (int i = 0; i < scheme->nrRegimes; ++i) {
+                printf("%11d", scheme->regimes[i].davidson_block);
+        }
+        printf("\n");
+        printf("%10s", optionnames[SINGLE_PREC]);
+        for (int i = 0; i < scheme->nrRegimes; ++i) {
+                printf("%11d", scheme->regimes[i].single_prec);
+        }
+        printf("\n");
+        printf("%10s", optionnames[DAVID_ADAPT]);
+        for (int i = 0; i < scheme->nrRegimes; ++i) {
+                printf("%11.2e", scheme->regimes[i].davidson_adapt);
+        }
+        printf("\n");
+        printf("%10s", optionnames[CLEAN_GUESS]);
+        for (int i = 0; i < scheme->nrRegimes; ++i) {
+                printf("%11d", scheme->regimes[i].clean_guess);
+        }
+        printf("\n");
+        printf("%10s", optionnames[DAVID_ROOTS]);
+        for (int i = 0; i < scheme->nrRegimes; ++i) {
+                printf("%11d", scheme->regimes[i].davidson_roots);
+        }
+        printf("\n");
         printf("################################################################################\n\n");
 }
@@ -17,7 +17,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <float.h>
 #include <assert.h>
+#include <omp.h>
 
 #include "optimize_network.h"
 #include "macros.h"
@@ -25,10 +27,14 @@
 #include "network.h"
 #include "bookkeeper.h"
 #include "Heff.h"
+#include "davidson.h"
 #include "wrapper_solvers.h"
 #include "io_to_disk.h"
 #include "RedDM.h" 
 #include "timers.h"
+#include "arena.h"
+#include "instructions.h"
+#include "symmetry_su2.h"
 
 #define MAX_NR_INTERNALS 3
 #define NR_TIMERS 12
@@ -55,7 +61,8 @@ static const char *timernames[] = {
         "io: write to disk",
         "siteTensor: permuting",
         "Network: entanglement",
-        "Network: Recanonicalizing"
+        "Network: Recanonicalizing",
+        "Instructions: prepare"
 };
 
 enum timerkeys {
@@ -73,7 +80,8 @@ enum timerkeys {
         IO_DISK,
         STENS_PERM,
         NETW_ENT,
-        NETW_CANON
+        NETW_CANON,
+        PREP_INSTR
 };
 
 static const int timkeys[] = {
@@ -91,7 +99,8 @@ static const int timkeys[] = {
         IO_DISK,
         STENS_PERM,
         NETW_ENT,
-        NETW_CANON
+        NETW_CANON,
+        PREP_INSTR
 };
 
 static void init_null_T3NS(struct siteTensor ** T3NS)
@@ -116,6 +125,9 @@ static struct optimize_data {
         int nr_internals;
         struct symsecs internalss[MAX_NR_INTERNALS];
         int internalbonds[MAX_NR_INTERNALS];
+
+        /* Workspace of the eigensolver, reused over the different steps. */
+        struct davidson_context david;
 } o_dat;
 
 static void set_internal_symsecs(void)
@@ -185,8 +197,50 @@ static void add_noise(struct siteTensor * tens, double noiseLevel)
         }
 }
 
-static double optimize_siteTensor(const struct regime * reg,
-                                  struct timers * timings)
+/* Residuals below this factor times the largest diagonal element of the
+ * effective Hamiltonian are not resolved by a single precision matvec. */
+#define SINGLE_PREC_FLOOR (16 * FLT_EPSILON)
+
+/* Switches the matvec between single and double (refined) precision during
+ * the Davidson. */
+static void refine_precision(void * vdat, int refined)
+{
+        set_Heff_precision(vdat, !refined);
+}
+
+static double eigensolve_siteTensor(const struct regime * reg, double tol,
+                                    const EL_TYPE * diagonal,
+                                    struct Heffdata * mv_dat)
+{
+        double energy;
+        const int ret = 
+                sparse_eigensolve(o_dat.msiteObj.blocks.tel, &energy, 
+                                  siteTensor_get_size(&o_dat.msiteObj), 
+                                  DAVIDSON_MAX_VECS, DAVIDSON_KEEP_DEFLATE, 
+                                  reg->davidson_block, reg->davidson_roots, 
+                                  tol, reg->davidson_max_its, 
+                                  diagonal, matvecT3NS, matvecT3NS_block, 
+                                  mv_dat, &o_dat.david, SOLVER_STRING);
+        if (ret < 0) { exit(EXIT_FAILURE); }
+        return energy;
+}
+
+/* The Davidson tolerance for a step, adapted to the discarded weight and the
+ * energy change of the previous step if DAVID_ADAPT is set. The error on the
+ * eigenvalue scales with the square of the residual, so the residual is 
+ * matched to the square root of the error of the previous step. */
+static double adapt_tolerance(const struct regime * reg, double trunc,
+                              double d_energy)
+{
+        if (reg->davidson_adapt <= 0) { return reg->davidson_rtl; }
+        const double err = trunc > fabs(d_energy) ? trunc : fabs(d_energy);
+        double tol = reg->davidson_adapt * sqrt(err);
+        if (tol > DAVIDSON_ADAPT_MAX_RTL) { tol = DAVIDSON_ADAPT_MAX_RTL; }
+        return tol < reg->davidson_rtl ? reg->davidson_rtl : tol;
+}
+
+static double optimize_siteTensor(const struct regime * reg, double rtl,
+                                  int * nr_matvecs, struct timers * timings)
 {
         assert(o_dat.specs.nr_bonds_opt == 2 || o_dat.specs.nr_bonds_opt == 3);
         const int isdmrg = o_dat.specs.nr_bonds_opt == 2;
@@ -213,13 +267,21 @@ static double optimize_siteTensor(const struct regime * reg,
         EL_TYPE * diagonal = make_diagonal(&mv_dat);
         toc(timings, diag);
 
-        double energy;
         tic(timings, heff);
-        sparse_eigensolve(o_dat.msiteObj.blocks.tel, &energy, size, 
-                          DAVIDSON_MAX_VECS, DAVIDSON_KEEP_DEFLATE, 
-                          reg->davidson_rtl, reg->davidson_max_its, 
-                          diagonal, matvecT3NS, &mv_dat, SOLVER_STRING);
+        if (reg->single_prec) {
+                double maxdiag = 0;
+                for (int i = 0; i < size; ++i) {
+                        if (maxdiag < fabs(diagonal[i])) { 
+                                maxdiag = fabs(diagonal[i]);
+                        }
+                }
+                o_dat.david.refine = refine_precision;
+                o_dat.david.refine_tol = SINGLE_PREC_FLOOR * maxdiag;
+        }
+        const double energy = eigensolve_siteTensor(reg, rtl, diagonal, 
+                                                    &mv_dat);
         toc(timings, heff);
+        *nr_matvecs = mv_dat.nr_matvecs;
         destroy_Heffdata(&mv_dat);
         safe_free(diagonal);
         return energy;
@@ -310,10 +372,46 @@ static void postprocess_rOperators(struct rOperators * rops,
         }
 }
 
+/* Makes sure the operators needed in the current step are in memory, spills
+ * the ones not needed in this and the next step and starts the prefetching
+ * for the next step. Only does something if spilling is enabled. */
+static void spill_rOperators(const struct stepSpecs * next)
+{
+        const struct stepSpecs * specs = &o_dat.specs;
+        fetch_rOps(specs->bonds_opt, specs->nr_bonds_opt);
+
+        /* Keep the bonds of the sites in the current step. The inner bonds
+         * get new operators in this step and are not prefetched. */
+        int keep[STEPSPECS_MSITES * 3];
+        int nkeep = 0;
+        for (int i = 0; i < specs->nr_sites_opt; ++i) {
+                int bonds[3];
+                get_bonds_of_site(specs->sites_opt[i], bonds);
+                for (int j = 0; j < 3; ++j) {
+                        /* Physical bonds have no renormalized operators */
+                        if (bonds[j] >= 0 && bonds[j] < netw.nr_bonds) {
+                                keep[nkeep++] = bonds[j];
+                        }
+                }
+        }
+
+        int fetch[STEPSPECS_MBONDS];
+        int nfetch = 0;
+        for (int i = 0; next != NULL && i < next->nr_bonds_opt; ++i) {
+                if (find_in_array(nkeep, keep, next->bonds_opt[i]) == -1) {
+                        fetch[nfetch++] = next->bonds_opt[i];
+                }
+        }
+        spill_and_prefetch_rOps(keep, nkeep, fetch, nfetch);
+}
+
 struct sweep_info {
         double sw_energy;
         double sw_trunc;
         int sw_maxdim;
+        long long sw_workspace;
+        int sw_reused;
+        long long sw_matvecs;
 
         struct timers chrono;
 };
@@ -328,13 +426,32 @@ static struct sweep_info execute_sweep(struct siteTensor * T3NS,
                                             sizeof timkeys / sizeof timkeys[0])
         };
         int first = 1;
+        const int reused = Heffplans_reused();
+        /* The errors of the previous step for the adaptive tolerance */
+        double prev_trunc = trunc_err;
+        double prev_denergy = 0;
+        double prev_energy = 0;
+
+        /* The next step is known in advance for prefetching its operators */
+        struct stepSpecs next;
+        int has_next = next_opt_step(reg->sitesize, &next);
+        while (has_next) {
+                o_dat.specs = next;
+                has_next = next_opt_step(reg->sitesize, &next);
+                reset_arenas_peak();
+
+                tic(&swinfo.chrono, IO_DISK);
+                spill_rOperators(has_next ? &next : NULL);
+                toc(&swinfo.chrono, IO_DISK);
 
-        while (next_opt_step(reg->sitesize, &o_dat.specs)) {
                 /* The order of makesiteTensor and preprocess_rOperators is
                  * really important!
                  * In makesiteTensor the symsec is set to an internal symsec. 
                  * This is what you need also for preprocess_rOperators */
                 tic(&swinfo.chrono, STENS_MAKE);
+                /* makesiteTensor consumes the site tensors */
+                wait_T3NS_checkpointed(o_dat.specs.sites_opt,
+                                       o_dat.specs.nr_sites_opt);
                 makesiteTensor(&o_dat.msiteObj, T3NS, o_dat.specs.sites_opt,
                                o_dat.specs.nr_sites_opt);
                 toc(&swinfo.chrono, STENS_MAKE);
@@ -344,10 +461,22 @@ static struct sweep_info execute_sweep(struct siteTensor * T3NS,
                 toc(&swinfo.chrono, ROP_APPEND);
                 set_internal_symsecs();
 
-                double energy = optimize_siteTensor(reg, &swinfo.chrono);
+                const double rtl = adapt_tolerance(reg, prev_trunc, 
+                                                   prev_denergy);
+                int nr_matvecs;
+                double energy = optimize_siteTensor(reg, rtl, &nr_matvecs,
+                                                    &swinfo.chrono);
                 printf("   * Energy: %.12lf\n", energy);
+                printf("   * Matvecs: %d (tolerance: %.1e)\n", nr_matvecs, rtl);
 
                 tic(&swinfo.chrono, STENS_DECOMP);
+                /* The noise only selects the bases, the converged tensor 
+                 * is propagated as guess for the next step. */
+                const int clean = reg->clean_guess && reg->noise != 0 &&
+                        o_dat.msiteObj.nrsites > 1;
+                struct siteTensor converged;
+                if (clean) { deep_copy_siteTensor(&converged, &o_dat.msiteObj); }
+
                 /* same noise as CheMPS2 */
                 add_noise(&o_dat.msiteObj, reg->noise * trunc_err);
                 norm_tensor(&o_dat.msiteObj);
@@ -355,26 +484,43 @@ static struct sweep_info execute_sweep(struct siteTensor * T3NS,
                 struct decompose_info d_inf = 
                         decompose_siteTensor(&o_dat.msiteObj, 
                                              o_dat.specs.nCenter,
-                                             T3NS, &reg->svd_sel);
+                                             T3NS, &reg->svd_sel, 
+                                             clean ? &converged : NULL);
 
                 if (d_inf.erflag) { exit(EXIT_FAILURE); }
+                mark_T3NS_modified(o_dat.specs.sites_opt, 
+                                   o_dat.specs.nr_sites_opt);
                 toc(&swinfo.chrono, STENS_DECOMP);
                 print_decompose_info(&d_inf, "   * ");
 
+                wait_rOps_checkpointed(o_dat.internalbonds, 
+                                       o_dat.nr_internals);
                 postprocess_rOperators(rops, T3NS, &swinfo.chrono);
+                mark_rOps_modified(o_dat.internalbonds, o_dat.nr_internals);
 
+                const long long workspace = arenas_peak();
+                printf("   * Workspace: %.1f MB\n", workspace / 1048576.);
+                trim_arenas();
                 if (first || swinfo.sw_energy > energy) 
                         swinfo.sw_energy = energy;
                 if (first || swinfo.sw_trunc < d_inf.cut_Mtrunc) 
                         swinfo.sw_trunc = d_inf.cut_Mtrunc;
                 if (first || swinfo.sw_maxdim < d_inf.cut_Mdim) 
                         swinfo.sw_maxdim = d_inf.cut_Mdim;
+                if (first || swinfo.sw_workspace < workspace) 
+                        swinfo.sw_workspace = workspace;
+                swinfo.sw_matvecs += nr_matvecs;
+                prev_denergy = first ? 0 : energy - prev_energy;
+                prev_energy = energy;
+                prev_trunc = d_inf.cut_Mtrunc;
                 first = 0;
                 printf("\n");
         }
 
+        swinfo.sw_reused = Heffplans_reused() - reused;
+
         tic(&swinfo.chrono, IO_DISK);
-        write_to_disk(saveloc, T3NS, rops);
+        checkpoint_to_disk(saveloc, T3NS, rops);
         toc(&swinfo.chrono, IO_DISK);
 
         return swinfo;
@@ -387,6 +533,9 @@ static void print_sweep_info(struct sweep_info * info, int sw_nr, int regnr)
         printf("MINIMUM ENERGY ENCOUNTERED DURING THIS SWEEP: %.16lf\n", info->sw_energy        );
         printf("MAXIMUM TRUNCATION ERROR ENCOUNTERED DURING THIS SWEEP: %.4e\n", info->sw_trunc );
         printf("MAXIMUM BOND DIMENSION ENCOUNTERED DURING THIS SWEEP: %d\n", info->sw_maxdim    );
+        printf("MAXIMUM WORKSPACE ENCOUNTERED DURING THIS SWEEP: %.1f MB\n", info->sw_workspace / 1048576.);
+        printf("MATVEC PLANS REUSED DURING THIS SWEEP: %d\n", info->sw_reused  );
+        printf("MATVECS DURING THIS SWEEP: %lld\n", info->sw_matvecs           );
         printf("TIMERS:\n");
         print_timers(&info->chrono, " * ", true);
         printf("============================================================================\n\n");
@@ -414,6 +563,8 @@ static double execute_regime(struct siteTensor * T3NS, struct rOperators * rops,
                 ++sweepnrs;
                 if (flag) { break; }
         }
+        /* The bond dimensions change in the next regime */
+        destroy_Heffplans();
         printf("============================================================================\n"  );
         printf("END OF REGIME %d AFTER %d/%d SWEEPS.\n", regnumber, sweepnrs, reg->max_sweeps);
         if (sweepnrs == reg->max_sweeps) {
@@ -472,9 +623,14 @@ static void init_rops(struct rOperators * const rops,
 
 int init_operators(struct rOperators ** rOps, struct siteTensor ** T3NS)
 { 
+        if (*rOps) { return 0; }
         struct timers chrono = init_timers(timernames, timkeys,
                                            sizeof timkeys / sizeof timkeys[0]);
-        if (*rOps) { return 0; }
+        printf(">> Preparing instructions...\n");
+        tic(&chrono, PREP_INSTR);
+        prepare_instructions();
+        toc(&chrono, PREP_INSTR);
+
         printf(">> Preparing renormalized operators...\n");
         init_null_rops(rOps);
         for (int i = 0; i < netw.nr_bonds; ++i) {
@@ -487,6 +643,8 @@ int init_operators(struct rOperators ** rOps, struct siteTensor ** T3NS)
         }
         print_timers(&chrono, " * ", true);
         destroy_timers(&chrono);
+        destroy_arenas();
+        destroy_wigner_caches();
         return 0;
 }
 
@@ -645,6 +803,13 @@ double execute_optScheme(struct siteTensor * const T3NS, struct rOperators * con
 
         double energy = 3000;
         double trunc_err = scheme->regimes[0].svd_sel.truncerr;
+        init_davidson_context(&o_dat.david);
+        if (init_rOps_spilling(rops)) {
+                printf(">> Renormalized operators are spilled to scratch.\n");
+        }
+        tic(&timings, PREP_INSTR);
+        prepare_instructions();
+        toc(&timings, PREP_INSTR);
 
         printf("============================================================================\n");
         for (int i = 0; i < scheme->nrRegimes; ++i) {
@@ -652,6 +817,11 @@ double execute_optScheme(struct siteTensor * const T3NS, struct rOperators * con
                                                        i + 1, &trunc_err, saveloc, &timings);
                 if (current_energy  < energy) energy = current_energy;
         }
+        destroy_davidson_context(&o_dat.david);
+        finish_checkpoints();
+        destroy_rOps_spilling();
+        destroy_arenas();
+        destroy_wigner_caches();
 
         printf("============================================================================\n"
                "END OF CONVERGENCE SCHEME.\n"
@@ -831,77 +1001,92 @@ static int accept_bestPerm(struct bestPerm * bp, struct siteTensor * T3NS)
         return recanonicalize_T3NS(T3NS, lastsite);
 }
 
-static bool written;
-static int nribs;
-static int internalbonds[STEPSPECS_MBONDS];
-
-static int orig_sitetoorb[STEPSPECS_MSITES];
-static struct symsecs origss[STEPSPECS_MBONDS];
-
-static int best_sitetoorb[STEPSPECS_MSITES];
-static struct siteTensor besttens[STEPSPECS_MSITES];
-static struct symsecs bestss[STEPSPECS_MBONDS];
+/* A candidate permutation of the orbitals in selectBestPerm.
+ *
+ * Every candidate is decomposed in its own copy of the sitetoorb array, of the
+ * symsecs of the internal bonds and of the site tensors, such that the
+ * candidates can be decomposed concurrently. Only the accepted one is put in
+ * the network, the bookkeeper and the T3NS. */
+struct perm_candidate {
+        int * sitetoorb;
+        struct symsecs ss[STEPSPECS_MBONDS];
+        struct siteTensor * T3NS;
+        struct decompose_info info;
+};
 
-static void backup_orig(const struct stepSpecs * specs)
+static void init_candidate(struct perm_candidate * cand, int nribs,
+                           const int * internalbonds)
 {
-        assert(!written);
-        for (int i = 0; i < specs->nr_sites_opt; ++i) {
-                orig_sitetoorb[i] = netw.sitetoorb[specs->sites_opt[i]];
+        cand->sitetoorb = safe_malloc(netw.sites, *cand->sitetoorb);
+        for (int i = 0; i < netw.sites; ++i) {
+                cand->sitetoorb[i] = netw.sitetoorb[i];
         }
         for (int i = 0; i < nribs; ++i) {
                 struct symsecs css;
                 get_symsecs(&css, internalbonds[i]);
-                deep_copy_symsecs(&origss[i], &css);
+                deep_copy_symsecs(&cand->ss[i], &css);
+        }
+        cand->T3NS = safe_malloc(netw.sites, *cand->T3NS);
+        for (int i = 0; i < netw.sites; ++i) {
+                init_null_siteTensor(&cand->T3NS[i]);
         }
 }
 
-static void backup_perm(const struct siteTensor * T3NS,
-                        const struct stepSpecs * specs)
+static void destroy_candidate(struct perm_candidate * cand, int nribs)
 {
-        for (int i = 0; i < specs->nr_sites_opt; ++i) {
-                best_sitetoorb[i] = netw.sitetoorb[specs->sites_opt[i]];
-                if (written) { destroy_siteTensor(&besttens[i]); }
-                deep_copy_siteTensor(&besttens[i], &T3NS[specs->sites_opt[i]]);
-        }
-        for (int i = 0; i < nribs; ++i) {
-                if (written) { destroy_symsecs(&bestss[i]); }
-                struct symsecs css;
-                get_symsecs(&css, internalbonds[i]);
-                deep_copy_symsecs(&bestss[i], &css);
+        safe_free(cand->sitetoorb);
+        for (int i = 0; i < nribs; ++i) { destroy_symsecs(&cand->ss[i]); }
+        for (int i = 0; i < netw.sites; ++i) {
+                destroy_siteTensor(&cand->T3NS[i]);
         }
-        written = true;
+        safe_free(cand->T3NS);
 }
 
-static void put_back_perm(struct siteTensor * T3NS,
-                          const struct stepSpecs * specs)
+/* Decomposes S permuted with perm in the private copies of cand. */
+static void decompose_candidate(struct perm_candidate * cand,
+                                const struct siteTensor * S, const int * perm,
+                                int nr, int nribs, const int * internalbonds,
+                                const struct stepSpecs * specs,
+                                const struct disentScheme * scheme)
 {
-        for (int i = 0; i < specs->nr_sites_opt; ++i) {
-                netw.sitetoorb[specs->sites_opt[i]] = best_sitetoorb[i];
-                destroy_siteTensor(&T3NS[specs->sites_opt[i]]);
-                T3NS[specs->sites_opt[i]] = besttens[i];
-        }
-        for (int i = 0; i < nribs; ++i) {
-                destroy_symsecs(&bookie.v_symsecs[internalbonds[i]]);
-                bookie.v_symsecs[internalbonds[i]] = bestss[i];
+        set_private_sitetoorb(cand->sitetoorb);
+        set_private_symsecs(nribs, internalbonds, cand->ss);
+
+        int i;
+        for (i = 0; i < nr; ++i) { if (perm[i] != i) { break; } }
+
+        struct siteTensor Sp;
+        if (i == nr || permute_siteTensor(S, &Sp, perm, nr)) {
+                // Identity or failed permutation, decompose S itself.
+                for (i = 0; i < specs->nr_sites_opt; ++i) {
+                        const int site = specs->sites_opt[i];
+                        cand->sitetoorb[site] = netw.sitetoorb[site];
+                }
+                deep_copy_siteTensor(&Sp, S);
         }
-        written = false;
+        cand->info = decompose_siteTensor(&Sp, specs->nCenter, cand->T3NS,
+                                          &scheme->svd_sel, NULL);
+
+        set_private_symsecs(0, NULL, NULL);
+        set_private_sitetoorb(NULL);
 }
 
-static void put_back_orig(const struct stepSpecs * specs)
+static void commit_candidate(struct perm_candidate * cand,
+                             struct siteTensor * T3NS, int nribs,
+                             const int * internalbonds,
+                             const struct stepSpecs * specs)
 {
         for (int i = 0; i < specs->nr_sites_opt; ++i) {
-                netw.sitetoorb[specs->sites_opt[i]] = orig_sitetoorb[i];
+                const int site = specs->sites_opt[i];
+                netw.sitetoorb[site] = cand->sitetoorb[site];
+                destroy_siteTensor(&T3NS[site]);
+                T3NS[site] = cand->T3NS[site];
+                init_null_siteTensor(&cand->T3NS[site]);
         }
         for (int i = 0; i < nribs; ++i) {
                 destroy_symsecs(&bookie.v_symsecs[internalbonds[i]]);
-                deep_copy_symsecs(&bookie.v_symsecs[internalbonds[i]], &origss[i]);
-        }
-}
-
-static void clean_orig(void)
-{
-        for (int i = 0; i < nribs; ++i) {
-                destroy_symsecs(&origss[i]);
+                bookie.v_symsecs[internalbonds[i]] = cand->ss[i];
+                init_null_symsecs(&cand->ss[i]);
         }
 }
 
@@ -929,88 +1114,84 @@ static struct decompose_info selectBestPerm(struct siteTensor * T3NS,
                 {2, 0, 1}
         };
 
-        int accepted_perm = 0;
         struct siteTensor S;
 
         tic(chrono, STENS_MAKE);
         makesiteTensor(&S, T3NS, specs->sites_opt, specs->nr_sites_opt);
         toc(chrono, STENS_MAKE);
-        nribs = get_nr_internalbonds(&S);
+        const int nribs = get_nr_internalbonds(&S);
+        int internalbonds[STEPSPECS_MBONDS];
         get_internalbonds(&S, internalbonds);
-        backup_orig(specs);
-
-        struct siteTensor Stemp;
-        deep_copy_siteTensor(&Stemp, &S);
-        tic(chrono, STENS_DECOMP);
-        struct decompose_info info = 
-                decompose_siteTensor(&Stemp, specs->nCenter, 
-                                     T3NS, &scheme->svd_sel);
-        toc(chrono, STENS_DECOMP);
 
         assert(S.nrsites == 2 || S.nrsites == 3 || S.nrsites == 4);
 
-
         int (*perm)[3] = S.nrsites == 4 ? perm3 : perm2;
+        const int nr = S.nrsites == 4 ? 3 : 2;
         int nrperm = S.nrsites == 4 ? sizeof perm3 / sizeof perm3[0] : 
                 sizeof perm2 / sizeof perm2[0];
-        const int nr = S.nrsites == 4 ? 3 : 2;
-
-        backup_perm(T3NS, specs);
-        if (verbosity > 0) { 
-                print_permutation(perm[0], nr);
-                printf("\n");
-                print_decompose_info(&info, NULL);
-        }
 
+        // The candidates: the identity and the permutations to try.
+        int candperm[sizeof perm3 / sizeof perm3[0]];
+        for (int i = 0; i < nrperm; ++i) { candperm[i] = i; }
         if (scheme->gambling) {
                 // Do a Metropolis step instead of trying all permutations!
-                perm = &perm[rand() % (nrperm - 1)];
+                candperm[1] = 1 + rand() % (nrperm - 1);
                 nrperm = 2;
         }
 
-        for (int i = 1; i < nrperm; ++i) {
-                put_back_orig(specs);
-                struct siteTensor Sp;
-                tic(chrono, STENS_PERM);
-                if (permute_siteTensor(&S, &Sp, perm[i], nr)) {
-                        deep_copy_siteTensor(&Sp, &S);
-                }
-                toc(chrono, STENS_PERM);
-                tic(chrono, STENS_DECOMP);
-                struct decompose_info cinfo = 
-                        decompose_siteTensor(&Sp, specs->nCenter, T3NS, 
-                                             &scheme->svd_sel);
-                toc(chrono, STENS_DECOMP);
+        struct perm_candidate * cands = safe_malloc(nrperm, *cands);
+        for (int i = 0; i < nrperm; ++i) {
+                init_candidate(&cands[i], nribs, internalbonds);
+        }
 
+        /* Every candidate is decomposed by one thread. The parallel regions
+         * in the permutation and decomposition are not made active, they would
+         * not see the private copies of the candidate. */
+        const int max_levels = omp_get_max_active_levels();
+        omp_set_max_active_levels(1);
+        tic(chrono, STENS_DECOMP);
+#pragma omp parallel for schedule(dynamic) default(none) \
+        shared(cands, candperm, perm, nrperm, S, internalbonds, specs, scheme)
+        for (int i = 0; i < nrperm; ++i) {
+                decompose_candidate(&cands[i], &S, perm[candperm[i]], nr, 
+                                    nribs, internalbonds, specs, scheme);
+        }
+        toc(chrono, STENS_DECOMP);
+        omp_set_max_active_levels(max_levels);
+
+        int accepted = 0;
+        for (int i = 0; i < nrperm; ++i) {
+                const struct decompose_info * cinfo = &cands[i].info;
                 if (verbosity > 0) { 
-                        print_permutation(perm[i], nr);
+                        print_permutation(perm[candperm[i]], nr);
                         printf("\n");
-                        print_decompose_info(&info, NULL);
+                        print_decompose_info(cinfo, NULL);
                 }
-                bool accepted = cinfo.cut_totalent < info.cut_totalent;
+                if (i == 0) { continue; }
+
+                const struct decompose_info * info = &cands[accepted].info;
+                bool accept = cinfo->cut_totalent < info->cut_totalent;
                 if (scheme->gambling) {
                         // Metropolis step
                         // Acceptance with probability exp(-b * dS)
-                        double diff = cinfo.cut_totalent - info.cut_totalent;
+                        double diff = cinfo->cut_totalent - info->cut_totalent;
                         double expval = exp(-scheme->beta * diff);
-                        accepted = rand() < expval * RAND_MAX;
-                }
-                if (accepted) {
-                        accepted_perm = i;
-                        info = cinfo;
-                        backup_perm(T3NS, specs);
+                        accept = rand() < expval * RAND_MAX;
                 }
+                if (accept) { accepted = i; }
         }
 
+        struct decompose_info info = cands[accepted].info;
         if (verbosity > 0) {
                 printf("Accepted ");
-                print_permutation(perm[accepted_perm], nr);
+                print_permutation(perm[candperm[accepted]], nr);
                 printf("with entanglement %g\n", info.cut_totalent);
         }
 
-        put_back_perm(T3NS, specs);
+        commit_candidate(&cands[accepted], T3NS, nribs, internalbonds, specs);
+        for (int i = 0; i < nrperm; ++i) { destroy_candidate(&cands[i], nribs); }
+        safe_free(cands);
         destroy_siteTensor(&S);
-        clean_orig();
         return info;
 }
 
@@ -1109,6 +1290,8 @@ double disentangle_state(struct siteTensor * T3NS,
         printf("Timers for disentangling scheme:\n");
         print_timers(&chrono, " * ", true);
         destroy_timers(&chrono);
+        destroy_arenas();
+        destroy_wigner_caches();
 
         safe_free(netw.sweep);
         netw.sweep = tempsweep;
@@ -26,6 +26,7 @@
 #include "instructions.h"
 #include "hamiltonian.h"
 #include "sort.h"
+#include "arena.h"
 
 /**
  * tens:
@@ -1052,8 +1053,10 @@ static void update_selected_blocks(const struct rOperators * Operator,
         struct contractinfo cinfo[3];
         int worksize[2] = {-1, -1};
         how_to_update(data, cinfo, worksize);
-        data->tels[WORKBRA] = safe_malloc(worksize[BRA], EL_TYPE);
-        data->tels[WORKKET] = safe_malloc(worksize[KET], EL_TYPE);
+        struct arena * ar = thread_arena();
+        const long long mark = arena_mark(ar);
+        data->tels[WORKBRA] = arena_malloc(ar, worksize[BRA], EL_TYPE);
+        data->tels[WORKKET] = arena_malloc(ar, worksize[KET], EL_TYPE);
 
         int (*instr_id)[2] = NULL;
         while (find_matching_instr(&instr_id, data)) {
@@ -1067,8 +1070,7 @@ static void update_selected_blocks(const struct rOperators * Operator,
                         do_contract(&cinfo[2], data->tels, prefactor, 1);
                 }
         }
-        safe_free(data->tels[WORKKET]);
-        safe_free(data->tels[WORKBRA]);
+        arena_release(ar, mark);
 }
 
 static int get_tels_operators(struct update_data * data, const int * ops, 
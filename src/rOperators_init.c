@@ -56,6 +56,37 @@ void destroy_rOperators(struct rOperators * rops)
         *rops = null_rOperators();
 }
 
+void deep_copy_rOperators(struct rOperators * copy, 
+                          const struct rOperators * orig)
+{
+        *copy = *orig;
+        if (orig->bond == -1) { return; }
+
+        const int nrqn = orig->begin_blocks_of_hss[orig->nrhss] *
+                rOperators_give_nr_of_couplings(orig);
+        copy->begin_blocks_of_hss = safe_malloc(orig->nrhss + 1, int);
+        for (int i = 0; i < orig->nrhss + 1; ++i) {
+                copy->begin_blocks_of_hss[i] = orig->begin_blocks_of_hss[i];
+        }
+        copy->qnumbers = safe_malloc(nrqn, QN_TYPE);
+        for (int i = 0; i < nrqn; ++i) {
+                copy->qnumbers[i] = orig->qnumbers[i];
+        }
+        copy->hss_of_ops = safe_malloc(orig->nrops, int);
+        copy->operators = safe_malloc(orig->nrops, struct sparseblocks);
+        for (int i = 0; i < orig->nrops; ++i) {
+                copy->hss_of_ops[i] = orig->hss_of_ops[i];
+                const int nr_blocks = nblocks_in_operator(orig, i);
+                if (nr_blocks == 0 || orig->operators[i].beginblock == NULL) {
+                        copy->operators[i].beginblock = NULL;
+                        copy->operators[i].tel = NULL;
+                } else {
+                        deep_copy_sparseblocks(&copy->operators[i], 
+                                               &orig->operators[i], nr_blocks);
+                }
+        }
+}
+
 static void make_unitOperator(struct rOperators * ops, int op)
 {
         assert(ops->P_operator == 0 && "Not implemented for physical rOperators");
@@ -27,6 +27,7 @@
 #include "sort.h"
 #include "macros.h"
 #include "bookkeeper.h"
+#include "arena.h"
 
 #ifdef T3NS_MKL
 #include "mkl.h"
@@ -36,6 +37,150 @@
 
 //#define T3NS_SITETENSOR_DECOMPOSE_DEBUG
 
+/* A symmetry sector is decomposed by a randomized SVD if maxD plus the
+ * oversampling is at most min(M, N) / RSVD_MIN_RATIO. */
+#define RSVD_OVERSAMPLE 10
+#define RSVD_MIN_RATIO 4
+#define RSVD_POWER_ITS 2
+
+/* Sets the number of threads LAPACK uses in calls from the calling thread.
+ * For 0, the default of MKL is used again. */
+static void set_lapack_threads(int nthreads)
+{
+#ifdef T3NS_THREADED_LAPACK
+        if (nthreads > 0) { omp_set_num_threads(nthreads); }
+#ifdef T3NS_MKL
+        mkl_set_num_threads_local(nthreads);
+#endif
+#else
+        (void) nthreads;
+#endif
+}
+
+/* Divides the threads over the blocks that cost more than an even share of
+ * the total. Returns the number of these large blocks, team[i] is the number
+ * of threads for the i'th most expensive one.
+ *
+ * The large blocks only get more than one thread if LAPACK is threaded and
+ * this is not called from a parallel region. */
+static int large_blocks(int n, const double * cost, const int * order, 
+                        int nthreads, int * team)
+{
+#ifdef T3NS_THREADED_LAPACK
+        if (nthreads == 1 || omp_get_active_level() > 0) { return 0; }
+
+        double total = 0;
+        for (int i = 0; i < n; ++i) { if (cost[i] > 0) { total += cost[i]; } }
+
+        int nlarge = 0;
+        int used = 0;
+        for (int i = n - 1; i >= 0 && cost[order[i]] * nthreads > total; --i) {
+                team[nlarge] = (int) (nthreads * cost[order[i]] / total);
+                used += team[nlarge++];
+        }
+        /* Keep a thread for the small blocks */
+        if (nlarge < n && used == nthreads && team[0] > 1) { --team[0]; }
+        return nlarge;
+#else
+        (void) n; (void) cost; (void) order; (void) nthreads; (void) team;
+        return 0;
+#endif
+}
+
+/* Returns the large block for which thread t lends its core to LAPACK, or 
+ * -1 if none. */
+static int lent_to(int t, int nlarge, const int * team)
+{
+        t -= nlarge;
+        for (int i = 0; i < nlarge && t >= 0; ++i) {
+                if (t < team[i] - 1) { return i; }
+                t -= team[i] - 1;
+        }
+        return -1;
+}
+
+/* Executes blockwork(dat, block) for every block with a non-negative cost.
+ *
+ * The blocks are distributed dynamically over the threads, largest first.
+ * Blocks that cost more than an even share of the total over the threads can
+ * not be balanced. With a threaded LAPACK (T3NS_THREADED_LAPACK), each of
+ * them gets a share of the threads proportional to its cost for its LAPACK
+ * calls in a nested parallel region. The threads lent to these LAPACK calls
+ * sleep till the large block is done, the other threads do the small blocks
+ * at the same time. Afterwards, all threads help with the small blocks that
+ * are left. Otherwise, every block uses a single threaded LAPACK.
+ *
+ * The team always has all threads, a smaller team would end the surplus
+ * threads of the pool together with their arenas.
+ *
+ * Returns 1 if a blockwork failed. */
+static int schedule_blocks(int n, double * cost, void * dat, 
+                           int (*blockwork)(void *, int))
+{
+        int * order = quickSort(cost, n, SORT_DOUBLE);
+        int erflag = 0;
+
+        const int nthreads = omp_get_max_threads();
+        int * team = safe_malloc(nthreads, *team);
+        const int nlarge = large_blocks(n, cost, order, nthreads, team);
+        omp_lock_t * done = nlarge == 0 ? NULL : safe_malloc(nlarge, *done);
+        for (int i = 0; i < nlarge; ++i) { omp_init_lock(&done[i]); }
+
+        const int max_levels = omp_get_max_active_levels();
+        const int dynamic = omp_get_dynamic();
+#ifdef T3NS_MKL
+        const int mkl_dynamic = mkl_get_dynamic();
+#endif
+        if (nlarge > 0) {
+                omp_set_max_active_levels(2);
+                omp_set_dynamic(0);
+#ifdef T3NS_MKL
+                /* Else MKL is sequential in a parallel region */
+                mkl_set_dynamic(0);
+#endif
+        }
+
+#pragma omp parallel num_threads(nthreads) default(none) shared(erflag, order, cost, dat, blockwork, n, team, done)
+        {
+                const int t = omp_get_thread_num();
+                const int lent = lent_to(t, nlarge, team);
+                if (t < nlarge) { omp_set_lock(&done[t]); }
+#pragma omp barrier
+                if (t < nlarge) {
+                        const int block = order[n - 1 - t];
+                        set_lapack_threads(team[t]);
+                        if (!erflag && cost[block] >= 0 && 
+                            blockwork(dat, block)) { erflag = 1; }
+                        omp_unset_lock(&done[t]);
+                } else if (lent != -1) {
+                        omp_set_lock(&done[lent]);
+                        omp_unset_lock(&done[lent]);
+                }
+                set_lapack_threads(1);
+
+#pragma omp for schedule(dynamic) nowait
+                for (int i = n - 1 - nlarge; i >= 0; --i) {
+                        const int block = order[i];
+                        if (!erflag && cost[block] >= 0 && 
+                            blockwork(dat, block)) { erflag = 1; }
+                }
+                set_lapack_threads(0);
+        }
+
+        if (nlarge > 0) {
+                omp_set_max_active_levels(max_levels);
+                omp_set_dynamic(dynamic);
+#ifdef T3NS_MKL
+                mkl_set_dynamic(mkl_dynamic);
+#endif
+        }
+        for (int i = 0; i < nlarge; ++i) { omp_destroy_lock(&done[i]); }
+        safe_free(done);
+        safe_free(team);
+        safe_free(order);
+        return erflag;
+}
+
 static int * sort_indices(int (*indices)[3], int n, int b)
 {
         assert(b < 3 && b >= 0);
@@ -249,24 +394,41 @@ static void QR_copy_fromto_mem(struct qrdata * dat, EL_TYPE * mem, int Rblock,
                 }
                 assert( M * N * O == get_size_block(T, *id));
 
-                if (copy_type == TO_MEMORY) {
-                        for (int m = 0; m < M; ++m) 
-                                for (int n = 0; n < N; ++n)
-                                        for (int o = 0; o < O; ++o)
-                                                cmem[m + o * M + ldmem * n] = 
-                                                        bl_p[m + n * M + o * M * N];
-                } else {
-                        for (int m = 0; m < M; ++m) 
-                                for (int n = 0; n < N; ++n)
-                                        for (int o = 0; o < O; ++o)
-                                                bl_p[m + n * M + o * M * N] =
-                                                        cmem[m + o * M + ldmem * n];
+                // Runs of M elements are contiguous in both layouts
+                for (int o = 0; o < O; ++o) {
+                        for (int n = 0; n < N; ++n) {
+                                EL_TYPE * m_p = &cmem[o * M + ldmem * n];
+                                EL_TYPE * b_p = &bl_p[n * M + o * M * N];
+                                if (copy_type == TO_MEMORY) {
+                                        memcpy(m_p, b_p, M * sizeof *m_p);
+                                } else {
+                                        memcpy(b_p, m_p, M * sizeof *m_p);
+                                }
+                        }
                 }
                 cmem += M * O;
         }
         assert(cmem - mem == ldmem);
 }
 
+/* Returns the block of T that already is the M x N matrix of the sector in
+ * column-major order, or NULL if the sector has to be gathered.
+ * This is the case for a single block without legs after the bond. */
+static EL_TYPE * qr_sector_block(const struct qrdata * dat, 
+                              const struct sparseblocks * T, int Rblock)
+{
+        if (dat->idstart[Rblock + 1] - dat->idstart[Rblock] != 1) { 
+                return NULL; 
+        }
+        const int block = dat->idperm[dat->idstart[Rblock]];
+        for (int i = dat->bond + 1; i < 3; ++i) {
+                if (dat->symarr[i].dims[dat->indices[block][i]] != 1) { 
+                        return NULL; 
+                }
+        }
+        return get_tel_block(T, block);
+}
+
 static int qrblocks(struct qrdata * dat, int Rblock)
 {
         int M, N, minMN;
@@ -277,17 +439,28 @@ static int qrblocks(struct qrdata * dat, int Rblock)
         }
         assert(dat->symarr[dat->bond].dims[Rblock] == N);
 
-        const int memsize = M * N;
-        EL_TYPE * mem = safe_malloc(memsize, *mem);
-        QR_copy_fromto_mem(dat, mem, Rblock, M, N, TO_MEMORY);
+        struct arena * ar = thread_arena();
+        const long long mark = arena_mark(ar);
+        /* If the sector is a single block of the right size in Q, it is 
+         * decomposed in place in Q instead of in a gathered copy. */
+        const int bl = dat->idperm[dat->idstart[Rblock]];
+        EL_TYPE * mem = minMN != N ? NULL : 
+                qr_sector_block(dat, &dat->Q->blocks, Rblock);
+        const bool in_place = mem != NULL;
+        if (in_place) {
+                memcpy(mem, get_tel_block(&dat->A->blocks, bl), 
+                       M * N * sizeof *mem);
+        } else {
+                mem = arena_malloc(ar, M * N, *mem);
+                QR_copy_fromto_mem(dat, mem, Rblock, M, N, TO_MEMORY);
+        }
 
-        EL_TYPE * tau  = safe_malloc(minMN, *tau);
+        EL_TYPE * tau  = arena_malloc(ar, minMN, *tau);
         int info = LAPACKE_dgeqrf(LAPACK_COL_MAJOR, M, N, mem, M, tau);
         if (info) {
                 fprintf(stderr, "%d %d %p %p\n", M, N, (void *) mem, (void *) tau);
                 fprintf(stderr, "dgeqrf exited with %d.\n", info);
-                safe_free(mem);
-                safe_free(tau);
+                arena_release(ar, mark);
                 return 1;
         }
         copy_to_R(dat->R, mem, M, N, Rblock);
@@ -295,21 +468,26 @@ static int qrblocks(struct qrdata * dat, int Rblock)
         info = LAPACKE_dorgqr(LAPACK_COL_MAJOR, M, minMN, minMN, mem, M, tau);
         if (info) {
                 fprintf(stderr, "dorgqr exited with %d.\n", info);
-                safe_free(mem);
-                safe_free(tau);
+                arena_release(ar, mark);
                 return 1;
         }
-        QR_copy_fromto_mem(dat, mem, Rblock, M, minMN, FROM_MEMORY);
+        if (!in_place) {
+                QR_copy_fromto_mem(dat, mem, Rblock, M, minMN, FROM_MEMORY);
+        }
 
         // change the dimension in the bookkeeper
         assert(M >= minMN);
         dat->symarr[dat->bond].dims[Rblock] = minMN;
 
-        safe_free(mem);
-        safe_free(tau);
+        arena_release(ar, mark);
         return 0;
 }
 
+static int qrblocks_work(void * dat, int Rblock) 
+{ 
+        return qrblocks(dat, Rblock); 
+}
+
 int qr(struct siteTensor * A, int bond, 
        struct siteTensor * Q, struct Rmatrix * R)
 {
@@ -318,11 +496,15 @@ int qr(struct siteTensor * A, int bond,
 
         struct qrdata dat = init_qrdata(A, Q, R, bond);
 
-        int erflag = 0;
-#pragma omp parallel for schedule(dynamic) default(none) shared(erflag, dat)
+        double * cost = safe_malloc(dat.nrRblocks, *cost);
         for (int block = 0; block < dat.nrRblocks; ++block) {
-                if (!erflag && qrblocks(&dat, block) != 0) { erflag = 1; }
+                int M, N, minMN;
+                getQRdimensions(&dat, &M, &N, &minMN, block);
+                cost[block] = (double) M * N * minMN;
         }
+        const int erflag = schedule_blocks(dat.nrRblocks, cost, &dat, 
+                                           qrblocks_work);
+        safe_free(cost);
 
         if (erflag) {
                 fprintf(stderr, "QR failed.\n");
@@ -497,10 +679,14 @@ static int orthoblock(struct qrdata * dat, int Rblock)
         if (!getQRdimensions(dat, &M, &N, &minMN, Rblock)) { return 0; }
         assert(dat->symarr[dat->bond].dims[Rblock] == N);
 
-        const int memsize = M * N;
-        EL_TYPE * mem = safe_malloc(memsize, *mem);
-        QR_copy_fromto_mem(dat, mem, Rblock, M, N, TO_MEMORY);
-        EL_TYPE * isunit = safe_malloc(N *N, *isunit);
+        struct arena * ar = thread_arena();
+        const long long mark = arena_mark(ar);
+        EL_TYPE * mem = qr_sector_block(dat, &dat->A->blocks, Rblock);
+        if (mem == NULL) {
+                mem = arena_malloc(ar, M * N, *mem);
+                QR_copy_fromto_mem(dat, mem, Rblock, M, N, TO_MEMORY);
+        }
+        EL_TYPE * isunit = arena_malloc(ar, N *N, *isunit);
         cblas_dsyrk(CblasColMajor, CblasUpper, CblasTrans, N, M, 
                     1, mem, M, 0, isunit, N);
         // Only upper triangle of unit should be stored in isunit.
@@ -523,8 +709,7 @@ static int orthoblock(struct qrdata * dat, int Rblock)
                 if (!flag) { break; }
         }
 
-        safe_free(mem);
-        safe_free(isunit);
+        arena_release(ar, mark);
         return flag;
 }
 
@@ -586,16 +771,22 @@ struct svddata {
         int id_csite;
         // The id of the bond to which it is connected.
         int id_cbond;
+        // The maximal bond dimension after truncation.
+        int maxD;
 
         // The leg-indices of A for each of its sites.
         int legs[STEPSPECS_MSITES][3];
         // The symsecs corresponding to legs.
         struct symsecs symarr[STEPSPECS_MSITES][3];
 
-        // Pointer to the tensor to decompose.
-        const struct siteTensor * A;
+        // Pointer to the tensor to decompose, its blocks are overwritten.
+        struct siteTensor * A;
         // U-tensor from SVD.
         struct siteTensor * U;
+        // Tensor with the same blocks as A to project on V, or NULL.
+        const struct siteTensor * B;
+        // The projection of B on V, same blocks as U.
+        struct siteTensor * UB;
         // Singular values from SVD.
         struct Sval * S;
         // V-tensor from SVD.
@@ -641,6 +832,11 @@ struct svd_bond_info {
         int * Nstart;
         // Allocated memory for VT
         EL_TYPE * memVT;
+        // Allocated memory for B projected on V (only if B is given)
+        EL_TYPE * memUB;
+        /* The weight of the singular values that are not calculated by a 
+         * randomized SVD and their number. */
+        double tail[2];
 };
 
 static void destroy_svd_bond_info(struct svd_bond_info * info)
@@ -652,6 +848,7 @@ static void destroy_svd_bond_info(struct svd_bond_info * info)
         safe_free(info->Nstart);
         safe_free(info->memU);
         safe_free(info->memVT);
+        safe_free(info->memUB);
 }
 
 static void destroy_svddata(struct svddata * dat)
@@ -777,6 +974,23 @@ static void make_r_count_svdinfos(struct svddata * dat, int make)
         }
 }
 
+/* Allocates the memory for dimS singular triplets of a symmetry sector.
+ * If dimS is smaller than min(M, N) a randomized SVD is done. */
+static void alloc_svdblocks(struct svddata * dat, int ss, int dimS)
+{
+        struct svd_bond_info * inf = &dat->ss_info[ss];
+        const int M = inf->Mstart[inf->Msecs];
+        const int N = inf->Nstart[inf->Nsecs];
+        dat->S->dimS[ss][0] = dimS;
+        dat->S->dimS[ss][1] = 0;
+        dat->S->sing[ss] = safe_malloc(dimS, *dat->S->sing[ss]);
+        inf->memU = safe_malloc(dimS * M, *inf->memU);
+        inf->memVT = safe_malloc(dimS * N, *inf->memVT);
+        inf->memUB = dat->B == NULL ? NULL : safe_malloc(dimS * M, *inf->memUB);
+        inf->tail[0] = 0;
+        inf->tail[1] = 0;
+}
+
 static void make_svdinfos(struct svddata * dat)
 {
         dat->nrSss = dat->symarr[dat->id_csite][dat->id_cbond].nrSecs;
@@ -813,22 +1027,26 @@ static void make_svdinfos(struct svddata * dat)
                 }
                 const int M = inf->Mstart[inf->Msecs];
                 const int N = inf->Nstart[inf->Nsecs];
-                const int dimS = M < N ? M : N;
-                dat->S->dimS[ss][0] = dimS;
-                dat->S->dimS[ss][1] = 0;
-                dat->S->sing[ss] = safe_malloc(dimS, *dat->S->sing[ss]);
-                inf->memU = safe_malloc(dimS * M, *inf->memU);
-                inf->memVT = safe_malloc(dimS * N, *inf->memVT);
+                const int minMN = M < N ? M : N;
+                // No more than maxD singular values can be kept
+                const int rank = dat->maxD + RSVD_OVERSAMPLE;
+                alloc_svdblocks(dat, ss, rank * RSVD_MIN_RATIO <= minMN ? 
+                                rank : minMN);
         }
 }
 
-static struct svddata init_svddata(const struct siteTensor * A, int site, 
+static struct svddata init_svddata(struct siteTensor * A, int site, 
                                    struct siteTensor * U, struct Sval * S, 
-                                   struct siteTensor * V)
+                                   struct siteTensor * V, 
+                                   const struct siteTensor * B,
+                                   struct siteTensor * UB, int maxD)
 {
         struct svddata result;
+        result.maxD = maxD;
         result.A = A;
         result.U = U;
+        result.B = B;
+        result.UB = UB;
         result.V = V;
         result.S = S;
         int to_incl[STEPSPECS_MSITES];
@@ -922,28 +1140,51 @@ static void get_dims(int * dims, int block, const struct siteTensor * T,
         assert(get_size_block(&T->blocks, block) == dims[0] * dims[1] * dims[2]);
 }
 
-// Copies and permutes a block from A to the working memory
-static void SVD_copy_to_mem(struct svddata * dat, const int ssid, 
+/* Returns the block of T (A or a tensor with the same blocks) that already is
+ * the M x N matrix of the sector in column-major order, or NULL if the sector
+ * has to be gathered. This is the case for a single block of which the legs 
+ * of the site to split off are the last ones. */
+static EL_TYPE * svd_sector_block(struct svddata * dat, 
+                                 const struct siteTensor * T, const int ssid)
+{
+        const struct svd_bond_info * inf = &dat->ss_info[ssid];
+        if (inf->idpermAsize != 1 || inf->Msecs != 1 || inf->Nsecs != 1) {
+                return NULL;
+        }
+        int dims[3];
+        get_dims(dims, inf->idpermA[0], T, dat->id_siteV, -1, 
+                 NULL, dat->symarr);
+        return dims[2] == 1 ? get_tel_block(&T->blocks, inf->idpermA[0]) : NULL;
+}
+
+// Copies and permutes a block from A (or a tensor with the same blocks) to 
+// the working memory
+static void SVD_copy_to_mem(struct svddata * dat, 
+                            const struct siteTensor * A, const int ssid, 
                             EL_TYPE * memA)
 {
         const struct svd_bond_info inf = dat->ss_info[ssid];
+        const int M = inf.Mstart[inf.Msecs];
+        // Only the tiles without a block in A have to be zeroed.
+        bool filled[inf.Msecs * inf.Nsecs];
+        for (int i = 0; i < inf.Msecs * inf.Nsecs; ++i) { filled[i] = false; }
 
         for (const int * block = inf.idpermA; 
              block < &inf.idpermA[inf.idpermAsize]; ++block) {
-                EL_TYPE * telA = get_tel_block(&dat->A->blocks, *block);
+                const EL_TYPE * telA = get_tel_block(&A->blocks, *block);
 
-                QN_TYPE * currqn = &dat->A->qnumbers[dat->A->nrsites * *block];
+                QN_TYPE * currqn = &A->qnumbers[A->nrsites * *block];
                 QN_TYPE qnU[STEPSPECS_MSITES];
                 QN_TYPE qnV;
                 int cnt = 0;
-                for (int i = 0; i < dat->A->nrsites; ++i) {
+                for (int i = 0; i < A->nrsites; ++i) {
                         if (i != dat->id_siteV) {
                                 qnU[cnt++] = currqn[i];
                         } else {
                                 qnV = currqn[i];
                         }
                 }
-                assert(cnt == dat->A->nrsites - 1);
+                assert(cnt == A->nrsites - 1);
 
                 const int idU = find_qn_in_idperm(qnU, inf.idpermU, inf.Msecs, 
                                                   dat->U->qnumbers, 
@@ -955,25 +1196,86 @@ static void SVD_copy_to_mem(struct svddata * dat, const int ssid,
                                                   dat->V->nrsites);
                 assert(idV >= 0 && idV < inf.Nsecs);
 
+                filled[idU + inf.Msecs * idV] = true;
+
                 const int Mpos = inf.Mstart[idU];
                 const int Npos = inf.Nstart[idV];
-                EL_TYPE * mem = &memA[Mpos + inf.Mstart[inf.Msecs] * Npos];
+                EL_TYPE * mem = &memA[Mpos + M * Npos];
 
                 int dims[3] = {1, 1, 1};
-                get_dims(dims, *block, dat->A, dat->id_siteV, -1, 
+                get_dims(dims, *block, A, dat->id_siteV, -1, 
                          NULL, dat->symarr);
-                const int ld[2][3] = {
-                        {1, dims[0], dims[0] * dims[1]}, 
-                        {1, dims[0], inf.Mstart[inf.Msecs]}
-                };
                 assert(dims[0] * dims[2] == inf.Mstart[idU+1]-inf.Mstart[idU]);
                 assert(dims[1] == inf.Nstart[idV + 1] - inf.Nstart[idV]);
                 assert(dims[0] * dims[1] * dims[2] == 
-                       get_size_block(&dat->A->blocks, *block));
+                       get_size_block(&A->blocks, *block));
+
+                // Runs of dims[0] elements are contiguous in both layouts
+                for (int n = 0; n < dims[1]; ++n) {
+                        for (int k = 0; k < dims[2]; ++k) {
+                                const int o = n * dims[0] + 
+                                        k * dims[0] * dims[1];
+                                memcpy(&mem[k * dims[0] + n * M], &telA[o],
+                                       dims[0] * sizeof *mem);
+                        }
+                }
+        }
 
-                const int old[] = {1, dims[0] * dims[1], dims[0]};
-                const int idim[] = {dims[0], dims[2], dims[1]};
-                permadd_block(telA, old, mem, ld[1], idim, 3, 1);
+        for (int idV = 0; idV < inf.Nsecs; ++idV) {
+                for (int idU = 0; idU < inf.Msecs; ++idU) {
+                        if (filled[idU + inf.Msecs * idV]) { continue; }
+                        const int Mpos = inf.Mstart[idU];
+                        const int Msize = inf.Mstart[idU + 1] - Mpos;
+                        for (int n = inf.Nstart[idV]; n < inf.Nstart[idV + 1]; 
+                             ++n) {
+                                memset(&memA[Mpos + M * n], 0, 
+                                       Msize * sizeof *memA);
+                        }
+                }
+        }
+}
+
+// Copies and permutes the first dimS columns of memU to the blocks of U
+static void copy_U_from_mem(struct svddata * dat, const int ssid,
+                            const EL_TYPE * memU, struct siteTensor * U)
+{
+        const struct svd_bond_info inf = dat->ss_info[ssid];
+        const int dimS = dat->S->dimS[ssid][1];
+        const int M = inf.Mstart[inf.Msecs];
+        for (int idU = 0; idU < inf.Msecs; ++idU) {
+                const int block = inf.idpermU[idU];
+                EL_TYPE * telU = get_tel_block(&U->blocks, block);
+
+                const EL_TYPE * mem = &memU[inf.Mstart[idU]];
+
+                const int id_csite = dat->id_csite - 
+                        (dat->id_siteV < dat->id_csite);
+                int sitemap[STEPSPECS_MSITES];
+                for (int i = 0; i < U->nrsites; ++i) {
+                        sitemap[i] = i + (i >= dat->id_siteV);
+                }
+
+                int tdims[3];
+                get_dims(tdims, block, U, id_csite, dat->id_cbond, 
+                         sitemap, dat->symarr);
+
+                assert(tdims[1] == dimS);
+                int dims[3] = {tdims[0], tdims[2], dimS};
+                const int ld[2][3] = {
+                        {1, dims[0], M}, 
+                        {1, dims[0], dims[0] * dims[2]}
+                };
+                assert(dims[0] * dims[1] == inf.Mstart[idU+1]-inf.Mstart[idU]);
+                assert(dims[0] * dims[1] * dims[2] == 
+                       get_size_block(&U->blocks, block));
+                // Runs of dims[0] elements are contiguous in both layouts
+                for (int k = 0; k < dims[1]; ++k) {
+                        for (int s = 0; s < dimS; ++s) {
+                                memcpy(&telU[s * ld[1][1] + k * ld[1][2]], 
+                                       &mem[s * M + k * dims[0]], 
+                                       dims[0] * sizeof *telU);
+                        }
+                }
         }
 }
 
@@ -1015,62 +1317,180 @@ static int SVD_copy_from_mem(struct svddata * dat, const int ssid)
                 cblas_dscal(M, dat->S->sing[ssid][s], inf.memU + s * M, 1);
         }
 
-        for (int idU = 0; idU < inf.Msecs; ++idU) {
-                const int block = inf.idpermU[idU];
-                EL_TYPE * telU = get_tel_block(&dat->U->blocks, block);
+        copy_U_from_mem(dat, ssid, inf.memU, dat->U);
+        if (dat->UB != NULL) { 
+                copy_U_from_mem(dat, ssid, inf.memUB, dat->UB); 
+        }
+        return 0;
+}
 
-                const EL_TYPE * mem = &inf.memU[inf.Mstart[idU]];
+/* Orthonormalizes the columns of the M x k matrix Y. */
+static int orthonormalize(int M, int k, EL_TYPE * Y, EL_TYPE * tau)
+{
+        int info = LAPACKE_dgeqrf(LAPACK_COL_MAJOR, M, k, Y, M, tau);
+        if (!info) { info = LAPACKE_dorgqr(LAPACK_COL_MAJOR, M, k, k, Y, M, tau); }
+        return info;
+}
 
-                const int id_csite = dat->id_csite - 
-                        (dat->id_siteV < dat->id_csite);
-                int sitemap[STEPSPECS_MSITES];
-                for (int i = 0; i < dat->U->nrsites; ++i) {
-                        sitemap[i] = i + (i >= dat->id_siteV);
+/* The range is refined by RSVD_POWER_ITS power iterations. The weight of
+ * the singular values that are not captured is |A - Q Q^T A|^2. */
+int randomized_svd(int M, int N, const EL_TYPE * A, int k, double * sing,
+                   EL_TYPE * U, EL_TYPE * VT, double * tail, 
+                   unsigned int seed)
+{
+        struct arena * ar = thread_arena();
+        const long long mark = arena_mark(ar);
+        EL_TYPE * Y = arena_malloc(ar, (long long) M * k, *Y);
+        EL_TYPE * Z = arena_malloc(ar, (long long) N * k, *Z);
+        EL_TYPE * B = arena_malloc(ar, (long long) N * k, *B);
+        EL_TYPE * UB = arena_malloc(ar, (long long) k * k, *UB);
+        EL_TYPE * tau = arena_malloc(ar, k, *tau);
+
+        for (long long i = 0; i < (long long) N * k; ++i) {
+                Z[i] = rand_r(&seed) * 1. / RAND_MAX - 0.5;
+        }
+        cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, M, k, N, 1, 
+                    A, M, Z, N, 0, Y, M);
+        int info = orthonormalize(M, k, Y, tau);
+        for (int it = 0; !info && it < RSVD_POWER_ITS; ++it) {
+                cblas_dgemm(CblasColMajor, CblasTrans, CblasNoTrans, N, k, M, 
+                            1, A, M, Y, M, 0, Z, N);
+                info = orthonormalize(N, k, Z, tau);
+                if (info) { break; }
+                cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, M, k, N, 
+                            1, A, M, Z, N, 0, Y, M);
+                info = orthonormalize(M, k, Y, tau);
+        }
+
+        if (!info) {
+                // B = Y^T A = UB S VT
+                cblas_dgemm(CblasColMajor, CblasTrans, CblasNoTrans, k, N, M, 
+                            1, Y, M, A, M, 0, B, k);
+                info = LAPACKE_dgesdd(LAPACK_COL_MAJOR, 'S', k, N, B, k, sing, 
+                                      UB, k, VT, k);
+        }
+        if (!info) {
+                cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, M, k, k, 
+                            1, Y, M, UB, k, 0, U, M);
+                *tail = 0;
+                for (long long i = 0; i < (long long) M * N; ++i) {
+                        *tail += A[i] * A[i];
                 }
-
-                int tdims[3];
-                get_dims(tdims, block, dat->U, id_csite, dat->id_cbond, 
-                         sitemap, dat->symarr);
-
-                assert(tdims[1] == dimS);
-                int dims[3] = {tdims[0], tdims[2], dimS};
-                const int ld[2][3] = {
-                        {1, dims[0], M}, 
-                        {1, dims[0], dims[0] * dims[2]}
-                };
-                assert(dims[0] * dims[1] == inf.Mstart[idU+1]-inf.Mstart[idU]);
-                assert(dims[0] * dims[1] * dims[2] == 
-                       get_size_block(&dat->U->blocks, block));
-                const int old[] = {1, M, dims[0]};
-                permadd_block(mem, old, telU, ld[1], tdims, 3, 1);
+                for (int i = 0; i < k; ++i) { *tail -= sing[i] * sing[i]; }
+                if (*tail < 0) { *tail = 0; }
         }
-        return 0;
+        arena_release(ar, mark);
+        return info;
 }
 
 static int svdblocks(struct svddata * dat, int ssid)
 {
         if (dat->S->dimS[ssid][0] == 0) { return 0; }
-        const struct svd_bond_info inf = dat->ss_info[ssid];
-        const int M = inf.Mstart[inf.Msecs];
-        const int N = inf.Nstart[inf.Nsecs];
-        assert(dat->S->dimS[ssid][0] == (M < N ? M : N));
+        struct svd_bond_info * inf = &dat->ss_info[ssid];
+        const int M = inf->Mstart[inf->Msecs];
+        const int N = inf->Nstart[inf->Nsecs];
+        const int minMN = M < N ? M : N;
+        const int dimS = dat->S->dimS[ssid][0];
+        assert(dimS <= minMN);
+
+        struct arena * ar = thread_arena();
+        const long long mark = arena_mark(ar);
+        /* A is destroyed after the decomposition, so a sector that is a 
+         * single block is decomposed in place. A randomized SVD only reads
+         * it, so it can still be redone afterwards. */
+        EL_TYPE * memA = svd_sector_block(dat, dat->A, ssid);
+        if (memA == NULL) {
+                memA = arena_malloc(ar, (long long) M * N, *memA);
+                SVD_copy_to_mem(dat, dat->A, ssid, memA);
+        }
+        int info;
+        if (dimS < minMN) {
+                info = randomized_svd(M, N, memA, dimS, dat->S->sing[ssid], 
+                                      inf->memU, inf->memVT, &inf->tail[0], 
+                                      ssid + 1);
+                inf->tail[1] = minMN - dimS;
+        } else {
+                info = LAPACKE_dgesdd(LAPACK_COL_MAJOR, 'S', M, N, memA, M, 
+                                      dat->S->sing[ssid], inf->memU, M, 
+                                      inf->memVT, dimS);
+        }
 
-        EL_TYPE * memA = safe_calloc(M * N, memA);
-        SVD_copy_to_mem(dat, ssid, memA);
-        int info = LAPACKE_dgesdd(LAPACK_COL_MAJOR, 'S', M, N, memA, M, 
-                                  dat->S->sing[ssid], inf.memU, M, 
-                                  inf.memVT, dat->S->dimS[ssid][0]);
+        if (!info && dat->B != NULL) {
+                // UB = B * V
+                const EL_TYPE * memB = svd_sector_block(dat, dat->B, ssid);
+                if (memB == NULL) {
+                        SVD_copy_to_mem(dat, dat->B, ssid, memA);
+                        memB = memA;
+                }
+                cblas_dgemm(CblasColMajor, CblasNoTrans, CblasTrans, M, dimS, 
+                            N, 1, memB, M, inf->memVT, dimS, 0, inf->memUB, M);
+        }
 
         if (info) {
                 fprintf(stderr, "%d %d %d %d %d %d\n", M, N,
-                        dat->S->dimS[ssid][0], ssid, inf.Msecs, inf.Nsecs);
+                        dimS, ssid, inf->Msecs, inf->Nsecs);
                 fprintf(stderr, "dgesdd exited with %d.\n", info);
         }
-        safe_free(memA);
+        arena_release(ar, mark);
 
         return info != 0;
 }
 
+static int svdblocks_work(void * dat, int ssid) 
+{ 
+        return svdblocks(dat, ssid); 
+}
+
+/* The expected cost of the SVD of every sector, -1 if it should be skipped. */
+static double * svd_costs(const struct svddata * dat, const int * todo)
+{
+        double * cost = safe_malloc(dat->nrSss, *cost);
+        for (int ss = 0; ss < dat->nrSss; ++ss) {
+                const struct svd_bond_info * inf = &dat->ss_info[ss];
+                cost[ss] = todo != NULL && !todo[ss] ? -1 : 
+                        (double) inf->Mstart[inf->Msecs] * 
+                        inf->Nstart[inf->Nsecs] * dat->S->dimS[ss][0];
+        }
+        return cost;
+}
+
+/* Redoes the randomized SVDs with a full SVD where an uncalculated singular 
+ * value can be larger than the smallest kept one, i.e. where the tail weight 
+ * is larger than its square. Returns the number of redone sectors, or -1 on
+ * failure. */
+static int redo_unreliable_svds(struct svddata * dat)
+{
+        double s_cut = -1;
+        for (int ss = 0; ss < dat->nrSss; ++ss) {
+                const int kept = dat->S->dimS[ss][1];
+                if (kept == 0) { continue; }
+                const double s = dat->S->sing[ss][kept - 1];
+                if (s_cut < 0 || s < s_cut) { s_cut = s; }
+        }
+
+        int * redo = safe_calloc(dat->nrSss, *redo);
+        int nredo = 0;
+        for (int ss = 0; ss < dat->nrSss; ++ss) {
+                struct svd_bond_info * inf = &dat->ss_info[ss];
+                redo[ss] = inf->tail[1] != 0 && inf->tail[0] > s_cut * s_cut;
+                if (!redo[ss]) { continue; }
+                ++nredo;
+                const int minMN = dat->S->dimS[ss][0] + inf->tail[1];
+                safe_free(dat->S->sing[ss]);
+                safe_free(inf->memU);
+                safe_free(inf->memVT);
+                safe_free(inf->memUB);
+                alloc_svdblocks(dat, ss, minMN);
+        }
+
+        double * cost = svd_costs(dat, redo);
+        safe_free(redo);
+        const int erflag = schedule_blocks(dat->nrSss, cost, dat, 
+                                           svdblocks_work);
+        safe_free(cost);
+        return erflag ? -1 : nredo;
+}
+
 static bool good_site_to_split(const struct siteTensor * A, int site)
 {
         int siteid;
@@ -1193,6 +1613,28 @@ static int truncSatisfied(const struct SvalSelect * sel, struct SelectRes * res)
         return -1;
 }
 
+/* Adds the weight of the singular values not calculated by a randomized SVD 
+ * to the norm. For the entropy the tail weight is assumed to be uniformly 
+ * spread over the uncalculated singular values. This is an upper bound, 
+ * thus the truncation error is never underestimated. */
+static void add_tail_contributions(const struct Sval * S, 
+                                   const struct svd_bond_info * ss_info,
+                                   struct SelectRes * res)
+{
+        struct symsecs symm;
+        get_symsecs(&symm, S->bond);
+        for (int block = 0; block < S->nrblocks; ++block) {
+                const double w = ss_info[block].tail[0];
+                const double n = ss_info[block].tail[1];
+                if (w == 0) { continue; }
+                const int multipl = multiplicity(bookie.nrSyms, bookie.sgs, 
+                                                 symm.irreps[block]);
+                res->norm[0] += w;
+                res->entropy[0] += n * multipl * 
+                        VonNeumannEntropy(sqrt(w / (n * multipl)));
+        }
+}
+
 /*
  * Selects the singular values that should be kept after truncation.
  *
@@ -1201,15 +1643,19 @@ static int truncSatisfied(const struct SvalSelect * sel, struct SelectRes * res)
  * param sel [in] structure with the selection criteria.
  * param res [out] structure which stores the discarded weight and loss in 
  * entanglement entropy.
+ * param ss_info [in] The info of the symmetry sectors with the weight of the 
+ * singular values not calculated by a randomized SVD.
  * return 0 for success, 1 for failure.
  */
 static int selectS(struct Sval * S, const struct SvalSelect * sel, 
-                   struct SelectRes * res)
+                   struct SelectRes * res, 
+                   const struct svd_bond_info * ss_info)
 {
         assert(sel->truncType == 'E' || sel->truncType == 'W');
         
         res->entropy[0] = calculateCostFunction(S, VonNeumannEntropy, 'A');
         res->norm[0] = calculateCostFunction(S, TotalWeight, 'A');
+        add_tail_contributions(S, ss_info, res);
         assert(fabs(res->norm[0] - 1) < 1e-10);
         
         int totalsings = 0;
@@ -1330,6 +1776,7 @@ static void init_UV_tensors_and_change_symsec(struct svddata * dat)
                                          *dat->U->blocks.tel);
         dat->V->blocks.tel = safe_calloc(siteTensor_get_size(dat->V),
                                          *dat->V->blocks.tel);
+        if (dat->UB != NULL) { deep_copy_siteTensor(dat->UB, dat->U); }
 }
 
 static void reform_tensor(struct siteTensor * tens, const int * nd, 
@@ -1391,32 +1838,45 @@ static void adapt_UV_tensors_and_kick_empties(struct svddata * dat)
 
         const int csite = dat->id_csite - (dat->id_csite > dat->id_siteV);
         reform_tensor(dat->U, newdimU, olddimU, newid, csite, dat->id_cbond);
+        if (dat->UB != NULL) {
+                reform_tensor(dat->UB, newdimU, olddimU, newid, csite, 
+                              dat->id_cbond);
+        }
         reform_tensor(dat->V, newdimV, olddimV, newid, 0, dat->id_bond);
         safe_free(newid);
 
         
         const int leg = dat->legs[dat->id_siteV][dat->id_bond];
-        kick_empty_symsecs(&bookie.v_symsecs[leg], 'n');
-        assert(cnt == bookie.v_symsecs[leg].nrSecs);
+        struct symsecs * ss = get_symsecs_ptr(leg);
+        kick_empty_symsecs(ss, 'n');
+        assert(cnt == ss->nrSecs);
 }
 
 struct SelectRes split_of_site(struct siteTensor * A, int site, 
                                const struct SvalSelect * sel, 
                                struct siteTensor * U, 
-                               struct Sval * S, struct siteTensor * V)
+                               struct Sval * S, struct siteTensor * V,
+                               struct siteTensor * B)
 {
         struct SelectRes res = { .erflag = 1 };
         if (!good_site_to_split(A, site)) { return res; }
-        struct svddata dat = init_svddata(A, site, U, S, V);
-
-        int erflag = 0;
-#pragma omp parallel for schedule(dynamic) default(none) shared(erflag, dat)
-        for (int ssid = 0; ssid < dat.nrSss; ++ssid) {
-                if (!erflag && svdblocks(&dat, ssid)) { erflag = 1; }
+        struct siteTensor UB;
+        struct svddata dat = init_svddata(A, site, U, S, V, B,
+                                          B == NULL ? NULL : &UB, sel->maxD);
+
+        double * cost = svd_costs(&dat, NULL);
+        int erflag = schedule_blocks(dat.nrSss, cost, &dat, svdblocks_work);
+        safe_free(cost);
+
+        if (!erflag && selectS(S, sel, &res, dat.ss_info)) { erflag = 1; }
+        if (!erflag) {
+                const int redone = redo_unreliable_svds(&dat);
+                if (redone == -1 || 
+                    (redone != 0 && selectS(S, sel, &res, dat.ss_info))) {
+                        erflag = 1;
+                }
         }
 
-        if (!erflag && selectS(S, sel, &res)) { erflag = 1; }
-
         init_UV_tensors_and_change_symsec(&dat);
 #pragma omp parallel for schedule(dynamic) default(none) shared(erflag, dat)
         for (int ssid = 0; ssid < dat.nrSss; ++ssid) {
@@ -1424,14 +1884,20 @@ struct SelectRes split_of_site(struct siteTensor * A, int site,
         }
         adapt_UV_tensors_and_kick_empties(&dat);
         destroy_siteTensor(A);
+        if (B != NULL) {
+                destroy_siteTensor(B);
+                *B = UB;
+        }
 
         if (erflag) {
                 fprintf(stderr, "SVD failed.\n");
                 destroy_Sval(S);
                 destroy_siteTensor(U);
                 destroy_siteTensor(V);
+                if (B != NULL) { destroy_siteTensor(B); }
         }
         norm_tensor(U);
+        if (B != NULL) { norm_tensor(B); }
         destroy_svddata(&dat);
 #ifdef T3NS_SITETENSOR_DECOMPOSE_DEBUG
         if (!erflag && !is_orthogonal(V, dat.id_bond)) {
@@ -1532,7 +1998,8 @@ static void fill_rdim_and_dim(struct decompose_info * info)
 
 struct decompose_info HOSVD(struct siteTensor * A, 
                             int nCenter, struct siteTensor * T3NS, 
-                            const struct SvalSelect * sel)
+                            const struct SvalSelect * sel, 
+                            struct siteTensor * B)
 {
         struct decompose_info info = {
                 .erflag = 1,
@@ -1557,7 +2024,7 @@ struct decompose_info HOSVD(struct siteTensor * A,
                 struct siteTensor newA;
                 destroy_siteTensor(&T3NS[*site]);
                 struct SelectRes res = split_of_site(A, *site, sel, &newA, 
-                                                     &S, &T3NS[*site]);
+                                                     &S, &T3NS[*site], B);
                 if (res.erflag) { return info; }
                 *A = newA;
 
@@ -1579,6 +2046,12 @@ struct decompose_info HOSVD(struct siteTensor * A,
                 info.cuts += 1;
         }
         destroy_siteTensor(&T3NS[A->sites[0]]);
+        if (B != NULL) {
+                // Propagate the projection of B instead of A
+                destroy_siteTensor(A);
+                *A = *B;
+                init_null_siteTensor(B);
+        }
         T3NS[A->sites[0]] = *A;
         info.erflag = 0;
         return info;
@@ -1631,10 +2104,11 @@ struct decompose_info qr_step(struct siteTensor * A, int nCenter,
 
 struct decompose_info decompose_siteTensor(struct siteTensor * A, int nCenter, 
                                            struct siteTensor * T3NS,
-                                           const struct SvalSelect * sel)
+                                           const struct SvalSelect * sel,
+                                           struct siteTensor * B)
 {
         if (A->nrsites > 1) {
-                return HOSVD(A, nCenter, T3NS, sel);
+                return HOSVD(A, nCenter, T3NS, sel, B);
         } else {
                 return qr_step(A, nCenter, T3NS, true);
         }
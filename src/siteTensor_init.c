@@ -169,6 +169,9 @@ static struct {
         // Pointer to the original symsecs.
         struct symsecs ssarr_old[STEPSPECS_MSITES][3];
 } md;
+/* Every thread has its own, such that different threads can permute
+ * different tensors. Parallel regions copy it in. */
+#pragma omp threadprivate(md)
 
 static void add_psite(int bond, int bid, const int * sitelist, int nr) 
 {
@@ -259,8 +262,9 @@ static int init_md(struct siteTensor * T, const int * sitelistdumdum, int nr,
 static void change_internals_in_bookkeeper(void)
 {
         for (int i = 0; i < md.nr_internal; ++i) {
-                destroy_symsecs(&bookie.v_symsecs[md.internals[i]]);
-                bookie.v_symsecs[md.internals[i]] = md.intss[i];
+                struct symsecs * ss = get_symsecs_ptr(md.internals[i]);
+                destroy_symsecs(ss);
+                *ss = md.intss[i];
         }
 }
 
@@ -447,7 +451,7 @@ static void make_qnumbers_and_dims(const struct good_sectors * const gs)
         int nrblocks = 0;
         const bool counted = md.T->nrblocks != 0;
 
-#pragma omp parallel default(none) shared(md) reduction(+:nrblocks)
+#pragma omp parallel default(none) copyin(md) reduction(+:nrblocks)
         {
                 QN_TYPE * qnumbers = NULL;
                 int * dims = NULL;
@@ -767,7 +771,7 @@ static void clean_makeinfo(struct makeinfo * minfo)
 
 static void contractsiteTensors(void)
 {
-#pragma omp parallel for schedule(static) default(none) shared(md)
+#pragma omp parallel for schedule(static) default(none) copyin(md)
         for (int sb = 0; sb < md.T->nrblocks; ++sb) {
                 const int order[3] = {0, 1, 2};
                 struct makeinfo minfo = init_makeinfo(sb);
@@ -859,6 +863,7 @@ static struct {
         // Maps the new bond to the old bond.
         int indexperminv[6];
 } pd;
+#pragma omp threadprivate(pd)
 
 struct permute_helper {
         // Old block index.
@@ -899,10 +904,11 @@ static void permute_orbitals(const int * perm)
 {
         int posP[STEPSPECS_MSITES];
         int orbitals[STEPSPECS_MSITES];
+        int * sitetoorb = get_sitetoorb();
         int cnt = 0;
         for (int i = 0; i < pd.ns; ++i) {
                 if (is_psite(pd.T->sites[i])) { 
-                        orbitals[cnt] = netw.sitetoorb[pd.T->sites[i]];
+                        orbitals[cnt] = sitetoorb[pd.T->sites[i]];
                         posP[cnt++] = i; 
                 }
         }
@@ -910,7 +916,7 @@ static void permute_orbitals(const int * perm)
         cnt = 0;
         for (int i = 0; i < pd.ns; ++i) {
                 if (is_psite(pd.T->sites[i])) { 
-                        netw.sitetoorb[pd.T->sites[i]] = orbitals[perm[cnt]];
+                        sitetoorb[pd.T->sites[i]] = orbitals[perm[cnt]];
                         ++cnt;
                 }
         }
@@ -1178,7 +1184,7 @@ static bool get_o_perm_block(struct permute_helper * ph)
 
 static void permute_tensors(void)
 {
-#pragma omp parallel for schedule(dynamic) default(none) shared(pd,bookie)
+#pragma omp parallel for schedule(dynamic) default(none) copyin(pd) shared(bookie)
         for (int nb = 0; nb < pd.Tp->nrblocks; ++nb) {
                 struct permute_helper ph = init_permute_helper(nb);
                 while (get_o_perm_block(&ph)) { 
@@ -1234,7 +1240,7 @@ int permute_siteTensor(const struct siteTensor * T, struct siteTensor * Tp,
 
         // Initial making of the permutation data
         // In this function some needed symsecs and so are stored and also
-        // the permutation is performed on the netw.sitetoorb array.
+        // the permutation is performed on the sitetoorb array.
         init_pd(T, Tp, perm);
         // Making the md
         if (init_md(Tp, T->sites, pd.ns, NULL)) { return 1; }
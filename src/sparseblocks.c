@@ -21,6 +21,8 @@
 
 #include "sparseblocks.h"
 #include "macros.h"
+#include "arena.h"
+#include "io_to_disk.h"
 #ifdef T3NS_MKL
 #include "mkl.h"
 #else
@@ -67,6 +69,7 @@ void deep_copy_sparseblocks(struct sparseblocks * copy,
 void destroy_sparseblocks(struct sparseblocks * blocks)
 {
         safe_free(blocks->beginblock);
+        if (release_mapped_memory(blocks->tel)) { blocks->tel = NULL; }
         safe_free(blocks->tel);
 }
 
@@ -157,38 +160,120 @@ void do_contract(const struct contractinfo * cinfo, EL_TYPE ** tel,
         }
 }
 
+void init_contractbuffer(struct contractbuffer * buf, struct arena * ar)
+{
+        buf->mem  = NULL;
+        buf->size = 0;
+        buf->ar   = ar;
+}
+
+void destroy_contractbuffer(struct contractbuffer * buf)
+{
+        if (buf->ar == NULL) { safe_free(buf->mem); }
+        buf->mem  = NULL;
+        buf->size = 0;
+}
+
+#define BATCH_TYPE EL_TYPE
+#define BATCH_GEMM cblas_dgemm
+#define BATCH_GEMM_BATCH cblas_dgemm_batch
+#define BATCH_CONTRACT do_contract
+#define BATCH_CONTRACT_BATCH do_contract_batch
+#include "sparseblocks_batch.h"
+
+/* Tile size for the transposing kernel of permadd_block. Two tiles of 
+ * PERM_TILE x PERM_TILE doubles fit in the L1 cache. */
+#define PERM_TILE 32
+
+// perm[i] += pref * orig[i] for i < n
+static void add_run(const EL_TYPE * orig, EL_TYPE * perm, int n, 
+                    const double pref)
+{
+#pragma omp simd
+        for (int i = 0; i < n; ++i) { perm[i] += pref * orig[i]; }
+}
+
+/* perm[i + j * ldp] += pref * orig[i * o0 + j * o1] for i < n0, j < n1
+ *
+ * The loops are tiled so that, if o1 == 1, both the strided reads and the
+ * strided writes of a tile stay in cache. */
+static void transpose_add(const EL_TYPE * orig, int o0, int o1, 
+                          EL_TYPE * perm, int ldp, int n0, int n1, 
+                          const double pref)
+{
+        for (int jt = 0; jt < n1; jt += PERM_TILE) {
+                const int je = jt + PERM_TILE < n1 ? jt + PERM_TILE : n1;
+                for (int it = 0; it < n0; it += PERM_TILE) {
+                        const int ie = it + PERM_TILE < n0 ? 
+                                it + PERM_TILE : n0;
+                        for (int j = jt; j < je; ++j) {
+                                const EL_TYPE * o = orig + o1 * j;
+                                EL_TYPE * p = perm + ldp * j;
+#pragma omp simd
+                                for (int i = it; i < ie; ++i) {
+                                        p[i] += pref * o[o0 * i];
+                                }
+                        }
+                }
+        }
+}
+
 void permadd_block(const EL_TYPE * orig, const int * old,
                    EL_TYPE * perm, const int * nld, const int * ndims, int n,
                    const double pref)
 {
-        // The n >= 2 is needed since I put two for loops explicit in it.
-        // The two first indices 
         assert(n <= MAX_PERM && n >= 2);
         assert(nld[0] == 1);
+        for (int i = 0; i < n; ++i) { if (ndims[i] == 0) { return; } }
+
+        /* The first index runs contiguously in perm. The second index of 
+         * the inner kernel is the one running contiguously in orig, 
+         * otherwise just the next one. */
+        int q = 1;
+        if (old[0] != 1 || ndims[0] == 1) {
+                for (int i = 1; i < n; ++i) {
+                        if (old[i] == 1 && ndims[i] != 1) { q = i; break; }
+                }
+        }
+        const bool unit = old[0] == 1 || ndims[0] == 1;
+
+        // The remaining indices are looped over as an odometer
+        int odims[MAX_PERM], oold[MAX_PERM], onld[MAX_PERM];
+        int m = 0;
+        for (int i = 1; i < n; ++i) {
+                if (i == q) { continue; }
+                odims[m] = ndims[i];
+                oold[m] = old[i];
+                onld[m] = nld[i];
+                ++m;
+        }
+
         int ids[MAX_PERM] = {0};
         const EL_TYPE * orig2 = orig;
         EL_TYPE * perm2 = perm;
         bool flag = true;
         while (flag) {
-                for (ids[1] = 0; ids[1] < ndims[1]; ++ids[1]) {
-                        const EL_TYPE * orig1 = orig2 + old[1] * ids[1];
-                        EL_TYPE * perm1 = perm2 + nld[1] * ids[1];
-                        for (ids[0] = 0; ids[0] < ndims[0]; ++ids[0]) {
-                                perm1[ids[0]] += pref * orig1[old[0] * ids[0]];
+                if (unit) {
+                        for (int j = 0; j < ndims[q]; ++j) {
+                                add_run(orig2 + old[q] * j, perm2 + nld[q] * j,
+                                        ndims[0], pref);
                         }
+                } else {
+                        transpose_add(orig2, old[0], old[q], perm2, nld[q],
+                                      ndims[0], ndims[q], pref);
                 }
 
                 flag = false;
-                for (int i = 2; i < n; ++i) {
-                        orig2 += old[i];
-                        perm2 += nld[i];
+                for (int i = 0; i < m; ++i) {
+                        orig2 += oold[i];
+                        perm2 += onld[i];
                         ++ids[i];
-                        if(ids[i] < ndims[i]) {
+                        if(ids[i] < odims[i]) {
                                 flag = true;
                                 break;
                         }
-                        orig2 -= old[i] * ids[i];
-                        perm2 -= nld[i] * ids[i];
+                        orig2 -= oold[i] * ids[i];
+                        perm2 -= onld[i] * ids[i];
                         ids[i] = 0;
                 }
         }
@@ -0,0 +1,339 @@
+/*
+    T3NS: an implementation of the Three-Legged Tree Tensor Network algorithm
+    Copyright (C) 2018-2019 Klaas Gunst <Klaas.Gunst@UGent.be>
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 3.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+/*
+ * The batched contractions of do_contract_batch(), written for a general
+ * element type.
+ *
+ * This file is included by sparseblocks.c for double precision and by
+ * sparseblocks_single.c for single precision. Before inclusion the following
+ * macros should be defined:
+ *
+ * * BATCH_TYPE: the element type.
+ * * BATCH_GEMM: the cblas gemm for this type.
+ * * BATCH_GEMM_BATCH: the MKL batched gemm for this type.
+ * * BATCH_CONTRACT: do_contract() for this type.
+ * * BATCH_CONTRACT_BATCH: the name of the resulting function.
+ */
+
+/* Contractions with more M * N * K are not packed by do_contract_batch(). */
+#define PACK_MAX_OPS 262144
+/* Maximal number of elements packed together by do_contract_batch(). */
+#define PACK_MAX_MEM 4194304
+
+static BATCH_TYPE * request_contractbuffer(struct contractbuffer * buf,
+                                           long long size)
+{
+        /* The buffer is counted in EL_TYPE elements */
+        size = (size * sizeof(BATCH_TYPE) + sizeof(EL_TYPE) - 1) / 
+                sizeof(EL_TYPE);
+        if (buf->size < size) {
+                if (buf->ar == NULL) {
+                        safe_free(buf->mem);
+                        buf->mem = safe_malloc(size, EL_TYPE);
+                } else {
+                        /* The old memory is only returned on release of the
+                         * arena, so grow at least twofold. */
+                        if (size < 2 * buf->size) { size = 2 * buf->size; }
+                        buf->mem = arena_malloc(buf->ar, size, EL_TYPE);
+                }
+                buf->size = size;
+        }
+        return (BATCH_TYPE *) buf->mem;
+}
+
+static bool shared_tensor(BATCH_TYPE ** const * tel, int n, int tensor)
+{
+        for (int k = 1; k < n; ++k) {
+                if (tel[k][tensor] != tel[0][tensor]) { return false; }
+        }
+        return true;
+}
+
+/* Copies the (stored) rows x cols matrix X to Y and multiplies it with pref. */
+static void copy_matrix(const BATCH_TYPE * X, int ldx, BATCH_TYPE * Y, int ldy,
+                        int rows, int cols, BATCH_TYPE pref)
+{
+        for (int j = 0; j < cols; ++j, X += ldx, Y += ldy) {
+                for (int i = 0; i < rows; ++i) { Y[i] = pref * X[i]; }
+        }
+}
+
+/* Checks if the (stored) rows x cols matrices X[k] + offset of the batch are
+ * already stacked in memory, i.e. consecutive without any gaps. */
+static bool stacked_in_place(BATCH_TYPE ** const * tel, int tensor, int ldx,
+                             int rows, int cols, int n, bool alongrows)
+{
+        if (alongrows ? cols != 1 : (ldx != rows && cols != 1)) {
+                return false;
+        }
+        for (int k = 1; k < n; ++k) {
+                if (tel[k][tensor] != tel[0][tensor] + (long long) k * rows * cols) {
+                        return false;
+                }
+        }
+        return true;
+}
+
+/* Stacks the (stored) rows x cols matrices X[k] + offset of the batch in Y.
+ * Along the rows, the stack is a (n * rows) x cols matrix. Else it is a
+ * rows x (n * cols) matrix.
+ *
+ * If the matrices are already stacked in memory and no pref is given, no
+ * copy is made.
+ *
+ * Returns the stacked matrix and its leading dimension in ldy. */
+static const BATCH_TYPE * stack_matrices(BATCH_TYPE ** const * tel, int tensor,
+                                      long long offset, int ldx, int rows,
+                                      int cols, const BATCH_TYPE * pref, int n,
+                                      bool alongrows, BATCH_TYPE * Y, int * ldy)
+{
+        *ldy = alongrows ? n * rows : rows;
+        if (pref == NULL &&
+            stacked_in_place(tel, tensor, ldx, rows, cols, n, alongrows)) {
+                return tel[0][tensor] + offset;
+        }
+
+        for (int k = 0; k < n; ++k) {
+                BATCH_TYPE * Yk = alongrows ? Y + k * rows :
+                        Y + (long long) k * rows * cols;
+                copy_matrix(tel[k][tensor] + offset, ldx, Yk, *ldy,
+                            rows, cols, pref == NULL ? 1 : pref[k]);
+        }
+        return Y;
+}
+
+/* C = α Y + β C for a M x N matrix. */
+static void scatter_result(const BATCH_TYPE * Y, int ldy, BATCH_TYPE * C, int ldc,
+                           int M, int N, BATCH_TYPE alpha, BATCH_TYPE beta)
+{
+        for (int j = 0; j < N; ++j, Y += ldy, C += ldc) {
+                if (beta == 0) {
+                        for (int i = 0; i < M; ++i) { C[i] = alpha * Y[i]; }
+                } else {
+                        for (int i = 0; i < M; ++i) {
+                                C[i] = alpha * Y[i] + beta * C[i];
+                        }
+                }
+        }
+}
+
+/* All contractions of the batch accumulate in the same C (β = 1).
+ * A's and B's are stacked along the contracted dimension. */
+static void contract_packK(const struct contractinfo * cinfo,
+                           BATCH_TYPE ** const * tel, const BATCH_TYPE * alpha,
+                           int n, struct contractbuffer * buf)
+{
+        const int M = cinfo->M;
+        const int N = cinfo->N;
+        const int K = cinfo->K;
+        const bool transA = cinfo->trans[0] != CblasNoTrans;
+        const bool transB = cinfo->trans[1] != CblasNoTrans;
+        BATCH_TYPE * Apack = request_contractbuffer(buf, (long long) n * K * (M + N));
+        BATCH_TYPE * Bpack = Apack + (long long) n * K * M;
+        BATCH_TYPE * C = tel[0][cinfo->tensneeded[2]];
+        /* The prefactors are put on B if A is already stacked in memory */
+        const bool prefonB = stacked_in_place(tel, cinfo->tensneeded[0],
+                                              cinfo->lda, transA ? K : M,
+                                              transA ? M : K, n, transA);
+
+        for (int l = 0; l < cinfo->L; ++l) {
+                int lda, ldb;
+                const BATCH_TYPE * A = 
+                        stack_matrices(tel, cinfo->tensneeded[0],
+                                       (long long) l * cinfo->stride[0],
+                                       cinfo->lda, transA ? K : M,
+                                       transA ? M : K, prefonB ? NULL : alpha,
+                                       n, transA, Apack, &lda);
+                const BATCH_TYPE * B = 
+                        stack_matrices(tel, cinfo->tensneeded[1],
+                                       (long long) l * cinfo->stride[1],
+                                       cinfo->ldb, transB ? N : K,
+                                       transB ? K : N, prefonB ? alpha : NULL,
+                                       n, !transB, Bpack, &ldb);
+                BATCH_GEMM(CblasColMajor, cinfo->trans[0], cinfo->trans[1],
+                            M, N, n * K, 1, A, lda, B, ldb,
+                            1, C + (long long) l * cinfo->stride[2],
+                            cinfo->ldc);
+        }
+}
+
+/* All contractions of the batch share the same A (sharedA) or B.
+ * The other matrices are stacked along N (or M) and the result is scattered
+ * to the different C's. */
+static void contract_packMN(const struct contractinfo * cinfo,
+                            BATCH_TYPE ** const * tel, const BATCH_TYPE * alpha,
+                            BATCH_TYPE beta, int n, bool sharedA,
+                            struct contractbuffer * buf)
+{
+        const int M = cinfo->M;
+        const int N = cinfo->N;
+        const int K = cinfo->K;
+        const bool trans = cinfo->trans[sharedA] != CblasNoTrans;
+        const int tC = cinfo->tensneeded[2];
+        /* Only when the C's are consecutive the packed result is already the
+         * final result. */
+        bool direct = sharedA && cinfo->L == 1 && beta == 0 && cinfo->ldc == M;
+        for (int k = 0; k < n && direct; ++k) {
+                direct = alpha[k] == 1 &&
+                        tel[k][tC] == tel[0][tC] + (long long) k * M * N;
+        }
+
+        const long long packsize = sharedA ? (long long) n * K * N :
+                (long long) n * M * K;
+        BATCH_TYPE * pack = request_contractbuffer(buf, packsize +
+                                                (direct ? 0 :
+                                                 (long long) n * M * N));
+        BATCH_TYPE * Cpack = direct ? tel[0][tC] : pack + packsize;
+        const int ldc = sharedA ? M : n * M;
+
+        for (int l = 0; l < cinfo->L; ++l) {
+                const BATCH_TYPE * shared = tel[0][cinfo->tensneeded[!sharedA]] +
+                        (long long) l * cinfo->stride[!sharedA];
+                const int ldshared = sharedA ? cinfo->lda : cinfo->ldb;
+                int ldp;
+                if (sharedA) {
+                        /* stack op(B) along N */
+                        const BATCH_TYPE * B = 
+                                stack_matrices(tel, cinfo->tensneeded[1],
+                                               (long long) l * cinfo->stride[1],
+                                               cinfo->ldb, trans ? N : K,
+                                               trans ? K : N, NULL, n,
+                                               trans, pack, &ldp);
+                        BATCH_GEMM(CblasColMajor, cinfo->trans[0],
+                                    cinfo->trans[1], M, n * N, K, 1,
+                                    shared, ldshared, B, ldp, 0,
+                                    Cpack, ldc);
+                } else {
+                        /* stack op(A) along M */
+                        const BATCH_TYPE * A = 
+                                stack_matrices(tel, cinfo->tensneeded[0],
+                                               (long long) l * cinfo->stride[0],
+                                               cinfo->lda, trans ? K : M,
+                                               trans ? M : K, NULL, n,
+                                               !trans, pack, &ldp);
+                        BATCH_GEMM(CblasColMajor, cinfo->trans[0],
+                                    cinfo->trans[1], n * M, N, K, 1,
+                                    A, ldp, shared, ldshared, 0,
+                                    Cpack, ldc);
+                }
+                if (direct) { continue; }
+
+                for (int k = 0; k < n; ++k) {
+                        const BATCH_TYPE * Y = sharedA ?
+                                Cpack + (long long) k * M * N : Cpack + k * M;
+                        scatter_result(Y, ldc, tel[k][tC] +
+                                       (long long) l * cinfo->stride[2],
+                                       cinfo->ldc, M, N, alpha[k], beta);
+                }
+        }
+}
+
+/* No packing possible, do every contraction separately.
+ *
+ * With MKL, every contraction is a group of L dgemms in a grouped dgemm.
+ * This can not be done if the C's overlap. */
+static void contract_grouped(const struct contractinfo * cinfo,
+                             BATCH_TYPE ** const * tel, const BATCH_TYPE * alpha,
+                             BATCH_TYPE beta, int n)
+{
+#ifdef T3NS_MKL
+        if (n > 1 && !shared_tensor(tel, n, cinfo->tensneeded[2])) {
+                const MKL_INT L = cinfo->L;
+                const BATCH_TYPE ** A = safe_malloc(n * L, const BATCH_TYPE *);
+                const BATCH_TYPE ** B = safe_malloc(n * L, const BATCH_TYPE *);
+                BATCH_TYPE ** C = safe_malloc(n * L, BATCH_TYPE *);
+                CBLAS_TRANSPOSE * ta = safe_malloc(n, CBLAS_TRANSPOSE);
+                CBLAS_TRANSPOSE * tb = safe_malloc(n, CBLAS_TRANSPOSE);
+                MKL_INT * dims = safe_malloc(7 * n, MKL_INT);
+                BATCH_TYPE * betas = safe_malloc(n, BATCH_TYPE);
+
+                for (int k = 0; k < n; ++k) {
+                        for (int l = 0; l < L; ++l) {
+                                A[k * L + l] = tel[k][cinfo->tensneeded[0]] +
+                                        (long long) l * cinfo->stride[0];
+                                B[k * L + l] = tel[k][cinfo->tensneeded[1]] +
+                                        (long long) l * cinfo->stride[1];
+                                C[k * L + l] = tel[k][cinfo->tensneeded[2]] +
+                                        (long long) l * cinfo->stride[2];
+                        }
+                        ta[k] = cinfo->trans[0];
+                        tb[k] = cinfo->trans[1];
+                        dims[k]         = cinfo->M;
+                        dims[n + k]     = cinfo->N;
+                        dims[2 * n + k] = cinfo->K;
+                        dims[3 * n + k] = cinfo->lda;
+                        dims[4 * n + k] = cinfo->ldb;
+                        dims[5 * n + k] = cinfo->ldc;
+                        dims[6 * n + k] = L;
+                        betas[k] = beta;
+                }
+                BATCH_GEMM_BATCH(CblasColMajor, ta, tb, dims, dims + n,
+                                  dims + 2 * n, alpha, A, dims + 3 * n,
+                                  B, dims + 4 * n, betas, C, dims + 5 * n,
+                                  n, dims + 6 * n);
+
+                safe_free(A);
+                safe_free(B);
+                safe_free(C);
+                safe_free(ta);
+                safe_free(tb);
+                safe_free(dims);
+                safe_free(betas);
+                return;
+        }
+#endif
+        for (int k = 0; k < n; ++k) {
+                BATCH_CONTRACT(cinfo, tel[k], alpha[k], beta);
+        }
+}
+
+void BATCH_CONTRACT_BATCH(const struct contractinfo * cinfo, 
+                          BATCH_TYPE ** const * tel, const BATCH_TYPE * alpha, 
+                          BATCH_TYPE beta, int n, struct contractbuffer * buf)
+{
+        if (n == 0) { return; }
+        const long long ops = (long long) cinfo->M * cinfo->N * cinfo->K;
+
+        /* Big contractions are efficient enough in a single dgemm */
+        if (n == 1 || ops > PACK_MAX_OPS) {
+                contract_grouped(cinfo, tel, alpha, beta, n);
+                return;
+        }
+
+        /* Split the batch such that the packed memory stays bounded */
+        const long long perel = (long long) cinfo->K * (cinfo->M + cinfo->N) +
+                (long long) cinfo->M * cinfo->N;
+        int chunk = perel * n > PACK_MAX_MEM ? PACK_MAX_MEM / perel : n;
+        if (chunk < 2) { chunk = 2; }
+
+        for (int k = 0; k < n; k += chunk) {
+                const int nk = k + chunk > n ? n - k : chunk;
+                BATCH_TYPE ** const * telk = tel + k;
+                const BATCH_TYPE * alphak = alpha + k;
+
+                if (shared_tensor(telk, nk, cinfo->tensneeded[2])) {
+                        assert(beta == 1);
+                        contract_packK(cinfo, telk, alphak, nk, buf);
+                } else if (shared_tensor(telk, nk, cinfo->tensneeded[0])) {
+                        contract_packMN(cinfo, telk, alphak, beta, nk, true, buf);
+                } else if (shared_tensor(telk, nk, cinfo->tensneeded[1])) {
+                        contract_packMN(cinfo, telk, alphak, beta, nk, false, buf);
+                } else {
+                        contract_grouped(cinfo, telk, alphak, beta, nk);
+                }
+        }
+}
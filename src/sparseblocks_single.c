@@ -0,0 +1,57 @@
+/*
+    T3NS: an implementation of the Three-Legged Tree Tensor Network algorithm
+    Copyright (C) 2018-2019 Klaas Gunst <Klaas.Gunst@UGent.be>
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 3.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdbool.h>
+
+#include "sparseblocks.h"
+#include "macros.h"
+#include "arena.h"
+#ifdef T3NS_MKL
+#include "mkl.h"
+#else
+#include <lapacke.h>
+#endif
+
+/* The single precision contractions used by the matvec in single precision
+ * (see set_Heff_precision()). */
+
+void do_contract_single(const struct contractinfo * cinfo, float ** tel, 
+                        float alpha, float beta)
+{
+        float * A = tel[cinfo->tensneeded[0]];
+        float * B = tel[cinfo->tensneeded[1]];
+        float * C = tel[cinfo->tensneeded[2]];
+
+        for (int l = 0; l < cinfo->L; ++l) {
+                cblas_sgemm(CblasColMajor, cinfo->trans[0], cinfo->trans[1], 
+                            cinfo->M, cinfo->N, cinfo->K, 
+                            alpha, A, cinfo->lda, B, cinfo->ldb, 
+                            beta, C, cinfo->ldc);
+                A += cinfo->stride[0];
+                B += cinfo->stride[1];
+                C += cinfo->stride[2];
+        }
+}
+
+#define BATCH_TYPE float
+#define BATCH_GEMM cblas_sgemm
+#define BATCH_GEMM_BATCH cblas_sgemm_batch
+#define BATCH_CONTRACT do_contract_single
+#define BATCH_CONTRACT_BATCH do_contract_batch_single
+#include "sparseblocks_batch.h"
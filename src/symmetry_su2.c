@@ -26,6 +26,150 @@
 static inline double bracket(const int twoj)    {return sqrt(twoj + 1);}
 static inline double divbracket(const int twoj) {return 1 / bracket(twoj);}
 
+/* The Wigner symbols are memoized. The number of different arguments is small
+ * compared to the number of calls. Every thread has its own table, thus no
+ * locking is needed for the lookups. The tables are kept in a list, such that
+ * destroy_wigner_caches() also frees the tables of threads that are not in
+ * the current team. */
+#define WIGNER_BITS 7
+#define WIGNER_6J_FLAG (1ULL << 62)
+#define WIGNER_9J_FLAG (1ULL << 63)
+
+struct wigner_cache {
+        /* Open addressing with linear probing, 0 is an empty slot. */
+        unsigned long long * keys;
+        double * vals;
+        int size;
+        int nr;
+        struct wigner_cache * next;
+};
+
+/* All the tables, protected by the critical section wigner_caches */
+static struct wigner_cache * wcache_list = NULL;
+/* Increased by every destroy_wigner_caches() */
+static int wcache_generation = 0;
+
+/* The table of the thread, only valid if wcache_gen == wcache_generation */
+static struct wigner_cache * wcache = NULL;
+static int wcache_gen = 0;
+#pragma omp threadprivate(wcache, wcache_gen)
+
+static struct wigner_cache * thread_wcache(void)
+{
+        if (wcache == NULL || wcache_gen != wcache_generation) {
+                wcache = safe_calloc(1, struct wigner_cache);
+                wcache_gen = wcache_generation;
+#pragma omp critical (wigner_caches)
+                {
+                        wcache->next = wcache_list;
+                        wcache_list = wcache;
+                }
+        }
+        return wcache;
+}
+
+/* Packs the 2j values in a key. Returns 0 if a 2j does not fit in
+ * WIGNER_BITS bits, such symbols are not memoized. */
+static int pack_2j(const int n, const int twoj[n], unsigned long long * key)
+{
+        *key = 0;
+        for (int i = 0; i < n; ++i) {
+                if (twoj[i] < 0 || twoj[i] >= 1 << WIGNER_BITS) { return 0; }
+                *key = *key << WIGNER_BITS | (unsigned long long) twoj[i];
+        }
+        return 1;
+}
+
+static int wcache_slot(const struct wigner_cache * c, unsigned long long key)
+{
+        int i = (int) ((key * 0x9E3779B97F4A7C15ULL) >> 40) & (c->size - 1);
+        while (c->keys[i] != 0 && c->keys[i] != key) {
+                i = (i + 1) & (c->size - 1);
+        }
+        return i;
+}
+
+static void wcache_insert(struct wigner_cache * c, unsigned long long key, 
+                          double val)
+{
+        if (2 * (c->nr + 1) > c->size) {
+                struct wigner_cache n = {
+                        .size = c->size == 0 ? 1024 : 2 * c->size,
+                        .nr = c->nr,
+                        .next = c->next
+                };
+                n.keys = safe_calloc(n.size, *n.keys);
+                n.vals = safe_malloc(n.size, *n.vals);
+                for (int i = 0; i < c->size; ++i) {
+                        if (c->keys[i] == 0) { continue; }
+                        const int j = wcache_slot(&n, c->keys[i]);
+                        n.keys[j] = c->keys[i];
+                        n.vals[j] = c->vals[i];
+                }
+                safe_free(c->keys);
+                safe_free(c->vals);
+                *c = n;
+        }
+        const int i = wcache_slot(c, key);
+        assert(c->keys[i] == 0);
+        c->keys[i] = key;
+        c->vals[i] = val;
+        ++c->nr;
+}
+
+static double cached_6j(int ja, int jb, int jc, int jd, int je, int jf)
+{
+        const int twoj[6] = {ja, jb, jc, jd, je, jf};
+        unsigned long long key;
+        if (!pack_2j(6, twoj, &key)) { 
+                return wigner6j(ja, jb, jc, jd, je, jf); 
+        }
+        key |= WIGNER_6J_FLAG;
+        struct wigner_cache * c = thread_wcache();
+        if (c->size != 0) {
+                const int i = wcache_slot(c, key);
+                if (c->keys[i] == key) { return c->vals[i]; }
+        }
+        const double val = wigner6j(ja, jb, jc, jd, je, jf);
+        wcache_insert(c, key, val);
+        return val;
+}
+
+static double cached_9j(int ja, int jb, int jc, int jd, int je, int jf,
+                        int jg, int jh, int ji)
+{
+        const int twoj[9] = {ja, jb, jc, jd, je, jf, jg, jh, ji};
+        unsigned long long key;
+        if (!pack_2j(9, twoj, &key)) {
+                return wigner9j(ja, jb, jc, jd, je, jf, jg, jh, ji);
+        }
+        key |= WIGNER_9J_FLAG;
+        struct wigner_cache * c = thread_wcache();
+        if (c->size != 0) {
+                const int i = wcache_slot(c, key);
+                if (c->keys[i] == key) { return c->vals[i]; }
+        }
+        const double val = wigner9j(ja, jb, jc, jd, je, jf, jg, jh, ji);
+        wcache_insert(c, key, val);
+        return val;
+}
+
+void destroy_wigner_caches(void)
+{
+#pragma omp critical (wigner_caches)
+        {
+                while (wcache_list != NULL) {
+                        struct wigner_cache * c = wcache_list;
+                        wcache_list = c->next;
+                        safe_free(c->keys);
+                        safe_free(c->vals);
+                        safe_free(c);
+                }
+                /* The pointers of the threads are stale now */
+                ++wcache_generation;
+        }
+}
+
 int SU2_get_max_irrep(int (*prop1)[MAX_SYMMETRIES], int nr1, 
                   int (*prop2)[MAX_SYMMETRIES], int nr2, int whichsym)
 {
@@ -78,17 +222,17 @@ double SU2_prefactor_pAppend(int (*sv)[3], int is_left)
                 double result =  bracket(sv[0][2]);
                 result *=  bracket(sv[1][2]);
                 result *=  bracket(sv[2][2]);
-                return result * wigner9j(sv[0][0], sv[1][0], sv[2][0],
-                                         sv[0][1], sv[1][1], sv[2][1],
-                                         sv[0][2], sv[1][2], sv[2][2]);
+                return result * cached_9j(sv[0][0], sv[1][0], sv[2][0],
+                                          sv[0][1], sv[1][1], sv[2][1],
+                                          sv[0][2], sv[1][2], sv[2][2]);
         } else {
                 double result =  bracket(sv[0][0]);
                 result *=  bracket(sv[1][0]);
                 result *=  bracket(sv[2][2]);
                 return ((sv[0][1] + sv[1][1] + sv[2][1]) % 4 ? -1 : 1) * 
-                        result * wigner9j(sv[0][0], sv[1][0], sv[2][0],
-                                          sv[0][2], sv[1][2], sv[2][2],
-                                          sv[0][1], sv[1][1], sv[2][1]);
+                        result * cached_9j(sv[0][0], sv[1][0], sv[2][0],
+                                           sv[0][2], sv[1][2], sv[2][2],
+                                           sv[0][1], sv[1][1], sv[2][1]);
         }
 }
 
@@ -101,9 +245,9 @@ double SU2_prefactor_combine_MPOs(int (*symv)[3], int * symvMPO, int isdmrg, int
         } else {
                 double result = ((symv[0][2] + symv[1][2] + symvMPO[2]) % 4 ? -1 : 1) * 
                         bracket(symvMPO[2]);
-                return result * wigner9j(symv[0][0], symv[1][0], symvMPO[0],
-                                         symv[0][1], symv[1][1], symvMPO[1],
-                                         symv[0][2], symv[1][2], symvMPO[2]);
+                return result * cached_9j(symv[0][0], symv[1][0], symvMPO[0],
+                                          symv[0][1], symv[1][1], symvMPO[1],
+                                          symv[0][2], symv[1][2], symvMPO[2]);
         }
 }
 
@@ -114,9 +258,9 @@ double SU2_prefactor_bUpdate(int (*symv)[3], int uCase)
         double result = sign * bracket(symv[uCase][0]);
         result *= bracket(symv[uCase][1]);
         result *= bracket(symv[2][2]);
-        return result * wigner9j(symv[0][0], symv[0][1], symv[0][2],
-                                 symv[1][0], symv[1][1], symv[1][2],
-                                 symv[2][0], symv[2][1], symv[2][2]);
+        return result * cached_9j(symv[0][0], symv[0][1], symv[0][2],
+                                  symv[1][0], symv[1][1], symv[1][2],
+                                  symv[2][0], symv[2][1], symv[2][2]);
 }
 
 double SU2_prefactor_1siteRDM(int * symv) { return 1. / (symv[1] + 1); }
@@ -139,9 +283,9 @@ static double swap12(int (*symv)[3])
         val *= bracket(symv[4][0]);
         val *= bracket(symv[3][1]);
         val *= bracket(symv[4][1]);
-        val *= wigner9j(symv[0][0], symv[1][1], symv[4][0],
-                        symv[0][1], symv[1][0], symv[4][1],
-                        symv[0][2], symv[1][2], symv[4][2]);
+        val *= cached_9j(symv[0][0], symv[1][1], symv[4][0],
+                         symv[0][1], symv[1][0], symv[4][1],
+                         symv[0][2], symv[1][2], symv[4][2]);
         return val;
 }
 
@@ -159,9 +303,9 @@ static double swap13(int (*symv)[3])
         val *= bracket(symv[4][0]);
         val *= bracket(symv[3][2]);
         val *= bracket(symv[4][2]);
-        val *= wigner9j(symv[0][0], symv[2][1], symv[4][0],
-                        symv[0][1], symv[2][2], symv[4][2],
-                        symv[0][2], symv[2][0], symv[4][1]);
+        val *= cached_9j(symv[0][0], symv[2][1], symv[4][0],
+                         symv[0][1], symv[2][2], symv[4][2],
+                         symv[0][2], symv[2][0], symv[4][1]);
         return val;
 }
 
@@ -175,9 +319,9 @@ static double swap23(int (*symv)[3])
         val *= bracket(symv[4][1]);
         val *= bracket(symv[3][2]);
         val *= bracket(symv[4][2]);
-        val *= wigner9j(symv[1][0], symv[2][1], symv[4][1],
-                        symv[1][1], symv[2][2], symv[4][2],
-                        symv[1][2], symv[2][0], symv[4][0]);
+        val *= cached_9j(symv[1][0], symv[2][1], symv[4][1],
+                         symv[1][1], symv[2][2], symv[4][2],
+                         symv[1][2], symv[2][0], symv[4][0]);
         return val;
 }
 
@@ -234,8 +378,8 @@ double SU2_prefactor_permutation(int (*symv)[3], int permuteType)
                 sign = (symv[1][0] + symv[4][0] - symv[0][1] - symv[1][1]) % 4 == 0 ? 1: -1;
                 val = sign * bracket(symv[1][0]);
                 val *= bracket(symv[4][0]);
-                return val * wigner6j(symv[0][1], symv[1][2], symv[4][0],
-                                      symv[1][1], symv[0][0], symv[1][0]);
+                return val * cached_6j(symv[0][1], symv[1][2], symv[4][0],
+                                       symv[1][1], symv[0][0], symv[1][0]);
         case 1:
                 return swap23(symv);
         case 2:
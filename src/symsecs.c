@@ -33,15 +33,58 @@ void init_null_symsecs(struct symsecs * symsec)
         *symsec = nullsymsec;
 }
 
+/* The symsecs of some virtual bonds that are private to the thread, see
+ * set_private_symsecs(). */
+static struct {
+        int nr;
+        const int * bonds;
+        struct symsecs * ss;
+} private_ss;
+#pragma omp threadprivate(private_ss)
+
+void set_private_symsecs(int n, const int * bonds, struct symsecs * ss)
+{
+        private_ss.nr = n;
+        private_ss.bonds = bonds;
+        private_ss.ss = ss;
+}
+
+static struct symsecs * find_private_symsecs(int bond)
+{
+        for (int i = 0; i < private_ss.nr; ++i) {
+                if (private_ss.bonds[i] == bond) { return &private_ss.ss[i]; }
+        }
+        return NULL;
+}
+
 void get_symsecs(struct symsecs *res, int bond)
 {
-        bookkeeper_get_symsecs(&bookie, res, bond);
+        const struct symsecs * priv = find_private_symsecs(bond);
+        if (priv != NULL) {
+                *res = *priv;
+        } else {
+                bookkeeper_get_symsecs(&bookie, res, bond);
+        }
         assert(res->bond == bond);
 }
 
 void get_symsecs_arr(int n, struct symsecs * symarr, const int * bonds)
 {
-        bookkeeper_get_symsecs_arr(&bookie, n, symarr, bonds);
+        for (int i = 0; i < n; ++i) {
+                const struct symsecs * priv = find_private_symsecs(bonds[i]);
+                if (priv != NULL) {
+                        symarr[i] = *priv;
+                } else {
+                        bookkeeper_get_symsecs(&bookie, &symarr[i], bonds[i]);
+                }
+        }
+}
+
+struct symsecs * get_symsecs_ptr(int bond)
+{
+        assert(bond >= 0 && bond < netw.nr_bonds);
+        struct symsecs * priv = find_private_symsecs(bond);
+        return priv != NULL ? priv : &bookie.v_symsecs[bond];
 }
 
 void destroy_symsecs(struct symsecs *sectors)
@@ -25,12 +25,15 @@
 
 #include "wrapper_solvers.h"
 #include "davidson.h"
+#include "macros.h"
 
 #define DIAG_CUTOFF 1e-12
 
 #ifdef T3NS_WITH_PRIMME
 struct primme_matrix {
         void (*matvec)(const double *, double *, void *);
+        void (*blockmatvec)(const double *, double *, int, void *);
+        int size;
         void * vdat;
 };
 
@@ -67,13 +70,27 @@ static void primmematvec(void * x, PRIMME_INT * ldx, void *y, PRIMME_INT * ldy,
                          int * blockSize, primme_params *primme, int *ierr)
 {
         struct primme_matrix * data = primme->matrix;
-        data->matvec(x, y, data->vdat);
+        const double * const d_x = x;
+        double * const d_y = y;
+
+        if (*blockSize > 1 && data->blockmatvec != NULL && 
+            *ldx == data->size && *ldy == data->size) {
+                data->blockmatvec(d_x, d_y, *blockSize, data->vdat);
+        } else {
+                for (int i = 0; i < *blockSize; ++i) {
+                        data->matvec(d_x + *ldx * i, d_y + *ldy * i, 
+                                     data->vdat);
+                }
+        }
         *ierr = 0;
 }
 
-static int primme_solve(double * result, double * energy, int size, double tol,
-                        int max_its, void * vdat, const double * diagonal,
-                        void (*matvec)(const double *, double *, void *))
+static int primme_solve(double * result, double * energy, int size, int block,
+                        double tol, int max_its, void * vdat, 
+                        const double * diagonal,
+                        void (*matvec)(const double *, double *, void *),
+                        void (*blockmatvec)(const double *, double *, int, 
+                                            void *))
 {
         primme_params primme;
         primme_initialize(&primme);
@@ -84,6 +101,7 @@ static int primme_solve(double * result, double * energy, int size, double tol,
         primme.aNorm = 1;
         primme.initSize = 1;
         primme.matrixMatvec = primmematvec;
+        if (block > 1) { primme.maxBlockSize = block; }
         primme.target = primme_smallest;
         double curr_e;
         primme.ShiftsForPreconditioner = &curr_e;
@@ -93,7 +111,7 @@ static int primme_solve(double * result, double * energy, int size, double tol,
         primme.preconditioner = &prec;
 
         primme.printLevel = 2;
-        struct primme_matrix mat = { matvec, vdat };
+        struct primme_matrix mat = { matvec, blockmatvec, size, vdat };
         primme.matrix = &mat; 
         primme_set_method(PRIMME_DYNAMIC, &primme);
 
@@ -104,25 +122,55 @@ static int primme_solve(double * result, double * energy, int size, double tol,
 }
 #endif
 
+static int davidson_solve(struct davidson_context * ctx, double * result, 
+                          double * energy, int size, int max_vecs, 
+                          int keep_deflate, int block, int nroots, double tol,
+                          int max_its,
+                          const double * diagonal, 
+                          void (*matvec)(const double *, double *, void *),
+                          void (*blockmatvec)(const double *, double *, 
+                                              int, void *),
+                          void * vdat)
+{
+        if (ctx == NULL) {
+                return davidson(result, energy, size, max_vecs, keep_deflate, 
+                                block, nroots, tol, max_its, diagonal, matvec, 
+                                blockmatvec, vdat);
+        } else {
+                return davidson_ctx(ctx, result, energy, size, max_vecs, 
+                                    keep_deflate, block, nroots, tol, max_its, 
+                                    diagonal, matvec, blockmatvec, vdat);
+        }
+}
+
 int sparse_eigensolve(double * result, double * energy, int size, int max_vecs, 
-                      int keep_deflate, double tol, int max_its, 
+                      int keep_deflate, int block, int nroots, double tol, 
+                      int max_its, 
                       const double * diagonal, 
                       void (*matvec)(const double*, double*, void*), 
-                      void * vdat, const char solver[])
+                      void (*blockmatvec)(const double *, double *, int, void *),
+                      void * vdat, struct davidson_context * ctx, 
+                      const char solver[])
 {
-        if (strcmp(solver, "D") == 0) {
-                return davidson(result, energy, size, max_vecs, keep_deflate, 
-                                tol, max_its, diagonal, matvec, vdat);
+        /* Only the Davidson can switch the matvec during the solve */
+        const int refine = ctx != NULL && ctx->refine != NULL;
+        if (nroots > 1 || refine || strcmp(solver, "D") == 0) {
+                return davidson_solve(ctx, result, energy, size, max_vecs, 
+                                      keep_deflate, block, nroots, tol, 
+                                      max_its, diagonal, matvec, blockmatvec,
+                                      vdat);
 #ifdef T3NS_WITH_PRIMME
         } else if (strcmp(solver, "PRIMME") == 0) {
-                return primme_solve(result, energy, size, tol, max_its, vdat,
-                                    diagonal, matvec);
+                return primme_solve(result, energy, size, block, tol, max_its, 
+                                    vdat, diagonal, matvec, blockmatvec);
 #endif
         } else {
                 fprintf(stderr, "Error @%s: Undefined solver %s.\n"
                         "Will continue with the default davidson solver.\n", 
                         __func__, solver);
-                return davidson(result, energy, size, max_vecs, keep_deflate, 
-                                tol, max_its, diagonal, matvec, vdat);
+                return davidson_solve(ctx, result, energy, size, max_vecs, 
+                                      keep_deflate, block, nroots, tol, 
+                                      max_its, diagonal, matvec, blockmatvec,
+                                      vdat);
         }
 }